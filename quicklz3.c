@@ -0,0 +1,33 @@
+// Builds quicklz.c a second time at compression level 3. The library's
+// entry points are renamed so both levels link into one program.
+
+#define QLZ_COMPRESSION_LEVEL 3
+#define QLZ_STREAMING_BUFFER 0
+
+#define qlz_get_setting       qlz3_get_setting
+#define qlz_size_decompressed qlz3_size_decompressed
+#define qlz_size_compressed   qlz3_size_compressed
+#define qlz_compress          qlz3_compress_state
+#define qlz_decompress        qlz3_decompress_state
+
+#include "quicklz.c"
+
+#include "quicklz3.h"
+
+size_t qlz3_state_compress_size(void) {
+    return sizeof(qlz_state_compress);
+}
+
+size_t qlz3_state_decompress_size(void) {
+    return sizeof(qlz_state_decompress);
+}
+
+size_t qlz3_compress(const void *source, char *destination,
+                     size_t size, void *state) {
+    return qlz_compress(source, destination, size,
+                        (qlz_state_compress*)state);
+}
+
+size_t qlz3_decompress(const char *source, void *destination, void *state) {
+    return qlz_decompress(source, destination, (qlz_state_decompress*)state);
+}
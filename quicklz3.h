@@ -0,0 +1,13 @@
+// quicklz at compression level 3, which compresses slower but decompresses
+// faster and smaller than the level 1 build in quicklz.c. States are
+// opaque as their layout differs between levels.
+
+#include <stddef.h>
+
+extern size_t qlz3_state_compress_size(void);
+extern size_t qlz3_state_decompress_size(void);
+
+extern size_t qlz3_compress(const void *source, char *destination,
+                            size_t size, void *state);
+extern size_t qlz3_decompress(const char *source, void *destination,
+                              void *state);
@@ -275,6 +275,50 @@ int main(int argc, char *argv[]) {
     ret = tsdb_get_by_index(&db, &index, &read_val);
     assert_int_equal(-1, ret);
 
+    //===================================================================
+    // Batch writes
+    //===================================================================
+
+    // Many keys can be set in a single call. This resolves all of the
+    // key indexes up front and allocates new indexes together.
+    //
+    // Values are passed as a single array, with values_per_entry values
+    // for each key.
+    //
+    ret = tsdb_goto_epoch(&db, 240, 0, 1);
+    assert_int_equal(0, ret);
+
+    u_int32_t lowest_free_index = db.lowest_free_index;
+    char *batch_keys[4] = { "key-2", "batch-b", "batch-a", "batch-b" };
+    tsdb_value batch_vals[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    u_int32_t batch_indexes[4];
+    ret = tsdb_set_batch(&db, batch_keys, batch_vals, 4, batch_indexes);
+    assert_int_equal(0, ret);
+
+    // Existing keys keep their index. Two new keys were added (batch-b
+    // appears twice).
+    //
+    ret = tsdb_get_key_index(&db, "key-2", &index);
+    assert_int_equal(0, ret);
+    assert_int_equal(index, batch_indexes[0]);
+    assert_int_equal(lowest_free_index + 2, db.lowest_free_index);
+    assert_int_equal(batch_indexes[1], batch_indexes[3]);
+
+    // The values are set as if each key was set in order.
+    //
+    ret = tsdb_get_by_key(&db, "key-2", &read_val);
+    assert_int_equal(0, ret);
+    assert_int_equal(1, read_val[0]);
+    assert_int_equal(2, read_val[1]);
+    ret = tsdb_get_by_key(&db, "batch-a", &read_val);
+    assert_int_equal(0, ret);
+    assert_int_equal(5, read_val[0]);
+    assert_int_equal(6, read_val[1]);
+    ret = tsdb_get_by_key(&db, "batch-b", &read_val);
+    assert_int_equal(0, ret);
+    assert_int_equal(7, read_val[0]);
+    assert_int_equal(8, read_val[1]);
+
     tsdb_close(&db);
 
     return 0;
@@ -0,0 +1,159 @@
+#include "test_core.h"
+
+static char *get_file_arg(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: test-backend TEST-DB\n");
+        exit(1);
+    }
+    char *file = argv[1];
+    if (file_exists(file)) {
+        fprintf(stderr, "%s exists\n", file);
+        exit(1);
+    }
+    return file;
+}
+
+#define slot_seconds 60
+#define num_keys 50000
+
+static void write_and_read(tsdb_handler *db) {
+    u_int32_t epoch = 120, i;
+    char key[32];
+    tsdb_value val, *stored;
+    int ret;
+
+    ret = tsdb_goto_epoch(db, epoch, 0, 1);
+    assert_int_equal(0, ret);
+    for (i = 0; i < num_keys; i++) {
+        sprintf(key, "key-%u", i);
+        val = i * 2;
+        ret = tsdb_set(db, key, &val);
+        assert_int_equal(0, ret);
+    }
+    ret = tsdb_tag_key(db, "key-7", "odd");
+    assert_int_equal(0, ret);
+
+    tsdb_flush(db);
+
+    // Read back with the fragments loaded as needed, which walks the
+    // epoch's keys with a cursor.
+    //
+    tsdb_set_load_on_demand(db, 1);
+    ret = tsdb_goto_epoch(db, epoch + slot_seconds, 1, 0);
+    assert_int_equal(-1, ret);
+    ret = tsdb_goto_epoch(db, epoch, 1, 0);
+    assert_int_equal(0, ret);
+    for (i = 0; i < num_keys; i += 997) {
+        sprintf(key, "key-%u", i);
+        ret = tsdb_get_by_key(db, key, &stored);
+        assert_int_equal(0, ret);
+        assert_int_equal(i * 2, *stored);
+    }
+    tsdb_set_load_on_demand(db, 0);
+}
+
+static void check_cursor(const tsdb_backend *backend) {
+    void *mdb, *cursor, *key, *value;
+    u_int32_t key_len, value_len, i, n = 0;
+    char str[32], last[32] = "";
+    int ret;
+
+    ret = backend->open(&mdb, "unused", 0);
+    assert_int_equal(0, ret);
+
+    for (i = 0; i < 100; i++) {
+        sprintf(str, "k%03u", (i * 37) % 100);
+        ret = backend->put(mdb, str, strlen(str), &i, sizeof(i));
+        assert_int_equal(0, ret);
+    }
+
+    // Keys come back in order from the first one >= the start key, and
+    // may be deleted along the way.
+    //
+    ret = backend->cursor_open(mdb, "k050", 4, &cursor);
+    assert_int_equal(0, ret);
+    while (backend->cursor_next(cursor, &key, &key_len,
+                                &value, &value_len) == 0) {
+        assert_int_equal(4, key_len);
+        assert_int_equal(sizeof(u_int32_t), value_len);
+        memcpy(str, key, key_len);
+        str[key_len] = '\0';
+        assert_true(strcmp(last, str) < 0);
+        strcpy(last, str);
+        if (n++ % 2 == 0) {
+            ret = backend->cursor_del(cursor);
+            assert_int_equal(0, ret);
+        }
+    }
+    backend->cursor_close(cursor);
+    assert_int_equal(50, n);
+
+    ret = backend->get(mdb, "k050", 4, &value, &value_len);
+    assert_int_equal(-1, ret);
+    ret = backend->get(mdb, "k051", 4, &value, &value_len);
+    assert_int_equal(0, ret);
+    ret = backend->del(mdb, "k049", 4);
+    assert_int_equal(0, ret);
+    ret = backend->del(mdb, "k049", 4);
+    assert_int_equal(-1, ret);
+
+    backend->close(mdb);
+}
+
+int main(int argc, char *argv[]) {
+
+    char *file = get_file_arg(argc, argv);
+    set_trace_level(0);
+
+    tsdb_handler db;
+    tsdb_value *stored;
+    int ret;
+    u_int16_t vals_per_entry = 1;
+
+    //===================================================================
+    // Memory backend
+    //===================================================================
+
+    ret = tsdb_open_backend(file, &db, &vals_per_entry, slot_seconds, 0,
+                            &tsdb_memory_backend);
+    assert_int_equal(0, ret);
+    write_and_read(&db);
+    tsdb_close(&db);
+
+    // Nothing was written to disk.
+    //
+    assert_false(file_exists(file));
+
+    // And nothing survives the handler.
+    //
+    ret = tsdb_open_backend(file, &db, &vals_per_entry, slot_seconds, 0,
+                            &tsdb_memory_backend);
+    assert_int_equal(0, ret);
+    ret = tsdb_goto_epoch(&db, 120, 1, 0);
+    assert_int_equal(-1, ret);
+    tsdb_close(&db);
+
+    check_cursor(&tsdb_memory_backend);
+
+    //===================================================================
+    // Berkeley DB backend
+    //===================================================================
+
+    // The same operations work against the default backend.
+    //
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    write_and_read(&db);
+    tsdb_close(&db);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 1);
+    assert_int_equal(0, ret);
+    ret = tsdb_goto_epoch(&db, 120, 1, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_get_by_key(&db, "key-42", &stored);
+    assert_int_equal(0, ret);
+    assert_int_equal(84, *stored);
+    tsdb_close(&db);
+
+    return 0;
+}
@@ -29,8 +29,166 @@ void compress_array(u_int32_t *array, u_int32_t array_len,
                                    &state_compress);
 }
 
+// Checks the word kernels against get_bit on random arrays, including odd
+// word counts and a max_index part way through a word
+void check_kernels(void) {
+    u_int32_t a[67], b[67], c[67], indexes[67 * 32];
+    u_int32_t n, i, op, count, expected, max_index;
+
+    srand(16);
+    for (n = 1; n <= 67; n += 3) {
+        for (op = BITMAP_AND; op <= BITMAP_ANDNOT; op++) {
+            for (i = 0; i < n; i++) {
+                a[i] = rand() ^ ((u_int32_t)rand() << 16);
+                b[i] = rand() ^ ((u_int32_t)rand() << 16);
+                c[i] = a[i];
+            }
+            bitmap_combine(c, b, n, op);
+            for (i = 0; i < n; i++) {
+                expected = op == BITMAP_AND ? a[i] & b[i]
+                    : op == BITMAP_OR ? a[i] | b[i] : a[i] & ~b[i];
+                assert_int_equal(expected, c[i]);
+            }
+        }
+
+        expected = 0;
+        for (i = 0; i < n * BITS_PER_WORD; i++) {
+            expected += get_bit(c, i);
+        }
+        assert_int_equal(expected, bitmap_count(c, n));
+
+        max_index = n * BITS_PER_WORD - 1 - (rand() % BITS_PER_WORD);
+        count = bitmap_scan(c, max_index, indexes);
+        expected = 0;
+        for (i = 0; i <= max_index; i++) {
+            if (get_bit(c, i)) {
+                assert_int_equal(i, indexes[expected++]);
+            }
+        }
+        assert_int_equal(expected, count);
+    }
+}
+
+#define ROARING_TEST_BITS (4 * 65536)
+#define ROARING_TEST_WORDS (ROARING_TEST_BITS / BITS_PER_WORD)
+
+// Fills four containers' worth of bits: sparse, dense, runs, and one left
+// empty in a so that it only appears in b
+static void fill_roaring(tsdb_roaring *r, u_int32_t *words, int b) {
+    u_int32_t i, index;
+
+    roaring_init(r);
+    memset(words, 0, ROARING_TEST_WORDS * sizeof(u_int32_t));
+
+    for (i = 0; i < 300; i++) {
+        index = rand() % 65536;
+        set_bit(words, index);
+        assert_int_equal(0, roaring_add(r, index));
+    }
+    for (i = 0; i < 40000; i++) {
+        index = 65536 + rand() % 65536;
+        set_bit(words, index);
+        assert_int_equal(0, roaring_add(r, index));
+    }
+    for (index = 2 * 65536 + (b ? 500 : 0); index < 3 * 65536;
+         index += 1000) {
+        for (i = 0; i < 700; i++) {
+            set_bit(words, index + i);
+            assert_int_equal(0, roaring_add(r, index + i));
+        }
+    }
+    if (b) {
+        set_bit(words, ROARING_TEST_BITS - 1);
+        assert_int_equal(0, roaring_add(r, ROARING_TEST_BITS - 1));
+    }
+}
+
+static void check_roaring_equal(tsdb_roaring *r, u_int32_t *words) {
+    u_int32_t *indexes = malloc(ROARING_TEST_BITS * sizeof(u_int32_t));
+    u_int32_t i, count, expected = 0;
+
+    count = roaring_scan(r, ROARING_TEST_BITS - 1, indexes);
+    for (i = 0; i < ROARING_TEST_BITS; i++) {
+        assert_int_equal(get_bit(words, i), roaring_contains(r, i));
+        if (get_bit(words, i)) {
+            assert_int_equal(i, indexes[expected++]);
+        }
+    }
+    assert_int_equal(expected, count);
+    assert_int_equal(expected, roaring_cardinality(r));
+
+    // Scanning stops at max_index part way through a container
+    count = roaring_scan(r, 65536 + 1234, indexes);
+    expected = 0;
+    for (i = 0; i <= 65536 + 1234; i++) {
+        expected += get_bit(words, i);
+    }
+    assert_int_equal(expected, count);
+
+    free(indexes);
+}
+
+// Checks compressed bitmaps against plain ones, before and after
+// optimizing and a round trip through the serialized form
+void check_roaring(void) {
+    u_int32_t *a_words = malloc(ROARING_TEST_WORDS * sizeof(u_int32_t));
+    u_int32_t *b_words = malloc(ROARING_TEST_WORDS * sizeof(u_int32_t));
+    u_int32_t *expected = malloc(ROARING_TEST_WORDS * sizeof(u_int32_t));
+    u_int32_t len, op;
+    u_int8_t *buf;
+    tsdb_roaring a, b, result, loaded;
+
+    fill_roaring(&a, a_words, 0);
+    fill_roaring(&b, b_words, 1);
+    check_roaring_equal(&a, a_words);
+
+    for (op = BITMAP_AND; op <= BITMAP_ANDNOT; op++) {
+        memcpy(expected, a_words, ROARING_TEST_WORDS * sizeof(u_int32_t));
+        bitmap_combine(expected, b_words, ROARING_TEST_WORDS, op);
+        assert_int_equal(0, roaring_combine(&result, &a, &b, op));
+        check_roaring_equal(&result, expected);
+        roaring_free(&result);
+    }
+
+    // Runs are kept as runs once optimized, and combine the same way
+    assert_int_equal(0, roaring_optimize(&a));
+    assert_int_equal(0, roaring_optimize(&b));
+    assert_int_equal(ROARING_RUN, a.containers[2].type);
+    for (op = BITMAP_AND; op <= BITMAP_ANDNOT; op++) {
+        memcpy(expected, a_words, ROARING_TEST_WORDS * sizeof(u_int32_t));
+        bitmap_combine(expected, b_words, ROARING_TEST_WORDS, op);
+        assert_int_equal(0, roaring_combine(&result, &a, &b, op));
+        check_roaring_equal(&result, expected);
+        roaring_free(&result);
+    }
+
+    len = roaring_serialized_size(&b);
+    buf = malloc(len);
+    roaring_serialize(&b, buf);
+    assert_int_equal(0, roaring_deserialize(&loaded, buf, len));
+    check_roaring_equal(&loaded, b_words);
+    roaring_free(&loaded);
+
+    // Adding to a run container expands it
+    assert_int_equal(0, roaring_add(&b, 2 * 65536 + 1300));
+    set_bit(b_words, 2 * 65536 + 1300);
+    check_roaring_equal(&b, b_words);
+
+    // Truncated or damaged records are rejected
+    assert_int_equal(-1, roaring_deserialize(&loaded, buf, len - 1));
+    buf[0] ^= 0xff;
+    assert_int_equal(-1, roaring_deserialize(&loaded, buf, len));
+
+    free(buf);
+    roaring_free(&a);
+    roaring_free(&b);
+    free(a_words);
+    free(b_words);
+    free(expected);
+}
+
 int main(int argc, char *argv[]) {
-    u_int32_t i, j;
+    u_int32_t i;
     u_int8_t word_size = sizeof(u_int32_t);
     u_int32_t array_len = CHUNK_GROWTH / word_size;
 
@@ -65,6 +223,9 @@ int main(int argc, char *argv[]) {
     u_int32_t max_index = 9999;
     u_int32_t array_max_used = max_index / word_size;
 
+    check_kernels();
+    check_roaring();
+
     printf("Size of tag array uncompressed: %lu\n", sizeof(tag1));
 
     char *compressed = 0;
@@ -120,9 +281,9 @@ int main(int argc, char *argv[]) {
     // calculate result and scan multiple times (demonstrate load)
     //
     for (i = 0; i < 100000; i++) {
-        for (j = 0; j < array_max_used; j++) {
-            result[j] = (tag1[j] & ~tag2[j]) | tag3[j];
-        }
+        memcpy(result, tag1, sizeof(result));
+        bitmap_combine(result, tag2, array_len, BITMAP_ANDNOT);
+        bitmap_combine(result, tag3, array_len, BITMAP_OR);
         scan_result(result, max_index, NULL);
     }
 
@@ -0,0 +1,237 @@
+#include "test_core.h"
+
+static char *get_file_arg(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: test-cache TEST-DB\n");
+        exit(1);
+    }
+    char *file = argv[1];
+    if (file_exists(file)) {
+        fprintf(stderr, "%s exists\n", file);
+        exit(1);
+    }
+    return file;
+}
+
+#define slot_seconds 60
+#define num_epochs 10
+#define num_keys 100
+
+static void write_epochs(tsdb_handler *db, u_int32_t start) {
+    u_int32_t epoch, i;
+    char key[32];
+    tsdb_value val;
+    int ret;
+
+    for (epoch = start; epoch < start + num_epochs * slot_seconds;
+         epoch += slot_seconds) {
+        ret = tsdb_goto_epoch(db, epoch, 0, 1);
+        assert_int_equal(0, ret);
+        for (i = 0; i < num_keys; i++) {
+            sprintf(key, "key-%u", i);
+            val = epoch + i;
+            ret = tsdb_set(db, key, &val);
+            assert_int_equal(0, ret);
+        }
+    }
+}
+
+static void check_epochs(tsdb_handler *db, u_int32_t start) {
+    u_int32_t epoch, i;
+    char key[32];
+    tsdb_value *val;
+    int ret;
+
+    for (epoch = start; epoch < start + num_epochs * slot_seconds;
+         epoch += slot_seconds) {
+        ret = tsdb_goto_epoch(db, epoch, 1, 0);
+        assert_int_equal(0, ret);
+        for (i = 0; i < num_keys; i++) {
+            sprintf(key, "key-%u", i);
+            ret = tsdb_get_by_key(db, key, &val);
+            assert_int_equal(0, ret);
+            assert_int_equal(epoch + i, *val);
+        }
+    }
+}
+
+static int failing_put(void *db, void *key, u_int32_t key_len,
+                       void *value, u_int32_t value_len) {
+    (void)db; (void)key; (void)key_len; (void)value; (void)value_len;
+    return -2;
+}
+
+int main(int argc, char *argv[]) {
+
+    char *file = get_file_arg(argc, argv);
+    set_trace_level(0);
+
+    tsdb_handler db;
+    int ret;
+    u_int16_t vals_per_entry = 1;
+    u_int32_t start = 6000;
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+
+    //===================================================================
+    // Cached epochs
+    //===================================================================
+
+    // The epoch cache is disabled by default. Let's make room for all
+    // of the epochs we're about to write.
+    //
+    tsdb_set_cache_size(&db, 1024 * 1024);
+    write_epochs(&db, start);
+
+    // Each epoch was new when we wrote it, so there were no hits.
+    //
+    assert_int_equal(0, db.cache.hits);
+    assert_int_equal(num_epochs, db.cache.misses);
+
+    // Going back over the epochs is served from the cache (the last
+    // epoch is cached when we move back to the first one).
+    //
+    check_epochs(&db, start);
+    assert_int_equal(num_epochs, db.cache.hits);
+    assert_int_equal(0, db.cache.evictions);
+
+    // And again.
+    //
+    check_epochs(&db, start);
+    assert_int_equal(num_epochs * 2, db.cache.hits);
+
+    //===================================================================
+    // Eviction
+    //===================================================================
+
+    // Shrinking the cache evicts the least recently used epochs, writing
+    // any changes back to the database.
+    //
+    tsdb_set_cache_size(&db, 1);
+    assert_true(db.cache.evictions > 0);
+    assert_true(db.cache.head == NULL);
+
+    // Dirty epochs are written on eviction -- we can write a new set of
+    // epochs with a cache that only holds a single epoch and read them
+    // back.
+    //
+    tsdb_set_cache_size(&db, db.chunk.data_len + sizeof(tsdb_cached_chunk));
+    write_epochs(&db, start + 3600);
+    check_epochs(&db, start + 3600);
+
+    tsdb_close(&db);
+
+    // Everything is on disk after close.
+    //
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    check_epochs(&db, start);
+    check_epochs(&db, start + 3600);
+    assert_int_equal(0, db.cache.hits);
+
+    //===================================================================
+    // Cached tags
+    //===================================================================
+
+    // Tags are cached as they're used. Tagging a key only changes the
+    // cached tag, so nothing is written yet.
+    //
+    u_int32_t i, matches[num_keys], match_count;
+    char key[32];
+    void *value;
+    u_int32_t value_len;
+    tsdb_backend failing;
+    const tsdb_backend *backend;
+
+    for (i = 0; i < num_keys; i++) {
+        sprintf(key, "key-%u", i);
+        ret = tsdb_tag_key(&db, key, i % 2 ? "odd" : "even");
+        assert_int_equal(0, ret);
+    }
+    assert_int_equal(2, db.tag_cache.count);
+    assert_int_equal(2, db.tag_cache.misses);
+    assert_int_equal(num_keys - 2, db.tag_cache.hits);
+    ret = db.backend->get(db.db, "tag-odd", 7, &value, &value_len);
+    assert_int_equal(-1, ret);
+
+    // Queries see the cached changes.
+    //
+    ret = tsdb_get_tag_indexes(&db, "odd", matches, num_keys, &match_count);
+    assert_int_equal(0, ret);
+    assert_int_equal(num_keys / 2, match_count);
+
+    // Flushing writes them.
+    //
+    tsdb_flush(&db);
+    ret = db.backend->get(db.db, "tag-odd", 7, &value, &value_len);
+    assert_int_equal(0, ret);
+
+    // Shrinking the cache evicts the least recently used tags, writing
+    // them if they've changed.
+    //
+    ret = tsdb_tag_key(&db, "key-0", "zero");
+    assert_int_equal(0, ret);
+    tsdb_set_tag_cache_size(&db, 1);
+    assert_int_equal(1, db.tag_cache.count);
+    assert_int_equal(2, db.tag_cache.evictions);
+    ret = db.backend->get(db.db, "tag-zero", 8, &value, &value_len);
+    assert_int_equal(-1, ret);
+
+    // Without a cache each change is written straight away.
+    //
+    tsdb_set_tag_cache_size(&db, 0);
+    ret = db.backend->get(db.db, "tag-zero", 8, &value, &value_len);
+    assert_int_equal(0, ret);
+    ret = tsdb_tag_key(&db, "key-1", "one");
+    assert_int_equal(0, ret);
+    assert_int_equal(0, db.tag_cache.count);
+    ret = db.backend->get(db.db, "tag-one", 7, &value, &value_len);
+    assert_int_equal(0, ret);
+
+    // A tag that can't be written stays cached and is written later.
+    //
+    failing = *db.backend;
+    failing.put = failing_put;
+    backend = db.backend;
+    db.backend = &failing;
+    ret = tsdb_tag_key(&db, "key-3", "three");
+    assert_int_equal(-2, ret);
+    assert_int_equal(1, db.tag_cache.count);
+    db.backend = backend;
+    ret = backend->get(db.db, "tag-three", 9, &value, &value_len);
+    assert_int_equal(-1, ret);
+    tsdb_set_tag_cache_size(&db, 0);
+    assert_int_equal(0, db.tag_cache.count);
+    ret = backend->get(db.db, "tag-three", 9, &value, &value_len);
+    assert_int_equal(0, ret);
+
+    // The default size is restored on open, and changes are written on
+    // close.
+    //
+    tsdb_close(&db);
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    assert_int_equal(TAG_CACHE_SIZE, db.tag_cache.max_count);
+    ret = tsdb_tag_key(&db, "key-2", "zero");
+    assert_int_equal(0, ret);
+    tsdb_close(&db);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_get_tag_indexes(&db, "even", matches, num_keys, &match_count);
+    assert_int_equal(0, ret);
+    assert_int_equal(num_keys / 2, match_count);
+    ret = tsdb_get_tag_indexes(&db, "zero", matches, num_keys, &match_count);
+    assert_int_equal(0, ret);
+    assert_int_equal(2, match_count);
+    ret = tsdb_get_tag_indexes(&db, "one", matches, num_keys, &match_count);
+    assert_int_equal(0, ret);
+    assert_int_equal(1, match_count);
+    ret = tsdb_get_tag_indexes(&db, "three", matches, num_keys, &match_count);
+    assert_int_equal(0, ret);
+    assert_int_equal(1, match_count);
+    tsdb_close(&db);
+
+    return 0;
+}
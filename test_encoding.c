@@ -0,0 +1,854 @@
+#include "test_core.h"
+
+static char *get_file_arg(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: test-encoding TEST-DB\n");
+        exit(1);
+    }
+    char *file = argv[1];
+    if (file_exists(file)) {
+        fprintf(stderr, "%s exists\n", file);
+        exit(1);
+    }
+    return file;
+}
+
+#define slot_seconds 60
+#define num_epochs 20
+#define num_keys 20001
+#define start 6000
+
+// Counters that move a little each slot
+static tsdb_value value_at(u_int32_t n, u_int32_t i) {
+    return i * 1000 + n * (i % 7);
+}
+
+static void write_epochs(tsdb_handler *db) {
+    u_int32_t n, i;
+    char key[32];
+    tsdb_value val;
+    int ret;
+
+    for (n = 0; n < num_epochs; n++) {
+        ret = tsdb_goto_epoch(db, start + n * slot_seconds, 0, 1);
+        assert_int_equal(0, ret);
+        for (i = 0; i < num_keys; i++) {
+            sprintf(key, "key-%u", i);
+            val = value_at(n, i);
+            ret = tsdb_set(db, key, &val);
+            assert_int_equal(0, ret);
+        }
+    }
+    tsdb_flush(db);
+}
+
+static void check_epoch(tsdb_handler *db, u_int32_t n, u_int32_t changed) {
+    u_int32_t i;
+    char key[32];
+    tsdb_value *val;
+    int ret;
+
+    ret = tsdb_goto_epoch(db, start + n * slot_seconds, 1, 0);
+    assert_int_equal(0, ret);
+    for (i = 0; i < num_keys; i += 37) {
+        sprintf(key, "key-%u", i);
+        ret = tsdb_get_by_key(db, key, &val);
+        assert_int_equal(0, ret);
+        assert_int_equal(value_at(n, i) + changed, *val);
+    }
+    for (i = 0; i < MAX_NUM_FRAGMENTS; i++) {
+        assert_true(db->chunk.fragment_depth[i] <= MAX_TRANSFORM_DEPTH);
+    }
+}
+
+// Total size of the stored fragments
+static u_int64_t stored_size(tsdb_handler *db) {
+    tsdb_fragment_key first;
+    void *cursor, *key, *value;
+    u_int32_t key_len, value_len;
+    u_int64_t size = 0;
+
+    fragment_key_first(db->format, &first);
+    assert_int_equal(0, db->backend->cursor_open(db->db, first.data,
+                                                 first.len, &cursor));
+    while (db->backend->cursor_next(cursor, &key, &key_len,
+                                    &value, &value_len) == 0
+           && fragment_key_in_range(db->format, key, key_len)) {
+        size += value_len;
+    }
+    db->backend->cursor_close(cursor);
+
+    return size;
+}
+
+// Number of stored fragments using codec
+static u_int32_t codec_count(tsdb_handler *db, u_int8_t codec) {
+    void *cursor, *key, *value;
+    u_int32_t key_len, value_len, count = 0;
+    tsdb_fragment_header header;
+    tsdb_fragment_key first;
+
+    fragment_key_first(db->format, &first);
+    assert_int_equal(0, db->backend->cursor_open(db->db, first.data,
+                                                 first.len, &cursor));
+    while (db->backend->cursor_next(cursor, &key, &key_len,
+                                    &value, &value_len) == 0
+           && fragment_key_in_range(db->format, key, key_len)) {
+        if (fragment_read_header(value, value_len, &header) > 0
+            && header.codec == codec) {
+            count++;
+        }
+    }
+    db->backend->cursor_close(cursor);
+
+    return count;
+}
+
+// Number of fragment keys in format, checking binary keys come in epoch
+// then fragment order
+static u_int32_t count_fragment_keys(tsdb_handler *db, u_int32_t format) {
+    tsdb_fragment_key first;
+    void *cursor, *key;
+    u_int32_t key_len, epoch, fragment, count = 0;
+    u_int64_t last = 0, pos;
+
+    fragment_key_first(format, &first);
+    assert_int_equal(0, db->backend->cursor_open(db->db, first.data,
+                                                 first.len, &cursor));
+    while (db->backend->cursor_next(cursor, &key, &key_len,
+                                    NULL, NULL) == 0
+           && fragment_key_in_range(format, key, key_len)) {
+        assert_int_equal(0, fragment_key_parse(format, key, key_len,
+                                               &epoch, &fragment));
+        pos = ((u_int64_t)epoch << 32) | fragment;
+        if (format == FORMAT_BINARY_KEYS) {
+            assert_true(count == 0 || pos > last);
+        }
+        last = pos;
+        count++;
+    }
+    db->backend->cursor_close(cursor);
+
+    return count;
+}
+
+// Leaves what an interrupted tsdb_migrate would: the first moved text
+// keys have been replaced by binary keys, and the next one has both
+static void interrupt_migration(tsdb_handler *db, u_int32_t moved) {
+    tsdb_fragment_key first, keys[16], binary;
+    void *cursor, *key, *value, *copy;
+    u_int32_t key_len, value_len, epoch, fragment, n = 0, i;
+
+    assert_true(moved < 16);
+    fragment_key_first(FORMAT_TEXT_KEYS, &first);
+    assert_int_equal(0, db->backend->cursor_open(db->db, first.data,
+                                                 first.len, &cursor));
+    while (n <= moved
+           && db->backend->cursor_next(cursor, &key, &key_len,
+                                       NULL, NULL) == 0
+           && fragment_key_in_range(FORMAT_TEXT_KEYS, key, key_len)) {
+        assert_true(key_len <= sizeof(keys[n].data));
+        memcpy(keys[n].data, key, key_len);
+        keys[n].len = key_len;
+        n++;
+    }
+    db->backend->cursor_close(cursor);
+    assert_int_equal(moved + 1, n);
+
+    for (i = 0; i < n; i++) {
+        assert_int_equal(0, fragment_key_parse(FORMAT_TEXT_KEYS,
+                                               keys[i].data, keys[i].len,
+                                               &epoch, &fragment));
+        assert_int_equal(0, db->backend->get(db->db, keys[i].data,
+                                             keys[i].len, &value,
+                                             &value_len));
+        copy = malloc(value_len);
+        memcpy(copy, value, value_len);
+        fragment_key(FORMAT_BINARY_KEYS, epoch, fragment, &binary);
+        assert_int_equal(0, db->backend->put(db->db, binary.data,
+                                             binary.len, copy, value_len));
+        free(copy);
+        if (i < moved) {
+            assert_int_equal(0, db->backend->del(db->db, keys[i].data,
+                                                 keys[i].len));
+        }
+    }
+}
+
+static u_int32_t count_blobs(tsdb_handler *db) {
+    void *cursor, *key, *value;
+    u_int32_t key_len, value_len, count = 0;
+
+    assert_int_equal(0, db->backend->cursor_open(db->db, "blob-", 5,
+                                                 &cursor));
+    while (db->backend->cursor_next(cursor, &key, &key_len,
+                                    &value, &value_len) == 0
+           && key_len > 5 && memcmp(key, "blob-", 5) == 0) {
+        count++;
+    }
+    db->backend->cursor_close(cursor);
+
+    return count;
+}
+
+// Packs values of every width and block length and unpacks them again
+static void check_bitpack(void) {
+    u_int32_t lengths[] = { 1, 3, 4, 127, 128, 129, 1000 };
+    u_int32_t num_values, bits, i, j, len, seed = 1;
+    u_int32_t values[1000], decoded[1000];
+    u_int8_t packed[bitpack_bound(1000)];
+
+    for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        num_values = lengths[i];
+        for (bits = 0; bits <= 32; bits++) {
+            for (j = 0; j < num_values; j++) {
+                seed = seed * 1103515245 + 12345;
+                values[j] = 70000 + (bits == 32 ? seed
+                                     : seed & ((1u << bits) - 1));
+            }
+            len = bitpack_encode(values, num_values, packed);
+            assert_int_equal(bitpack_size(values, num_values), len);
+            assert_true(len <= bitpack_bound(num_values));
+            assert_int_equal(0, bitpack_check(packed, len, num_values));
+            assert_int_equal(-1, bitpack_check(packed, len - 1, num_values));
+            memset(decoded, 0, sizeof(decoded));
+            bitpack_decode(packed, num_values, decoded);
+            for (j = 0; j < num_values; j++) {
+                assert_int_equal(values[j], decoded[j]);
+            }
+        }
+    }
+}
+
+// Values that compress well but don't pack
+static tsdb_value pattern_at(u_int32_t n, u_int32_t i) {
+    return (i % 10) * 100000000 + n;
+}
+
+// Writes the values for slot v to slot n
+static void write_pattern(tsdb_handler *db, u_int32_t n, u_int32_t v) {
+    u_int32_t i;
+    char key[32];
+    tsdb_value val;
+    int ret;
+
+    ret = tsdb_goto_epoch(db, start + n * slot_seconds, 0, 1);
+    assert_int_equal(0, ret);
+    for (i = 0; i < num_keys; i++) {
+        sprintf(key, "key-%u", i);
+        val = pattern_at(v, i);
+        ret = tsdb_set(db, key, &val);
+        assert_int_equal(0, ret);
+    }
+    tsdb_flush(db);
+}
+
+static void check_pattern(tsdb_handler *db, u_int32_t n, u_int32_t v) {
+    u_int32_t i;
+    char key[32];
+    tsdb_value *val;
+    int ret;
+
+    ret = tsdb_goto_epoch(db, start + n * slot_seconds, 1, 0);
+    assert_int_equal(0, ret);
+    for (i = 0; i < num_keys; i += 37) {
+        sprintf(key, "key-%u", i);
+        ret = tsdb_get_by_key(db, key, &val);
+        assert_int_equal(0, ret);
+        assert_int_equal(pattern_at(v, i), *val);
+    }
+}
+
+// Stores the blob of the first fragment of pattern v under the hash of
+// pattern w, as if the two hashes collided
+static void collide_blob(tsdb_handler *db, u_int32_t v, u_int32_t w) {
+    u_int32_t fragment_size = db->values_len * CHUNK_GROWTH, i, value_len;
+    tsdb_value *values = (tsdb_value*)malloc(fragment_size);
+    char key[32];
+    void *value, *copy;
+
+    for (i = 0; i < CHUNK_GROWTH; i++) {
+        values[i] = pattern_at(v, i);
+    }
+    snprintf(key, sizeof(key), "blob-%016llx",
+             (unsigned long long)fragment_hash((u_int8_t*)values,
+                                               fragment_size));
+    assert_int_equal(0, db->backend->get(db->db, key, strlen(key),
+                                         &value, &value_len));
+    copy = malloc(value_len);
+    memcpy(copy, value, value_len);
+
+    for (i = 0; i < CHUNK_GROWTH; i++) {
+        values[i] = pattern_at(w, i);
+    }
+    snprintf(key, sizeof(key), "blob-%016llx",
+             (unsigned long long)fragment_hash((u_int8_t*)values,
+                                               fragment_size));
+    assert_int_equal(0, db->backend->put(db->db, key, strlen(key),
+                                         copy, value_len));
+    free(copy);
+    free(values);
+}
+
+static u_int64_t encoded_size(char *file, u_int8_t encoding) {
+    tsdb_handler db;
+    u_int16_t vals_per_entry = 1;
+    u_int64_t size;
+    u_int32_t n;
+    int ret;
+
+    ret = tsdb_open_backend(file, &db, &vals_per_entry, slot_seconds, 0,
+                            &tsdb_memory_backend);
+    assert_int_equal(0, ret);
+    ret = tsdb_set_encoding(&db, encoding);
+    assert_int_equal(0, ret);
+    write_epochs(&db);
+    size = stored_size(&db);
+    for (n = 0; n < num_epochs; n++) {
+        check_epoch(&db, n, 0);
+    }
+    tsdb_close(&db);
+
+    return size;
+}
+
+int main(int argc, char *argv[]) {
+
+    char *file = get_file_arg(argc, argv);
+    set_trace_level(0);
+
+    tsdb_handler db;
+    tsdb_compact_stats stats;
+    tsdb_purge_stats purge_stats;
+    u_int64_t plain, xor, delta, size;
+    u_int16_t vals_per_entry = 1;
+    u_int32_t n, i;
+    tsdb_value val, *valp;
+    char key[32];
+    int ret;
+
+    //===================================================================
+    // Encodings
+    //===================================================================
+
+    // Storing each fragment against the previous epoch takes a fraction
+    // of the space for slowly changing values.
+    //
+    plain = encoded_size(file, TRANSFORM_NONE);
+    xor = encoded_size(file, TRANSFORM_XOR);
+    delta = encoded_size(file, TRANSFORM_DELTA);
+    assert_true(xor < plain / 2);
+    assert_true(delta < plain / 4);
+
+    //===================================================================
+    // Bit-packing
+    //===================================================================
+
+    check_bitpack();
+
+    // Fragments of small values are packed rather than compressed.
+    //
+    ret = tsdb_open_backend(file, &db, &vals_per_entry, slot_seconds, 0,
+                            &tsdb_memory_backend);
+    assert_int_equal(0, ret);
+    ret = tsdb_set_encoding(&db, TRANSFORM_DELTA);
+    assert_int_equal(0, ret);
+    write_epochs(&db);
+    assert_true(codec_count(&db, CODEC_BITPACK) > 0);
+    for (n = 0; n < num_epochs; n++) {
+        check_epoch(&db, n, 0);
+    }
+    tsdb_close(&db);
+
+    //===================================================================
+    // Codecs
+    //===================================================================
+
+    // The codec is saved in the database and applies to fragments
+    // written from then on.
+    //
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    assert_int_equal(CODEC_QLZ, db.codec);
+    assert_int_equal(-1, tsdb_set_codec(&db, NUM_CODECS));
+    write_pattern(&db, 0, 0);
+    ret = tsdb_set_codec(&db, CODEC_QLZ3);
+    assert_int_equal(0, ret);
+    write_pattern(&db, 1, 1);
+    ret = tsdb_set_codec(&db, CODEC_RAW);
+    assert_int_equal(0, ret);
+    write_pattern(&db, 2, 2);
+    ret = tsdb_set_codec(&db, CODEC_QLZ3);
+    assert_int_equal(0, ret);
+    tsdb_close(&db);
+
+    // Every fragment is decoded with the codec it was written with. The
+    // last fragment of an epoch is mostly empty and may be packed instead.
+    //
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 1);
+    assert_int_equal(0, ret);
+    assert_int_equal(CODEC_QLZ3, db.codec);
+    assert_true(codec_count(&db, CODEC_QLZ) >= 2);
+    assert_true(codec_count(&db, CODEC_QLZ3) >= 2);
+    assert_int_equal(3, codec_count(&db, CODEC_RAW));
+    for (n = 0; n < 3; n++) {
+        check_pattern(&db, n, n);
+    }
+    tsdb_close(&db);
+    unlink(file);
+
+    //===================================================================
+    // Identical fragments
+    //===================================================================
+
+    // A fragment that's the same as in the previous epoch is stored once,
+    // in a blob that both epochs point to. Later copies point to it too.
+    // The first two fragments of each epoch are the same, the third is
+    // mostly empty.
+    //
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    write_pattern(&db, 0, 0);
+    assert_int_equal(0, count_blobs(&db));
+    write_pattern(&db, 1, 0);
+    assert_int_equal(2, count_blobs(&db));
+    assert_int_equal(6, codec_count(&db, CODEC_BLOB));
+    write_pattern(&db, 2, 0);
+    tsdb_close(&db);
+
+    // Blobs are found by their hash from then on.
+    //
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    write_pattern(&db, 7, 0);
+    assert_int_equal(2, count_blobs(&db));
+    assert_int_equal(12, codec_count(&db, CODEC_BLOB));
+    check_pattern(&db, 0, 0);
+    check_pattern(&db, 2, 0);
+    check_pattern(&db, 7, 0);
+
+    // Replacing a fragment that points to a blob leaves the blob alone.
+    //
+    write_pattern(&db, 2, 2);
+    assert_int_equal(2, count_blobs(&db));
+    assert_int_equal(9, codec_count(&db, CODEC_BLOB));
+    tsdb_close(&db);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 1);
+    assert_int_equal(0, ret);
+    check_pattern(&db, 0, 0);
+    check_pattern(&db, 1, 0);
+    check_pattern(&db, 2, 2);
+    check_pattern(&db, 7, 0);
+    tsdb_close(&db);
+
+    // A blob whose hash matches isn't used unless its values match too.
+    //
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    collide_blob(&db, 0, 5);
+    tsdb_close(&db);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    write_pattern(&db, 3, 5);
+    write_pattern(&db, 4, 5);
+    check_pattern(&db, 3, 5);
+    check_pattern(&db, 4, 5);
+    check_pattern(&db, 0, 0);
+    tsdb_close(&db);
+    unlink(file);
+
+    // Encoded fragments can be stored against one that points to a blob.
+    //
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_set_encoding(&db, TRANSFORM_DELTA);
+    assert_int_equal(0, ret);
+    write_pattern(&db, 0, 0);
+    write_pattern(&db, 1, 0);
+    write_pattern(&db, 2, 2);
+    assert_true(codec_count(&db, CODEC_BLOB) >= 6);
+    tsdb_close(&db);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 1);
+    assert_int_equal(0, ret);
+    check_pattern(&db, 2, 2);
+    check_pattern(&db, 1, 0);
+    check_pattern(&db, 0, 0);
+    tsdb_close(&db);
+    unlink(file);
+
+    //===================================================================
+    // Compacting old epochs
+    //===================================================================
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    for (n = 0; n < 10; n++) {
+        write_pattern(&db, n, n);
+    }
+    tsdb_close(&db);
+
+    // Epochs before the given one are stored again with the new codec, a
+    // few fragments at a time. Where it got to is saved in the database.
+    //
+    memset(&stats, 0, sizeof(stats));
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_compact(&db, CODEC_QLZ3, start + 5 * slot_seconds, 4, &stats);
+    assert_int_equal(1, ret);
+    assert_int_equal(4, stats.examined);
+    tsdb_close(&db);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    i = 0;
+    do {
+        ret = tsdb_compact(&db, CODEC_QLZ3, start + 5 * slot_seconds, 4,
+                           &stats);
+        i++;
+    } while (ret == 1);
+    assert_int_equal(0, ret);
+    assert_true(i > 1);
+
+    // Keys sort by epoch, so the walk stops at the first epoch kept
+    assert_int_equal(5 * 3, stats.examined);
+    assert_true(stats.fragments >= 10);
+    assert_int_equal(stats.fragments, codec_count(&db, CODEC_QLZ3));
+    assert_true(codec_count(&db, CODEC_QLZ) >= 10);
+    for (n = 0; n < 10; n++) {
+        check_pattern(&db, n, n);
+    }
+
+    // There's nothing left to do
+    memset(&stats, 0, sizeof(stats));
+    ret = tsdb_compact(&db, CODEC_QLZ3, start + 5 * slot_seconds, 100,
+                       &stats);
+    assert_int_equal(0, ret);
+    assert_int_equal(5 * 3, stats.examined);
+    assert_int_equal(0, stats.fragments);
+    tsdb_close(&db);
+    unlink(file);
+
+    // Fragments stored against other epochs keep their encoding.
+    //
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_set_encoding(&db, TRANSFORM_DELTA);
+    assert_int_equal(0, ret);
+    write_epochs(&db);
+    tsdb_close(&db);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    memset(&stats, 0, sizeof(stats));
+    while ((ret = tsdb_compact(&db, CODEC_RAW, start + num_epochs
+                               * slot_seconds, 7, &stats)) == 1);
+    assert_int_equal(0, ret);
+    assert_int_equal(num_epochs * 3, codec_count(&db, CODEC_RAW));
+    for (n = num_epochs; n > 0; n--) {
+        check_epoch(&db, n - 1, 0);
+    }
+    tsdb_close(&db);
+    unlink(file);
+
+    //===================================================================
+    // Reading encoded epochs
+    //===================================================================
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_set_encoding(&db, TRANSFORM_DELTA);
+    assert_int_equal(0, ret);
+    write_epochs(&db);
+    tsdb_close(&db);
+
+    // Going backwards, each epoch is decoded from the database along
+    // with the epochs it's stored against.
+    //
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 1);
+    assert_int_equal(0, ret);
+    assert_int_equal(TRANSFORM_DELTA, db.encoding);
+    for (n = num_epochs; n > 0; n--) {
+        check_epoch(&db, n - 1, 0);
+    }
+    tsdb_close(&db);
+
+    // Same for fragments loaded on demand.
+    //
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 1);
+    assert_int_equal(0, ret);
+    tsdb_set_load_on_demand(&db, 1);
+    check_epoch(&db, 13, 0);
+    check_epoch(&db, 2, 0);
+    tsdb_close(&db);
+
+    //===================================================================
+    // Rewriting an epoch
+    //===================================================================
+
+    // The next epoch is stored against the values we replace, so it's
+    // stored again before they're gone.
+    //
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_goto_epoch(&db, start + 5 * slot_seconds, 1, 0);
+    assert_int_equal(0, ret);
+    for (i = 0; i < num_keys; i++) {
+        sprintf(key, "key-%u", i);
+        val = value_at(5, i) + 1;
+        ret = tsdb_set(&db, key, &val);
+        assert_int_equal(0, ret);
+    }
+    tsdb_close(&db);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 1);
+    assert_int_equal(0, ret);
+    for (n = num_epochs; n > 0; n--) {
+        check_epoch(&db, n - 1, n - 1 == 5 ? 1 : 0);
+    }
+    tsdb_close(&db);
+
+    // Encoding can be turned off; encoded epochs are still readable.
+    //
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_set_encoding(&db, TRANSFORM_NONE);
+    assert_int_equal(0, ret);
+    check_epoch(&db, 9, 0);
+    tsdb_close(&db);
+    unlink(file);
+
+    //===================================================================
+    // Fragment keys
+    //===================================================================
+
+    // New databases store fragments under binary keys, in epoch then
+    // fragment order.
+    //
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    assert_int_equal(FORMAT_CURRENT, db.format);
+    write_epochs(&db);
+    assert_int_equal(num_epochs * 3,
+                     count_fragment_keys(&db, FORMAT_BINARY_KEYS));
+    assert_int_equal(0, count_fragment_keys(&db, FORMAT_TEXT_KEYS));
+    tsdb_close(&db);
+    unlink(file);
+
+    // Databases from before binary keys have no format record and keep
+    // their "EPOCH-FRAGMENT" keys until they're migrated.
+    //
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    db.backend->del(db.db, "format", strlen("format"));
+    db.format = FORMAT_TEXT_KEYS;
+    ret = tsdb_set_encoding(&db, TRANSFORM_DELTA);
+    assert_int_equal(0, ret);
+    write_epochs(&db);
+    tsdb_close(&db);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    assert_int_equal(FORMAT_TEXT_KEYS, db.format);
+    assert_int_equal(num_epochs * 3,
+                     count_fragment_keys(&db, FORMAT_TEXT_KEYS));
+    check_epoch(&db, 7, 0);
+
+    n = 0;
+    ret = tsdb_migrate(&db, &n);
+    assert_int_equal(0, ret);
+    assert_int_equal(num_epochs * 3, n);
+    assert_int_equal(FORMAT_BINARY_KEYS, db.format);
+    assert_int_equal(0, count_fragment_keys(&db, FORMAT_TEXT_KEYS));
+    assert_int_equal(num_epochs * 3,
+                     count_fragment_keys(&db, FORMAT_BINARY_KEYS));
+    tsdb_close(&db);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 1);
+    assert_int_equal(0, ret);
+    assert_int_equal(FORMAT_BINARY_KEYS, db.format);
+    for (n = num_epochs; n > 0; n--) {
+        check_epoch(&db, n - 1, 0);
+    }
+    tsdb_close(&db);
+    unlink(file);
+
+    // A migration that's interrupted in the middle of a batch finishes
+    // when it's run again.
+    //
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    db.backend->del(db.db, "format", strlen("format"));
+    db.format = FORMAT_TEXT_KEYS;
+    ret = tsdb_set_encoding(&db, TRANSFORM_DELTA);
+    assert_int_equal(0, ret);
+    write_epochs(&db);
+    tsdb_close(&db);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    interrupt_migration(&db, 4);
+    assert_int_equal(num_epochs * 3 - 4,
+                     count_fragment_keys(&db, FORMAT_TEXT_KEYS));
+    assert_int_equal(5, count_fragment_keys(&db, FORMAT_BINARY_KEYS));
+
+    n = 0;
+    ret = tsdb_migrate(&db, &n);
+    assert_int_equal(0, ret);
+    assert_int_equal(num_epochs * 3 - 4, n);
+    assert_int_equal(FORMAT_BINARY_KEYS, db.format);
+    assert_int_equal(0, count_fragment_keys(&db, FORMAT_TEXT_KEYS));
+    assert_int_equal(num_epochs * 3,
+                     count_fragment_keys(&db, FORMAT_BINARY_KEYS));
+    tsdb_close(&db);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 1);
+    assert_int_equal(0, ret);
+    for (n = num_epochs; n > 0; n--) {
+        check_epoch(&db, n - 1, 0);
+    }
+    tsdb_close(&db);
+    unlink(file);
+
+    //===================================================================
+    // Purging old epochs
+    //===================================================================
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_set_encoding(&db, TRANSFORM_DELTA);
+    assert_int_equal(0, ret);
+    write_epochs(&db);
+    size = stored_size(&db);
+
+    // Nothing is purged without a retention.
+    //
+    memset(&purge_stats, 0, sizeof(purge_stats));
+    ret = tsdb_purge(&db, start + num_epochs * slot_seconds, 100,
+                     &purge_stats);
+    assert_int_equal(0, ret);
+    assert_int_equal(0, purge_stats.examined);
+
+    // The retention is kept in the database.
+    //
+    ret = tsdb_set_retention(&db, 12 * slot_seconds);
+    assert_int_equal(0, ret);
+    tsdb_close(&db);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    assert_int_equal(12 * slot_seconds, db.retention);
+
+    // Epochs older than the retention are deleted a few fragments at a
+    // time, carrying on where the last call stopped. Epoch 5 is only
+    // partly older, so it's kept. It's stored against epoch 4, so it's
+    // stored again on its own first.
+    //
+    memset(&purge_stats, 0, sizeof(purge_stats));
+    ret = tsdb_purge(&db, start + 17 * slot_seconds + 30, 7, &purge_stats);
+    assert_int_equal(1, ret);
+    assert_int_equal(7, purge_stats.examined);
+    assert_int_equal(3, purge_stats.rebased);
+    tsdb_close(&db);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    assert_int_equal(start + 5 * slot_seconds, db.purging);
+    i = 0;
+    do {
+        ret = tsdb_purge(&db, start + 17 * slot_seconds + 30, 7,
+                         &purge_stats);
+        i++;
+    } while (ret == 1);
+    assert_int_equal(0, ret);
+    assert_true(i > 1);
+    assert_int_equal(5 * 3, purge_stats.examined);
+    assert_int_equal(5 * 3, purge_stats.fragments);
+    assert_int_equal(3, purge_stats.rebased);
+    assert_int_equal(0, db.purging);
+    assert_true(stored_size(&db) < size);
+    tsdb_close(&db);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 1);
+    assert_int_equal(0, ret);
+    for (n = 0; n < 5; n++) {
+        ret = tsdb_goto_epoch(&db, start + n * slot_seconds, 1, 0);
+        assert_int_equal(-1, ret);
+    }
+    for (n = num_epochs; n > 5; n--) {
+        check_epoch(&db, n - 1, 0);
+    }
+    tsdb_close(&db);
+
+    // Epochs in memory are dropped rather than written.
+    //
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    tsdb_set_cache_size(&db, 16 * 1024 * 1024);
+    for (n = 5; n < 8; n++) {
+        ret = tsdb_goto_epoch(&db, start + n * slot_seconds, 1, 0);
+        assert_int_equal(0, ret);
+        val = 1;
+        ret = tsdb_set(&db, "key-0", &val);
+        assert_int_equal(0, ret);
+    }
+    memset(&purge_stats, 0, sizeof(purge_stats));
+    ret = tsdb_purge_before(&db, start + 7 * slot_seconds, 100,
+                            &purge_stats);
+    assert_int_equal(0, ret);
+    assert_int_equal(2 * 3, purge_stats.fragments);
+    tsdb_close(&db);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 1);
+    assert_int_equal(0, ret);
+    ret = tsdb_goto_epoch(&db, start + 6 * slot_seconds, 1, 0);
+    assert_int_equal(-1, ret);
+    ret = tsdb_goto_epoch(&db, start + 7 * slot_seconds, 1, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_get_by_key(&db, "key-0", &valp);
+    assert_int_equal(0, ret);
+    assert_int_equal(1, *valp);
+    for (n = num_epochs; n > 8; n--) {
+        check_epoch(&db, n - 1, 0);
+    }
+    tsdb_close(&db);
+    unlink(file);
+
+    // Blobs that only purged epochs pointed to are deleted at the end.
+    //
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    write_pattern(&db, 0, 0);
+    write_pattern(&db, 1, 0);
+    write_pattern(&db, 2, 2);
+    write_pattern(&db, 3, 2);
+    write_pattern(&db, 4, 2);
+    assert_int_equal(4, count_blobs(&db));
+    size = stored_size(&db);
+
+    memset(&purge_stats, 0, sizeof(purge_stats));
+    ret = tsdb_purge_before(&db, start + 3 * slot_seconds, 100,
+                            &purge_stats);
+    assert_int_equal(0, ret);
+    assert_int_equal(3 * 3, purge_stats.fragments);
+    assert_int_equal(2, purge_stats.blobs);
+    assert_int_equal(2, count_blobs(&db));
+    assert_true(stored_size(&db) < size);
+
+    // Blobs that kept epochs point to are still shared.
+    //
+    write_pattern(&db, 5, 2);
+    assert_int_equal(2, count_blobs(&db));
+    tsdb_close(&db);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 1);
+    assert_int_equal(0, ret);
+    check_pattern(&db, 3, 2);
+    check_pattern(&db, 4, 2);
+    check_pattern(&db, 5, 2);
+    tsdb_close(&db);
+
+    return 0;
+}
@@ -0,0 +1,277 @@
+#include "test_core.h"
+
+static char *get_file_arg(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: test-generations TEST-DB\n");
+        exit(1);
+    }
+    char *file = argv[1];
+    if (file_exists(file)) {
+        fprintf(stderr, "%s exists\n", file);
+        exit(1);
+    }
+    return file;
+}
+
+#define slot_seconds 60
+#define num_old_keys 25000
+
+typedef struct {
+    u_int32_t count;
+    tsdb_value sum;
+} scan_state;
+
+static int sum_values(u_int32_t epoch, u_int32_t index, tsdb_value *values,
+                      void *context) {
+    scan_state *state = (scan_state*)context;
+
+    state->count++;
+    state->sum += values[0];
+    return 0;
+}
+
+static void check_new_generation(tsdb_handler *db) {
+    tsdb_value *read_val;
+    tsdb_query *query;
+    scan_state state;
+    int ret;
+
+    // The new generation's epochs are only as wide as the keys written
+    // in them.
+    //
+    ret = tsdb_goto_epoch(db, 120, 1, 0);
+    assert_int_equal(0, ret);
+    assert_int_equal(CHUNK_GROWTH * sizeof(tsdb_value), db->chunk.data_len);
+    ret = tsdb_get_by_key(db, "old-25000", &read_val);
+    assert_int_equal(0, ret);
+    assert_int_equal(2500, *read_val);
+    ret = tsdb_get_by_key(db, "new-1", &read_val);
+    assert_int_equal(0, ret);
+    assert_int_equal(1001, *read_val);
+
+    // Keys that weren't written in the generation have no value.
+    //
+    ret = tsdb_get_by_key(db, "old-1", &read_val);
+    assert_int_equal(-1, ret);
+
+    // Epochs of the first generation are read as they were written.
+    //
+    ret = tsdb_goto_epoch(db, 60, 1, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_get_by_key(db, "old-1", &read_val);
+    assert_int_equal(0, ret);
+    assert_int_equal(1, *read_val);
+    ret = tsdb_get_by_key(db, "old-25000", &read_val);
+    assert_int_equal(0, ret);
+    assert_int_equal(25000, *read_val);
+
+    // Scans read each epoch with its generation. new-1 is past the keys
+    // written in the first epoch, so it's unknown there.
+    //
+    memset(&state, 0, sizeof(state));
+    ret = tsdb_compile_query("t", &query);
+    assert_int_equal(0, ret);
+    ret = tsdb_scan_query(db, query, 60, 120, sum_values, &state);
+    assert_int_equal(0, ret);
+    tsdb_free_query(query);
+    assert_int_equal(3, state.count);
+    assert_int_equal(1 + 0 + 1001, state.sum);
+}
+
+int main(int argc, char *argv[]) {
+
+    char *file = get_file_arg(argc, argv);
+    set_trace_level(0);
+
+    tsdb_handler db, crashed;
+    int ret;
+    u_int16_t vals_per_entry = 1;
+    tsdb_value write_val;
+    tsdb_value *read_val;
+    char key[32];
+    u_int32_t i, index;
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+
+    //===================================================================
+    // First generation
+    //===================================================================
+
+    // Without generations, an epoch is as wide as every key ever
+    // written.
+    //
+    ret = tsdb_goto_epoch(&db, 60, 0, 1);
+    assert_int_equal(0, ret);
+    for (i = 1; i <= num_old_keys; i++) {
+        snprintf(key, sizeof(key), "old-%u", i);
+        write_val = i;
+        ret = tsdb_set(&db, key, &write_val);
+        assert_int_equal(0, ret);
+    }
+    assert_int_equal(3 * CHUNK_GROWTH * sizeof(tsdb_value),
+                     db.chunk.data_len);
+    ret = tsdb_tag_key(&db, "old-1", "t");
+    assert_int_equal(0, ret);
+
+    //===================================================================
+    // New generation
+    //===================================================================
+
+    // A generation can only start after the epochs written so far.
+    //
+    ret = tsdb_start_generation(&db, 60);
+    assert_int_equal(-1, ret);
+    ret = tsdb_start_generation(&db, 120);
+    assert_int_equal(0, ret);
+    ret = tsdb_start_generation(&db, 120);
+    assert_int_equal(-1, ret);
+
+    ret = tsdb_goto_epoch(&db, 120, 0, 1);
+    assert_int_equal(0, ret);
+    write_val = 1001;
+    ret = tsdb_set(&db, "new-1", &write_val);
+    assert_int_equal(0, ret);
+    write_val = 2500;
+    ret = tsdb_set(&db, "old-25000", &write_val);
+    assert_int_equal(0, ret);
+
+    // Writes return the key's index rather than its slot in the
+    // generation.
+    //
+    write_val = 99;
+    ret = tsdb_set_with_index(&db, "old-99", &write_val, &index);
+    assert_int_equal(0, ret);
+    assert_int_equal(98, index);
+    ret = tsdb_tag_key(&db, "new-1", "t");
+    assert_int_equal(0, ret);
+
+    // Keys keep their index.
+    //
+    ret = tsdb_get_key_index(&db, "old-25000", &index);
+    assert_int_equal(0, ret);
+    assert_int_equal(num_old_keys - 1, index);
+    ret = tsdb_get_key_index(&db, "new-1", &index);
+    assert_int_equal(0, ret);
+    assert_int_equal(num_old_keys, index);
+
+    check_new_generation(&db);
+
+    // Series are read across generations.
+    //
+    tsdb_value values[2];
+    u_int8_t present[2];
+    u_int32_t count;
+    ret = tsdb_get_key_index(&db, "old-25000", &index);
+    assert_int_equal(0, ret);
+    ret = tsdb_get_series(&db, index, 60, 120, values, present, 2, &count);
+    assert_int_equal(0, ret);
+    assert_int_equal(2, count);
+    assert_int_equal(1, present[0]);
+    assert_int_equal(25000, values[0]);
+    assert_int_equal(1, present[1]);
+    assert_int_equal(2500, values[1]);
+
+    tsdb_close(&db);
+
+    // Generations are stored with the database.
+    //
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    assert_int_equal(1, db.num_generations);
+    check_new_generation(&db);
+
+    //===================================================================
+    // Write-ahead log
+    //===================================================================
+
+    // Slots assigned since the last checkpoint are replayed with the
+    // values written to them.
+    //
+    ret = tsdb_enable_wal(&db);
+    assert_int_equal(0, ret);
+    ret = tsdb_goto_epoch(&db, 180, 0, 1);
+    assert_int_equal(0, ret);
+    write_val = 3;
+    ret = tsdb_set(&db, "old-3", &write_val);
+    assert_int_equal(0, ret);
+    write_val = 2;
+    ret = tsdb_set(&db, "new-2", &write_val);
+    assert_int_equal(0, ret);
+    ret = tsdb_commit(&db);
+    assert_int_equal(0, ret);
+
+    memcpy(&crashed, &db, sizeof(db));
+    crashed.backend->close(crashed.db);
+    close(crashed.wal.fd);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_goto_epoch(&db, 180, 1, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_get_by_key(&db, "old-3", &read_val);
+    assert_int_equal(0, ret);
+    assert_int_equal(3, *read_val);
+    ret = tsdb_get_by_key(&db, "new-2", &read_val);
+    assert_int_equal(0, ret);
+    assert_int_equal(2, *read_val);
+    check_new_generation(&db);
+    tsdb_close(&db);
+
+    // Epochs stored after a generation's start would be read with the
+    // wrong slots, so it can't start before them -- even when they're no
+    // longer in memory.
+    //
+    char later[PATH_MAX];
+    snprintf(later, sizeof(later), "%s-later", file);
+    ret = tsdb_open(later, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_goto_epoch(&db, 6000, 0, 1);
+    assert_int_equal(0, ret);
+    for (i = 0; i < 3; i++) {
+        snprintf(key, sizeof(key), "k%u", i);
+        write_val = i;
+        ret = tsdb_set(&db, key, &write_val);
+        assert_int_equal(0, ret);
+    }
+    ret = tsdb_goto_epoch(&db, 18000, 0, 1);
+    assert_int_equal(0, ret);
+    for (i = 0; i < 3; i++) {
+        snprintf(key, sizeof(key), "k%u", i);
+        write_val = 10 + i;
+        ret = tsdb_set(&db, key, &write_val);
+        assert_int_equal(0, ret);
+    }
+    ret = tsdb_goto_epoch(&db, 3000, 0, 1);
+    assert_int_equal(0, ret);
+    tsdb_flush(&db);
+    tsdb_set_cache_size(&db, 0);
+
+    ret = tsdb_start_generation(&db, 12000);
+    assert_int_equal(-1, ret);
+    ret = tsdb_goto_epoch(&db, 12000, 0, 1);
+    assert_int_equal(0, ret);
+    write_val = 99;
+    ret = tsdb_set(&db, "k2", &write_val);
+    assert_int_equal(0, ret);
+
+    ret = tsdb_goto_epoch(&db, 18000, 1, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_get_by_key(&db, "k2", &read_val);
+    assert_int_equal(0, ret);
+    assert_int_equal(12, *read_val);
+    ret = tsdb_get_by_key(&db, "k0", &read_val);
+    assert_int_equal(0, ret);
+    assert_int_equal(10, *read_val);
+
+    // After the last epoch stored it's fine.
+    //
+    ret = tsdb_start_generation(&db, 18060);
+    assert_int_equal(0, ret);
+    tsdb_close(&db);
+    unlink(later);
+    snprintf(later, sizeof(later), "%s-later.keys", file);
+    unlink(later);
+
+    return 0;
+}
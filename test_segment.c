@@ -0,0 +1,363 @@
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "test_core.h"
+
+static char *get_file_arg(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: test-segment TEST-DB\n");
+        exit(1);
+    }
+    char *file = argv[1];
+    if (file_exists(file)) {
+        fprintf(stderr, "%s exists\n", file);
+        exit(1);
+    }
+    return file;
+}
+
+#define slot_seconds 60
+#define num_epochs 20
+#define num_keys 20000
+#define start 6000
+
+static void write_epochs(tsdb_handler *db, u_int32_t round) {
+    u_int32_t epoch, i;
+    char key[32];
+    tsdb_value val;
+    int ret;
+
+    for (epoch = start; epoch < start + num_epochs * slot_seconds;
+         epoch += slot_seconds) {
+        ret = tsdb_goto_epoch(db, epoch, 0, 1);
+        assert_int_equal(0, ret);
+        for (i = 0; i < num_keys; i++) {
+            sprintf(key, "key-%u", i);
+            val = epoch * round + i;
+            ret = tsdb_set(db, key, &val);
+            assert_int_equal(0, ret);
+        }
+    }
+    tsdb_flush(db);
+}
+
+static void check_epochs(tsdb_handler *db, u_int32_t round) {
+    u_int32_t epoch, i;
+    char key[32];
+    tsdb_value *val;
+    int ret;
+
+    for (epoch = start; epoch < start + num_epochs * slot_seconds;
+         epoch += slot_seconds) {
+        ret = tsdb_goto_epoch(db, epoch, 1, 0);
+        assert_int_equal(0, ret);
+        for (i = 0; i < num_keys; i += 101) {
+            sprintf(key, "key-%u", i);
+            ret = tsdb_get_by_key(db, key, &val);
+            assert_int_equal(0, ret);
+            assert_int_equal(epoch * round + i, *val);
+        }
+    }
+}
+
+static u_int64_t segments_size(char *path, char *last) {
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    struct stat st;
+    char str[1024];
+    u_int64_t size = 0;
+
+    assert_true(dir != NULL);
+    last[0] = '\0';
+    while ((entry = readdir(dir))) {
+        if (strstr(entry->d_name, ".seg")) {
+            sprintf(str, "%s/%s", path, entry->d_name);
+            assert_int_equal(0, stat(str, &st));
+            size += st.st_size;
+            if (strcmp(str, last) > 0) {
+                strcpy(last, str);
+            }
+        }
+    }
+    closedir(dir);
+
+    return size;
+}
+
+static void append_garbage(char *path) {
+    FILE *file = fopen(path, "a");
+
+    assert_true(file != NULL);
+    fwrite("\x10\x00\x00\x00garbage", 11, 1, file);
+    fclose(file);
+}
+
+// Puts junk until segment id exists
+static void fill_until_segment(void *store, char *path, u_int32_t id) {
+    char value[1024], str[1024];
+    u_int32_t i;
+
+    memset(value, 'j', sizeof(value));
+    sprintf(str, "%s/%08u.seg", path, id);
+    for (i = 0; !file_exists(str); i++) {
+        assert_true(i < 1000);
+        assert_int_equal(0, tsdb_segment_backend.put(store, "junk", 4, value,
+                                                     sizeof(value)));
+    }
+}
+
+// Walks the keys of the sorted store from k050, in order, and deletes
+// every other one if asked to. Returns the number of keys and the last.
+static u_int32_t walk_sorted(void *store, u_int8_t del, char *last) {
+    void *cursor, *key, *value;
+    u_int32_t key_len, value_len, n = 0;
+    char str[32];
+
+    last[0] = '\0';
+    assert_int_equal(0, tsdb_segment_backend.cursor_open(store, "k050", 4,
+                                                         &cursor));
+    while (tsdb_segment_backend.cursor_next(cursor, &key, &key_len,
+                                            &value, &value_len) == 0) {
+        memcpy(str, key, key_len);
+        str[key_len] = '\0';
+        assert_true(strcmp(last, str) < 0);
+        strcpy(last, str);
+        if (strcmp(str, "k052") == 0) {
+            assert_int_equal(1000, *(u_int32_t*)value);
+        }
+        if (del && n % 2 == 1) {
+            assert_int_equal(0, tsdb_segment_backend.cursor_del(cursor));
+        }
+        n++;
+    }
+    tsdb_segment_backend.cursor_close(cursor);
+
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+
+    char *file = get_file_arg(argc, argv);
+    set_trace_level(0);
+
+    tsdb_handler db;
+    char last[1024], index[1024], store_path[512], str[1024], key[32];
+    char value[1024];
+    u_int64_t first_size, size;
+    int ret;
+    u_int16_t vals_per_entry = 1;
+    u_int32_t round, i, len;
+    void *store, *valp;
+
+    // Small segments so that we roll over and compact several of them.
+    //
+    tsdb_segment_size = 64 * 1024;
+
+    ret = tsdb_open_backend(file, &db, &vals_per_entry, slot_seconds, 0,
+                            &tsdb_segment_backend);
+    assert_int_equal(0, ret);
+    write_epochs(&db, 1);
+    check_epochs(&db, 1);
+    tsdb_close(&db);
+
+    first_size = segments_size(file, last);
+    assert_true(first_size > 4 * tsdb_segment_size);
+
+    //===================================================================
+    // Compaction
+    //===================================================================
+
+    // Rewriting the same epochs leaves old fragment versions behind in
+    // the segments. Mostly dead segments are compacted when the store is
+    // synced, so the store doesn't keep growing.
+    //
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    assert_true(db.backend == &tsdb_segment_backend);
+    for (round = 2; round <= 6; round++) {
+        write_epochs(&db, round);
+    }
+    check_epochs(&db, 6);
+    tsdb_close(&db);
+
+    size = segments_size(file, last);
+    assert_true(size < 3 * first_size);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 1);
+    assert_int_equal(0, ret);
+    check_epochs(&db, 6);
+    tsdb_close(&db);
+
+    //===================================================================
+    // Recovery
+    //===================================================================
+
+    // A torn record at the end of the last segment is dropped.
+    //
+    append_garbage(last);
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    check_epochs(&db, 6);
+    tsdb_close(&db);
+    assert_int_equal(size, segments_size(file, last));
+
+    // Without an index, it's rebuilt from the segments.
+    //
+    sprintf(index, "%s/index", file);
+    assert_int_equal(0, unlink(index));
+    append_garbage(last);
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    check_epochs(&db, 6);
+    write_epochs(&db, 7);
+    tsdb_close(&db);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 1);
+    assert_int_equal(0, ret);
+    check_epochs(&db, 7);
+    tsdb_close(&db);
+
+    //===================================================================
+    // Tombstones
+    //===================================================================
+
+    // A deleted key's tombstone is copied forward when its segment is
+    // compacted, as long as an older segment still holds the key.
+    // Otherwise, rebuilding the index would bring the key back.
+    //
+    snprintf(store_path, sizeof(store_path), "%s-del", file);
+    assert_int_equal(0, tsdb_segment_backend.open(&store, store_path, 0));
+    memset(value, 'k', sizeof(value));
+    for (i = 0; i < 40; i++) {
+        sprintf(key, "keep-%u", i);
+        assert_int_equal(0, tsdb_segment_backend.put(store, key, strlen(key),
+                                                     value, sizeof(value)));
+    }
+    assert_int_equal(0, tsdb_segment_backend.put(store, "gone", 4, value,
+                                                 sizeof(value)));
+    fill_until_segment(store, store_path, 1);
+    assert_int_equal(0, tsdb_segment_backend.del(store, "gone", 4));
+    fill_until_segment(store, store_path, 3);
+    assert_int_equal(0, tsdb_segment_backend.sync(store));
+    snprintf(str, sizeof(str), "%s/%08u.seg", store_path, 1);
+    assert_false(file_exists(str));
+    snprintf(str, sizeof(str), "%s/%08u.seg", store_path, 0);
+    assert_true(file_exists(str));
+    tsdb_segment_backend.close(store);
+
+    snprintf(index, sizeof(index), "%s/index", store_path);
+    assert_int_equal(0, unlink(index));
+    assert_int_equal(0, tsdb_segment_backend.open(&store, store_path, 0));
+    assert_int_equal(-1, tsdb_segment_backend.get(store, "gone", 4,
+                                                  &valp, &len));
+    assert_int_equal(0, tsdb_segment_backend.get(store, "keep-7", 6,
+                                                 &valp, &len));
+    assert_int_equal(sizeof(value), len);
+    tsdb_segment_backend.close(store);
+
+    //===================================================================
+    // Sorted index
+    //===================================================================
+
+    // The index is searched where it's mapped. Keys changed since it was
+    // written are kept aside, and cursors merge the two in key order.
+    //
+    snprintf(store_path, sizeof(store_path), "%s-sorted", file);
+    assert_int_equal(0, tsdb_segment_backend.open(&store, store_path, 0));
+    for (i = 0; i < 100; i++) {
+        sprintf(key, "k%03u", (i * 37) % 100);
+        assert_int_equal(0, tsdb_segment_backend.put(store, key, 4,
+                                                     &i, sizeof(i)));
+    }
+    tsdb_segment_backend.close(store);
+
+    assert_int_equal(0, tsdb_segment_backend.open(&store, store_path, 0));
+    assert_int_equal(0, tsdb_segment_backend.get(store, "k037", 4,
+                                                 &valp, &len));
+    assert_int_equal(1, *(u_int32_t*)valp);
+    i = 1000;
+    assert_int_equal(0, tsdb_segment_backend.put(store, "k050a", 5,
+                                                 &i, sizeof(i)));
+    assert_int_equal(0, tsdb_segment_backend.put(store, "k052", 4,
+                                                 &i, sizeof(i)));
+    assert_int_equal(0, tsdb_segment_backend.del(store, "k051", 4));
+    assert_int_equal(-1, tsdb_segment_backend.del(store, "k051", 4));
+    assert_int_equal(-1, tsdb_segment_backend.get(store, "k051", 4,
+                                                  &valp, &len));
+    assert_int_equal(50, walk_sorted(store, 1, last));
+    assert_string_equal("k099", last);
+
+    // Again, from the index alone.
+    //
+    tsdb_segment_backend.close(store);
+    assert_int_equal(0, tsdb_segment_backend.open(&store, store_path, 0));
+    assert_int_equal(25, walk_sorted(store, 0, last));
+    assert_string_equal("k098", last);
+    assert_int_equal(-1, tsdb_segment_backend.get(store, "k050a", 5,
+                                                  &valp, &len));
+    assert_int_equal(0, tsdb_segment_backend.get(store, "k000", 4,
+                                                 &valp, &len));
+    tsdb_segment_backend.close(store);
+
+    // Indexes written before they were sorted are loaded and then written
+    // again in the current format. This one covers "a" and "b", 17 byte
+    // records at the start of the first segment -- swapped, so that we
+    // can tell it was used rather than rebuilt.
+    //
+    snprintf(store_path, sizeof(store_path), "%s-old", file);
+    assert_int_equal(0, tsdb_segment_backend.open(&store, store_path, 0));
+    for (i = 1; i <= 2; i++) {
+        key[0] = 'a' + i - 1;
+        assert_int_equal(0, tsdb_segment_backend.put(store, key, 1,
+                                                     &i, sizeof(i)));
+    }
+    tsdb_segment_backend.close(store);
+
+    u_int8_t old_index[24 + 2 * 25];
+    u_int32_t word;
+    u_int64_t offset;
+    memset(old_index, 0, sizeof(old_index));
+    word = SEGMENT_INDEX_MAGIC;
+    memcpy(&old_index[0], &word, 4);
+    word = 2;
+    memcpy(&old_index[4], &word, 4);
+    memcpy(&old_index[8], &word, 4);
+    offset = 34;
+    memcpy(&old_index[16], &offset, 8);
+    for (i = 0; i < 2; i++) {
+        u_int8_t *entry = &old_index[24 + i * 25];
+        word = 1;
+        memcpy(&entry[0], &word, 4);
+        offset = (1 - i) * 17;
+        memcpy(&entry[8], &offset, 8);
+        word = 4;
+        memcpy(&entry[16], &word, 4);
+        entry[24] = 'a' + i;
+    }
+    snprintf(index, sizeof(index), "%s/index", store_path);
+    FILE *index_file = fopen(index, "w");
+    assert_true(index_file != NULL);
+    assert_int_equal(1, fwrite(old_index, sizeof(old_index), 1, index_file));
+    fclose(index_file);
+
+    assert_int_equal(0, tsdb_segment_backend.open(&store, store_path, 0));
+    assert_int_equal(0, tsdb_segment_backend.get(store, "b", 1,
+                                                 &valp, &len));
+    assert_int_equal(1, *(u_int32_t*)valp);
+    tsdb_segment_backend.close(store);
+
+    index_file = fopen(index, "r");
+    assert_true(index_file != NULL);
+    assert_int_equal(1, fread(old_index, 8, 1, index_file));
+    fclose(index_file);
+    memcpy(&word, &old_index[4], 4);
+    assert_int_equal(SEGMENT_INDEX_VERSION, word);
+
+    assert_int_equal(0, tsdb_segment_backend.open(&store, store_path, 1));
+    assert_int_equal(0, tsdb_segment_backend.get(store, "a", 1,
+                                                 &valp, &len));
+    assert_int_equal(2, *(u_int32_t*)valp);
+    tsdb_segment_backend.close(store);
+
+    return 0;
+}
@@ -0,0 +1,171 @@
+#include "test_core.h"
+
+static char *get_file_arg(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: test-series TEST-DB\n");
+        exit(1);
+    }
+    char *file = argv[1];
+    if (file_exists(file)) {
+        fprintf(stderr, "%s exists\n", file);
+        exit(1);
+    }
+    return file;
+}
+
+#define slot_seconds 60
+#define num_slots 150
+#define num_keys 12000
+
+static tsdb_value expected(u_int32_t slot, u_int32_t key) {
+    return slot * 100000 + key;
+}
+
+static void check_series(tsdb_handler *db, u_int32_t index,
+                         u_int32_t start) {
+    tsdb_value values[(num_slots + 10) * 2];
+    u_int8_t present[num_slots + 10];
+    u_int32_t count, i;
+    int ret;
+
+    // We ask for 5 slots before and after the ones we wrote.
+    //
+    ret = tsdb_get_series(db, index, start - 5 * slot_seconds,
+                          start + (num_slots + 4) * slot_seconds,
+                          values, present, num_slots + 10, &count);
+    assert_int_equal(0, ret);
+    assert_int_equal(num_slots + 10, count);
+
+    for (i = 0; i < count; i++) {
+        if (i < 5 || i >= num_slots + 5) {
+            assert_int_equal(0, present[i]);
+        } else if ((i - 5) % 7 == 3 && index >= CHUNK_GROWTH) {
+            // Every 7th slot only has the first fragment of keys.
+            assert_int_equal(0, present[i]);
+        } else {
+            assert_int_equal(1, present[i]);
+            assert_int_equal(expected(i - 5, index), values[i * 2]);
+            assert_int_equal(index, values[i * 2 + 1]);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+
+    char *file = get_file_arg(argc, argv);
+    set_trace_level(0);
+
+    tsdb_handler db;
+    int ret;
+    u_int16_t vals_per_entry = 2;
+    u_int32_t start = 60000, slot, i, index;
+    tsdb_value val[2];
+    char key[32];
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+
+    for (slot = 0; slot < num_slots; slot++) {
+        u_int32_t keys = (slot % 7 == 3 ? CHUNK_GROWTH : num_keys);
+        ret = tsdb_goto_epoch(&db, start + slot * slot_seconds, 0, 1);
+        assert_int_equal(0, ret);
+        for (i = 0; i < keys; i++) {
+            sprintf(key, "key-%u", i);
+            val[0] = expected(slot, i);
+            val[1] = i;
+            ret = tsdb_set(&db, key, val);
+            assert_int_equal(0, ret);
+        }
+    }
+
+    //===================================================================
+    // Series reads
+    //===================================================================
+
+    // Without a transposed layout, series are read one epoch at a time.
+    //
+    check_series(&db, 0, start);
+    check_series(&db, 11999, start);
+
+    //===================================================================
+    // Key-major layout
+    //===================================================================
+
+    ret = tsdb_transpose(&db, start, start + num_slots * slot_seconds);
+    assert_int_equal(0, ret);
+    assert_int_equal(1, db.key_major);
+
+    // The same reads are now served from transposed blocks.
+    //
+    check_series(&db, 0, start);
+    check_series(&db, 4321, start);
+    check_series(&db, 11999, start);
+
+    // A read that's fully served from transposed blocks doesn't move the
+    // current epoch.
+    //
+    tsdb_value values[2];
+    u_int8_t present;
+    u_int32_t count;
+    ret = tsdb_goto_epoch(&db, start + 5 * slot_seconds, 1, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_get_series(&db, 42, start + 100 * slot_seconds,
+                          start + 100 * slot_seconds, values, &present, 1,
+                          &count);
+    assert_int_equal(0, ret);
+    assert_int_equal(1, present);
+    assert_int_equal(expected(100, 42), values[0]);
+    assert_int_equal(start + 5 * slot_seconds, db.chunk.epoch);
+
+    // Writing to a transposed epoch invalidates its block -- we'll still
+    // read the new value.
+    //
+    ret = tsdb_goto_epoch(&db, start + 10 * slot_seconds, 0, 1);
+    assert_int_equal(0, ret);
+    val[0] = 999;
+    val[1] = 999;
+    ret = tsdb_set_with_index(&db, "key-100", val, &index);
+    assert_int_equal(0, ret);
+
+    ret = tsdb_get_series(&db, index, start + 10 * slot_seconds,
+                          start + 10 * slot_seconds, values, &present, 1,
+                          &count);
+    assert_int_equal(0, ret);
+    assert_int_equal(1, count);
+    assert_int_equal(1, present);
+    assert_int_equal(999, values[0]);
+
+    tsdb_close(&db);
+
+    //===================================================================
+    // Time zones
+    //===================================================================
+
+    // Epochs that aren't transposed are loaded as they were written
+    // outside UTC too.
+    //
+    setenv("TZ", "CET-1CEST,M3.5.0,M10.5.0/3", 1);
+    tzset();
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_goto_epoch(&db, 1300000000, 0, 1);
+    assert_int_equal(0, ret);
+    val[0] = 777;
+    val[1] = 777;
+    ret = tsdb_set_with_index(&db, "key-1", val, &index);
+    assert_int_equal(0, ret);
+    tsdb_close(&db);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_get_series(&db, index, 1300000000, 1300000000, values,
+                          &present, 1, &count);
+    assert_int_equal(0, ret);
+    assert_int_equal(1, count);
+    assert_int_equal(1, present);
+    assert_int_equal(777, values[0]);
+    tsdb_close(&db);
+
+    return 0;
+}
@@ -17,6 +17,35 @@ static char *get_file_arg(int argc, char *argv[]) {
 #define slot_seconds 60
 #define num_keys 10001
 
+typedef struct {
+    char keys[8][32];
+    u_int32_t count;
+} key_list;
+
+static int collect_key(const char *key, u_int32_t index, void *context) {
+    key_list *list = (key_list*)context;
+
+    if (list->count == 8) {
+        return 1;
+    }
+    snprintf(list->keys[list->count++], 32, "%s", key);
+    return 0;
+}
+
+static void check_prefix(tsdb_handler *db) {
+    key_list list;
+    int ret;
+
+    memset(&list, 0, sizeof(list));
+    ret = tsdb_scan_keys(db, "key-1000", collect_key, &list);
+    assert_int_equal(0, ret);
+    assert_int_equal(4, list.count);
+    assert_string_equal("key-1000", list.keys[0]);
+    assert_string_equal("key-10000", list.keys[1]);
+    assert_string_equal("key-10001", list.keys[2]);
+    assert_string_equal("key-1000x", list.keys[3]);
+}
+
 int main(int argc, char *argv[]) {
 
     char *file = get_file_arg(argc, argv);
@@ -37,6 +66,11 @@ int main(int argc, char *argv[]) {
     ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
     assert_int_equal(0, ret);
 
+    // Fragments are compressed by a pool of workers (one per CPU by
+    // default). Use several, whatever the machine.
+
+    tsdb_set_threads(&db, 4);
+
     // Move through epochs for write.
 
     start = 1000000000;
@@ -57,7 +91,15 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    // Key lookups are served from an in-memory map.
+
+    assert_int_equal(num_keys, db.keymap.count);
+
+    // Which is merged into the key dictionary on flush, once large enough.
+
     tsdb_flush(&db);
+    assert_int_equal(num_keys, db.keydict.count);
+    assert_int_equal(0, db.keymap.count);
 
     // Move through epochs for reads.
 
@@ -77,6 +119,87 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    // Read again, loading only the fragments we need.
+
+    tsdb_set_load_on_demand(&db, 1);
+
+    for (cur = start; cur <= stop; cur += slot_seconds) {
+
+        ret = tsdb_goto_epoch(&db, cur, 1, 0);
+        assert_int_equal(0, ret);
+        assert_int_equal(0, db.chunk.fragment_loaded[0]);
+        assert_int_equal(0, db.chunk.fragment_loaded[1]);
+
+        sprintf(key, "key-%i", num_keys);
+        ret = tsdb_get_by_key(&db, key, &read_val);
+        assert_int_equal(0, ret);
+        assert_int_equal(num_keys * 1000, *read_val);
+        assert_int_equal(0, db.chunk.fragment_loaded[0]);
+        assert_int_equal(1, db.chunk.fragment_loaded[1]);
+
+        // Read keys.
+
+        for (i = 1; i <= num_keys; i++) {
+            sprintf(key, "key-%i", i);
+            ret = tsdb_get_by_key(&db, key, &read_val);
+            assert_int_equal(0, ret);
+            write_val = i * 1000;
+            assert_int_equal(write_val, *read_val);
+        }
+    }
+
+    // Keys can be of any length.
+
+    char long_key[100];
+    u_int32_t index1, index2;
+    memset(long_key, 'x', 80);
+    long_key[80] = '\0';
+    ret = tsdb_goto_epoch(&db, stop, 0, 1);
+    assert_int_equal(0, ret);
+    write_val = 1;
+    ret = tsdb_set(&db, long_key, &write_val);
+    assert_int_equal(0, ret);
+    long_key[79] = 'y';
+    write_val = 2;
+    ret = tsdb_set(&db, long_key, &write_val);
+    assert_int_equal(0, ret);
+
+    ret = tsdb_get_by_key(&db, long_key, &read_val);
+    assert_int_equal(0, ret);
+    assert_int_equal(2, *read_val);
+    long_key[79] = 'x';
+    ret = tsdb_get_by_key(&db, long_key, &read_val);
+    assert_int_equal(0, ret);
+    assert_int_equal(1, *read_val);
+
+    // Keys can be listed by prefix, whether they've been merged into the
+    // dictionary or not.
+
+    write_val = 3;
+    ret = tsdb_set(&db, "key-1000x", &write_val);
+    assert_int_equal(0, ret);
+    check_prefix(&db);
+
+    tsdb_close(&db);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_get_key_index(&db, long_key, &index1);
+    assert_int_equal(0, ret);
+    long_key[79] = 'y';
+    ret = tsdb_get_key_index(&db, long_key, &index2);
+    assert_int_equal(0, ret);
+    assert_int_equal(index1 + 1, index2);
+    check_prefix(&db);
+
+    ret = tsdb_merge_keys(&db);
+    assert_int_equal(0, ret);
+    assert_int_equal(num_keys + 3, db.keydict.count);
+    check_prefix(&db);
+    ret = tsdb_get_key_index(&db, long_key, &index1);
+    assert_int_equal(0, ret);
+    assert_int_equal(index2, index1);
+
     tsdb_close(&db);
 
     return 0;
@@ -1,5 +1,27 @@
 #include "test_core.h"
 
+typedef struct {
+    u_int32_t count;
+    u_int32_t limit;
+    u_int32_t epoch_counts[2];
+} scan_state;
+
+static int scan_value(u_int32_t epoch, u_int32_t index, tsdb_value *values,
+                      void *context) {
+    scan_state *state = (scan_state*)context;
+
+    // key-1 to key-4 were set to 111 to 444 in the first epoch, the rest
+    // to N in the second. Anything else is unset.
+    if (epoch == 60) {
+        assert_int_equal(index < 4 ? (index + 1) * 111 : 0, *values);
+    } else {
+        assert_int_equal(index < 4 ? 0 : index + 1, *values);
+    }
+    state->epoch_counts[epoch > 60 ? 1 : 0]++;
+
+    return ++state->count == state->limit;
+}
+
 static char *get_file_arg(int argc, char *argv[]) {
     if (argc < 2) {
         fprintf(stderr, "usage: test-advanced TEST-DB\n");
@@ -100,6 +122,15 @@ int main(int argc, char *argv[]) {
     assert_int_equal(0, ret);
     assert_int_equal(222, *read_val);
 
+    // And their key.
+    //
+    const char *name;
+    ret = tsdb_get_key_name(&db, matches[0], &name);
+    assert_int_equal(0, ret);
+    assert_string_equal("key-2", (char*)name);
+    ret = tsdb_get_key_name(&db, 100, &name);
+    assert_int_equal(-1, ret);
+
     //===================================================================
     // Complex tag queries
     //===================================================================
@@ -158,6 +189,306 @@ int main(int argc, char *argv[]) {
     tsdb_get_by_index(&db, &matches[3], &read_val);
     assert_int_equal(444, *read_val);
 
+    //===================================================================
+    // Tag queries
+    //===================================================================
+
+    // Queries combine tags with and, or and not, in prefix form. Here's
+    // where we are:
+    //
+    //   key-1: blue
+    //   key-2: red, blue
+    //   key-3: red, blue, green
+    //   key-4: red, green
+    //
+    tsdb_query *query;
+    ret = tsdb_compile_query("(and red (not green))", &query);
+    assert_int_equal(0, ret);
+    ret = tsdb_get_query_indexes(&db, query, matches, 100, &match_count);
+    assert_int_equal(0, ret);
+    assert_int_equal(1, match_count);
+    tsdb_get_by_index(&db, &matches[0], &read_val);
+    assert_int_equal(222, *read_val);
+    tsdb_free_query(query);
+
+    // Groups can be nested, and "i", "u" and "n" are short for "and",
+    // "or" and "not".
+    //
+    ret = tsdb_compile_query("(u green (i blue (n red)))", &query);
+    assert_int_equal(0, ret);
+    ret = tsdb_get_query_indexes(&db, query, matches, 100, &match_count);
+    assert_int_equal(0, ret);
+    assert_int_equal(3, match_count);
+    tsdb_get_by_index(&db, &matches[0], &read_val);
+    assert_int_equal(111, *read_val);
+    tsdb_get_by_index(&db, &matches[1], &read_val);
+    assert_int_equal(333, *read_val);
+    tsdb_get_by_index(&db, &matches[2], &read_val);
+    assert_int_equal(444, *read_val);
+    tsdb_free_query(query);
+
+    // Space is allowed anywhere between the parentheses.
+    //
+    ret = tsdb_compile_query(" ( and red\t( not green ) ) ", &query);
+    assert_int_equal(0, ret);
+    ret = tsdb_get_query_indexes(&db, query, matches, 100, &match_count);
+    assert_int_equal(0, ret);
+    assert_int_equal(1, match_count);
+    tsdb_get_by_index(&db, &matches[0], &read_val);
+    assert_int_equal(222, *read_val);
+    tsdb_free_query(query);
+
+    // A negation on its own is everything else.
+    //
+    ret = tsdb_compile_query("(not red)", &query);
+    assert_int_equal(0, ret);
+    ret = tsdb_get_query_indexes(&db, query, matches, 100, &match_count);
+    assert_int_equal(0, ret);
+    assert_int_equal(1, match_count);
+    tsdb_free_query(query);
+
+    ret = tsdb_compile_query("(and (not red) (not (not blue)))", &query);
+    assert_int_equal(0, ret);
+    ret = tsdb_get_query_indexes(&db, query, matches, 100, &match_count);
+    assert_int_equal(0, ret);
+    assert_int_equal(1, match_count);
+    tsdb_free_query(query);
+
+    // Unlike tsdb_get_consolidated_tag_indexes, a tag that doesn't exist
+    // matches nothing.
+    //
+    ret = tsdb_compile_query("(and red (or blue purple) purple)", &query);
+    assert_int_equal(0, ret);
+    ret = tsdb_get_query_indexes(&db, query, matches, 100, &match_count);
+    assert_int_equal(0, ret);
+    assert_int_equal(0, match_count);
+    tsdb_free_query(query);
+
+    // Queries have to be well formed.
+    //
+    ret = tsdb_compile_query("(and red", &query);
+    assert_int_equal(-1, ret);
+    ret = tsdb_compile_query("(xor red blue)", &query);
+    assert_int_equal(-1, ret);
+    ret = tsdb_compile_query("(not red blue)", &query);
+    assert_int_equal(-1, ret);
+    ret = tsdb_compile_query("red blue", &query);
+    assert_int_equal(-1, ret);
+    ret = tsdb_compile_query("()", &query);
+    assert_int_equal(-1, ret);
+
+    //===================================================================
+    // Many keys
+    //===================================================================
+
+    // Tags are compressed bitmaps that grow with the number of keys.
+    // Let's tag keys well past the first 65536 indexes, in an epoch that
+    // can grow to hold them.
+    //
+    ret = tsdb_goto_epoch(&db, 120, 0, 1);
+    assert_int_equal(0, ret);
+    u_int32_t i, num_keys = 70000;
+    char key[32];
+    u_int32_t *many = malloc(num_keys * sizeof(u_int32_t));
+    for (i = 5; i <= num_keys; i++) {
+        snprintf(key, sizeof(key), "key-%u", i);
+        write_val = i;
+        ret = tsdb_set(&db, key, &write_val);
+        assert_int_equal(0, ret);
+        if (i % 7 == 0) {
+            ret = tsdb_tag_key(&db, key, "seventh");
+            assert_int_equal(0, ret);
+        }
+        if (i > 60000) {
+            ret = tsdb_tag_key(&db, key, "late");
+            assert_int_equal(0, ret);
+        }
+    }
+
+    ret = tsdb_get_tag_indexes(&db, "seventh", many, num_keys,
+                               &match_count);
+    assert_int_equal(0, ret);
+    assert_int_equal(num_keys / 7, match_count);
+    tsdb_get_by_index(&db, &many[match_count - 1], &read_val);
+    assert_int_equal(70000, *read_val);
+
+    const char *names[4];
+    ret = tsdb_get_key_names(&db, &many[match_count - 3], 3, names);
+    assert_int_equal(0, ret);
+    assert_string_equal("key-69986", (char*)names[0]);
+    assert_string_equal("key-69993", (char*)names[1]);
+    assert_string_equal("key-70000", (char*)names[2]);
+
+    // Keys 60001 to 70000 are late, and 1429 of those are a seventh.
+    //
+    char *seventh_and_late[2] = { "seventh", "late" };
+    ret = tsdb_get_consolidated_tag_indexes(&db, seventh_and_late, 2,
+                                            TSDB_AND, many, num_keys,
+                                            &match_count);
+    assert_int_equal(0, ret);
+    assert_int_equal(1429, match_count);
+    ret = tsdb_get_consolidated_tag_indexes(&db, seventh_and_late, 2,
+                                            TSDB_OR, many, num_keys,
+                                            &match_count);
+    assert_int_equal(0, ret);
+    assert_int_equal(10000 + 10000 - 1429, match_count);
+
+    // The same through a query, which also runs the tags in the order
+    // that's cheapest rather than the order given.
+    //
+    ret = tsdb_compile_query("(and late seventh (not (and late blue)))",
+                             &query);
+    assert_int_equal(0, ret);
+    ret = tsdb_get_query_indexes(&db, query, many, num_keys, &match_count);
+    assert_int_equal(0, ret);
+    assert_int_equal(1429, match_count);
+    tsdb_free_query(query);
+
+    ret = tsdb_compile_query("(or (not seventh) (and seventh late))",
+                             &query);
+    assert_int_equal(0, ret);
+    ret = tsdb_get_query_indexes(&db, query, many, num_keys, &match_count);
+    assert_int_equal(0, ret);
+    assert_int_equal(num_keys - 10000 + 1429, match_count);
+    tsdb_free_query(query);
+
+    // A scan reads the values of the matching indexes over a range of
+    // epochs, reading only fragments that hold a match.
+    //
+    scan_state state;
+    memset(&state, 0, sizeof(state));
+    ret = tsdb_compile_query("(and seventh late)", &query);
+    assert_int_equal(0, ret);
+    ret = tsdb_scan_query(&db, query, 60, 120, scan_value, &state);
+    assert_int_equal(0, ret);
+    assert_int_equal(0, state.epoch_counts[0]);
+    assert_int_equal(1429, state.epoch_counts[1]);
+
+    // The callback can stop a scan.
+    //
+    memset(&state, 0, sizeof(state));
+    state.limit = 10;
+    ret = tsdb_scan_query(&db, query, 60, 120, scan_value, &state);
+    assert_int_equal(1, ret);
+    assert_int_equal(10, state.count);
+
+    // A range ending at the last epoch stops there.
+    //
+    memset(&state, 0, sizeof(state));
+    ret = tsdb_scan_query(&db, query, UINT_MAX - 120, UINT_MAX, scan_value,
+                          &state);
+    assert_int_equal(0, ret);
+    assert_int_equal(0, state.count);
+    tsdb_free_query(query);
+
+    // Tags written as plain bit arrays by earlier versions still load.
+    //
+    u_int32_t legacy[625];
+    memset(legacy, 0, sizeof(legacy));
+    legacy[0] = 0xa;
+    ret = db.backend->put(db.db, "tag-legacy", 10, legacy, sizeof(legacy));
+    assert_int_equal(0, ret);
+    ret = tsdb_get_tag_indexes(&db, "legacy", matches, 100, &match_count);
+    assert_int_equal(0, ret);
+    assert_int_equal(2, match_count);
+    assert_int_equal(1, matches[0]);
+    assert_int_equal(3, matches[1]);
+
+    free(many);
+    tsdb_close(&db);
+
+    // Scans read epochs that aren't in memory from the database.
+    //
+    ret = tsdb_open(file, &db, &vals_per_entry, 60, 0);
+    assert_int_equal(0, ret);
+    memset(&state, 0, sizeof(state));
+    ret = tsdb_compile_query("(or blue seventh)", &query);
+    assert_int_equal(0, ret);
+    ret = tsdb_scan_query(&db, query, 60, 120, scan_value, &state);
+    assert_int_equal(0, ret);
+    tsdb_free_query(query);
+
+    // The first epoch only has a fragment for the first 10000 indexes,
+    // which are read even where they're unset.
+    //
+    assert_int_equal(3 + 1428, state.epoch_counts[0]);
+    assert_int_equal(10003, state.epoch_counts[1]);
+    tsdb_close(&db);
+
+    // Key names are stored in blocks, and read back after a reopen.
+    //
+    ret = tsdb_open(file, &db, &vals_per_entry, 60, 0);
+    assert_int_equal(0, ret);
+    assert_int_equal(0, db.names.backfill);
+    ret = tsdb_get_key_name(&db, 69999, &name);
+    assert_int_equal(0, ret);
+    assert_string_equal("key-70000", (char*)name);
+
+    // Databases without them, as written by earlier versions, have them
+    // rebuilt from the key mappings.
+    //
+    char block_key[32];
+    db.backend->del(db.db, "names", 5);
+    for (i = 0; i <= 70000 / NAME_BLOCK_KEYS; i++) {
+        snprintf(block_key, sizeof(block_key), "name-%u", i);
+        db.backend->del(db.db, block_key, strlen(block_key));
+    }
+    names_free(&db.names);
+    tsdb_close(&db);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, 60, 0);
+    assert_int_equal(0, ret);
+    assert_int_equal(1, db.names.backfill);
+    u_int32_t name_indexes[3] = { 0, 40000, 80000 };
+    ret = tsdb_get_key_names(&db, name_indexes, 3, names);
+    assert_int_equal(0, ret);
+    assert_string_equal("key-1", (char*)names[0]);
+    assert_string_equal("key-40001", (char*)names[1]);
+    assert_true(names[2] == NULL);
+    assert_int_equal(0, db.names.backfill);
+    tsdb_close(&db);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, 60, 0);
+    assert_int_equal(0, ret);
+    assert_int_equal(0, db.names.backfill);
+    ret = tsdb_get_key_name(&db, 40000, &name);
+    assert_int_equal(0, ret);
+    assert_string_equal("key-40001", (char*)name);
+
+    // A block missing some of its names: those present are only handed
+    // out once the rest are back, as rebuilding moves them.
+    //
+    tsdb_name_block *partial = name_block_new();
+    u_int8_t *block_buf;
+    u_int32_t block_len;
+    assert_true(partial != NULL);
+    for (i = 0; i < NAME_BLOCK_KEYS / 2; i++) {
+        snprintf(block_key, sizeof(block_key), "key-%u", i + 1);
+        ret = name_block_set(partial, i, block_key, strlen(block_key));
+        assert_int_equal(0, ret);
+    }
+    block_len = name_block_serialized_size(partial);
+    block_buf = malloc(block_len);
+    assert_true(block_buf != NULL);
+    name_block_serialize(partial, block_buf);
+    db.backend->put(db.db, "name-0", 6, block_buf, block_len);
+    db.backend->del(db.db, "names", 5);
+    free(block_buf);
+    name_block_free(partial);
+    names_free(&db.names);
+    tsdb_close(&db);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, 60, 0);
+    assert_int_equal(0, ret);
+    assert_int_equal(1, db.names.backfill);
+    u_int32_t mixed_indexes[4] = { 1, NAME_BLOCK_KEYS - 1, 2, 90000 };
+    ret = tsdb_get_key_names(&db, mixed_indexes, 4, names);
+    assert_int_equal(0, ret);
+    assert_string_equal("key-2", (char*)names[0]);
+    snprintf(block_key, sizeof(block_key), "key-%u", NAME_BLOCK_KEYS);
+    assert_string_equal(block_key, (char*)names[1]);
+    assert_string_equal("key-3", (char*)names[2]);
+    assert_true(names[3] == NULL);
     tsdb_close(&db);
 
     return 0;
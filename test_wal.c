@@ -0,0 +1,284 @@
+#include <fcntl.h>
+
+#include "test_core.h"
+
+static char *get_file_arg(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: test-wal TEST-DB\n");
+        exit(1);
+    }
+    char *file = argv[1];
+    if (file_exists(file)) {
+        fprintf(stderr, "%s exists\n", file);
+        exit(1);
+    }
+    return file;
+}
+
+#define slot_seconds 60
+
+int main(int argc, char *argv[]) {
+
+    char *file = get_file_arg(argc, argv);
+    set_trace_level(0);
+
+    tsdb_handler db, crashed;
+    int ret, fd;
+    u_int16_t vals_per_entry = 1;
+    tsdb_value write_val;
+    tsdb_value *read_val;
+    u_int32_t matches[10], match_count;
+    char wal_file[1024];
+
+    snprintf(wal_file, sizeof(wal_file), "%s.wal", file);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+
+    //===================================================================
+    // Commits
+    //===================================================================
+
+    // With a write-ahead log, changes are made durable by appending them
+    // to the log rather than writing and syncing the database.
+    //
+    ret = tsdb_enable_wal(&db);
+    assert_int_equal(0, ret);
+    assert_true(file_exists(wal_file));
+
+    ret = tsdb_goto_epoch(&db, 60, 0, 1);
+    assert_int_equal(0, ret);
+    write_val = 111;
+    ret = tsdb_set(&db, "key-1", &write_val);
+    assert_int_equal(0, ret);
+    write_val = 222;
+    ret = tsdb_set(&db, "key-2", &write_val);
+    assert_int_equal(0, ret);
+    ret = tsdb_tag_key(&db, "key-2", "red");
+    assert_int_equal(0, ret);
+
+    // Nothing is written until a commit, and then all of the changes are
+    // written together.
+    //
+    assert_int_equal(0, db.wal.file_len);
+    ret = tsdb_commit(&db);
+    assert_int_equal(0, ret);
+    assert_true(db.wal.file_len > 0);
+    assert_int_equal(1, db.wal.commits);
+
+    // tsdb_flush is a commit when the log is enabled -- the epoch is
+    // still loaded and dirty.
+    //
+    ret = tsdb_goto_epoch(&db, 120, 0, 1);
+    assert_int_equal(0, ret);
+    write_val = 333;
+    ret = tsdb_set(&db, "key-1", &write_val);
+    assert_int_equal(0, ret);
+    tsdb_flush(&db);
+    assert_int_equal(2, db.wal.commits);
+    assert_int_equal(1, db.chunk.fragment_changed[0]);
+
+    //===================================================================
+    // Replay
+    //===================================================================
+
+    // Let's simulate a crash: we'll copy the handler and abandon it
+    // without closing. Only the first epoch was written to the database
+    // (when we moved to the second one) and nothing was synced.
+    //
+    memcpy(&crashed, &db, sizeof(db));
+    crashed.backend->close(crashed.db);
+    close(crashed.wal.fd);
+
+    // The log is replayed when the database is opened.
+    //
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    assert_true(db.wal.buf != NULL);
+
+    // Replay checkpoints the database, leaving an empty log.
+    //
+    assert_int_equal(0, db.wal.file_len);
+
+    ret = tsdb_goto_epoch(&db, 60, 1, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_get_by_key(&db, "key-1", &read_val);
+    assert_int_equal(0, ret);
+    assert_int_equal(111, *read_val);
+    ret = tsdb_get_by_key(&db, "key-2", &read_val);
+    assert_int_equal(0, ret);
+    assert_int_equal(222, *read_val);
+
+    ret = tsdb_goto_epoch(&db, 120, 1, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_get_by_key(&db, "key-1", &read_val);
+    assert_int_equal(0, ret);
+    assert_int_equal(333, *read_val);
+
+    ret = tsdb_get_tag_indexes(&db, "red", matches, 10, &match_count);
+    assert_int_equal(0, ret);
+    assert_int_equal(1, match_count);
+
+    //===================================================================
+    // Checkpoints
+    //===================================================================
+
+    // A checkpoint writes all changes to the database and empties the
+    // log.
+    //
+    ret = tsdb_goto_epoch(&db, 180, 0, 1);
+    assert_int_equal(0, ret);
+    write_val = 444;
+    ret = tsdb_set(&db, "key-3", &write_val);
+    assert_int_equal(0, ret);
+    ret = tsdb_commit(&db);
+    assert_int_equal(0, ret);
+    assert_true(db.wal.file_len > 0);
+    ret = tsdb_checkpoint(&db);
+    assert_int_equal(0, ret);
+    assert_int_equal(0, db.wal.file_len);
+    assert_int_equal(0, db.chunk.fragment_changed[0]);
+
+    tsdb_close(&db);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_goto_epoch(&db, 180, 1, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_get_by_key(&db, "key-3", &read_val);
+    assert_int_equal(0, ret);
+    assert_int_equal(444, *read_val);
+
+    //===================================================================
+    // Torn records
+    //===================================================================
+
+    // A crash in the middle of an append leaves a partial record at the
+    // end of the log. Replay stops there, and the log is reset so that
+    // later records don't end up behind the torn one.
+    //
+    ret = tsdb_goto_epoch(&db, 240, 0, 1);
+    assert_int_equal(0, ret);
+    write_val = 555;
+    ret = tsdb_set(&db, "key-1", &write_val);
+    assert_int_equal(0, ret);
+    ret = tsdb_commit(&db);
+    assert_int_equal(0, ret);
+
+    memcpy(&crashed, &db, sizeof(db));
+    crashed.backend->close(crashed.db);
+    close(crashed.wal.fd);
+
+    fd = open(wal_file, O_WRONLY | O_APPEND);
+    assert_true(fd >= 0);
+    assert_int_equal(5, write(fd, "\x40\x00\x00\x00\x01", 5));
+    close(fd);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    assert_int_equal(0, db.wal.file_len);
+    ret = tsdb_goto_epoch(&db, 240, 1, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_get_by_key(&db, "key-1", &read_val);
+    assert_int_equal(0, ret);
+    assert_int_equal(555, *read_val);
+
+    // The log is reset even when nothing in it could be replayed.
+    //
+    memcpy(&crashed, &db, sizeof(db));
+    crashed.backend->close(crashed.db);
+    close(crashed.wal.fd);
+
+    fd = open(wal_file, O_WRONLY | O_APPEND);
+    assert_true(fd >= 0);
+    assert_int_equal(12, write(fd, "\x03\x00\x00\x00garbage!", 12));
+    close(fd);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    assert_int_equal(0, db.wal.file_len);
+
+    // Records committed after the reset are replayed after a crash.
+    //
+    ret = tsdb_goto_epoch(&db, 300, 0, 1);
+    assert_int_equal(0, ret);
+    write_val = 666;
+    ret = tsdb_set(&db, "key-2", &write_val);
+    assert_int_equal(0, ret);
+    ret = tsdb_commit(&db);
+    assert_int_equal(0, ret);
+
+    memcpy(&crashed, &db, sizeof(db));
+    crashed.backend->close(crashed.db);
+    close(crashed.wal.fd);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_goto_epoch(&db, 300, 1, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_get_by_key(&db, "key-2", &read_val);
+    assert_int_equal(0, ret);
+    assert_int_equal(666, *read_val);
+    ret = tsdb_goto_epoch(&db, 240, 1, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_get_by_key(&db, "key-1", &read_val);
+    assert_int_equal(0, ret);
+    assert_int_equal(555, *read_val);
+
+    //===================================================================
+    // Failed batches
+    //===================================================================
+
+    // Keys are only mapped once they're logged. If the log fails part way
+    // through a batch, only the indexes of the keys mapped so far are
+    // used up. Here the buffer only has room for the first record (20
+    // bytes for "batch-1"), and the one after it can't be written out.
+    //
+    char *batch_keys[3] = { "batch-1", "batch-2", "batch-3" };
+    tsdb_value batch_vals[3] = { 1, 2, 3 };
+    u_int32_t batch_indexes[3], lowest_free_index, buf_len;
+
+    lowest_free_index = db.lowest_free_index;
+    buf_len = db.wal.buf_len;
+    fd = db.wal.fd;
+    db.wal.fd = -1;
+    db.wal.buf_len = db.wal.buf_size - 20;
+    ret = tsdb_set_batch(&db, batch_keys, batch_vals, 3, batch_indexes);
+    assert_int_equal(-2, ret);
+    assert_int_equal(lowest_free_index + 1, db.lowest_free_index);
+    db.wal.fd = fd;
+    db.wal.buf_len = buf_len;
+
+    //===================================================================
+    // Time zones
+    //===================================================================
+
+    // Epochs are logged as loaded, so replay outside UTC puts values
+    // back in the epoch they were written to.
+    //
+    setenv("TZ", "CET-1CEST,M3.5.0,M10.5.0/3", 1);
+    tzset();
+
+    ret = tsdb_goto_epoch(&db, 1300000000, 0, 1);
+    assert_int_equal(0, ret);
+    write_val = 777;
+    ret = tsdb_set(&db, "key-3", &write_val);
+    assert_int_equal(0, ret);
+    ret = tsdb_commit(&db);
+    assert_int_equal(0, ret);
+
+    memcpy(&crashed, &db, sizeof(db));
+    crashed.backend->close(crashed.db);
+    close(crashed.wal.fd);
+
+    ret = tsdb_open(file, &db, &vals_per_entry, slot_seconds, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_goto_epoch(&db, 1300000000, 1, 0);
+    assert_int_equal(0, ret);
+    ret = tsdb_get_by_key(&db, "key-3", &read_val);
+    assert_int_equal(0, ret);
+    assert_int_equal(777, *read_val);
+    tsdb_close(&db);
+
+    return 0;
+}
@@ -21,25 +21,33 @@
 #include "tsdb_api.h"
 #include "tsdb_bitmap.h"
 
+static int open_wal(tsdb_handler *handler);
+static int write_cached_tags(tsdb_handler *handler);
+static void write_names(tsdb_handler *handler);
+static int write_keys(tsdb_handler *handler, u_int8_t force);
+static int open_keydict(tsdb_handler *handler);
+static int load_generations(tsdb_handler *handler);
+static void write_generations(tsdb_handler *handler);
+static void free_generations(tsdb_handler *handler);
+static int evict_cached_tags(tsdb_handler *handler, u_int32_t max_count);
+static void free_cached_tags(tsdb_handler *handler);
+static int read_fragment(tsdb_handler *handler, u_int32_t epoch,
+                         u_int32_t fragment, u_int8_t *dest,
+                         u_int8_t *depth);
+static int get_reference(tsdb_handler *handler, u_int32_t epoch,
+                         u_int32_t fragment, u_int8_t **ref,
+                         u_int8_t **owned, u_int8_t *depth);
+
 static void db_put(tsdb_handler *handler,
                    void *key, u_int32_t key_len,
                    void *value, u_int32_t value_len) {
-    DBT key_data, data;
-
     if (handler->read_only) {
         trace_warning("Unable to set value (read-only mode)");
         return;
     }
 
-    memset(&key_data, 0, sizeof(key_data));
-    memset(&data, 0, sizeof(data));
-
-    key_data.data = key;
-    key_data.size = key_len;
-    data.data = value;
-    data.size = value_len;
-
-    if (handler->db->put(handler->db, NULL, &key_data, &data, 0) != 0) {
+    if (handler->backend->put(handler->db, key, key_len,
+                              value, value_len) != 0) {
         trace_error("Error while map_set(%u, %u)", key, value);
     }
 }
@@ -47,50 +55,83 @@ static void db_put(tsdb_handler *handler,
 static int db_get(tsdb_handler *handler,
                   void *key, u_int32_t key_len,
                   void **value, u_int32_t *value_len) {
-    DBT key_data, data;
-
-    memset(&key_data, 0, sizeof(key_data));
-    memset(&data, 0, sizeof(data));
-
-    key_data.data = key;
-    key_data.size = key_len;
+    return handler->backend->get(handler->db, key, key_len,
+                                 value, value_len) == 0 ? 0 : -1;
+}
 
-    if (handler->db->get(handler->db, NULL, &key_data, &data, 0) == 0) {
-        *value = data.data, *value_len = data.size;
-        return 0;
-    } else {
-        return -1;
+static void db_del(tsdb_handler *handler, void *key, u_int32_t key_len) {
+    if (handler->read_only) {
+        trace_warning("Unable to delete value (read-only mode)");
+        return;
     }
+
+    handler->backend->del(handler->db, key, key_len);
 }
 
 int tsdb_open(char *tsdb_path, tsdb_handler *handler,
 	      u_int16_t *values_per_entry,
 	      u_int32_t slot_duration,
 	      u_int8_t read_only) {
+    struct stat st;
+
+    // Segment stores are directories
+    if (stat(tsdb_path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        return tsdb_open_backend(tsdb_path, handler, values_per_entry,
+                                 slot_duration, read_only,
+                                 &tsdb_segment_backend);
+    }
+
+    return tsdb_open_backend(tsdb_path, handler, values_per_entry,
+                             slot_duration, read_only, &tsdb_bdb_backend);
+}
+
+int tsdb_open_backend(char *tsdb_path, tsdb_handler *handler,
+                      u_int16_t *values_per_entry,
+                      u_int32_t slot_duration,
+                      u_int8_t read_only,
+                      const tsdb_backend *backend) {
     void *value;
     u_int32_t value_len;
-    int ret, mode;
 
     memset(handler, 0, sizeof(tsdb_handler));
 
     handler->read_only = read_only;
+    handler->backend = backend;
+    handler->tag_cache.max_count = TAG_CACHE_SIZE;
 
-    if ((ret = db_create(&handler->db, NULL, 0)) != 0) {
-        trace_error("Error while creating DB handler [%s]", db_strerror(ret));
+    if (backend->open(&handler->db, tsdb_path, read_only) != 0) {
+        trace_error("Unable to open %s with the %s backend",
+                    tsdb_path, backend->name);
         return -1;
     }
 
-    mode = (read_only ? 00444 : 00664 );
+    handler->path = strdup(tsdb_path);
+
+    // Databases from before the format record have text fragment keys
+    if (db_get(handler, "format",
+               strlen("format"),
+               &value, &value_len) == 0) {
+        handler->format = *((u_int32_t*)value);
+    } else if (db_get(handler, "lowest_free_index",
+                      strlen("lowest_free_index"),
+                      &value, &value_len) == 0) {
+        handler->format = FORMAT_TEXT_KEYS;
+    } else {
+        handler->format = FORMAT_CURRENT;
+        if (!handler->read_only) {
+            db_put(handler, "format",
+                   strlen("format"),
+                   &handler->format,
+                   sizeof(handler->format));
+        }
+    }
 
-    if ((ret = handler->db->open(handler->db,
-                                 NULL,
-                                 (const char*)tsdb_path,
-                                 NULL,
-                                 DB_BTREE,
-                                 (read_only ? 0 : DB_CREATE),
-                                 mode)) != 0) {
-        trace_error("Error while opening DB %s [%s][r/o=%u,mode=%o]",
-                    tsdb_path, db_strerror(ret), read_only, mode);
+    if (handler->format > FORMAT_CURRENT) {
+        trace_error("Unsupported format %u for %s", handler->format,
+                    tsdb_path);
+        backend->close(handler->db);
+        free(handler->path);
+        handler->path = NULL;
         return -1;
     }
 
@@ -137,553 +178,4432 @@ int tsdb_open(char *tsdb_path, tsdb_handler *handler,
         }
     }
 
+    if (db_get(handler, "key_major",
+               strlen("key_major"),
+               &value, &value_len) == 0) {
+        handler->key_major = *((u_int8_t*)value);
+    }
+
+    if (db_get(handler, "wal",
+               strlen("wal"),
+               &value, &value_len) == 0) {
+        handler->wal_enabled = *((u_int8_t*)value);
+    }
+
+    if (db_get(handler, "encoding",
+               strlen("encoding"),
+               &value, &value_len) == 0) {
+        handler->encoding = *((u_int8_t*)value);
+    }
+
+    handler->codec = CODEC_QLZ;
+    if (db_get(handler, "codec",
+               strlen("codec"),
+               &value, &value_len) == 0) {
+        handler->codec = *((u_int8_t*)value);
+        if (!codec_find(handler->codec)) {
+            trace_warning("Unknown codec %u, using qlz", handler->codec);
+            handler->codec = CODEC_QLZ;
+        }
+    }
+
+    if (db_get(handler, "retention",
+               strlen("retention"),
+               &value, &value_len) == 0) {
+        handler->retention = *((u_int32_t*)value);
+    }
+
+    if (db_get(handler, "purge",
+               strlen("purge"),
+               &value, &value_len) == 0) {
+        handler->purging = *((u_int32_t*)value);
+    }
+
+    if (db_get(handler, "names",
+               strlen("names"),
+               &value, &value_len) == 0) {
+        handler->names.complete = *((u_int32_t*)value);
+    }
+    handler->names.backfill =
+        handler->names.complete < handler->lowest_free_index;
+
     handler->values_len = handler->values_per_entry * sizeof(tsdb_value);
 
     trace_info("lowest_free_index: %u", handler->lowest_free_index);
     trace_info("slot_duration: %u", handler->slot_duration);
+    trace_info("format: %u", handler->format);
     trace_info("values_per_entry: %u", handler->values_per_entry);
 
-    memset(&handler->state_compress, 0, sizeof(handler->state_compress));
-    memset(&handler->state_decompress, 0, sizeof(handler->state_decompress));
+    handler->num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (handler->num_threads < 1) {
+        handler->num_threads = 1;
+    } else if (handler->num_threads > MAX_NUM_THREADS) {
+        handler->num_threads = MAX_NUM_THREADS;
+    }
+
+    if (open_keydict(handler) != 0 || load_generations(handler) != 0) {
+        keydict_close(&handler->keydict);
+        free_generations(handler);
+        backend->close(handler->db);
+        free(handler->path);
+        handler->path = NULL;
+        return -1;
+    }
 
     handler->alive = 1;
 
+    if (handler->wal_enabled && open_wal(handler) != 0) {
+        tsdb_close(handler);
+        return -1;
+    }
+
     return 0;
 }
 
-static void tsdb_flush_chunk(tsdb_handler *handler) {
-    char *compressed;
-    u_int compressed_len, new_len, num_fragments, i;
-    u_int fragment_size;
-    char str[32];
-
-    if (!handler->chunk.data) return;
+// Starts the worker pool on first use
+static int ensure_pool(tsdb_handler *handler) {
+    if (handler->pool.threads) {
+        return 0;
+    }
 
-    fragment_size = handler->values_len * CHUNK_GROWTH;
-    new_len = handler->chunk.data_len + CHUNK_LEN_PADDING;
-    compressed = (char*)malloc(new_len);
-    if (!compressed) {
-        trace_error("Not enough memory (%u bytes)", new_len);
-        return;
+    if (pool_init(&handler->pool, handler->num_threads) != 0) {
+        return -2;
     }
 
-    // Split chunks on the DB
-    num_fragments = handler->chunk.data_len / fragment_size;
+    handler->worker_codec = (tsdb_codec_state*)
+        calloc(handler->pool.num_workers, sizeof(tsdb_codec_state));
+
+    if (!handler->worker_codec) {
+        pool_free(&handler->pool);
+        return -2;
+    }
 
-    for (i=0; i < num_fragments; i++) {
-        u_int offset;
+    trace_info("Started %u workers", handler->pool.num_workers);
 
-        if ((!handler->read_only) && handler->chunk.fragment_changed[i]) {
-            offset = i * fragment_size;
+    return 0;
+}
 
-            compressed_len = qlz_compress(&handler->chunk.data[offset],
-                                          compressed, fragment_size,
-                                          &handler->state_compress);
+static void free_pool(tsdb_handler *handler) {
+    u_int32_t i;
 
-            trace_info("Compression %u -> %u [fragment %u] [%.1f %%]",
-                       fragment_size, compressed_len, i,
-                       ((float)(compressed_len*100))/((float)fragment_size));
+    if (handler->worker_codec) {
+        for (i = 0; i < handler->pool.num_workers; i++) {
+            codec_state_free(&handler->worker_codec[i]);
+        }
+        free(handler->worker_codec);
+        handler->worker_codec = NULL;
+    }
+    pool_free(&handler->pool);
+}
 
-            snprintf(str, sizeof(str), "%u-%u", handler->chunk.epoch, i);
+// Allocates the state every worker needs for codec
+static int prepare_workers(tsdb_handler *handler, const tsdb_codec *codec,
+                           u_int8_t compress) {
+    u_int32_t i;
 
-            db_put(handler, str, strlen(str), compressed, compressed_len);
-        } else {
-            trace_info("Skipping fragment %u (unchanged)", i);
+    for (i = 0; i < handler->pool.num_workers; i++) {
+        if (codec_prepare(&handler->worker_codec[i], codec, compress) != 0) {
+            return -2;
         }
     }
 
-    free(compressed);
-    free(handler->chunk.data);
-    memset(&handler->chunk, 0, sizeof(handler->chunk));
-    handler->chunk.epoch = 0;
-    handler->chunk.data_len = 0;
+    return 0;
 }
 
-void tsdb_close(tsdb_handler *handler) {
+void tsdb_set_threads(tsdb_handler *handler, u_int32_t num_threads) {
+    if (num_threads < 1) {
+        num_threads = 1;
+    } else if (num_threads > MAX_NUM_THREADS) {
+        num_threads = MAX_NUM_THREADS;
+    }
 
-    if (!handler->alive) {
-        return;
+    free_pool(handler);
+    handler->num_threads = num_threads;
+}
+
+int tsdb_set_encoding(tsdb_handler *handler, u_int8_t encoding) {
+    if (handler->read_only || encoding > TRANSFORM_DELTA) {
+        return -1;
     }
 
-    tsdb_flush_chunk(handler);
+    handler->encoding = encoding;
+    db_put(handler, "encoding", strlen("encoding"),
+           &handler->encoding, sizeof(handler->encoding));
 
-    if (!handler->read_only) {
-        trace_info("Flushing database changes...");
+    return 0;
+}
+
+int tsdb_set_codec(tsdb_handler *handler, u_int8_t codec) {
+    if (handler->read_only || !codec_find(codec)) {
+        return -1;
     }
 
-    handler->db->close(handler->db, 0);
+    handler->codec = codec;
+    db_put(handler, "codec", strlen("codec"),
+           &handler->codec, sizeof(handler->codec));
 
-    handler->alive = 0;
+    return 0;
 }
 
-void normalize_epoch(tsdb_handler *handler, u_int32_t *epoch) {
-    *epoch -= *epoch % handler->slot_duration;
-    *epoch += timezone - daylight * 3600;
+static void fill_unknown(tsdb_handler *handler, u_int8_t *ptr,
+                         u_int32_t len) {
+    memset(ptr, handler->unknown_value, len);
 }
 
-int tsdb_get_key_index(tsdb_handler *handler, char *key, u_int32_t *index) {
-    void *ptr;
-    u_int32_t len;
-    char str[32] = { 0 };
+// An epoch that's in memory, or NULL
+static tsdb_chunk *find_chunk(tsdb_handler *handler, u_int32_t epoch) {
+    tsdb_cached_chunk *entry;
 
-    snprintf(str, sizeof(str), "key-%s", key);
+    if (handler->chunk.data && handler->chunk.epoch == epoch) {
+        return &handler->chunk;
+    }
 
-    if (db_get(handler, str, strlen(str), &ptr, &len) == 0) {
-        *index = *(u_int32_t*)ptr;
-        return 0;
+    for (entry = handler->cache.head; entry; entry = entry->next) {
+        if (entry->chunk.epoch == epoch) {
+            return &entry->chunk;
+        }
     }
 
-    return -1;
+    if (handler->reference.data && handler->reference.epoch == epoch) {
+        return &handler->reference;
+    }
+
+    return NULL;
 }
 
-static void set_key_index(tsdb_handler *handler, char *key, u_int32_t index) {
-    char str[32];
+// A fragment in memory that matches what's stored, or NULL
+static u_int8_t *find_reference(tsdb_handler *handler, u_int32_t epoch,
+                                u_int32_t fragment, u_int8_t *depth) {
+    u_int32_t fragment_size = handler->values_len * CHUNK_GROWTH;
+    tsdb_chunk *chunk = find_chunk(handler, epoch);
+
+    if (!chunk
+        || (u_int64_t)(fragment + 1) * fragment_size > chunk->data_len
+        || !chunk->fragment_loaded[fragment]
+        || chunk->fragment_changed[fragment]) {
+        return NULL;
+    }
 
-    snprintf(str, sizeof(str), "key-%s", key);
+    *depth = chunk->fragment_depth[fragment];
 
-    db_put(handler, str, strlen(str), &index, sizeof(index));
+    return &chunk->data[fragment * fragment_size];
+}
 
-    trace_info("[SET] Mapping %s -> %u", key, index);
+static void write_fragment(tsdb_handler *handler, u_int32_t epoch,
+                           u_int32_t fragment, u_int8_t *data,
+                           u_int32_t data_len) {
+    tsdb_fragment_key key;
+
+    fragment_key(handler->format, epoch, fragment, &key);
+
+    db_put(handler, key.data, key.len, data, data_len);
 }
 
-int tsdb_goto_epoch(tsdb_handler *handler,
-                    u_int32_t epoch,
-                    u_int8_t fail_if_missing,
-                    u_int8_t growable) {
-    int rc;
+static void blob_key(char *str, u_int32_t len, u_int64_t hash) {
+    snprintf(str, len, "blob-%016llx", (unsigned long long)hash);
+}
+
+// Stores a fragment as a pointer to the blob holding its values
+static void write_blob_pointer(tsdb_handler *handler, u_int32_t epoch,
+                               u_int32_t fragment, u_int64_t hash) {
+    u_int8_t record[FRAGMENT_HEADER_LEN + sizeof(hash)];
+    tsdb_fragment_header header;
+
+    memset(&header, 0, sizeof(header));
+    header.codec = CODEC_BLOB;
+    header.size = handler->values_len * CHUNK_GROWTH;
+    fragment_write_header(&header, record);
+    memcpy(&record[FRAGMENT_HEADER_LEN], &hash, sizeof(hash));
+
+    write_fragment(handler, epoch, fragment, record, sizeof(record));
+}
+
+// Before a fragment is replaced, the same fragment of the next epoch may
+// have to be decoded against the old version. Returns the decoded
+// fragment to store with rebase_next_fragment, or NULL if there's nothing
+// to do.
+static u_int8_t *decode_next_fragment(tsdb_handler *handler, u_int32_t epoch,
+                                      u_int32_t fragment) {
+    u_int32_t fragment_size = handler->values_len * CHUNK_GROWTH;
+    u_int32_t next = epoch + handler->slot_duration, value_len;
+    tsdb_fragment_header header;
+    u_int8_t *decoded, *ptr, depth;
+    tsdb_fragment_key key;
     void *value;
-    u_int32_t value_len, fragment = 0;
-    char str[32];
 
-    if (handler->chunk.epoch == epoch) {
-        return 0;
+    fragment_key(handler->format, next, fragment, &key);
+
+    if (db_get(handler, key.data, key.len, &value, &value_len) == -1
+        || fragment_read_header(value, value_len, &header) <= 0
+        || header.transform == TRANSFORM_NONE
+        || header.ref_epoch != epoch) {
+        return NULL;
     }
 
-    tsdb_flush_chunk(handler);
+    if (!(decoded = (u_int8_t*)malloc(fragment_size))) {
+        trace_error("Not enough memory (%u bytes)", fragment_size);
+        return NULL;
+    }
 
-    normalize_epoch(handler, &epoch);
-    snprintf(str, sizeof(str), "%u-%u", epoch, fragment);
+    if ((ptr = find_reference(handler, next, fragment, &depth))) {
+        memcpy(decoded, ptr, fragment_size);
+    } else if (read_fragment(handler, next, fragment, decoded, &depth) != 0) {
+        trace_error("Unable to decode fragment %u-%u", next, fragment);
+        free(decoded);
+        return NULL;
+    }
+
+    return decoded;
+}
 
-    rc = db_get(handler, str, strlen(str), &value, &value_len);
+// Room needed for a payload encoded by encode_payload
+static u_int32_t payload_bound(const tsdb_codec *codec, u_int32_t size) {
+    u_int32_t bound = codec->bound(size);
 
-    if (rc == -1 && fail_if_missing) {
-        return -1;
+    if (bound < bitpack_bound(size / sizeof(u_int32_t))) {
+        bound = bitpack_bound(size / sizeof(u_int32_t));
     }
 
-    handler->chunk.epoch = epoch;
-    handler->chunk.growable = growable;
+    return bound;
+}
 
-    if (rc == 0) {
-        u_int32_t len, offset = 0;
-        u_int8_t *ptr;
+// Compresses a fragment's values with codec and sets header->codec.
+// Small integers are packed instead when that's about as compact, unless
+// the database stores fragments as they are.
+static u_int32_t encode_payload(const tsdb_codec *codec, void *state,
+                                u_int8_t *src, u_int32_t size,
+                                u_int8_t *dest,
+                                tsdb_fragment_header *header) {
+    u_int32_t num_values = size / sizeof(u_int32_t);
+    u_int32_t len = codec->compress(state, src, size, dest);
+
+    header->codec = codec->id;
+
+    if (codec->id != CODEC_RAW && codec->id != CODEC_BITPACK
+        && bitpack_size((u_int32_t*)src, num_values)
+           <= len + len / BITPACK_PREFERENCE) {
+        header->codec = CODEC_BITPACK;
+        len = bitpack_encode((u_int32_t*)src, num_values, dest);
+    }
 
-        trace_info("Loading epoch %u", epoch);
+    return len;
+}
 
-        while (1) {
-            len = qlz_size_decompressed(value);
-            ptr = (u_int8_t*)malloc(handler->chunk.data_len + len);
-            if (ptr == NULL) {
-                trace_error("Not enough memory (%u bytes)",
-                              handler->chunk.data_len+len);
-                free(value);
-                return -2;
-            }
-            if (handler->chunk.data_len > 0) {
-                memcpy(ptr, handler->chunk.data, handler->chunk.data_len);
-            }
-            len = qlz_decompress(value, &ptr[offset],
-                                 &handler->state_decompress);
+// Stores a fragment decoded by decode_next_fragment without a reference
+static void rebase_next_fragment(tsdb_handler *handler, u_int32_t epoch,
+                                 u_int32_t fragment, u_int8_t *decoded) {
+    u_int32_t fragment_size = handler->values_len * CHUNK_GROWTH;
+    u_int32_t next = epoch + handler->slot_duration, len;
+    const tsdb_codec *codec = codec_find(handler->codec);
+    tsdb_fragment_header header;
+    tsdb_chunk *chunk;
+    u_int8_t *compressed;
+
+    len = FRAGMENT_HEADER_LEN + payload_bound(codec, fragment_size);
+    if (codec_prepare(&handler->codec_state, codec, 1) != 0
+        || !(compressed = (u_int8_t*)malloc(len))) {
+        trace_error("Not enough memory (%u bytes)", len);
+        return;
+    }
 
-            trace_info("Decompression %u -> %u [fragment %u] [%.1f %%]",
-                       value_len, len, fragment,
-                       ((float)(len*100))/((float)value_len));
+    memset(&header, 0, sizeof(header));
+    header.size = fragment_size;
+    len = FRAGMENT_HEADER_LEN
+        + encode_payload(codec, handler->codec_state.compress[codec->id],
+                         decoded, fragment_size,
+                         &compressed[FRAGMENT_HEADER_LEN], &header);
+    fragment_write_header(&header, compressed);
 
-            handler->chunk.data_len += len;
-            fragment++;
-            offset = handler->chunk.data_len;
+    trace_info("Rebasing fragment %u-%u", next, fragment);
 
-            free(handler->chunk.data);
-            handler->chunk.data = ptr;
+    write_fragment(handler, next, fragment, compressed, len);
 
-            snprintf(str, sizeof(str), "%u-%u", epoch, fragment);
-            if (db_get(handler, str, strlen(str), &value, &value_len) == -1) {
-                break; // No more fragments
-            }
-        }
+    if ((chunk = find_chunk(handler, next))
+        && (u_int64_t)(fragment + 1) * fragment_size <= chunk->data_len) {
+        chunk->fragment_depth[fragment] = 0;
     }
 
-    return 0;
+    free(compressed);
 }
 
-static int ensure_key_index(tsdb_handler *handler, char *key,
-                            u_int32_t *index, u_int8_t for_write) {
-    if (tsdb_get_key_index(handler, key, index) == 0) {
-        trace_info("Index %s mapped to hash %u", key, *index);
-        return 0;
+typedef struct {
+    tsdb_handler *handler;
+    tsdb_chunk *chunk;
+    const tsdb_codec *codec;
+    u_int32_t fragment_size;
+    u_int32_t buffer_size;
+    u_int32_t *fragments;
+    u_int32_t *compressed_len;
+    char *compressed;
+    tsdb_fragment_header *headers;
+    u_int8_t **refs;
+    u_int8_t **owned_refs;
+    u_int8_t *scratch;      // Transformed values, per worker
+    u_int64_t *hashes;
+    u_int8_t *dedup;
+} compress_batch;
+
+#define DEDUP_NONE   0
+#define DEDUP_STORED 1      // Its blob exists
+#define DEDUP_NEW    2      // Same as the previous epoch, store a blob
+
+static void compress_fragment(void *context, u_int32_t task,
+                              u_int32_t worker) {
+    compress_batch *batch = (compress_batch*)context;
+    tsdb_fragment_header *header = &batch->headers[task];
+    u_int32_t offset = batch->fragments[task] * batch->fragment_size;
+    u_int32_t num_values = batch->fragment_size / sizeof(u_int32_t);
+    u_int32_t len;
+    u_int8_t *src = &batch->chunk->data[offset];
+    char *dest = &batch->compressed[task * batch->buffer_size];
+
+    if (batch->dedup[task] == DEDUP_STORED) {
+        batch->compressed_len[task] = 0;
+        return;
     }
 
-    if (!for_write) {
-        trace_info("Unable to find index %s", key);
-        return -1;
+    if (header->transform != TRANSFORM_NONE) {
+        u_int8_t *scratch = &batch->scratch[worker * batch->fragment_size];
+
+        fragment_transform(header->transform, (u_int32_t*)src,
+                           (u_int32_t*)batch->refs[task], num_values,
+                           (u_int32_t*)scratch);
+        src = scratch;
     }
 
-    *index = handler->lowest_free_index++;
-    set_key_index(handler, key, *index);
+    len = encode_payload(
+        batch->codec,
+        batch->handler->worker_codec[worker].compress[batch->codec->id],
+        src, batch->fragment_size, (u_int8_t*)&dest[FRAGMENT_HEADER_LEN],
+        header);
 
-    db_put(handler,
-           "lowest_free_index", strlen("lowest_free_index"),
-           &handler->lowest_free_index,
-           sizeof(handler->lowest_free_index));
+    fragment_write_header(header, (u_int8_t*)dest);
 
-    return 0;
+    batch->compressed_len[task] = FRAGMENT_HEADER_LEN + len;
 }
 
-static int prepare_offset_by_index(tsdb_handler *handler, u_int32_t *index,
-                                   u_int64_t *offset, u_int8_t for_write) {
-
-    if (!handler->chunk.data) {
-        if (!for_write) {
-            return -1;
-        }
+// Loads the keys of the stored blobs, so fragments that can't be
+// duplicates are written without looking them up
+static int load_blobs(tsdb_handler *handler) {
+    void *cursor, *key;
+    u_int32_t key_len;
+    int ret;
 
-        u_int32_t fragment = *index / CHUNK_GROWTH, value_len;
-        char str[32];
-        void *value;
+    if (keymap_init(&handler->blobs, 0) != 0) {
+        trace_error("Not enough memory to allocate blob map");
+        return -2;
+    }
 
-        // Load the epoch handler->chunk.epoch/fragment
+    if (handler->backend->cursor_open(handler->db, "blob-", 5, &cursor) != 0) {
+        trace_error("Error while creating cursor");
+        keymap_free(&handler->blobs);
+        return -2;
+    }
 
-        snprintf(str, sizeof(str), "%u-%u", handler->chunk.epoch, fragment);
-        if (db_get(handler, str, strlen(str), &value, &value_len) == -1) {
-            u_int32_t mem_len = handler->values_len * CHUNK_GROWTH;
-            handler->chunk.data_len = mem_len;
-            handler->chunk.data = (u_int8_t*)malloc(mem_len);
-            if (handler->chunk.data == NULL) {
-                trace_error("Not enough memory (%u bytes)", mem_len);
-                return -2;
-            }
-            memset(handler->chunk.data,
-                   handler->unknown_value,
-                   handler->chunk.data_len);
-        } else {
-            handler->chunk.data_len = qlz_size_decompressed(value);
-            handler->chunk.data = (u_int8_t*)malloc(handler->chunk.data_len);
-            if (handler->chunk.data == NULL) {
-                trace_error("Not enough memory (%u bytes)",
-                            handler->chunk.data_len);
-                return -2;
-            }
-            qlz_decompress(value, handler->chunk.data,
-                           &handler->state_decompress);
+    ret = handler->backend->cursor_next(cursor, &key, &key_len, NULL, NULL);
+    while (ret == 0
+           && key_len >= 5
+           && memcmp(key, "blob-", 5) == 0) {
+        if (keymap_put(&handler->blobs, key, key_len, 0) != 0) {
+            trace_error("Not enough memory to load blob map");
+            handler->backend->cursor_close(cursor);
+            keymap_free(&handler->blobs);
+            return -2;
         }
-        handler->chunk.base_index = fragment * CHUNK_GROWTH;
-        index -= handler->chunk.base_index;
+        ret = handler->backend->cursor_next(cursor, &key, &key_len,
+                                            NULL, NULL);
     }
 
- get_offset:
+    handler->backend->cursor_close(cursor);
 
-    if (*index >= (handler->chunk.data_len / handler->values_len)) {
-        if (!for_write || !handler->chunk.growable) {
-            return -1;
-        }
+    handler->blobs_loaded = 1;
 
-        u_int32_t to_add = CHUNK_GROWTH * handler->values_len;
-        u_int32_t new_len = handler->chunk.data_len + to_add;
-        u_int8_t *ptr = malloc(new_len);
+    trace_info("Loaded %u blob keys", handler->blobs.count);
 
-        if (!ptr) {
-            trace_error("Not enough memory (%u bytes): unable to grow "
-                        "table", new_len);
-            return -2;
-        }
+    return 0;
+}
 
-        memcpy(ptr, handler->chunk.data, handler->chunk.data_len);
-        memset(&ptr[handler->chunk.data_len],
-               handler->unknown_value, to_add);
-        handler->chunk.data = ptr;
-        handler->chunk.data_len = new_len;
+static void free_blobs(tsdb_handler *handler) {
+    if (handler->blobs_loaded) {
+        keymap_free(&handler->blobs);
+        handler->blobs_loaded = 0;
+    }
+}
 
-        trace_warning("Epoch grown to %u", new_len);
+// Decodes a stored blob into dest. Returns -1 if there's no such blob.
+static int read_blob(tsdb_handler *handler, u_int64_t hash, u_int8_t *dest) {
+    u_int32_t fragment_size = handler->values_len * CHUNK_GROWTH;
+    tsdb_fragment_header header;
+    const tsdb_codec *codec;
+    u_int32_t value_len;
+    void *value;
+    int header_len;
+    char str[32];
 
-        goto get_offset;
+    blob_key(str, sizeof(str), hash);
+    if (db_get(handler, str, strlen(str), &value, &value_len) == -1) {
+        return -1;
     }
 
-    *offset = handler->values_len * *index;
+    header_len = fragment_read_header(value, value_len, &header);
+    codec = header_len > 0 ? codec_find(header.codec) : NULL;
+    if (!codec
+        || header.transform != TRANSFORM_NONE
+        || header.size != fragment_size
+        || codec->check((u_int8_t*)value + header_len,
+                        value_len - header_len, header.size) != 0) {
+        trace_error("Corrupt %s", str);
+        return -2;
+    }
 
-    if (*offset >= handler->chunk.data_len) {
-        trace_error("INTERNAL ERROR [Id: %u][Offset: %u/%u]",
-                    *index, *offset, handler->chunk.data_len);
+    if (codec_prepare(&handler->codec_state, codec, 0) != 0) {
+        trace_error("Not enough memory to decompress %s", str);
+        return -2;
     }
+    codec->decompress(handler->codec_state.decompress[codec->id],
+                      (u_int8_t*)value + header_len, header.size, dest);
 
     return 0;
 }
 
-static int prepare_offset_by_key(tsdb_handler *handler, char *key,
-                                 u_int64_t *offset, u_int8_t for_write) {
-    u_int32_t index;
+// Identical fragments are stored once. A fragment is written as a pointer
+// to a blob when the blob already exists, or when it's the same as the
+// fragment written for the previous epoch. Hashes only find candidates:
+// the values are compared before anything is shared.
+static u_int8_t pick_dedup(tsdb_handler *handler, compress_batch *batch,
+                           u_int32_t task) {
+    u_int32_t fragment = batch->fragments[task], index;
+    u_int8_t *data = &batch->chunk->data[fragment * batch->fragment_size];
+    tsdb_fragment_hash *last = &handler->written[fragment];
+    u_int8_t *stored, *owned, depth, dedup = DEDUP_NONE;
+    char str[32];
 
-    if (!handler->chunk.epoch) {
-        return -1;
-    }
+    batch->hashes[task] = fragment_hash(data, batch->fragment_size);
 
-    if (ensure_key_index(handler, key, &index, for_write) == -1) {
-        trace_info("Unable to find index %s", key);
-        return -1;
+    blob_key(str, sizeof(str), batch->hashes[task]);
+    if (keymap_get(&handler->blobs, str, strlen(str), &index) == 0) {
+        if (!(owned = (u_int8_t*)malloc(batch->fragment_size))) {
+            return DEDUP_NONE;
+        }
+        if (read_blob(handler, batch->hashes[task], owned) == 0
+            && memcmp(owned, data, batch->fragment_size) == 0) {
+            dedup = DEDUP_STORED;
+        }
+        free(owned);
+        return dedup;
     }
 
-    trace_info("%s mapped to idx %u", key, index);
+    if (last->epoch
+        && last->epoch + handler->slot_duration == batch->chunk->epoch
+        && last->hash == batch->hashes[task]) {
+        if (get_reference(handler, last->epoch, fragment, &stored, &owned,
+                          &depth) == 0
+            && memcmp(stored, data, batch->fragment_size) == 0) {
+            dedup = DEDUP_NEW;
+        }
+        free(owned);
+    }
 
-    return prepare_offset_by_index(handler, &index, offset, for_write);
+    return dedup;
 }
 
-int tsdb_set_with_index(tsdb_handler *handler, char *key,
-                        tsdb_value *value, u_int32_t *index) {
-    u_int32_t *chunk_ptr;
-    u_int64_t offset;
-    int rc;
-
-    if (!handler->alive) {
-        return -1;
+// Picks how a fragment is stored: as a blob, or against the previous
+// epoch when the database is encoded and the chain isn't too long
+static void prepare_fragment(tsdb_handler *handler, compress_batch *batch,
+                             u_int32_t task) {
+    tsdb_fragment_header *header = &batch->headers[task];
+    u_int32_t epoch = batch->chunk->epoch, prev;
+    u_int8_t depth;
+
+    memset(header, 0, sizeof(tsdb_fragment_header));
+    header->codec = batch->codec->id;
+    header->size = batch->fragment_size;
+    batch->refs[task] = batch->owned_refs[task] = NULL;
+
+    batch->dedup[task] = pick_dedup(handler, batch, task);
+    if (batch->dedup[task] != DEDUP_NONE) {
+        return;
     }
 
-    if (!handler->chunk.epoch) {
-        trace_error("Missing epoch");
-        return -2;
+    if (handler->encoding == TRANSFORM_NONE
+        || epoch < handler->slot_duration) {
+        return;
     }
 
-    rc = prepare_offset_by_key(handler, key, &offset, 1);
-    if (rc == 0) {
-        chunk_ptr = (tsdb_value*)(&handler->chunk.data[offset]);
-        memcpy(chunk_ptr, value, handler->values_len);
-
-        // Mark a fragment as changed
-        int fragment = offset / CHUNK_GROWTH;
-        if (fragment > MAX_NUM_FRAGMENTS) {
-            trace_error("Internal error [%u > %u]",
-                        fragment, MAX_NUM_FRAGMENTS);
-        } else {
-            handler->chunk.fragment_changed[fragment] = 1;
-        }
+    prev = epoch - handler->slot_duration;
 
-        *index = offset / handler->values_len;
+    // The reference may be deleted by a purge
+    if (prev < handler->purging) {
+        return;
     }
 
-    return rc;
-}
+    if (get_reference(handler, prev, batch->fragments[task],
+                      &batch->refs[task], &batch->owned_refs[task],
+                      &depth) != 0
+        || depth >= MAX_TRANSFORM_DEPTH) {
+        free(batch->owned_refs[task]);
+        batch->refs[task] = batch->owned_refs[task] = NULL;
+        return;
+    }
 
-int tsdb_set(tsdb_handler *handler, char *key, tsdb_value *value) {
-    u_int32_t index;
-    return tsdb_set_with_index(handler, key, value, &index);
+    header->transform = handler->encoding;
+    header->depth = depth + 1;
+    header->ref_epoch = prev;
 }
 
-int tsdb_get_by_key(tsdb_handler *handler, char *key, tsdb_value **value) {
-    u_int64_t offset;
-    int rc;
+// Stores a new blob, and points the previous epoch's copy of the fragment
+// at it too
+static void write_blob(tsdb_handler *handler, u_int32_t epoch,
+                       u_int32_t fragment, u_int64_t hash,
+                       u_int8_t *data, u_int32_t data_len) {
+    u_int32_t fragment_size = handler->values_len * CHUNK_GROWTH;
+    u_int32_t prev = epoch - handler->slot_duration;
+    tsdb_chunk *chunk;
+    char str[32];
+
+    blob_key(str, sizeof(str), hash);
+    db_put(handler, str, strlen(str), data, data_len);
+    if (keymap_put(&handler->blobs, str, strlen(str), 0) != 0) {
+        trace_error("Not enough memory to add %s to the blob map", str);
+    }
+
+    trace_info("Stored blob %s", str);
+
+    write_blob_pointer(handler, prev, fragment, hash);
+
+    if ((chunk = find_chunk(handler, prev))
+        && (u_int64_t)(fragment + 1) * fragment_size <= chunk->data_len) {
+        chunk->fragment_depth[fragment] = 0;
+    }
+}
+
+static void write_chunk(tsdb_handler *handler, tsdb_chunk *chunk) {
+    compress_batch batch;
+    u_int num_fragments, batch_size, n, i, j, fragment, written = 0;
+    u_int8_t *next, *compressed;
+    char str[32];
+
+    if (!chunk->data || handler->read_only) return;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.handler = handler;
+    batch.chunk = chunk;
+    batch.codec = codec_find(handler->codec);
+    batch.fragment_size = handler->values_len * CHUNK_GROWTH;
+
+    if (ensure_pool(handler) != 0
+        || prepare_workers(handler, batch.codec, 1) != 0) {
+        trace_error("Not enough memory to start workers");
+        return;
+    }
+
+    if (!handler->blobs_loaded && load_blobs(handler) != 0) {
+        return;
+    }
+
+    batch.buffer_size = FRAGMENT_HEADER_LEN
+        + payload_bound(batch.codec, batch.fragment_size);
+
+    // Split chunks on the DB
+    num_fragments = chunk->data_len / batch.fragment_size;
+    if (num_fragments == 0) return;
+
+    // Changed fragments are compressed by the workers a batch at a time
+    // and written in order
+    batch_size = handler->pool.num_workers * 4;
+    if (batch_size > num_fragments) {
+        batch_size = num_fragments;
+    }
+
+    batch.fragments = (u_int32_t*)malloc(batch_size * sizeof(u_int32_t));
+    batch.compressed_len = (u_int32_t*)malloc(batch_size * sizeof(u_int32_t));
+    batch.compressed = (char*)malloc((u_int64_t)batch_size * batch.buffer_size);
+    batch.headers = (tsdb_fragment_header*)
+        malloc(batch_size * sizeof(tsdb_fragment_header));
+    batch.refs = (u_int8_t**)malloc(batch_size * sizeof(u_int8_t*));
+    batch.owned_refs = (u_int8_t**)malloc(batch_size * sizeof(u_int8_t*));
+    batch.hashes = (u_int64_t*)malloc(batch_size * sizeof(u_int64_t));
+    batch.dedup = (u_int8_t*)malloc(batch_size);
+    if (!handler->written) {
+        handler->written = (tsdb_fragment_hash*)
+            calloc(MAX_NUM_FRAGMENTS, sizeof(tsdb_fragment_hash));
+    }
+    if (handler->encoding != TRANSFORM_NONE) {
+        batch.scratch = (u_int8_t*)malloc((u_int64_t)batch.fragment_size
+                                          * handler->pool.num_workers);
+    }
+    if (!batch.fragments || !batch.compressed_len || !batch.compressed
+        || !batch.headers || !batch.refs || !batch.owned_refs
+        || !batch.hashes || !batch.dedup || !handler->written
+        || (handler->encoding != TRANSFORM_NONE && !batch.scratch)) {
+        trace_error("Not enough memory (%u bytes)",
+                    batch_size * batch.buffer_size);
+        goto out;
+    }
+
+    for (i = 0; i < num_fragments; ) {
+        for (n = 0; i < num_fragments && n < batch_size; i++) {
+            if (chunk->fragment_changed[i]) {
+                batch.fragments[n] = i;
+                prepare_fragment(handler, &batch, n);
+                n++;
+            } else {
+                trace_info("Skipping fragment %u (unchanged)", i);
+            }
+        }
+
+        pool_run(&handler->pool, compress_fragment, &batch, n);
+
+        for (j = 0; j < n; j++) {
+            fragment = batch.fragments[j];
+            compressed = (u_int8_t*)&batch.compressed[j * batch.buffer_size];
+
+            trace_info("Compression %u -> %u [fragment %u] [%.1f %%]",
+                       batch.fragment_size, batch.compressed_len[j],
+                       fragment,
+                       ((float)(batch.compressed_len[j]*100))
+                       /((float)batch.fragment_size));
+
+            next = decode_next_fragment(handler, chunk->epoch, fragment);
+
+            if (batch.dedup[j] == DEDUP_NONE) {
+                write_fragment(handler, chunk->epoch, fragment, compressed,
+                               batch.compressed_len[j]);
+            } else {
+                if (batch.dedup[j] == DEDUP_NEW) {
+                    write_blob(handler, chunk->epoch, fragment,
+                               batch.hashes[j], compressed,
+                               batch.compressed_len[j]);
+                }
+                write_blob_pointer(handler, chunk->epoch, fragment,
+                                   batch.hashes[j]);
+            }
+            handler->written[fragment].epoch = chunk->epoch;
+            handler->written[fragment].hash = batch.hashes[j];
+
+            chunk->fragment_changed[fragment] = 0;
+            chunk->fragment_depth[fragment] = batch.headers[j].depth;
+            if (batch.headers[j].depth) {
+                chunk->transformed = 1;
+            }
+            written++;
+
+            if (next) {
+                rebase_next_fragment(handler, chunk->epoch, fragment, next);
+                free(next);
+            }
+
+            free(batch.owned_refs[j]);
+        }
+    }
+
+    if (written && handler->key_major) {
+        // The transposed block no longer matches the epoch
+        snprintf(str, sizeof(str), "ser-%u",
+                 (chunk->epoch / handler->slot_duration) / SERIES_BLOCK_SLOTS);
+        db_del(handler, str, strlen(str));
+    }
+
+ out:
+    free(batch.fragments);
+    free(batch.compressed_len);
+    free(batch.compressed);
+    free(batch.headers);
+    free(batch.refs);
+    free(batch.owned_refs);
+    free(batch.scratch);
+    free(batch.hashes);
+    free(batch.dedup);
+}
+
+static void tsdb_flush_chunk(tsdb_handler *handler) {
+    write_chunk(handler, &handler->chunk);
+
+    if (handler->chunk.data
+        && (handler->encoding != TRANSFORM_NONE || handler->chunk.transformed)) {
+        // The next epoch is likely stored against this one
+        free(handler->reference.data);
+        memcpy(&handler->reference, &handler->chunk, sizeof(tsdb_chunk));
+    } else {
+        free(handler->chunk.data);
+    }
+
+    memset(&handler->chunk, 0, sizeof(handler->chunk));
+}
+
+static u_int64_t cached_chunk_size(tsdb_cached_chunk *entry) {
+    return sizeof(tsdb_cached_chunk) + entry->chunk.data_len;
+}
+
+static void unlink_cached_chunk(tsdb_chunk_cache *cache,
+                                tsdb_cached_chunk *entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        cache->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        cache->tail = entry->prev;
+    }
+    entry->prev = entry->next = NULL;
+    cache->size -= cached_chunk_size(entry);
+}
+
+static void evict_cached_chunks(tsdb_handler *handler, u_int64_t max_size) {
+    tsdb_chunk_cache *cache = &handler->cache;
+    tsdb_cached_chunk *entry;
+
+    while (cache->tail && cache->size > max_size) {
+        entry = cache->tail;
+        unlink_cached_chunk(cache, entry);
+
+        trace_info("Evicting epoch %u from cache", entry->chunk.epoch);
+
+        write_chunk(handler, &entry->chunk);
+        free(entry->chunk.data);
+        free(entry);
+        cache->evictions++;
+    }
+}
+
+// Moves the current chunk into the cache, or writes and frees it if it
+// can't be cached.
+static void retire_chunk(tsdb_handler *handler) {
+    tsdb_chunk_cache *cache = &handler->cache;
+    tsdb_cached_chunk *entry;
+
+    if (!cache->max_size || !handler->chunk.data) {
+        tsdb_flush_chunk(handler);
+        return;
+    }
+
+    entry = (tsdb_cached_chunk*)malloc(sizeof(tsdb_cached_chunk));
+    if (!entry) {
+        trace_error("Not enough memory (%u bytes)",
+                    sizeof(tsdb_cached_chunk));
+        tsdb_flush_chunk(handler);
+        return;
+    }
+
+    memcpy(&entry->chunk, &handler->chunk, sizeof(tsdb_chunk));
+    memset(&handler->chunk, 0, sizeof(handler->chunk));
+
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head) {
+        cache->head->prev = entry;
+    } else {
+        cache->tail = entry;
+    }
+    cache->head = entry;
+    cache->size += cached_chunk_size(entry);
+
+    evict_cached_chunks(handler, cache->max_size);
+}
+
+// Moves a cached epoch into the current chunk. Returns 0 on a hit.
+static int restore_cached_chunk(tsdb_handler *handler, u_int32_t epoch) {
+    tsdb_chunk_cache *cache = &handler->cache;
+    tsdb_cached_chunk *entry;
+
+    if (!cache->max_size) {
+        return -1;
+    }
+
+    for (entry = cache->head; entry; entry = entry->next) {
+        if (entry->chunk.epoch == epoch) {
+            unlink_cached_chunk(cache, entry);
+            memcpy(&handler->chunk, &entry->chunk, sizeof(tsdb_chunk));
+            free(entry);
+            cache->hits++;
+            return 0;
+        }
+    }
+
+    cache->misses++;
+
+    return -1;
+}
+
+static void write_cached_chunks(tsdb_handler *handler) {
+    tsdb_cached_chunk *entry;
+
+    for (entry = handler->cache.head; entry; entry = entry->next) {
+        write_chunk(handler, &entry->chunk);
+    }
+}
+
+void tsdb_set_cache_size(tsdb_handler *handler, u_int64_t max_size) {
+    handler->cache.max_size = max_size;
+    evict_cached_chunks(handler, max_size);
+}
+
+void tsdb_close(tsdb_handler *handler) {
+
+    if (!handler->alive) {
+        return;
+    }
+
+    tsdb_flush_chunk(handler);
+    evict_cached_chunks(handler, 0);
+    free_cached_tags(handler);
+    write_names(handler);
+    names_free(&handler->names);
+    write_generations(handler);
+    free_generations(handler);
+    free(handler->reference.data);
+    memset(&handler->reference, 0, sizeof(handler->reference));
+    free(handler->written);
+    handler->written = NULL;
+    free_blobs(handler);
+
+    write_keys(handler, 0);
+
+    if (handler->keymap_loaded) {
+        keymap_free(&handler->keymap);
+        handler->keymap_loaded = 0;
+    }
+    keydict_close(&handler->keydict);
+
+    trace_info("Cache hits: %u, misses: %u, evictions: %u",
+               handler->cache.hits, handler->cache.misses,
+               handler->cache.evictions);
+    trace_info("Tag cache hits: %u, misses: %u, evictions: %u",
+               handler->tag_cache.hits, handler->tag_cache.misses,
+               handler->tag_cache.evictions);
+
+    if (!handler->read_only) {
+        trace_info("Flushing database changes...");
+    }
+
+    handler->backend->close(handler->db);
+
+    // Everything in the log is now in the database
+    if (handler->wal.buf) {
+        wal_reset(&handler->wal);
+        wal_close(&handler->wal);
+    }
+
+    free_pool(handler);
+    codec_state_free(&handler->codec_state);
+
+    free(handler->path);
+    handler->path = NULL;
+
+    handler->alive = 0;
+}
+
+void tsdb_set_load_on_demand(tsdb_handler *handler, u_int8_t load_on_demand) {
+    handler->load_on_demand = load_on_demand;
+}
+
+void normalize_epoch(tsdb_handler *handler, u_int32_t *epoch) {
+    *epoch -= *epoch % handler->slot_duration;
+    *epoch += timezone - daylight * 3600;
+}
+
+// Opens the key dictionary of persistent databases, "PATH.keys"
+static int open_keydict(tsdb_handler *handler) {
+    char path[PATH_MAX];
+
+    if (!handler->backend->persistent) {
+        return 0;
+    }
+
+    snprintf(path, sizeof(path), "%s.keys", handler->path);
+
+    if (keydict_open(&handler->keydict, path) != 0) {
+        trace_error("Unable to open key dictionary %s", path);
+        return -1;
+    }
+
+    trace_info("Key dictionary: %u keys", handler->keydict.count);
+
+    return 0;
+}
+
+// Loads the "key-" records, i.e. the keys that aren't in the dictionary
+// yet, into the in-memory key map
+static int load_keymap(tsdb_handler *handler) {
+    void *cursor, *key, *value;
+    u_int32_t key_len, value_len;
+    int ret;
+
+    if (keymap_init(&handler->keymap, 0) != 0) {
+        trace_error("Not enough memory to allocate key map");
+        return -2;
+    }
+
+    if (handler->backend->cursor_open(handler->db, "key-", 4, &cursor) != 0) {
+        trace_error("Error while creating cursor");
+        keymap_free(&handler->keymap);
+        return -2;
+    }
+
+    ret = handler->backend->cursor_next(cursor, &key, &key_len,
+                                        &value, &value_len);
+    while (ret == 0
+           && key_len >= 4
+           && memcmp(key, "key-", 4) == 0) {
+        if (value_len == sizeof(u_int32_t)
+            && keymap_put(&handler->keymap, (char*)key + 4,
+                          key_len - 4, *(u_int32_t*)value) != 0) {
+            trace_error("Not enough memory to load key map");
+            handler->backend->cursor_close(cursor);
+            keymap_free(&handler->keymap);
+            return -2;
+        }
+        ret = handler->backend->cursor_next(cursor, &key, &key_len,
+                                            &value, &value_len);
+    }
+
+    handler->backend->cursor_close(cursor);
+
+    handler->keymap_loaded = 1;
+
+    trace_info("Loaded %u keys", handler->keymap.count);
+
+    return 0;
+}
+
+int tsdb_get_key_index(tsdb_handler *handler, char *key, u_int32_t *index) {
+    u_int32_t key_len = strlen(key);
+
+    if (!handler->keymap_loaded && load_keymap(handler) != 0) {
+        return -2;
+    }
+
+    if (keymap_get(&handler->keymap, key, key_len, index) == 0) {
+        return 0;
+    }
+
+    return keydict_get(&handler->keydict, key, key_len, index);
+}
+
+static int compare_keydict_entries(const void *a, const void *b) {
+    const keydict_entry *x = (const keydict_entry*)a;
+    const keydict_entry *y = (const keydict_entry*)b;
+
+    return keydict_compare(x->key, x->key_len, y->key, y->key_len);
+}
+
+// The keys in the key map starting with prefix, sorted
+static int get_added_keys(tsdb_handler *handler, const char *prefix,
+                          keydict_entry **found, u_int32_t *count) {
+    tsdb_keymap *map = &handler->keymap;
+    u_int32_t i, prefix_len = strlen(prefix);
+    keydict_entry *entries;
+    char *key;
+
+    *found = NULL;
+    *count = 0;
+
+    if (!handler->keymap_loaded && load_keymap(handler) != 0) {
+        return -2;
+    }
+    if (map->count == 0) {
+        return 0;
+    }
+
+    if (!(entries = malloc(map->count * sizeof(keydict_entry)))) {
+        return -2;
+    }
+
+    for (i = 0; i < map->size; i++) {
+        if (map->entries[i].key_offset == 0) {
+            continue;
+        }
+        key = &map->arena[map->entries[i].key_offset];
+        if (strncmp(key, prefix, prefix_len) == 0) {
+            entries[*count].key = key;
+            entries[*count].key_len = strlen(key);
+            entries[*count].index = map->entries[i].index;
+            (*count)++;
+        }
+    }
+
+    qsort(entries, *count, sizeof(keydict_entry), compare_keydict_entries);
+    *found = entries;
+
+    return 0;
+}
+
+static int remove_added_keys(tsdb_handler *handler) {
+    void *cursor, *key;
+    u_int32_t key_len;
+    int ret, rc = 0;
+
+    if (handler->backend->cursor_open(handler->db, "key-", 4, &cursor) != 0) {
+        trace_error("Error while creating cursor");
+        return -2;
+    }
+
+    ret = handler->backend->cursor_next(cursor, &key, &key_len, NULL, NULL);
+    while (ret == 0 && rc == 0
+           && key_len >= 4
+           && memcmp(key, "key-", 4) == 0) {
+        rc = handler->backend->cursor_del(cursor);
+        ret = handler->backend->cursor_next(cursor, &key, &key_len,
+                                            NULL, NULL);
+    }
+
+    handler->backend->cursor_close(cursor);
+
+    return rc;
+}
+
+// Merges the "key-" records into the dictionary once there are enough of
+// them, then drops them
+static int write_keys(tsdb_handler *handler, u_int8_t force) {
+    char path[PATH_MAX];
+    keydict_entry *added;
+    u_int32_t count;
+    int rc;
+
+    if (handler->read_only || !handler->backend->persistent
+        || !handler->keymap_loaded) {
+        return 0;
+    }
+
+    count = handler->keymap.count;
+    if (count == 0
+        || (!force && (count < KEYDICT_MERGE_KEYS
+                       || count < handler->keydict.count / 16))) {
+        return 0;
+    }
+
+    if ((rc = get_added_keys(handler, "", &added, &count)) != 0) {
+        return rc;
+    }
+
+    snprintf(path, sizeof(path), "%s.keys", handler->path);
+    rc = keydict_write(&handler->keydict, added, count, path);
+    free(added);
+
+    if (rc != 0) {
+        trace_error("Unable to merge %u keys into %s", count, path);
+        return rc;
+    }
+
+    // Safe to lose from here, the dictionary has them
+    keymap_free(&handler->keymap);
+    handler->keymap_loaded = 0;
+    rc = remove_added_keys(handler);
+
+    trace_info("Merged %u keys into %s", count, path);
+
+    return rc;
+}
+
+int tsdb_merge_keys(tsdb_handler *handler) {
+    if (!handler->alive || handler->read_only) {
+        return -1;
+    }
+
+    return write_keys(handler, 1);
+}
+
+typedef struct {
+    keydict_entry *added;
+    u_int32_t num_added;
+    u_int32_t next;
+    tsdb_key_handler callback;
+    void *context;
+} key_scan;
+
+// Visits the added keys that sort before key, and skips an equal one
+static int scan_added_keys(key_scan *scan, const char *key,
+                           u_int32_t key_len) {
+    keydict_entry *entry;
+    int cmp, rc;
+
+    while (scan->next < scan->num_added) {
+        entry = &scan->added[scan->next];
+        cmp = key ? keydict_compare(entry->key, entry->key_len,
+                                    key, key_len) : -1;
+        if (cmp > 0) {
+            break;
+        }
+        scan->next++;
+        if (cmp == 0) {
+            break;
+        }
+        if ((rc = scan->callback(entry->key, entry->index,
+                                 scan->context)) != 0) {
+            return rc;
+        }
+    }
+
+    return 0;
+}
+
+static int scan_dict_key(const char *key, u_int32_t key_len,
+                         u_int32_t index, void *context) {
+    key_scan *scan = (key_scan*)context;
+    int rc;
+
+    if ((rc = scan_added_keys(scan, key, key_len)) != 0) {
+        return rc;
+    }
+
+    return scan->callback(key, index, scan->context);
+}
+
+int tsdb_scan_keys(tsdb_handler *handler, const char *prefix,
+                   tsdb_key_handler callback, void *context) {
+    key_scan scan;
+    int rc;
+
+    if (!handler->alive) {
+        return -1;
+    }
+
+    memset(&scan, 0, sizeof(scan));
+    scan.callback = callback;
+    scan.context = context;
+
+    if ((rc = get_added_keys(handler, prefix, &scan.added,
+                             &scan.num_added)) != 0) {
+        return rc;
+    }
+
+    // Keys added since the dictionary was written take precedence
+    rc = keydict_scan(&handler->keydict, prefix, strlen(prefix),
+                      scan_dict_key, &scan);
+    if (rc == 0) {
+        rc = scan_added_keys(&scan, NULL, 0);
+    }
+
+    free(scan.added);
+
+    return rc;
+}
+
+// The names block holding index, loaded if need be
+static int get_name_block(tsdb_handler *handler, u_int32_t index,
+                          tsdb_name_block **found) {
+    tsdb_names *names = &handler->names;
+    u_int32_t block = index / NAME_BLOCK_KEYS, value_len;
+    void *value;
+    char str[32];
+    int rc;
+
+    if (names_reserve(names, block) != 0) {
+        return -2;
+    }
+    if (names->blocks[block]) {
+        *found = names->blocks[block];
+        return 0;
+    }
+
+    if (!(names->blocks[block] = name_block_new())) {
+        return -2;
+    }
+
+    snprintf(str, sizeof(str), "name-%u", block);
+    if (db_get(handler, str, strlen(str), &value, &value_len) == 0) {
+        rc = name_block_deserialize(names->blocks[block], value, value_len);
+        if (rc == -2) {
+            return -2;
+        }
+        if (rc == -1) {
+            trace_error("Names block %u is corrupt, rebuilding", block);
+            names->backfill = 1;
+        }
+    }
+    *found = names->blocks[block];
+
+    return 0;
+}
+
+static void set_key_name(tsdb_handler *handler, char *key, u_int32_t index) {
+    tsdb_name_block *block;
+
+    if (get_name_block(handler, index, &block) != 0
+        || name_block_set(block, index % NAME_BLOCK_KEYS,
+                          key, strlen(key)) != 0) {
+        // Recovered from the "key-" records when it's next needed
+        trace_error("Not enough memory to add key name %s", key);
+        handler->names.backfill = 1;
+    }
+}
+
+static int backfill_name(const char *key, u_int32_t key_len,
+                         u_int32_t index, void *context) {
+    tsdb_handler *handler = (tsdb_handler*)context;
+    tsdb_name_block *block;
+    int rc;
+
+    if ((rc = get_name_block(handler, index, &block)) != 0
+        || name_block_get(block, index % NAME_BLOCK_KEYS)) {
+        return rc;
+    }
+
+    return name_block_set(block, index % NAME_BLOCK_KEYS, key, key_len);
+}
+
+// Adds the names missing from the blocks, e.g. in databases created before
+// there were names, or after a crash
+static int backfill_names(tsdb_handler *handler) {
+    keydict_entry *added;
+    u_int32_t count, i;
+    int rc;
+
+    rc = keydict_scan(&handler->keydict, "", 0, backfill_name, handler);
+    if (rc != 0) {
+        return rc;
+    }
+
+    if ((rc = get_added_keys(handler, "", &added, &count)) != 0) {
+        return rc;
+    }
+    for (i = 0; i < count && rc == 0; i++) {
+        rc = backfill_name(added[i].key, added[i].key_len, added[i].index,
+                           handler);
+    }
+    free(added);
+
+    if (rc == 0) {
+        handler->names.backfill = 0;
+    }
+
+    return rc;
+}
+
+static void write_names(tsdb_handler *handler) {
+    tsdb_names *names = &handler->names;
+    tsdb_name_block *block;
+    u_int32_t i, len;
+    u_int8_t *buf;
+    char str[32];
+
+    if (handler->read_only) {
+        return;
+    }
+
+    for (i = 0; i < names->num_blocks; i++) {
+        if (!(block = names->blocks[i]) || !block->dirty) {
+            continue;
+        }
+        len = name_block_serialized_size(block);
+        if (!(buf = malloc(len))) {
+            trace_error("Not enough memory to write names block %u", i);
+            return;
+        }
+        name_block_serialize(block, buf);
+        snprintf(str, sizeof(str), "name-%u", i);
+        db_put(handler, str, strlen(str), buf, len);
+        free(buf);
+        block->dirty = 0;
+    }
+
+    if (!names->backfill && names->complete != handler->lowest_free_index) {
+        names->complete = handler->lowest_free_index;
+        db_put(handler, "names", strlen("names"),
+               &names->complete, sizeof(names->complete));
+    }
+}
+
+int tsdb_get_key_name(tsdb_handler *handler, u_int32_t index,
+                      const char **key) {
+    tsdb_name_block *block;
+    int rc;
+
+    if (index >= handler->lowest_free_index) {
+        return -1;
+    }
+
+    if ((rc = get_name_block(handler, index, &block)) != 0) {
+        return rc;
+    }
+    *key = name_block_get(block, index % NAME_BLOCK_KEYS);
+
+    if (!*key && handler->names.backfill) {
+        if ((rc = backfill_names(handler)) != 0) {
+            return rc;
+        }
+        *key = name_block_get(block, index % NAME_BLOCK_KEYS);
+    }
+
+    return *key ? 0 : -1;
+}
+
+int tsdb_get_key_names(tsdb_handler *handler, u_int32_t *indexes,
+                       u_int32_t count, const char **keys) {
+    tsdb_name_block *block;
+    u_int8_t missing = 0;
+    u_int32_t i;
+    int rc;
+
+    // Backfilling moves the names in a block, so it's done before any
+    // are handed out
+    for (i = 0; i < count; i++) {
+        if (indexes[i] >= handler->lowest_free_index) {
+            continue;
+        }
+        if ((rc = get_name_block(handler, indexes[i], &block)) != 0) {
+            return rc;
+        }
+        if (!name_block_get(block, indexes[i] % NAME_BLOCK_KEYS)) {
+            missing = 1;
+        }
+    }
+    if (missing && handler->names.backfill
+        && (rc = backfill_names(handler)) != 0) {
+        return rc;
+    }
+
+    for (i = 0; i < count; i++) {
+        keys[i] = NULL;
+        if (indexes[i] < handler->lowest_free_index
+            && get_name_block(handler, indexes[i], &block) == 0) {
+            keys[i] = name_block_get(block, indexes[i] % NAME_BLOCK_KEYS);
+        }
+    }
+
+    return 0;
+}
+
+static int set_key_index(tsdb_handler *handler, char *key, u_int32_t index) {
+    u_int32_t key_len = strlen(key);
+    char *str;
+
+    // "key-KEY", until merged into the dictionary
+    if (!(str = malloc(key_len + 5))) {
+        trace_error("Not enough memory to add key %s", key);
+        return -2;
+    }
+    memcpy(str, "key-", 4);
+    memcpy(&str[4], key, key_len + 1);
+
+    // Nothing is changed unless it's logged
+    if (handler->wal.buf && !handler->wal_replaying
+        && wal_append(&handler->wal, WAL_KEY, &index, sizeof(index),
+                      key, key_len) != 0) {
+        trace_error("Unable to append to write-ahead log");
+        free(str);
+        return -2;
+    }
+
+    db_put(handler, str, key_len + 4, &index, sizeof(index));
+    free(str);
+
+    set_key_name(handler, key, index);
+
+    if (handler->keymap_loaded
+        && keymap_put(&handler->keymap, key, key_len, index) != 0) {
+        // The map is only a cache, fall back on the DB
+        trace_error("Not enough memory to update key map");
+        keymap_free(&handler->keymap);
+        handler->keymap_loaded = 0;
+    }
+
+    trace_info("[SET] Mapping %s -> %u", key, index);
+
+    return 0;
+}
+
+static int count_epoch_fragments(tsdb_handler *handler, u_int32_t epoch,
+                                 u_int32_t *num_fragments) {
+    tsdb_fragment_key prefix;
+    void *cursor, *key;
+    u_int32_t key_len, key_epoch, fragment;
+    int ret;
+
+    *num_fragments = 0;
+
+    // Walk the epoch's fragment keys without reading their values
+    fragment_key_epoch(handler->format, epoch, &prefix);
+
+    if (handler->backend->cursor_open(handler->db, prefix.data, prefix.len,
+                                      &cursor) != 0) {
+        trace_error("Error while creating cursor");
+        return -2;
+    }
+
+    ret = handler->backend->cursor_next(cursor, &key, &key_len, NULL, NULL);
+    while (ret == 0
+           && key_len > prefix.len
+           && memcmp(key, prefix.data, prefix.len) == 0) {
+        if (fragment_key_parse(handler->format, key, key_len,
+                               &key_epoch, &fragment) == 0
+            && key_epoch == epoch
+            && fragment < MAX_NUM_FRAGMENTS
+            && fragment >= *num_fragments) {
+            *num_fragments = fragment + 1;
+        }
+
+        ret = handler->backend->cursor_next(cursor, &key, &key_len,
+                                            NULL, NULL);
+    }
+
+    handler->backend->cursor_close(cursor);
+
+    return ret == -2 ? -2 : 0;
+}
+
+static int map_epoch_fragments(tsdb_handler *handler, u_int32_t epoch) {
+    u_int32_t num_fragments, fragment_size;
+
+    if (count_epoch_fragments(handler, epoch, &num_fragments) != 0) {
+        return -2;
+    }
+
+    if (num_fragments == 0) {
+        return -1;
+    }
+
+    fragment_size = handler->values_len * CHUNK_GROWTH;
+    handler->chunk.data_len = num_fragments * fragment_size;
+    handler->chunk.data = (u_int8_t*)malloc(handler->chunk.data_len);
+    if (handler->chunk.data == NULL) {
+        trace_error("Not enough memory (%u bytes)", handler->chunk.data_len);
+        handler->chunk.data_len = 0;
+        return -2;
+    }
+
+    trace_info("Mapped epoch %u [%u fragments]", epoch, num_fragments);
+
+    return 0;
+}
+
+// Reads a fragment record, following a pointer to the blob holding its
+// values. Returns -1 if the fragment doesn't exist.
+static int get_fragment(tsdb_handler *handler, u_int32_t epoch,
+                        u_int32_t fragment, void **value,
+                        u_int32_t *value_len) {
+    tsdb_fragment_header header;
+    tsdb_fragment_key key;
+    u_int64_t hash;
+    char str[32];
+
+    fragment_key(handler->format, epoch, fragment, &key);
+
+    if (db_get(handler, key.data, key.len, value, value_len) == -1) {
+        return -1;
+    }
+
+    if (fragment_read_header(*value, *value_len, &header) <= 0
+        || header.codec != CODEC_BLOB) {
+        return 0;
+    }
+
+    if (*value_len != FRAGMENT_HEADER_LEN + sizeof(hash)) {
+        trace_error("Corrupt fragment %u-%u", epoch, fragment);
+        return -2;
+    }
+
+    memcpy(&hash, (u_int8_t*)*value + FRAGMENT_HEADER_LEN, sizeof(hash));
+    blob_key(str, sizeof(str), hash);
+
+    if (db_get(handler, str, strlen(str), value, value_len) == -1) {
+        trace_error("Missing %s for fragment %u-%u", str, epoch, fragment);
+        return -2;
+    }
+
+    return 0;
+}
+
+// Checks a stored fragment and returns the length of its header
+static int check_fragment(tsdb_handler *handler, u_int32_t epoch,
+                          u_int32_t fragment, void *value,
+                          u_int32_t value_len,
+                          tsdb_fragment_header *header) {
+    u_int32_t fragment_size = handler->values_len * CHUNK_GROWTH;
+    int header_len = fragment_read_header(value, value_len, header);
+    const tsdb_codec *codec;
+
+    if (header_len < 0) {
+        trace_error("Unknown format for fragment %u-%u", epoch, fragment);
+        return -2;
+    }
+
+    // Fragments without a header are quicklz blocks
+    if (header_len == 0 && value_len >= 9) {
+        header->size = qlz_size_decompressed(value);
+    }
+
+    // A blob can't point to another blob
+    codec = codec_find(header->codec);
+    if (!codec || codec->check((u_int8_t*)value + header_len,
+                               value_len - header_len, header->size) != 0) {
+        trace_error("Corrupt fragment %u-%u", epoch, fragment);
+        return -2;
+    }
+
+    if (header->transform != TRANSFORM_NONE
+        && (header->size != fragment_size || header->ref_epoch >= epoch)) {
+        trace_error("Bad reference for fragment %u-%u", epoch, fragment);
+        return -2;
+    }
+
+    return header_len;
+}
+
+// Reads and decodes a single fragment into dest. Returns -1 if the
+// fragment doesn't exist.
+static int read_fragment(tsdb_handler *handler, u_int32_t epoch,
+                         u_int32_t fragment, u_int8_t *dest,
+                         u_int8_t *depth) {
+    u_int32_t fragment_size = handler->values_len * CHUNK_GROWTH;
+    tsdb_fragment_header header;
+    const tsdb_codec *codec;
+    u_int32_t value_len;
+    u_int8_t *ref, *owned, ref_depth;
+    void *value;
+    int header_len, rc;
+
+    if ((rc = get_fragment(handler, epoch, fragment, &value,
+                           &value_len)) != 0) {
+        return rc;
+    }
+
+    if ((header_len = check_fragment(handler, epoch, fragment, value,
+                                     value_len, &header)) < 0) {
+        return -2;
+    }
+
+    if (header.size != fragment_size) {
+        trace_error("Unexpected size for fragment %u-%u [%u != %u]", epoch,
+                    fragment, header.size, fragment_size);
+        return -2;
+    }
+
+    codec = codec_find(header.codec);
+    if (codec_prepare(&handler->codec_state, codec, 0) != 0) {
+        trace_error("Not enough memory to decompress fragment %u-%u", epoch,
+                    fragment);
+        return -2;
+    }
+    codec->decompress(handler->codec_state.decompress[codec->id],
+                      (u_int8_t*)value + header_len, header.size, dest);
+
+    trace_info("Decompression %u -> %u [fragment %u]",
+               value_len, fragment_size, fragment);
+
+    *depth = header.depth;
+
+    if (header.transform == TRANSFORM_NONE) {
+        return 0;
+    }
+
+    // May read further back
+    if (get_reference(handler, header.ref_epoch, fragment, &ref, &owned,
+                      &ref_depth) == -2) {
+        return -2;
+    }
+    fragment_untransform(header.transform, (u_int32_t*)dest, (u_int32_t*)ref,
+                         fragment_size / sizeof(u_int32_t));
+    free(owned);
+
+    return 0;
+}
+
+// The decoded fragment of an epoch, for fragments stored against it. A
+// missing fragment reads as unknown values and returns -1.
+static int get_reference(tsdb_handler *handler, u_int32_t epoch,
+                         u_int32_t fragment, u_int8_t **ref,
+                         u_int8_t **owned, u_int8_t *depth) {
+    u_int32_t fragment_size = handler->values_len * CHUNK_GROWTH;
+    int rc;
+
+    *owned = NULL;
+
+    if ((*ref = find_reference(handler, epoch, fragment, depth))) {
+        return 0;
+    }
+
+    if (!(*owned = (u_int8_t*)malloc(fragment_size))) {
+        trace_error("Not enough memory (%u bytes)", fragment_size);
+        return -2;
+    }
+
+    rc = read_fragment(handler, epoch, fragment, *owned, depth);
+    if (rc == -2) {
+        free(*owned);
+        *owned = NULL;
+        return -2;
+    }
+    if (rc == -1) {
+        fill_unknown(handler, *owned, fragment_size);
+        *depth = 0;
+    }
+
+    *ref = *owned;
+
+    return rc;
+}
+
+static int load_fragment(tsdb_handler *handler, u_int32_t fragment) {
+    u_int32_t fragment_size = handler->values_len * CHUNK_GROWTH;
+    u_int8_t *ptr = &handler->chunk.data[fragment * fragment_size];
+    u_int8_t *depth = &handler->chunk.fragment_depth[fragment];
+    int rc;
+
+    rc = read_fragment(handler, handler->chunk.epoch, fragment, ptr, depth);
+    if (rc == -2) {
+        return -2;
+    }
+    if (rc == -1) {
+        fill_unknown(handler, ptr, fragment_size);
+        *depth = 0;
+    }
+    if (*depth) {
+        handler->chunk.transformed = 1;
+    }
+
+    handler->chunk.fragment_loaded[fragment] = 1;
+
+    return 0;
+}
+
+typedef struct {
+    u_int64_t blob_offset;
+    u_int32_t data_offset;
+    tsdb_fragment_header header;
+    u_int8_t header_len;
+    u_int8_t *ref;
+    u_int8_t *owned_ref;
+} fragment_blob;
+
+typedef struct {
+    tsdb_handler *handler;
+    u_int8_t *blobs;
+    fragment_blob *fragments;
+    u_int8_t *data;
+} decompress_batch;
+
+static void decompress_fragment(void *context, u_int32_t task,
+                                u_int32_t worker) {
+    decompress_batch *batch = (decompress_batch*)context;
+    fragment_blob *blob = &batch->fragments[task];
+    u_int8_t *dest = &batch->data[blob->data_offset];
+    const tsdb_codec *codec = codec_find(blob->header.codec);
+
+    codec->decompress(
+        batch->handler->worker_codec[worker].decompress[codec->id],
+        &batch->blobs[blob->blob_offset + blob->header_len],
+        blob->header.size, dest);
+
+    if (blob->header.transform != TRANSFORM_NONE) {
+        fragment_untransform(blob->header.transform, (u_int32_t*)dest,
+                             (u_int32_t*)blob->ref,
+                             blob->header.size / sizeof(u_int32_t));
+    }
+}
+
+// Reads every fragment of an epoch, then decompresses them in parallel
+// into a single buffer
+static int load_epoch(tsdb_handler *handler, u_int32_t epoch) {
+    decompress_batch batch;
+    tsdb_fragment_header header;
+    fragment_blob *blob;
+    u_int64_t blobs_len = 0, blobs_size = 0;
+    u_int32_t num_fragments = 0, fragments_size = 0, data_len = 0, i;
+    u_int32_t value_len;
+    u_int8_t ref_depth;
+    void *value, *grown;
+    int header_len, rc = 0;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.handler = handler;
+
+    while (num_fragments < MAX_NUM_FRAGMENTS) {
+        if ((rc = get_fragment(handler, epoch, num_fragments, &value,
+                               &value_len)) != 0) {
+            if (rc == -1) {
+                rc = 0; // No more fragments
+            }
+            break;
+        }
+
+        if ((header_len = check_fragment(handler, epoch, num_fragments,
+                                         value, value_len, &header)) < 0) {
+            rc = -2;
+            break;
+        }
+
+        // Values only last until the next read, so keep a copy
+        if (num_fragments == fragments_size) {
+            fragments_size = fragments_size ? fragments_size * 2 : 16;
+            grown = realloc(batch.fragments,
+                            fragments_size * sizeof(fragment_blob));
+            if (!grown) {
+                rc = -2;
+                break;
+            }
+            batch.fragments = (fragment_blob*)grown;
+        }
+        if (blobs_len + value_len > blobs_size) {
+            blobs_size = (blobs_len + value_len) * 2;
+            if (!(grown = realloc(batch.blobs, blobs_size))) {
+                rc = -2;
+                break;
+            }
+            batch.blobs = (u_int8_t*)grown;
+        }
+        memcpy(&batch.blobs[blobs_len], value, value_len);
+
+        trace_info("Decompression %u -> %u [fragment %u] [%.1f %%]",
+                   value_len, header.size, num_fragments,
+                   ((float)(header.size*100))/((float)value_len));
+
+        blob = &batch.fragments[num_fragments];
+        memset(blob, 0, sizeof(fragment_blob));
+        blob->blob_offset = blobs_len;
+        blob->data_offset = data_len;
+        blob->header = header;
+        blob->header_len = header_len;
+        blobs_len += value_len;
+        data_len += header.size;
+        num_fragments++;
+
+        // Fragments stored against another epoch need it decoded first,
+        // which may read further back
+        if (header.transform != TRANSFORM_NONE
+            && get_reference(handler, header.ref_epoch, num_fragments - 1,
+                             &blob->ref, &blob->owned_ref,
+                             &ref_depth) == -2) {
+            rc = -2;
+            break;
+        }
+    }
+
+    if (rc == 0 && num_fragments == 0) {
+        rc = -1;
+    }
+
+    if (rc == 0) {
+        trace_info("Loading epoch %u", epoch);
+
+        if (ensure_pool(handler) != 0) {
+            rc = -2;
+        }
+        for (i = 0; rc == 0 && i < num_fragments; i++) {
+            rc = prepare_workers(handler,
+                                 codec_find(batch.fragments[i].header.codec),
+                                 0);
+        }
+        if (rc == 0 && !(batch.data = (u_int8_t*)malloc(data_len))) {
+            rc = -2;
+        }
+        if (rc != 0) {
+            trace_error("Not enough memory to load epoch %u", epoch);
+        }
+    }
+
+    if (rc == 0) {
+        pool_run(&handler->pool, decompress_fragment, &batch, num_fragments);
+
+        handler->chunk.data = batch.data;
+        handler->chunk.data_len = data_len;
+        memset(handler->chunk.fragment_loaded, 1, num_fragments);
+        for (i = 0; i < num_fragments; i++) {
+            u_int8_t depth = batch.fragments[i].header.depth;
+            handler->chunk.fragment_depth[i] = depth;
+            if (depth) {
+                handler->chunk.transformed = 1;
+            }
+        }
+    }
+
+    for (i = 0; i < num_fragments; i++) {
+        free(batch.fragments[i].owned_ref);
+    }
+    free(batch.blobs);
+    free(batch.fragments);
+
+    return rc;
+}
+
+// Loads an epoch that's already normalized
+static int goto_epoch(tsdb_handler *handler, u_int32_t epoch,
+                      u_int8_t fail_if_missing, u_int8_t growable) {
+    int rc;
+
+    if (handler->chunk.epoch == epoch) {
+        return 0;
+    }
+
+    retire_chunk(handler);
+
+    if (handler->reference.data && handler->reference.epoch == epoch) {
+        // About to be loaded again, and possibly changed
+        free(handler->reference.data);
+        memset(&handler->reference, 0, sizeof(handler->reference));
+    }
+
+    if (restore_cached_chunk(handler, epoch) == 0) {
+        trace_info("Loading epoch %u (cached)", epoch);
+        handler->chunk.growable = growable;
+        return 0;
+    }
+
+    if (handler->load_on_demand) {
+        rc = map_epoch_fragments(handler, epoch);
+        if (rc == -2) {
+            return -2;
+        }
+        if (rc == -1 && fail_if_missing) {
+            return -1;
+        }
+        handler->chunk.epoch = epoch;
+        handler->chunk.growable = growable;
+        return 0;
+    }
+
+    rc = load_epoch(handler, epoch);
+    if (rc == -2) {
+        return -2;
+    }
+    if (rc == -1 && fail_if_missing) {
+        return -1;
+    }
+
+    handler->chunk.epoch = epoch;
+    handler->chunk.growable = growable;
+
+    return 0;
+}
+
+int tsdb_goto_epoch(tsdb_handler *handler,
+                    u_int32_t epoch,
+                    u_int8_t fail_if_missing,
+                    u_int8_t growable) {
+    normalize_epoch(handler, &epoch);
+
+    return goto_epoch(handler, epoch, fail_if_missing, growable);
+}
+
+static int ensure_key_index(tsdb_handler *handler, char *key,
+                            u_int32_t *index, u_int8_t for_write) {
+    int rc = tsdb_get_key_index(handler, key, index);
+
+    if (rc == 0) {
+        trace_info("Index %s mapped to hash %u", key, *index);
+        return 0;
+    }
+
+    if (rc == -2) {
+        return -2;
+    }
+
+    if (!for_write) {
+        trace_info("Unable to find index %s", key);
+        return -1;
+    }
+
+    *index = handler->lowest_free_index;
+    if ((rc = set_key_index(handler, key, *index)) != 0) {
+        return rc;
+    }
+    handler->lowest_free_index++;
+
+    db_put(handler,
+           "lowest_free_index", strlen("lowest_free_index"),
+           &handler->lowest_free_index,
+           sizeof(handler->lowest_free_index));
+
+    return 0;
+}
+
+// The generation of epoch, NULL for the first
+static tsdb_generation *find_generation(tsdb_handler *handler,
+                                        u_int32_t epoch) {
+    u_int32_t i;
+
+    for (i = handler->num_generations; i > 0; i--) {
+        if (epoch >= handler->generations[i - 1].start) {
+            return &handler->generations[i - 1];
+        }
+    }
+
+    return NULL;
+}
+
+static int load_generation(tsdb_handler *handler, tsdb_generation *gen) {
+    u_int32_t number = gen - handler->generations + 1;
+    u_int32_t count = gen->num_slots, block, value_len, i, slot;
+    u_int32_t *indexes;
+    void *value;
+    char str[32];
+
+    gen->num_slots = 0;
+    gen->loaded = 1;
+
+    for (block = 0; block * GENERATION_BLOCK_SLOTS < count; block++) {
+        snprintf(str, sizeof(str), "gen-%u-%u", number, block);
+        if (db_get(handler, str, strlen(str), &value, &value_len) != 0
+            || value_len % sizeof(u_int32_t) != 0
+            || gen->num_slots + value_len / sizeof(u_int32_t) > count) {
+            trace_error("Missing or invalid generation block %s", str);
+            generation_free(gen);
+            gen->num_slots = count;
+            return -2;
+        }
+        indexes = (u_int32_t*)value;
+        for (i = 0; i < value_len / sizeof(u_int32_t); i++) {
+            if (generation_add(gen, indexes[i], &slot) != 0) {
+                trace_error("Not enough memory to load generation %u",
+                            number);
+                generation_free(gen);
+                gen->num_slots = count;
+                return -2;
+            }
+        }
+    }
+    gen->num_written = gen->num_slots;
+
+    trace_info("Loaded generation %u (%u slots)", number, gen->num_slots);
+
+    return 0;
+}
+
+// The slot of index in the epochs of gen, assigned on first write
+static int get_slot(tsdb_handler *handler, tsdb_generation *gen,
+                    u_int32_t index, u_int32_t *slot, u_int8_t for_write) {
+    u_int32_t record[3];
+
+    if (!gen) {
+        *slot = index;
+        return 0;
+    }
+
+    if (!gen->loaded && load_generation(handler, gen) != 0) {
+        return -2;
+    }
+
+    if (generation_get(gen, index, slot) == 0) {
+        return 0;
+    }
+    if (!for_write) {
+        return -1;
+    }
+
+    // Logged first; generation_add assigns the next slot
+    if (handler->wal.buf && !handler->wal_replaying) {
+        record[0] = gen - handler->generations + 1;
+        record[1] = index;
+        record[2] = gen->num_slots;
+        if (wal_append(&handler->wal, WAL_SLOT, record, sizeof(u_int32_t) * 2,
+                       &record[2], sizeof(u_int32_t)) != 0) {
+            trace_error("Unable to append to write-ahead log");
+            return -2;
+        }
+    }
+
+    if (generation_add(gen, index, slot) != 0) {
+        trace_error("Not enough memory to add index %u to generation", index);
+        return -2;
+    }
+
+    return 0;
+}
+
+// The "generations" record is a start epoch and slot count for each
+// generation after the first
+static int load_generations(tsdb_handler *handler) {
+    u_int32_t value_len, i;
+    u_int32_t *record;
+    void *value;
+
+    if (db_get(handler, "generations", strlen("generations"),
+               &value, &value_len) != 0) {
+        return 0;
+    }
+    if (value_len % (sizeof(u_int32_t) * 2) != 0) {
+        trace_error("Invalid generations record");
+        return -1;
+    }
+
+    handler->num_generations = value_len / (sizeof(u_int32_t) * 2);
+    handler->generations = calloc(handler->num_generations,
+                                  sizeof(tsdb_generation));
+    if (!handler->generations) {
+        handler->num_generations = 0;
+        return -2;
+    }
+
+    record = (u_int32_t*)value;
+    for (i = 0; i < handler->num_generations; i++) {
+        handler->generations[i].start = record[i * 2];
+        handler->generations[i].num_slots = record[i * 2 + 1];
+        handler->generations[i].num_written = record[i * 2 + 1];
+    }
+
+    trace_info("Generations: %u", handler->num_generations + 1);
+
+    return 0;
+}
+
+static void put_generations(tsdb_handler *handler) {
+    u_int32_t *record, i;
+
+    record = malloc((handler->num_generations * 2 + 1) * sizeof(u_int32_t));
+    if (!record) {
+        trace_error("Not enough memory to write generations");
+        return;
+    }
+    for (i = 0; i < handler->num_generations; i++) {
+        record[i * 2] = handler->generations[i].start;
+        record[i * 2 + 1] = handler->generations[i].num_written;
+    }
+
+    db_put(handler, "generations", strlen("generations"),
+           record, handler->num_generations * 2 * sizeof(u_int32_t));
+    free(record);
+}
+
+// Writes the blocks with new slots, then their count
+static void write_generations(tsdb_handler *handler) {
+    tsdb_generation *gen;
+    u_int32_t i, block, first, count;
+    u_int8_t changed = 0;
+    char str[32];
+
+    if (handler->read_only) {
+        return;
+    }
+
+    for (i = 0; i < handler->num_generations; i++) {
+        gen = &handler->generations[i];
+        if (!gen->loaded || gen->num_written == gen->num_slots) {
+            continue;
+        }
+        for (block = gen->num_written / GENERATION_BLOCK_SLOTS;
+             block * GENERATION_BLOCK_SLOTS < gen->num_slots; block++) {
+            first = block * GENERATION_BLOCK_SLOTS;
+            count = gen->num_slots - first;
+            if (count > GENERATION_BLOCK_SLOTS) {
+                count = GENERATION_BLOCK_SLOTS;
+            }
+            snprintf(str, sizeof(str), "gen-%u-%u", i + 1, block);
+            db_put(handler, str, strlen(str), &gen->indexes[first],
+                   count * sizeof(u_int32_t));
+        }
+        gen->num_written = gen->num_slots;
+        changed = 1;
+    }
+
+    if (changed) {
+        put_generations(handler);
+    }
+}
+
+static void free_generations(tsdb_handler *handler) {
+    u_int32_t i;
+
+    for (i = 0; i < handler->num_generations; i++) {
+        generation_free(&handler->generations[i]);
+    }
+    free(handler->generations);
+    handler->generations = NULL;
+    handler->num_generations = 0;
+}
+
+// Whether fragments are stored for epoch or any later epoch. Binary keys
+// sort by epoch so that's the first key from epoch on; text keys have to
+// be walked.
+static int has_fragments_from(tsdb_handler *handler, u_int32_t epoch,
+                              u_int8_t *found) {
+    tsdb_fragment_key start;
+    void *cursor, *key;
+    u_int32_t key_len, key_epoch, fragment;
+    int ret;
+
+    *found = 0;
+
+    if (handler->format == FORMAT_TEXT_KEYS) {
+        fragment_key_first(handler->format, &start);
+    } else {
+        fragment_key_epoch(handler->format, epoch, &start);
+    }
+
+    if (handler->backend->cursor_open(handler->db, start.data, start.len,
+                                      &cursor) != 0) {
+        trace_error("Error while creating cursor");
+        return -2;
+    }
+
+    while ((ret = handler->backend->cursor_next(cursor, &key, &key_len,
+                                                NULL, NULL)) == 0
+           && fragment_key_in_range(handler->format, key, key_len)) {
+        if (fragment_key_parse(handler->format, key, key_len,
+                               &key_epoch, &fragment) == 0
+            && key_epoch >= epoch) {
+            *found = 1;
+            break;
+        }
+    }
+
+    handler->backend->cursor_close(cursor);
+
+    return ret == -2 ? -2 : 0;
+}
+
+int tsdb_start_generation(tsdb_handler *handler, u_int32_t epoch) {
+    tsdb_generation *gens;
+    tsdb_cached_chunk *entry;
+    u_int8_t found;
+
+    if (!handler->alive || handler->read_only) {
+        return -1;
+    }
+
+    normalize_epoch(handler, &epoch);
+
+    // Epochs already written keep the slots they were written with
+    if ((handler->num_generations > 0
+         && epoch <= handler->generations[handler->num_generations - 1].start)
+        || epoch <= handler->chunk.epoch) {
+        return -1;
+    }
+    for (entry = handler->cache.head; entry; entry = entry->next) {
+        if (entry->chunk.epoch >= epoch) {
+            return -1;
+        }
+    }
+    if (has_fragments_from(handler, epoch, &found) != 0) {
+        return -2;
+    }
+    if (found) {
+        return -1;
+    }
+
+    gens = realloc(handler->generations,
+                   (handler->num_generations + 1) * sizeof(tsdb_generation));
+    if (!gens) {
+        return -2;
+    }
+    handler->generations = gens;
+    memset(&gens[handler->num_generations], 0, sizeof(tsdb_generation));
+    gens[handler->num_generations].start = epoch;
+    gens[handler->num_generations].loaded = 1;
+    handler->num_generations++;
+
+    // Slots logged from here on refer to it
+    put_generations(handler);
+    handler->backend->sync(handler->db);
+
+    trace_info("Generation %u starts at %u", handler->num_generations, epoch);
+
+    return 0;
+}
+
+static int prepare_offset_by_slot(tsdb_handler *handler, u_int32_t slot,
+                                  u_int64_t *offset, u_int8_t for_write) {
+    u_int32_t fragment;
+
+    if (!handler->chunk.data) {
+        if (!for_write) {
+            return -1;
+        }
+
+        u_int32_t mem_len = handler->values_len * CHUNK_GROWTH;
+        handler->chunk.data_len = mem_len;
+        handler->chunk.data = (u_int8_t*)malloc(mem_len);
+        if (handler->chunk.data == NULL) {
+            trace_error("Not enough memory (%u bytes)", mem_len);
+            handler->chunk.data_len = 0;
+            return -2;
+        }
+        memset(handler->chunk.data,
+               handler->unknown_value,
+               handler->chunk.data_len);
+        // New fragments are always written so the epoch has no holes
+        handler->chunk.fragment_changed[0] = 1;
+        handler->chunk.fragment_loaded[0] = 1;
+    }
+
+ get_offset:
+
+    if (slot >= (handler->chunk.data_len / handler->values_len)) {
+        if (!for_write || !handler->chunk.growable) {
+            return -1;
+        }
+
+        u_int32_t to_add = CHUNK_GROWTH * handler->values_len;
+        u_int32_t new_len = handler->chunk.data_len + to_add;
+
+        if (new_len / to_add > MAX_NUM_FRAGMENTS) {
+            trace_error("Unable to grow table past %u fragments",
+                        MAX_NUM_FRAGMENTS);
+            return -2;
+        }
+
+        u_int8_t *ptr = malloc(new_len);
+
+        if (!ptr) {
+            trace_error("Not enough memory (%u bytes): unable to grow "
+                        "table", new_len);
+            return -2;
+        }
+
+        memcpy(ptr, handler->chunk.data, handler->chunk.data_len);
+        memset(&ptr[handler->chunk.data_len],
+               handler->unknown_value, to_add);
+        free(handler->chunk.data);
+        handler->chunk.data = ptr;
+        fragment = handler->chunk.data_len / to_add;
+        handler->chunk.fragment_changed[fragment] = 1;
+        handler->chunk.fragment_loaded[fragment] = 1;
+        handler->chunk.data_len = new_len;
+
+        trace_warning("Epoch grown to %u", new_len);
+
+        goto get_offset;
+    }
+
+    fragment = slot / CHUNK_GROWTH;
+    if (!handler->chunk.fragment_loaded[fragment]) {
+        if (load_fragment(handler, fragment) != 0) {
+            return -2;
+        }
+    }
+
+    *offset = handler->values_len * slot;
+
+    if (*offset >= handler->chunk.data_len) {
+        trace_error("INTERNAL ERROR [Id: %u][Offset: %u/%u]",
+                    slot, *offset, handler->chunk.data_len);
+    }
+
+    return 0;
+}
+
+static int prepare_offset_by_index(tsdb_handler *handler, u_int32_t *index,
+                                   u_int64_t *offset, u_int8_t for_write) {
+    tsdb_generation *gen = find_generation(handler, handler->chunk.epoch);
+    u_int32_t slot;
+    int rc;
+
+    if ((rc = get_slot(handler, gen, *index, &slot, for_write)) != 0) {
+        return rc;
+    }
+
+    return prepare_offset_by_slot(handler, slot, offset, for_write);
+}
+
+static int prepare_offset_by_key(tsdb_handler *handler, char *key,
+                                 u_int32_t *index, u_int64_t *offset,
+                                 u_int8_t for_write) {
+    int rc;
+
+    if (!handler->chunk.epoch) {
+        return -1;
+    }
+
+    if ((rc = ensure_key_index(handler, key, index, for_write)) != 0) {
+        trace_info("Unable to find index %s", key);
+        return rc;
+    }
+
+    trace_info("%s mapped to idx %u", key, *index);
+
+    return prepare_offset_by_index(handler, index, offset, for_write);
+}
+
+static int set_value_at(tsdb_handler *handler, u_int64_t offset,
+                        tsdb_value *value) {
+    u_int32_t *chunk_ptr;
+
+    if (handler->wal.buf && !handler->wal_replaying) {
+        u_int32_t record[2];
+
+        record[0] = handler->chunk.epoch;
+        record[1] = offset / handler->values_len;
+        if (wal_append(&handler->wal, WAL_VALUE, record, sizeof(record),
+                       value, handler->values_len) != 0) {
+            trace_error("Unable to append to write-ahead log");
+            return -2;
+        }
+    }
+
+    chunk_ptr = (tsdb_value*)(&handler->chunk.data[offset]);
+    memcpy(chunk_ptr, value, handler->values_len);
+
+    // Mark a fragment as changed
+    int fragment = offset / (handler->values_len * CHUNK_GROWTH);
+    if (fragment >= MAX_NUM_FRAGMENTS) {
+        trace_error("Internal error [%u > %u]",
+                    fragment, MAX_NUM_FRAGMENTS);
+    } else {
+        handler->chunk.fragment_changed[fragment] = 1;
+    }
+
+    return 0;
+}
+
+int tsdb_set_with_index(tsdb_handler *handler, char *key,
+                        tsdb_value *value, u_int32_t *index) {
+    u_int64_t offset;
+    int rc;
+
+    if (!handler->alive) {
+        return -1;
+    }
+
+    if (!handler->chunk.epoch) {
+        trace_error("Missing epoch");
+        return -2;
+    }
+
+    rc = prepare_offset_by_key(handler, key, index, &offset, 1);
+    if (rc == 0) {
+        rc = set_value_at(handler, offset, value);
+    }
+
+    return rc;
+}
+
+int tsdb_set(tsdb_handler *handler, char *key, tsdb_value *value) {
+    u_int32_t index;
+    return tsdb_set_with_index(handler, key, value, &index);
+}
+
+typedef struct {
+    char *key;
+    u_int32_t pos;
+} batch_key;
+
+static int cmp_batch_keys(const void *a, const void *b) {
+    return strcmp(((batch_key*)a)->key, ((batch_key*)b)->key);
+}
+
+// Resolves the index of each key, allocating indexes for new keys in a
+// single block. New keys are written in key order.
+static int resolve_batch_indexes(tsdb_handler *handler, batch_key *sorted,
+                                 u_int32_t n, u_int32_t *indexes) {
+    u_int32_t i, new_keys = 0, mapped = 0;
+    int rc = 0;
+
+    for (i = 0; i < n; i++) {
+        u_int32_t pos = sorted[i].pos;
+
+        if (i > 0 && strcmp(sorted[i].key, sorted[i - 1].key) == 0) {
+            indexes[pos] = indexes[sorted[i - 1].pos];
+            continue;
+        }
+
+        rc = tsdb_get_key_index(handler, sorted[i].key, &indexes[pos]);
+        if (rc == -2) {
+            return -2;
+        }
+        if (rc == -1) {
+            indexes[pos] = handler->lowest_free_index + new_keys++;
+        }
+    }
+
+    if (new_keys == 0) {
+        return 0;
+    }
+
+    // New indexes follow key order, so the keys mapped before a failure
+    // hold the first of them
+    for (i = 0; i < n; i++) {
+        u_int32_t pos = sorted[i].pos;
+
+        if (indexes[pos] < handler->lowest_free_index
+            || (i > 0 && strcmp(sorted[i].key, sorted[i - 1].key) == 0)) {
+            continue;
+        }
+        if ((rc = set_key_index(handler, sorted[i].key, indexes[pos])) != 0) {
+            break;
+        }
+        mapped++;
+    }
+
+    if (mapped > 0) {
+        handler->lowest_free_index += mapped;
+        db_put(handler,
+               "lowest_free_index", strlen("lowest_free_index"),
+               &handler->lowest_free_index,
+               sizeof(handler->lowest_free_index));
+    }
+
+    trace_info("Allocated %u of %u indexes in batch", mapped, new_keys);
+
+    return rc;
+}
+
+int tsdb_set_batch(tsdb_handler *handler, char **keys, tsdb_value *values,
+                   u_int32_t n, u_int32_t *indexes) {
+    batch_key *sorted;
+    tsdb_generation *gen;
+    u_int64_t offset;
+    u_int32_t i, slot, max_slot = 0;
+    int rc;
+
+    if (!handler->alive || handler->read_only) {
+        return -1;
+    }
+
+    if (!handler->chunk.epoch) {
+        trace_error("Missing epoch");
+        return -2;
+    }
+
+    if (n == 0) {
+        return 0;
+    }
+
+    sorted = (batch_key*)malloc(n * sizeof(batch_key));
+    if (!sorted) {
+        trace_error("Not enough memory (%u bytes)", n * sizeof(batch_key));
+        return -2;
+    }
+
+    for (i = 0; i < n; i++) {
+        sorted[i].key = keys[i];
+        sorted[i].pos = i;
+    }
+    qsort(sorted, n, sizeof(batch_key), cmp_batch_keys);
+
+    rc = resolve_batch_indexes(handler, sorted, n, indexes);
+    free(sorted);
+    if (rc != 0) {
+        return rc;
+    }
+
+    // Size the chunk once for the highest slot
+    gen = find_generation(handler, handler->chunk.epoch);
+    for (i = 0; i < n; i++) {
+        if ((rc = get_slot(handler, gen, indexes[i], &slot, 1)) != 0) {
+            return rc;
+        }
+        if (slot > max_slot) {
+            max_slot = slot;
+        }
+    }
+    if ((rc = prepare_offset_by_slot(handler, max_slot, &offset, 1)) != 0) {
+        return rc;
+    }
+
+    for (i = 0; i < n; i++) {
+        rc = prepare_offset_by_index(handler, &indexes[i], &offset, 1);
+        if (rc != 0) {
+            return rc;
+        }
+        rc = set_value_at(handler, offset,
+                          &values[i * handler->values_per_entry]);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
+    return 0;
+}
+
+int tsdb_get_by_key(tsdb_handler *handler, char *key, tsdb_value **value) {
+    u_int32_t index;
+    u_int64_t offset;
+    int rc;
+
+    if (!handler->alive || !handler->chunk.data) {
+        return -1;
+    }
+
+    rc = prepare_offset_by_key(handler, key, &index, &offset, 0);
+    if (rc == 0) {
+        *value = (tsdb_value*)(handler->chunk.data + offset);
+    }
+
+    return rc ;
+}
+
+int tsdb_get_by_index(tsdb_handler *handler, u_int32_t *index,
+                      tsdb_value **value) {
+    u_int64_t offset;
+    int rc;
+
+    if (!handler->alive || !handler->chunk.data) {
+        return -1;
+    }
+
+    rc = prepare_offset_by_index(handler, index, &offset, 0);
+    if (rc == 0) {
+        *value = (tsdb_value*)(handler->chunk.data + offset);
+    }
+
+    return rc ;
+}
+
+void tsdb_flush(tsdb_handler *handler) {
+    if (!handler->alive || handler->read_only) {
+        return;
+    }
+    if (handler->wal.buf) {
+        tsdb_commit(handler);
+        return;
+    }
+    trace_info("Flushing database changes");
+    retire_chunk(handler);
+    write_cached_chunks(handler);
+    write_cached_tags(handler);
+    write_names(handler);
+    write_generations(handler);
+    write_keys(handler, 0);
+    handler->backend->sync(handler->db);
+}
+
+int tsdb_checkpoint(tsdb_handler *handler) {
+    int tags_rc;
+
+    if (!handler->alive || handler->read_only) {
+        return -1;
+    }
+
+    trace_info("Checkpoint");
+
+    write_chunk(handler, &handler->chunk);
+    write_cached_chunks(handler);
+    tags_rc = write_cached_tags(handler);
+    write_names(handler);
+    write_generations(handler);
+    write_keys(handler, 0);
+    handler->backend->sync(handler->db);
+
+    // The log still holds the changes to tags that weren't written
+    if (tags_rc != 0) {
+        return -2;
+    }
+
+    if (handler->wal.buf && wal_reset(&handler->wal) != 0) {
+        trace_error("Unable to reset write-ahead log");
+        return -1;
+    }
+
+    return 0;
+}
+
+int tsdb_commit(tsdb_handler *handler) {
+    if (!handler->alive || !handler->wal.buf) {
+        return -1;
+    }
+
+    if (wal_commit(&handler->wal) != 0) {
+        trace_error("Unable to commit write-ahead log");
+        return -1;
+    }
+
+    if (handler->wal.file_len > WAL_CHECKPOINT_SIZE) {
+        return tsdb_checkpoint(handler);
+    }
+
+    return 0;
+}
+
+// generation, index, slot
+static int replay_slot(tsdb_handler *handler, u_int8_t *data) {
+    tsdb_generation *gen;
+    u_int32_t record[3], slot;
+    int rc;
+
+    memcpy(record, data, sizeof(record));
+
+    if (record[0] == 0 || record[0] > handler->num_generations) {
+        trace_error("Unknown generation %u in write-ahead log", record[0]);
+        return -2;
+    }
+    gen = &handler->generations[record[0] - 1];
+
+    if ((rc = get_slot(handler, gen, record[1], &slot, 1)) != 0) {
+        return rc;
+    }
+    if (slot != record[2]) {
+        trace_error("Index %u has slot %u, logged as %u", record[1], slot,
+                    record[2]);
+        return -2;
+    }
+
+    return 0;
+}
+
+static int replay_wal_record(u_int8_t type, u_int8_t *data, u_int32_t len,
+                             void *context) {
+    tsdb_handler *handler = (tsdb_handler*)context;
+    u_int32_t record[2];
+    u_int64_t offset;
+    char *key;
+    int rc;
+
+    switch (type) {
+    case WAL_KEY:
+        if (len < sizeof(u_int32_t)) {
+            return -2;
+        }
+        memcpy(record, data, sizeof(u_int32_t));
+        if (!(key = strndup((char*)&data[sizeof(u_int32_t)],
+                            len - sizeof(u_int32_t)))) {
+            return -2;
+        }
+        rc = set_key_index(handler, key, record[0]);
+        free(key);
+        if (rc != 0) {
+            return rc;
+        }
+        if (record[0] >= handler->lowest_free_index) {
+            handler->lowest_free_index = record[0] + 1;
+            db_put(handler,
+                   "lowest_free_index", strlen("lowest_free_index"),
+                   &handler->lowest_free_index,
+                   sizeof(handler->lowest_free_index));
+        }
+        return 0;
+
+    case WAL_VALUE:
+        if (len != sizeof(record) + handler->values_len) {
+            return -2;
+        }
+        memcpy(record, data, sizeof(record));
+        // Logged as loaded, normalized
+        if ((rc = goto_epoch(handler, record[0], 0, 1)) != 0) {
+            return rc;
+        }
+        rc = prepare_offset_by_slot(handler, record[1], &offset, 1);
+        if (rc != 0) {
+            return rc;
+        }
+        return set_value_at(handler, offset,
+                            (tsdb_value*)&data[sizeof(record)]);
+
+    case WAL_SLOT:
+        if (len != sizeof(u_int32_t) * 3) {
+            return -2;
+        }
+        return replay_slot(handler, data);
+
+    case WAL_TAG:
+        // key\0tag
+        if (memchr(data, '\0', len) == NULL) {
+            return -2;
+        }
+        if (!(key = (char*)malloc(len + 1))) {
+            return -2;
+        }
+        memcpy(key, data, len);
+        key[len] = '\0';
+        tsdb_tag_key(handler, key, &key[strlen(key) + 1]);
+        free(key);
+        return 0;
+
+    default:
+        trace_error("Unknown write-ahead log record type %u", type);
+        return -2;
+    }
+}
+
+static int open_wal(tsdb_handler *handler) {
+    char path[PATH_MAX];
+    int count;
+
+    if (handler->read_only) {
+        trace_warning("Not replaying write-ahead log (read-only mode)");
+        return 0;
+    }
+
+    snprintf(path, sizeof(path), "%s.wal", handler->path);
+
+    if (wal_open(&handler->wal, path) != 0) {
+        trace_error("Unable to open write-ahead log %s", path);
+        return -1;
+    }
+
+    handler->wal_replaying = 1;
+    count = wal_replay(&handler->wal, replay_wal_record, handler);
+    handler->wal_replaying = 0;
+
+    if (count < 0) {
+        trace_error("Error replaying write-ahead log %s", path);
+        wal_close(&handler->wal);
+        return -1;
+    }
+
+    trace_info("Replayed %d write-ahead log records", count);
+
+    // New records would go after a torn or corrupt tail, where replay
+    // stops, so the log is reset whenever it isn't all replayed
+    if (count > 0 || handler->wal.replayed_len < handler->wal.file_len) {
+        return tsdb_checkpoint(handler);
+    }
+
+    return 0;
+}
+
+int tsdb_enable_wal(tsdb_handler *handler) {
+    if (!handler->alive || handler->read_only) {
+        return -1;
+    }
+
+    if (handler->wal.buf) {
+        return 0;
+    }
+
+    // Start from a consistent database
+    tsdb_checkpoint(handler);
+
+    handler->wal_enabled = 1;
+    db_put(handler, "wal", strlen("wal"),
+           &handler->wal_enabled, sizeof(handler->wal_enabled));
+    handler->backend->sync(handler->db);
+
+    return open_wal(handler);
+}
+
+static u_int32_t series_block(tsdb_handler *handler, u_int32_t epoch) {
+    return (epoch / handler->slot_duration) / SERIES_BLOCK_SLOTS;
+}
+
+static u_int32_t series_slot(tsdb_handler *handler, u_int32_t epoch) {
+    return (epoch / handler->slot_duration) % SERIES_BLOCK_SLOTS;
+}
+
+static void write_pending_chunks(tsdb_handler *handler) {
+    write_chunk(handler, &handler->chunk);
+    write_cached_chunks(handler);
+}
+
+static int transpose_block(tsdb_handler *handler, u_int32_t first_epoch) {
+    const tsdb_codec *codec = codec_find(CODEC_QLZ);
+    tsdb_series_block block;
+    u_int32_t fragment_size = handler->values_len * CHUNK_GROWTH;
+    u_int32_t group_len = handler->values_len * SERIES_GROUP_KEYS
+        * SERIES_BLOCK_SLOTS;
+    u_int32_t groups_per_fragment = CHUNK_GROWTH / SERIES_GROUP_KEYS;
+    u_int32_t max_fragments = 0, epoch, slot, fragment, group, i;
+    u_int8_t *fragment_data, *columns, *compressed, depth;
+    char str[32];
+    int rc = 0;
+
+    memset(&block, 0, sizeof(block));
+
+    for (slot = 0; slot < SERIES_BLOCK_SLOTS; slot++) {
+        epoch = first_epoch + slot * handler->slot_duration;
+        if (count_epoch_fragments(handler, epoch,
+                                  &block.num_fragments[slot]) != 0) {
+            return -2;
+        }
+        if (block.num_fragments[slot] > max_fragments) {
+            max_fragments = block.num_fragments[slot];
+        }
+    }
+
+    if (max_fragments == 0) {
+        return 0;
+    }
+
+    fragment_data = (u_int8_t*)malloc(fragment_size);
+    columns = (u_int8_t*)malloc(fragment_size * SERIES_BLOCK_SLOTS);
+    compressed = (u_int8_t*)malloc(codec->bound(group_len));
+    if (!fragment_data || !columns || !compressed
+        || codec_prepare(&handler->codec_state, codec, 1) != 0) {
+        trace_error("Not enough memory (%u bytes)",
+                    fragment_size * SERIES_BLOCK_SLOTS);
+        rc = -2;
+        goto out;
+    }
+
+    for (fragment = 0; fragment < max_fragments; fragment++) {
+        memset(columns, handler->unknown_value,
+               fragment_size * SERIES_BLOCK_SLOTS);
+
+        // Each key gets a column of consecutive slots
+        for (slot = 0; slot < SERIES_BLOCK_SLOTS; slot++) {
+            if (block.num_fragments[slot] <= fragment) {
+                continue;
+            }
+            epoch = first_epoch + slot * handler->slot_duration;
+            if (read_fragment(handler, epoch, fragment, fragment_data,
+                              &depth) != 0) {
+                memset(fragment_data, handler->unknown_value, fragment_size);
+            }
+            for (i = 0; i < CHUNK_GROWTH; i++) {
+                memcpy(&columns[(i * SERIES_BLOCK_SLOTS + slot)
+                                * handler->values_len],
+                       &fragment_data[i * handler->values_len],
+                       handler->values_len);
+            }
+        }
+
+        for (group = 0; group < groups_per_fragment; group++) {
+            u_int32_t compressed_len;
+
+            compressed_len = codec->compress(
+                handler->codec_state.compress[codec->id],
+                &columns[group * group_len], group_len, compressed);
+            snprintf(str, sizeof(str), "ser-%u-%u",
+                     series_block(handler, first_epoch),
+                     fragment * groups_per_fragment + group);
+            db_put(handler, str, strlen(str), compressed, compressed_len);
+        }
+    }
+
+    // The block record is written last -- it's what makes the groups valid
+    snprintf(str, sizeof(str), "ser-%u", series_block(handler, first_epoch));
+    db_put(handler, str, strlen(str), &block, sizeof(block));
+
+    trace_info("Transposed block %u [%u fragments]",
+               series_block(handler, first_epoch), max_fragments);
+
+ out:
+    free(fragment_data);
+    free(columns);
+    free(compressed);
+
+    return rc;
+}
+
+int tsdb_transpose(tsdb_handler *handler, u_int32_t start, u_int32_t end) {
+    u_int32_t epoch, block_duration;
+    int rc;
+
+    if (!handler->alive || handler->read_only) {
+        return -1;
+    }
+
+    normalize_epoch(handler, &start);
+    normalize_epoch(handler, &end);
+
+    write_pending_chunks(handler);
+
+    if (!handler->key_major) {
+        handler->key_major = 1;
+        db_put(handler, "key_major", strlen("key_major"),
+               &handler->key_major, sizeof(handler->key_major));
+    }
+
+    block_duration = handler->slot_duration * SERIES_BLOCK_SLOTS;
+    epoch = start - series_slot(handler, start) * handler->slot_duration;
+
+    for (; epoch <= end; epoch += block_duration) {
+        if ((rc = transpose_block(handler, epoch)) != 0) {
+            return rc;
+        }
+    }
+
+    return 0;
+}
+
+int tsdb_get_series(tsdb_handler *handler, u_int32_t index,
+                    u_int32_t start, u_int32_t end,
+                    tsdb_value *values, u_int8_t *present,
+                    u_int32_t slots_len, u_int32_t *count) {
+    const tsdb_codec *codec = codec_find(CODEC_QLZ);
+    tsdb_series_block block;
+    u_int32_t group_len = handler->values_len * SERIES_GROUP_KEYS
+        * SERIES_BLOCK_SLOTS;
+    u_int32_t cur_block = 0, cur_group = 0, value_len, epoch, slot, pos;
+    u_int8_t has_block = 0, has_group = 0, *group_data;
+    tsdb_value *out, *ptr;
+    void *value;
+    char str[32];
+    int rc;
+
+    *count = 0;
+
+    if (!handler->alive) {
+        return -1;
+    }
+
+    normalize_epoch(handler, &start);
+    normalize_epoch(handler, &end);
+
+    write_pending_chunks(handler);
+
+    group_data = (u_int8_t*)malloc(group_len);
+    if (!group_data || codec_prepare(&handler->codec_state, codec, 0) != 0) {
+        trace_error("Not enough memory (%u bytes)", group_len);
+        free(group_data);
+        return -2;
+    }
+
+    for (epoch = start; epoch <= end && *count < slots_len;
+         epoch += handler->slot_duration, (*count)++) {
+        out = &values[*count * handler->values_per_entry];
+        present[*count] = 0;
+
+        if (!has_block || series_block(handler, epoch) != cur_block) {
+            cur_block = series_block(handler, epoch);
+            snprintf(str, sizeof(str), "ser-%u", cur_block);
+            has_block = (db_get(handler, str, strlen(str),
+                                &value, &value_len) == 0
+                         && value_len == sizeof(block));
+            if (has_block) {
+                memcpy(&block, value, sizeof(block));
+            }
+            has_group = 0;
+        }
+
+        if (has_block) {
+            // Where the index was in the epoch's chunk
+            rc = get_slot(handler, find_generation(handler, epoch), index,
+                          &pos, 0);
+            if (rc == -2) {
+                free(group_data);
+                return -2;
+            }
+            slot = series_slot(handler, epoch);
+            if (rc == -1 || pos >= block.num_fragments[slot] * CHUNK_GROWTH) {
+                continue;
+            }
+
+            if (!has_group || pos / SERIES_GROUP_KEYS != cur_group) {
+                cur_group = pos / SERIES_GROUP_KEYS;
+                snprintf(str, sizeof(str), "ser-%u-%u", cur_block, cur_group);
+                if (db_get(handler, str, strlen(str),
+                           &value, &value_len) == -1
+                    || codec->check(value, value_len, group_len) != 0) {
+                    trace_error("Missing or invalid series group %s", str);
+                    free(group_data);
+                    return -2;
+                }
+                codec->decompress(handler->codec_state.decompress[codec->id],
+                                  value, group_len, group_data);
+                has_group = 1;
+            }
+
+            memcpy(out, &group_data[((pos % SERIES_GROUP_KEYS)
+                                     * SERIES_BLOCK_SLOTS + slot)
+                                    * handler->values_len],
+                   handler->values_len);
+            present[*count] = 1;
+            continue;
+        }
+
+        // Not transposed, read the epoch
+        if (goto_epoch(handler, epoch, 1, 0) == 0
+            && tsdb_get_by_index(handler, &index, &ptr) == 0) {
+            memcpy(out, ptr, handler->values_len);
+            present[*count] = 1;
+        }
+    }
+
+    free(group_data);
+
+    return 0;
+}
+
+// Where tsdb_compact continues from, saved in the "compact" record
+typedef struct {
+    u_int8_t codec;
+    tsdb_fragment_key key;      // The last fragment seen
+} compact_position;
+
+typedef struct {
+    char key[32];
+    u_int32_t epoch;
+    u_int32_t fragment;
+    u_int32_t value_len;
+    u_int8_t *value;
+} compact_entry;
+
+// Reads up to max_fragments fragment records after pos, keeping copies of
+// those for epochs before before. Returns the number read, or -2.
+static int read_compact_entries(tsdb_handler *handler, compact_position *pos,
+                                u_int32_t before, u_int32_t max_fragments,
+                                compact_entry *entries,
+                                u_int32_t *num_entries) {
+    void *cursor, *key, *value;
+    u_int32_t key_len, value_len, epoch, fragment, num_read = 0;
+    compact_entry *entry;
+    int parsed;
+
+    *num_entries = 0;
+
+    if (handler->backend->cursor_open(handler->db, pos->key.data,
+                                      pos->key.len, &cursor) != 0) {
+        return -2;
+    }
+
+    while (num_read < max_fragments
+           && handler->backend->cursor_next(cursor, &key, &key_len,
+                                            &value, &value_len) == 0) {
+        if (!fragment_key_in_range(handler->format, key, key_len)) {
+            break;
+        }
+        if (key_len > sizeof(pos->key.data)
+            || (key_len == pos->key.len
+                && memcmp(key, pos->key.data, key_len) == 0)) {
+            continue;
+        }
+        parsed = fragment_key_parse(handler->format, key, key_len,
+                                    &epoch, &fragment) == 0;
+
+        // Binary keys sort by epoch, so the walk is done (num_read is
+        // short of max_fragments)
+        if (parsed && epoch >= before
+            && handler->format == FORMAT_BINARY_KEYS) {
+            break;
+        }
+
+        num_read++;
+        memcpy(pos->key.data, key, key_len);
+        pos->key.len = key_len;
+
+        if (!parsed || epoch >= before) {
+            continue;
+        }
+
+        entry = &entries[(*num_entries)++];
+        snprintf(entry->key, sizeof(entry->key), "%u-%u", epoch, fragment);
+        entry->epoch = epoch;
+        entry->fragment = fragment;
+        entry->value_len = value_len;
+        if (!(entry->value = (u_int8_t*)malloc(value_len))) {
+            (*num_entries)--;
+            handler->backend->cursor_close(cursor);
+            return -2;
+        }
+        memcpy(entry->value, value, value_len);
+    }
+
+    handler->backend->cursor_close(cursor);
+
+    return num_read;
+}
+
+// Stores a fragment again with codec. The values stay as they were
+// transformed, so fragments stored against it are unaffected.
+static int recompress_fragment(tsdb_handler *handler, compact_entry *entry,
+                               const tsdb_codec *codec, u_int8_t *decoded,
+                               u_int8_t *encoded, tsdb_compact_stats *stats) {
+    u_int32_t fragment_size = handler->values_len * CHUNK_GROWTH, len;
+    tsdb_fragment_header header;
+    const tsdb_codec *stored;
+    int header_len;
+
+    // Blobs are shared, and stay as they are
+    if (fragment_read_header(entry->value, entry->value_len, &header) > 0
+        && header.codec == CODEC_BLOB) {
+        return 0;
+    }
+
+    if ((header_len = check_fragment(handler, entry->epoch,
+                                     entry->fragment, entry->value,
+                                     entry->value_len, &header)) < 0) {
+        return -2;
+    }
+
+    if (header.size != fragment_size) {
+        trace_warning("Skipping fragment %s [%u bytes]", entry->key,
+                      header.size);
+        return 0;
+    }
+
+    if (header_len > 0 && header.codec == codec->id) {
+        return 0;
+    }
+
+    stored = codec_find(header.codec);
+    if (codec_prepare(&handler->codec_state, stored, 0) != 0
+        || codec_prepare(&handler->codec_state, codec, 1) != 0) {
+        return -2;
+    }
+    stored->decompress(handler->codec_state.decompress[stored->id],
+                       &entry->value[header_len], header.size, decoded);
+
+    len = FRAGMENT_HEADER_LEN
+        + encode_payload(codec, handler->codec_state.compress[codec->id],
+                         decoded, fragment_size,
+                         &encoded[FRAGMENT_HEADER_LEN], &header);
+
+    // Already as good as it gets
+    if (header_len > 0 && header.codec == stored->id) {
+        return 0;
+    }
+
+    fragment_write_header(&header, encoded);
+    write_fragment(handler, entry->epoch, entry->fragment, encoded, len);
+
+    trace_info("Recompressed %s %u -> %u", entry->key, entry->value_len, len);
+
+    if (stats) {
+        stats->fragments++;
+        stats->bytes_before += entry->value_len;
+        stats->bytes_after += len;
+    }
+
+    return 0;
+}
+
+int tsdb_compact(tsdb_handler *handler, u_int8_t codec_id, u_int32_t before,
+                 u_int32_t max_fragments, tsdb_compact_stats *stats) {
+    u_int32_t fragment_size = handler->values_len * CHUNK_GROWTH;
+    const tsdb_codec *codec = codec_find(codec_id);
+    compact_entry *entries;
+    compact_position pos;
+    u_int32_t num_entries = 0, value_len, i;
+    u_int8_t *decoded, *encoded;
+    void *value;
+    int num_read, rc = 0;
+
+    if (handler->read_only || !codec || max_fragments == 0) {
+        return -1;
+    }
+
+    // Carry on from the last call unless that was for another codec
+    if (db_get(handler, "compact", strlen("compact"),
+               &value, &value_len) == 0
+        && value_len == sizeof(pos)
+        && ((compact_position*)value)->codec == codec_id) {
+        memcpy(&pos, value, sizeof(pos));
+    } else {
+        memset(&pos, 0, sizeof(pos));
+        pos.codec = codec_id;
+        fragment_key_first(handler->format, &pos.key);
+    }
+
+    entries = (compact_entry*)calloc(max_fragments, sizeof(compact_entry));
+    decoded = (u_int8_t*)malloc(fragment_size);
+    encoded = (u_int8_t*)malloc(FRAGMENT_HEADER_LEN
+                                + payload_bound(codec, fragment_size));
+    if (!entries || !decoded || !encoded) {
+        trace_error("Not enough memory to compact");
+        rc = -2;
+        goto out;
+    }
+
+    if ((num_read = read_compact_entries(handler, &pos, before,
+                                         max_fragments, entries,
+                                         &num_entries)) < 0) {
+        rc = -2;
+        goto out;
+    }
+
+    for (i = 0; i < num_entries && rc == 0; i++) {
+        rc = recompress_fragment(handler, &entries[i], codec, decoded,
+                                 encoded, stats);
+    }
+    if (rc != 0) {
+        goto out;
+    }
+
+    if (stats) {
+        stats->examined += num_read;
+    }
+
+    if ((u_int32_t)num_read < max_fragments) {
+        db_del(handler, "compact", strlen("compact"));
+    } else {
+        db_put(handler, "compact", strlen("compact"), &pos, sizeof(pos));
+        rc = 1;
+    }
+
+    handler->backend->sync(handler->db);
+
+ out:
+    for (i = 0; i < num_entries; i++) {
+        free(entries[i].value);
+    }
+    free(entries);
+    free(decoded);
+    free(encoded);
+
+    return rc;
+}
+
+// Tags written before compressed bitmaps were plain arrays of bits
+static int load_legacy_tag(tsdb_tag *tag, u_int32_t *words, u_int32_t len) {
+    u_int32_t i, x;
+
+    for (i = 0; i < len / sizeof(u_int32_t); i++) {
+        for (x = words[i]; x; x &= x - 1) {
+            if (roaring_add(&tag->bitmap,
+                            i * BITS_PER_WORD + __builtin_ctz(x))) {
+                roaring_free(&tag->bitmap);
+                return -2;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int load_tag(tsdb_handler *handler, char *name, tsdb_tag *tag) {
+    void *ptr;
+    u_int32_t len;
+    char str[255] = { 0 };
+    int rc;
+
+    snprintf(str, sizeof(str), "tag-%s", name);
+
+    if (db_get(handler, str, strlen(str), &ptr, &len) != 0) {
+        return -1;
+    }
+
+    rc = roaring_deserialize(&tag->bitmap, ptr, len);
+    if (rc == -1 && len % sizeof(u_int32_t) == 0) {
+        rc = load_legacy_tag(tag, ptr, len);
+    }
+    if (rc == -1) {
+        trace_error("Tag %s is corrupt", name);
+    }
+
+    return rc ? -2 : 0;
+}
+
+static int set_tag(tsdb_handler *handler, char *name, tsdb_tag *tag) {
+    char str[255];
+    u_int8_t *buf;
+    u_int32_t len;
+
+    if (roaring_optimize(&tag->bitmap)) {
+        return -2;
+    }
+
+    len = roaring_serialized_size(&tag->bitmap);
+    if (!(buf = malloc(len))) {
+        return -2;
+    }
+    roaring_serialize(&tag->bitmap, buf);
+
+    snprintf(str, sizeof(str), "tag-%s", name);
+
+    if (handler->read_only
+        || handler->backend->put(handler->db, str, strlen(str),
+                                 buf, len) != 0) {
+        free(buf);
+        return -2;
+    }
+    free(buf);
+
+    return 0;
+}
+
+static void unlink_cached_tag(tsdb_tag_cache *cache,
+                              tsdb_cached_tag *entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        cache->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        cache->tail = entry->prev;
+    }
+    entry->prev = entry->next = NULL;
+    cache->count--;
+}
+
+static void push_cached_tag(tsdb_tag_cache *cache, tsdb_cached_tag *entry) {
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head) {
+        cache->head->prev = entry;
+    } else {
+        cache->tail = entry;
+    }
+    cache->head = entry;
+    cache->count++;
+}
+
+static u_int32_t tag_hash(char *name) {
+    u_int32_t hash = 2166136261U;
+
+    for (; *name; name++) {
+        hash = (hash ^ (u_int8_t)*name) * 16777619U;
+    }
+
+    return hash;
+}
+
+static tsdb_cached_tag *find_cached_tag(tsdb_tag_cache *cache, char *name,
+                                        u_int32_t hash) {
+    tsdb_cached_tag *entry;
+
+    if (!cache->buckets) {
+        return NULL;
+    }
+
+    for (entry = cache->buckets[hash & (cache->num_buckets - 1)]; entry;
+         entry = entry->hash_next) {
+        if (entry->hash == hash && strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+// Doubles the buckets, moving the entries over
+static int grow_tag_buckets(tsdb_tag_cache *cache) {
+    u_int32_t num_buckets = cache->num_buckets
+        ? cache->num_buckets * 2 : TAG_CACHE_BUCKETS, i;
+    tsdb_cached_tag **buckets, **slot, *entry, *next;
+
+    if (!(buckets = calloc(num_buckets, sizeof(tsdb_cached_tag*)))) {
+        return -2;
+    }
+
+    for (i = 0; i < cache->num_buckets; i++) {
+        for (entry = cache->buckets[i]; entry; entry = next) {
+            next = entry->hash_next;
+            slot = &buckets[entry->hash & (num_buckets - 1)];
+            entry->hash_next = *slot;
+            *slot = entry;
+        }
+    }
+
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->num_buckets = num_buckets;
+
+    return 0;
+}
+
+static int hash_cached_tag(tsdb_tag_cache *cache, tsdb_cached_tag *entry) {
+    tsdb_cached_tag **slot;
+
+    if (cache->count >= cache->num_buckets && grow_tag_buckets(cache) != 0) {
+        return -2;
+    }
+
+    slot = &cache->buckets[entry->hash & (cache->num_buckets - 1)];
+    entry->hash_next = *slot;
+    *slot = entry;
+
+    return 0;
+}
+
+static void unhash_cached_tag(tsdb_tag_cache *cache, tsdb_cached_tag *entry) {
+    tsdb_cached_tag **slot;
+
+    slot = &cache->buckets[entry->hash & (cache->num_buckets - 1)];
+    while (*slot != entry) {
+        slot = &(*slot)->hash_next;
+    }
+    *slot = entry->hash_next;
+}
+
+static void free_cached_tag(tsdb_cached_tag *entry) {
+    roaring_free(&entry->tag.bitmap);
+    free(entry->name);
+    free(entry);
+}
+
+static int write_cached_tag(tsdb_handler *handler, tsdb_cached_tag *entry) {
+    if (!entry->dirty) {
+        return 0;
+    }
+    if (set_tag(handler, entry->name, &entry->tag) != 0) {
+        trace_error("Unable to write tag %s", entry->name);
+        return -2;
+    }
+    entry->dirty = 0;
+
+    return 0;
+}
+
+static int write_cached_tags(tsdb_handler *handler) {
+    tsdb_cached_tag *entry;
+    int rc = 0;
+
+    for (entry = handler->tag_cache.head; entry; entry = entry->next) {
+        if (write_cached_tag(handler, entry) != 0) {
+            rc = -2;
+        }
+    }
+
+    return rc;
+}
+
+// Evicts the least recently used tags down to max_count. A tag that can't
+// be written is kept, and stops the eviction.
+static int evict_cached_tags(tsdb_handler *handler, u_int32_t max_count) {
+    tsdb_tag_cache *cache = &handler->tag_cache;
+    tsdb_cached_tag *entry;
+
+    while (cache->tail && cache->count > max_count) {
+        entry = cache->tail;
+        if (write_cached_tag(handler, entry) != 0) {
+            return -2;
+        }
+        unlink_cached_tag(cache, entry);
+        unhash_cached_tag(cache, entry);
+        free_cached_tag(entry);
+        cache->evictions++;
+    }
+
+    return 0;
+}
+
+static void free_cached_tags(tsdb_handler *handler) {
+    tsdb_tag_cache *cache = &handler->tag_cache;
+    tsdb_cached_tag *entry;
+
+    if (evict_cached_tags(handler, 0) != 0) {
+        trace_error("Dropping %u cached tags", cache->count);
+        while ((entry = cache->tail)) {
+            unlink_cached_tag(cache, entry);
+            free_cached_tag(entry);
+        }
+    }
+
+    free(cache->buckets);
+    cache->buckets = NULL;
+    cache->num_buckets = 0;
+}
+
+void tsdb_set_tag_cache_size(tsdb_handler *handler, u_int32_t max_count) {
+    handler->tag_cache.max_count = max_count;
+    evict_cached_tags(handler, max_count);
+}
+
+// Finds a tag in the cache, loading it (or creating it, if create is set)
+// on a miss. Entries stay put until the next evict_cached_tags.
+static int get_cached_tag(tsdb_handler *handler, char *name, u_int8_t create,
+                          tsdb_cached_tag **found) {
+    tsdb_tag_cache *cache = &handler->tag_cache;
+    u_int32_t hash = tag_hash(name);
+    tsdb_cached_tag *entry;
+    int rc;
+
+    if ((entry = find_cached_tag(cache, name, hash))) {
+        unlink_cached_tag(cache, entry);
+        push_cached_tag(cache, entry);
+        cache->hits++;
+        *found = entry;
+        return 0;
+    }
+
+    cache->misses++;
+
+    if (!(entry = calloc(1, sizeof(tsdb_cached_tag)))) {
+        return -2;
+    }
+    if (!(entry->name = strdup(name))) {
+        free(entry);
+        return -2;
+    }
+    entry->hash = hash;
+
+    rc = load_tag(handler, name, &entry->tag);
+    if (rc == -1 && create) {
+        roaring_init(&entry->tag.bitmap);
+        rc = 0;
+    }
+    if (rc == 0 && hash_cached_tag(cache, entry) != 0) {
+        roaring_free(&entry->tag.bitmap);
+        rc = -2;
+    }
+    if (rc != 0) {
+        free(entry->name);
+        free(entry);
+        return rc;
+    }
+
+    push_cached_tag(cache, entry);
+    *found = entry;
+
+    return 0;
+}
+
+int tsdb_tag_key(tsdb_handler *handler, char *key, char *tag_name) {
+    u_int32_t index;
+
+    if (tsdb_get_key_index(handler, key, &index) != 0) {
+        return -1;
+    }
+
+    tsdb_cached_tag *entry;
+    if (get_cached_tag(handler, tag_name, 1, &entry)) {
+        return -1;
+    }
+
+    if (handler->wal.buf && !handler->wal_replaying
+        && wal_append(&handler->wal, WAL_TAG, key, strlen(key) + 1,
+                      tag_name, strlen(tag_name)) != 0) {
+        trace_error("Unable to append to write-ahead log");
+        return -2;
+    }
+
+    if (roaring_add(&entry->tag.bitmap, index)) {
+        evict_cached_tags(handler, handler->tag_cache.max_count);
+        return -1;
+    }
+    entry->dirty = 1;
+
+    return evict_cached_tags(handler, handler->tag_cache.max_count);
+}
+
+void scan_tag_indexes(tsdb_tag *tag, u_int32_t *indexes,
+                      u_int32_t max_index, u_int32_t *count) {
+    *count = roaring_scan(&tag->bitmap, max_index, indexes);
+}
+
+static u_int32_t max_tag_index(tsdb_handler *handler, u_int32_t max_len) {
+    if (handler->lowest_free_index < max_len) {
+        return handler->lowest_free_index - 1;
+    } else {
+        return max_len - 1;
+    }
+}
+
+int tsdb_get_tag_indexes(tsdb_handler *handler, char *tag_name,
+                         u_int32_t *indexes, u_int32_t indexes_len,
+                         u_int32_t *count) {
+    tsdb_cached_tag *entry;
+    u_int32_t max_index;
+
+    if (get_cached_tag(handler, tag_name, 0, &entry) != 0) {
+        return -1;
+    }
+
+    max_index = max_tag_index(handler, indexes_len);
+    scan_tag_indexes(&entry->tag, indexes, max_index, count);
+
+    return evict_cached_tags(handler, handler->tag_cache.max_count);
+}
+
+int tsdb_get_consolidated_tag_indexes(tsdb_handler *handler,
+                                      char **tag_names,
+                                      u_int16_t tag_names_len,
+                                      int consolidator,
+                                      u_int32_t *indexes,
+                                      u_int32_t indexes_len,
+                                      u_int32_t *count) {
+    u_int32_t i, max_index;
+    tsdb_cached_tag *entry;
+    tsdb_roaring *consolidated = NULL, combined, owned;
+    int owning = 0, rc = 0;
+
+    max_index = max_tag_index(handler, indexes_len);
+
+    *count = 0;
+
+    // Cached tags aren't evicted until the end, so they can be used as is
+    for (i = 0; i < tag_names_len; i++) {
+        if (get_cached_tag(handler, tag_names[i], 0, &entry) != 0) {
+            continue;
+        }
+        if (!consolidated || (consolidator != TSDB_AND
+                              && consolidator != TSDB_OR)) {
+            if (owning) {
+                roaring_free(&owned);
+                owning = 0;
+            }
+            consolidated = &entry->tag.bitmap;
+            continue;
+        }
+        if (roaring_combine(&combined, consolidated, &entry->tag.bitmap,
+                            consolidator == TSDB_AND
+                            ? BITMAP_AND : BITMAP_OR)) {
+            rc = -2;
+            break;
+        }
+        if (owning) {
+            roaring_free(&owned);
+        }
+        owned = combined;
+        consolidated = &owned;
+        owning = 1;
+    }
+
+    if (consolidated && rc == 0) {
+        *count = roaring_scan(consolidated, max_index, indexes);
+    }
+    if (owning) {
+        roaring_free(&owned);
+    }
+
+    if (evict_cached_tags(handler, handler->tag_cache.max_count) != 0) {
+        rc = -2;
+    }
+
+    return rc;
+}
+
+int tsdb_compile_query(char *expr, tsdb_query **query) {
+    int rc = query_parse(expr, query);
+
+    if (rc == -1) {
+        trace_error("Invalid tag query: %s", expr);
+    } else if (rc == -2) {
+        trace_error("Not enough memory to compile tag query");
+    }
+
+    return rc;
+}
+
+void tsdb_free_query(tsdb_query *query) {
+    query_free(query);
+}
+
+typedef struct {
+    tsdb_roaring universe;      // Every index, for NOT
+    u_int8_t universe_built;
+    u_int32_t num_indexes;
+} query_context;
+
+// An intermediate result: either owned, or a cached tag used in place
+typedef struct {
+    tsdb_roaring owned;
+    tsdb_roaring *bitmap;
+} query_value;
+
+static void init_value(query_value *value) {
+    roaring_init(&value->owned);
+    value->bitmap = &value->owned;
+}
+
+static void take_value(query_value *value, tsdb_roaring *result) {
+    roaring_free(&value->owned);
+    value->owned = *result;
+    value->bitmap = &value->owned;
+}
+
+static int compare_estimates(const void *a, const void *b) {
+    const tsdb_query *x = *(tsdb_query**)a, *y = *(tsdb_query**)b;
+
+    // Negated operands go last, where they're subtracted
+    if ((x->type == QUERY_NOT) != (y->type == QUERY_NOT)) {
+        return x->type == QUERY_NOT ? 1 : -1;
+    }
+    if (x->estimate != y->estimate) {
+        return x->estimate < y->estimate ? -1 : 1;
+    }
+    return 0;
+}
+
+// Loads the tags a query uses and orders each AND from its most selective
+// operand. Estimates are exact for tags and an upper bound otherwise.
+static int plan_query(tsdb_handler *handler, tsdb_query *node,
+                      query_context *context) {
+    tsdb_cached_tag *entry;
+    u_int64_t sum = 0;
+    u_int32_t i;
+    int rc;
+
+    for (i = 0; i < node->num_children; i++) {
+        if ((rc = plan_query(handler, node->children[i], context)) != 0) {
+            return rc;
+        }
+        sum += node->children[i]->estimate;
+    }
 
-    if (!handler->alive || !handler->chunk.data) {
-        return -1;
+    switch (node->type) {
+    case QUERY_TAG:
+        rc = get_cached_tag(handler, node->tag, 0, &entry);
+        if (rc == -2) {
+            return rc;
+        }
+        node->bitmap = rc == 0 ? &entry->tag.bitmap : NULL;
+        node->estimate = rc == 0 ? roaring_cardinality(node->bitmap) : 0;
+        break;
+    case QUERY_NOT:
+        node->estimate = context->num_indexes
+            - (node->children[0]->estimate < context->num_indexes
+               ? node->children[0]->estimate : context->num_indexes);
+        break;
+    case QUERY_AND:
+        qsort(node->children, node->num_children, sizeof(tsdb_query*),
+              compare_estimates);
+        node->estimate = node->children[0]->estimate;
+        break;
+    case QUERY_OR:
+        node->estimate = sum < context->num_indexes
+            ? sum : context->num_indexes;
+        break;
     }
 
-    rc = prepare_offset_by_key(handler, key, &offset, 0);
-    if (rc == 0) {
-        *value = (tsdb_value*)(handler->chunk.data + offset);
+    return 0;
+}
+
+static int get_universe(query_context *context, tsdb_roaring **universe) {
+    if (!context->universe_built) {
+        if (roaring_fill(&context->universe, context->num_indexes) != 0) {
+            return -2;
+        }
+        context->universe_built = 1;
     }
+    *universe = &context->universe;
 
-    return rc ;
+    return 0;
 }
 
-int tsdb_get_by_index(tsdb_handler *handler, u_int32_t *index,
-                      tsdb_value **value) {
-    u_int64_t offset;
+static int eval_query(tsdb_query *node, query_context *context,
+                      query_value *value);
+
+static int eval_group(tsdb_query *node, query_context *context,
+                      query_value *value) {
+    query_value operand;
+    tsdb_roaring result;
+    tsdb_query *child;
+    u_int32_t i = 0;
+    int op, rc = 0;
+
+    // An AND of nothing but negations starts from every index
+    if (node->type == QUERY_AND && node->children[0]->type == QUERY_NOT) {
+        if ((rc = get_universe(context, &value->bitmap)) != 0) {
+            return rc;
+        }
+    } else if ((rc = eval_query(node->children[i++], context, value)) != 0) {
+        return rc;
+    }
+
+    for (; i < node->num_children; i++) {
+        // Nothing more can match
+        if (node->type == QUERY_AND && value->bitmap->count == 0) {
+            break;
+        }
+
+        child = node->children[i];
+        op = node->type == QUERY_OR ? BITMAP_OR : BITMAP_AND;
+        if (node->type == QUERY_AND && child->type == QUERY_NOT) {
+            child = child->children[0];
+            op = BITMAP_ANDNOT;
+        }
+
+        init_value(&operand);
+        if ((rc = eval_query(child, context, &operand)) == 0) {
+            rc = roaring_combine(&result, value->bitmap, operand.bitmap, op);
+        }
+        roaring_free(&operand.owned);
+        if (rc != 0) {
+            return rc;
+        }
+        take_value(value, &result);
+    }
+
+    return 0;
+}
+
+static int eval_query(tsdb_query *node, query_context *context,
+                      query_value *value) {
+    query_value operand;
+    tsdb_roaring *universe, result;
     int rc;
 
-    if (!handler->alive || !handler->chunk.data) {
-        return -1;
+    switch (node->type) {
+    case QUERY_TAG:
+        if (node->bitmap) {
+            value->bitmap = node->bitmap;
+        }
+        return 0;
+    case QUERY_NOT:
+        if ((rc = get_universe(context, &universe)) != 0) {
+            return rc;
+        }
+        init_value(&operand);
+        if ((rc = eval_query(node->children[0], context, &operand)) == 0) {
+            rc = roaring_combine(&result, universe, operand.bitmap,
+                                 BITMAP_ANDNOT);
+        }
+        roaring_free(&operand.owned);
+        if (rc == 0) {
+            take_value(value, &result);
+        }
+        return rc;
+    default:
+        return eval_group(node, context, value);
     }
+}
 
-    rc = prepare_offset_by_index(handler, index, &offset, 0);
-    if (rc == 0) {
-        *value = (tsdb_value*)(handler->chunk.data + offset);
+// Evaluates a query into value, which the caller frees
+static int run_query(tsdb_handler *handler, tsdb_query *query,
+                     query_context *context, query_value *value) {
+    int rc;
+
+    memset(context, 0, sizeof(query_context));
+    context->num_indexes = handler->lowest_free_index;
+    init_value(value);
+
+    if ((rc = plan_query(handler, query, context)) == 0) {
+        rc = eval_query(query, context, value);
     }
 
-    return rc ;
+    return rc;
 }
 
-void tsdb_flush(tsdb_handler *handler) {
-    if (!handler->alive || handler->read_only) {
-        return;
+static void end_query(tsdb_handler *handler, query_context *context,
+                      query_value *value) {
+    roaring_free(&value->owned);
+    roaring_free(&context->universe);
+    evict_cached_tags(handler, handler->tag_cache.max_count);
+}
+
+int tsdb_get_query_indexes(tsdb_handler *handler, tsdb_query *query,
+                           u_int32_t *indexes, u_int32_t indexes_len,
+                           u_int32_t *count) {
+    query_context context;
+    query_value value;
+    int rc;
+
+    *count = 0;
+
+    if ((rc = run_query(handler, query, &context, &value)) == 0) {
+        *count = roaring_scan(value.bitmap,
+                              max_tag_index(handler, indexes_len), indexes);
     }
-    trace_info("Flushing database changes");
-    tsdb_flush_chunk(handler);
-    handler->db->sync(handler->db, 0);
+    end_query(handler, &context, &value);
+
+    return rc;
 }
 
-static int load_tag_array(tsdb_handler *handler, char *name,
-                          tsdb_tag *tag) {
-    void *ptr;
-    u_int32_t len;
-    char str[255] = { 0 };
+// A decoded fragment of an epoch, used in place if the epoch is in memory.
+// Returns -1 if the epoch doesn't have the fragment.
+static int scan_fragment(tsdb_handler *handler, u_int32_t epoch,
+                         u_int32_t fragment, u_int8_t *scratch,
+                         u_int8_t **data) {
+    u_int32_t fragment_size = handler->values_len * CHUNK_GROWTH;
+    tsdb_chunk *chunk = find_chunk(handler, epoch);
+    u_int8_t depth;
+    int rc;
 
-    snprintf(str, sizeof(str), "tag-%s", name);
+    if (chunk
+        && (u_int64_t)(fragment + 1) * fragment_size <= chunk->data_len
+        && chunk->fragment_loaded[fragment]) {
+        *data = &chunk->data[fragment * fragment_size];
+        return 0;
+    }
+
+    if ((rc = read_fragment(handler, epoch, fragment, scratch, &depth)) == 0) {
+        *data = scratch;
+    }
+
+    return rc;
+}
 
-    if (db_get(handler, str, strlen(str), &ptr, &len) == 0) {
-        u_int32_t *array;
-        array = (u_int32_t*)malloc(len);
-        if (array == NULL) {
-            free(ptr);
+typedef struct {
+    u_int32_t slot;
+    u_int32_t index;
+} scan_slot;
+
+static int compare_scan_slots(const void *a, const void *b) {
+    u_int32_t x = ((const scan_slot*)a)->slot;
+    u_int32_t y = ((const scan_slot*)b)->slot;
+
+    return x < y ? -1 : x > y;
+}
+
+// The slots of the indexes in the epochs of gen, in slot order
+static int get_scan_slots(tsdb_handler *handler, tsdb_generation *gen,
+                          u_int32_t *indexes, u_int32_t num_indexes,
+                          scan_slot *slots, u_int32_t *num_slots) {
+    u_int32_t i;
+    int rc;
+
+    *num_slots = 0;
+    for (i = 0; i < num_indexes; i++) {
+        rc = get_slot(handler, gen, indexes[i], &slots[*num_slots].slot, 0);
+        if (rc == -2) {
             return -2;
         }
-        memcpy(array, ptr, len);
-        tag->array = array;
-        tag->array_len = len;
-        return 0;
+        if (rc == 0) {
+            slots[(*num_slots)++].index = indexes[i];
+        }
     }
 
-    return -1;
+    if (gen) {
+        qsort(slots, *num_slots, sizeof(scan_slot), compare_scan_slots);
+    }
+
+    return 0;
 }
 
-static int allocate_tag_array(tsdb_tag *tag) {
-    u_int32_t array_len = CHUNK_GROWTH / sizeof(u_int32_t);
+int tsdb_scan_query(tsdb_handler *handler, tsdb_query *query,
+                    u_int32_t start, u_int32_t end,
+                    tsdb_scan_handler callback, void *context) {
+    u_int32_t fragment_size = handler->values_len * CHUNK_GROWTH;
+    u_int32_t *indexes = NULL, num_indexes = 0, i, j, k, epoch, fragment;
+    u_int32_t num_slots = 0;
+    u_int8_t *scratch = NULL, *data;
+    tsdb_generation *gen = NULL, *epoch_gen;
+    scan_slot *slots = NULL;
+    query_context query_context;
+    query_value value;
+    int rc;
 
-    u_int32_t* array = malloc(array_len);
-    if (!array) {
+    if (!handler->alive) {
         return -1;
     }
 
-    memset(array, 0, array_len);
+    normalize_epoch(handler, &start);
+    normalize_epoch(handler, &end);
+
+    // The matching indexes are the same for every epoch
+    if ((rc = run_query(handler, query, &query_context, &value)) == 0) {
+        num_indexes = roaring_cardinality(value.bitmap);
+        indexes = malloc((num_indexes ? num_indexes : 1)
+                         * sizeof(u_int32_t));
+        slots = malloc((num_indexes ? num_indexes : 1) * sizeof(scan_slot));
+        scratch = malloc(fragment_size);
+        if (indexes && slots && scratch) {
+            roaring_scan(value.bitmap, UINT_MAX, indexes);
+        } else {
+            trace_error("Not enough memory to scan %u indexes", num_indexes);
+            rc = -2;
+        }
+    }
+    end_query(handler, &query_context, &value);
+
+    for (epoch = start; rc == 0 && epoch <= end;
+         epoch += handler->slot_duration) {
+        // Indexes are placed by the generation of the epoch
+        epoch_gen = find_generation(handler, epoch);
+        if (epoch == start || epoch_gen != gen) {
+            gen = epoch_gen;
+            rc = get_scan_slots(handler, gen, indexes, num_indexes,
+                                slots, &num_slots);
+        }
+
+        for (i = 0; rc == 0 && i < num_slots; i = j) {
+            // Only fragments with a match are read
+            fragment = slots[i].slot / CHUNK_GROWTH;
+            for (j = i; j < num_slots
+                     && slots[j].slot / CHUNK_GROWTH == fragment; j++);
+
+            rc = scan_fragment(handler, epoch, fragment, scratch, &data);
+            if (rc == -1) {
+                rc = 0;
+                continue;
+            }
+            for (k = i; rc == 0 && k < j; k++) {
+                rc = callback(epoch, slots[k].index,
+                              (tsdb_value*)&data[(slots[k].slot % CHUNK_GROWTH)
+                                                 * handler->values_len],
+                              context);
+            }
+        }
+
+        // The next epoch would wrap past the end
+        if (epoch > end - handler->slot_duration) {
+            break;
+        }
+    }
+
+    free(indexes);
+    free(slots);
+    free(scratch);
+
+    return rc;
+}
+
+int tsdb_set_retention(tsdb_handler *handler, u_int32_t retention) {
+    if (!handler->alive || handler->read_only) {
+        return -1;
+    }
 
-    tag->array = array;
-    tag->array_len = array_len;
+    handler->retention = retention;
+    db_put(handler, "retention", strlen("retention"),
+           &handler->retention, sizeof(handler->retention));
+    handler->backend->sync(handler->db);
 
     return 0;
 }
 
-static void set_tag(tsdb_handler *handler, char *name, tsdb_tag *tag) {
-    char str[255];
+// Where tsdb_purge_before continues from, saved in the "purge" record
+typedef struct {
+    u_int32_t before;
+    tsdb_fragment_key key;      // The last fragment seen
+} purge_position;
 
-    snprintf(str, sizeof(str), "tag-%s", name);
+// Drops epochs before before from memory without writing them, and writes
+// the rest so what's stored is up to date
+static void drop_purged_chunks(tsdb_handler *handler, u_int32_t before) {
+    tsdb_cached_chunk *entry, *next;
+
+    if (handler->chunk.data && handler->chunk.epoch < before) {
+        free(handler->chunk.data);
+        memset(&handler->chunk, 0, sizeof(handler->chunk));
+    }
+
+    for (entry = handler->cache.head; entry; entry = next) {
+        next = entry->next;
+        if (entry->chunk.epoch < before) {
+            unlink_cached_chunk(&handler->cache, entry);
+            free(entry->chunk.data);
+            free(entry);
+        }
+    }
+
+    if (handler->reference.data && handler->reference.epoch < before) {
+        free(handler->reference.data);
+        memset(&handler->reference, 0, sizeof(handler->reference));
+    }
 
-    db_put(handler, str, strlen(str), tag->array, tag->array_len);
+    // Identical fragments would otherwise point purged epochs at blobs
+    free(handler->written);
+    handler->written = NULL;
+
+    // Logged values of purged epochs mustn't be replayed
+    if (handler->wal.buf) {
+        tsdb_checkpoint(handler);
+    } else {
+        write_pending_chunks(handler);
+    }
 }
 
-static int ensure_tag_array(tsdb_handler *handler, char *name, tsdb_tag *tag) {
-    if (load_tag_array(handler, name, tag) == 0) {
+// Stores the fragments of the first epoch kept without a reference to
+// the epoch before it
+static int rebase_first_epoch(tsdb_handler *handler, u_int32_t before,
+                              tsdb_purge_stats *stats) {
+    u_int32_t first = before, num_fragments, fragment;
+    u_int8_t *decoded;
+
+    if (first % handler->slot_duration) {
+        first += handler->slot_duration - first % handler->slot_duration;
+    }
+    if (first < handler->slot_duration) {
         return 0;
     }
 
-    if (allocate_tag_array(tag) == 0) {
-        return 0;
+    if (count_epoch_fragments(handler, first, &num_fragments) != 0) {
+        return -2;
     }
 
-    return -1;
+    for (fragment = 0; fragment < num_fragments; fragment++) {
+        decoded = decode_next_fragment(handler,
+                                       first - handler->slot_duration,
+                                       fragment);
+        if (decoded) {
+            rebase_next_fragment(handler, first - handler->slot_duration,
+                                 fragment, decoded);
+            free(decoded);
+            if (stats) {
+                stats->rebased++;
+            }
+        }
+    }
+
+    return 0;
 }
 
-int tsdb_tag_key(tsdb_handler *handler, char *key, char *tag_name) {
-    u_int32_t index;
+// Deletes up to max_fragments fragment records after pos that belong to
+// epochs before before. Returns the number of records walked, or -2.
+static int delete_purged_fragments(tsdb_handler *handler,
+                                   purge_position *pos,
+                                   u_int32_t max_fragments,
+                                   tsdb_purge_stats *stats) {
+    void *cursor, *key;
+    u_int32_t key_len, epoch, fragment, num_read = 0;
+    int parsed, rc = 0;
+
+    if (handler->backend->cursor_open(handler->db, pos->key.data,
+                                      pos->key.len, &cursor) != 0) {
+        return -2;
+    }
 
-    if (tsdb_get_key_index(handler, key, &index) == -1) {
-        return -1;
+    while (num_read < max_fragments
+           && handler->backend->cursor_next(cursor, &key, &key_len,
+                                            NULL, NULL) == 0) {
+        if (!fragment_key_in_range(handler->format, key, key_len)) {
+            break;
+        }
+        if (key_len > sizeof(pos->key.data)
+            || (key_len == pos->key.len
+                && memcmp(key, pos->key.data, key_len) == 0)) {
+            continue;
+        }
+        parsed = fragment_key_parse(handler->format, key, key_len,
+                                    &epoch, &fragment) == 0;
+
+        // Binary keys sort by epoch: the rest are all kept
+        if (parsed && epoch >= pos->before
+            && handler->format == FORMAT_BINARY_KEYS) {
+            break;
+        }
+
+        num_read++;
+        memcpy(pos->key.data, key, key_len);
+        pos->key.len = key_len;
+
+        if (!parsed || epoch >= pos->before) {
+            continue;
+        }
+
+        if (handler->backend->cursor_del(cursor) != 0) {
+            rc = -2;
+            break;
+        }
+        if (stats) {
+            stats->fragments++;
+        }
     }
 
-    tsdb_tag tag;
-    if (ensure_tag_array(handler, tag_name, &tag)) {
-        return -1;
+    handler->backend->cursor_close(cursor);
+
+    return rc == 0 ? (int)num_read : rc;
+}
+
+// Deletes transposed blocks that start before before. A block that's only
+// partly purged is read from its epochs until it's transposed again.
+static int delete_purged_series(tsdb_handler *handler, u_int32_t before) {
+    void *cursor, *key;
+    u_int32_t key_len, block;
+    char str[32];
+    int ret;
+
+    if (handler->backend->cursor_open(handler->db, "ser-", strlen("ser-"),
+                                      &cursor) != 0) {
+        return -2;
     }
 
-    set_bit(tag.array, index);
-    set_tag(handler, tag_name, &tag);
+    while ((ret = handler->backend->cursor_next(cursor, &key, &key_len,
+                                                NULL, NULL)) == 0
+           && key_len > strlen("ser-")
+           && memcmp(key, "ser-", strlen("ser-")) == 0) {
+        if (key_len >= sizeof(str)) {
+            continue;
+        }
+        memcpy(str, key, key_len);
+        str[key_len] = '\0';
 
-    free(tag.array);
+        if (sscanf(str, "ser-%u", &block) != 1
+            || (u_int64_t)block * SERIES_BLOCK_SLOTS
+               * handler->slot_duration >= before) {
+            continue;
+        }
 
-    return 0;
+        if (handler->backend->cursor_del(cursor) != 0) {
+            ret = -2;
+            break;
+        }
+    }
+
+    handler->backend->cursor_close(cursor);
+
+    return ret == -2 ? -2 : 0;
 }
 
-void scan_tag_indexes(tsdb_tag *tag, u_int32_t *indexes,
-                      u_int32_t max_index, u_int32_t *count) {
-    u_int32_t i, j, index;
-    u_int32_t max_word = max_index / BITS_PER_WORD;
+// Adds the blobs that fragments stored in format point to to marked
+static int mark_blobs(tsdb_handler *handler, u_int32_t format,
+                      tsdb_keymap *marked) {
+    tsdb_fragment_header header;
+    tsdb_fragment_key first;
+    void *cursor, *key, *value;
+    u_int32_t key_len, value_len;
+    u_int64_t hash;
+    char str[32];
+    int ret;
 
-    *count = 0;
+    fragment_key_first(format, &first);
+    if (handler->backend->cursor_open(handler->db, first.data, first.len,
+                                      &cursor) != 0) {
+        return -2;
+    }
 
-    for (i = 0; i <= max_word; i++) {
-        if (tag->array[i] == 0) {
+    while ((ret = handler->backend->cursor_next(cursor, &key, &key_len,
+                                                &value, &value_len)) == 0
+           && fragment_key_in_range(format, key, key_len)) {
+        if (value_len != FRAGMENT_HEADER_LEN + sizeof(hash)
+            || fragment_read_header(value, value_len, &header) <= 0
+            || header.codec != CODEC_BLOB) {
             continue;
         }
-        for (j = 0; j < BITS_PER_WORD; j++) {
-            index = i * BITS_PER_WORD + j;
-            if (index > max_index) {
-                break;
-            }
-            if (get_bit(tag->array, index)) {
-                indexes[(*count)++] = index;
-            }
+        memcpy(&hash, (u_int8_t*)value + FRAGMENT_HEADER_LEN, sizeof(hash));
+        blob_key(str, sizeof(str), hash);
+        if (keymap_put(marked, str, strlen(str), 0) != 0) {
+            trace_error("Not enough memory to mark blobs");
+            ret = -2;
+            break;
         }
     }
+
+    handler->backend->cursor_close(cursor);
+
+    return ret == -2 ? -2 : 0;
 }
 
-static u_int32_t max_tag_index(tsdb_handler *handler, u_int32_t max_len) {
-    if (handler->lowest_free_index < max_len) {
-        return handler->lowest_free_index - 1;
+// Deletes the blobs that no fragment points to any more. Fragments of an
+// interrupted migration may be stored in either format, so both are
+// marked.
+static int sweep_blobs(tsdb_handler *handler, tsdb_purge_stats *stats) {
+    tsdb_keymap marked;
+    void *cursor, *key;
+    u_int32_t key_len, index;
+    int ret;
+
+    if (keymap_init(&marked, 0) != 0) {
+        trace_error("Not enough memory to sweep blobs");
+        return -2;
+    }
+
+    if (mark_blobs(handler, FORMAT_TEXT_KEYS, &marked) != 0
+        || mark_blobs(handler, FORMAT_BINARY_KEYS, &marked) != 0
+        || handler->backend->cursor_open(handler->db, "blob-", 5,
+                                         &cursor) != 0) {
+        keymap_free(&marked);
+        return -2;
+    }
+
+    while ((ret = handler->backend->cursor_next(cursor, &key, &key_len,
+                                                NULL, NULL)) == 0
+           && key_len >= 5
+           && memcmp(key, "blob-", 5) == 0) {
+        if (keymap_get(&marked, key, key_len, &index) == 0) {
+            continue;
+        }
+        if (handler->backend->cursor_del(cursor) != 0) {
+            ret = -2;
+            break;
+        }
+        if (stats) {
+            stats->blobs++;
+        }
+    }
+
+    handler->backend->cursor_close(cursor);
+    keymap_free(&marked);
+
+    // Loaded again when it's next needed
+    free_blobs(handler);
+
+    return ret == -2 ? -2 : 0;
+}
+
+int tsdb_purge_before(tsdb_handler *handler, u_int32_t before,
+                      u_int32_t max_fragments, tsdb_purge_stats *stats) {
+    purge_position pos;
+    u_int32_t value_len;
+    void *value;
+    int num_read;
+
+    if (!handler->alive || handler->read_only || max_fragments == 0) {
+        return -1;
+    }
+
+    // Carry on from the last call unless that was for another epoch
+    if (db_get(handler, "purge", strlen("purge"), &value, &value_len) == 0
+        && value_len == sizeof(pos)
+        && ((purge_position*)value)->before == before) {
+        memcpy(&pos, value, sizeof(pos));
     } else {
-        return max_len - 1;
+        memset(&pos, 0, sizeof(pos));
+        pos.before = before;
+        fragment_key_first(handler->format, &pos.key);
+
+        trace_info("Purging epochs before %u", before);
+
+        handler->purging = before;
+        drop_purged_chunks(handler, before);
+        if (rebase_first_epoch(handler, before, stats) != 0) {
+            return -2;
+        }
+    }
+
+    if ((num_read = delete_purged_fragments(handler, &pos, max_fragments,
+                                            stats)) < 0) {
+        return -2;
+    }
+
+    if (stats) {
+        stats->examined += num_read;
     }
+
+    if ((u_int32_t)num_read == max_fragments) {
+        db_put(handler, "purge", strlen("purge"), &pos, sizeof(pos));
+        handler->backend->sync(handler->db);
+        return 1;
+    }
+
+    if (delete_purged_series(handler, before) != 0
+        || sweep_blobs(handler, stats) != 0) {
+        return -2;
+    }
+
+    db_del(handler, "purge", strlen("purge"));
+    handler->purging = 0;
+
+    if (handler->backend->compact(handler->db) != 0) {
+        trace_warning("Unable to give back space after purging");
+    }
+    handler->backend->sync(handler->db);
+
+    return 0;
 }
 
-int tsdb_get_tag_indexes(tsdb_handler *handler, char *tag_name,
-                         u_int32_t *indexes, u_int32_t indexes_len,
-                         u_int32_t *count) {
-    tsdb_tag tag;
-    if (load_tag_array(handler, tag_name, &tag) == 0) {
-        u_int32_t max_index = max_tag_index(handler, indexes_len);
-        scan_tag_indexes(&tag, indexes, max_index, count);
-        free(tag.array);
+int tsdb_purge(tsdb_handler *handler, u_int32_t now,
+               u_int32_t max_fragments, tsdb_purge_stats *stats) {
+    u_int32_t before = 0;
+
+    if (!handler->retention) {
         return 0;
     }
 
-    return -1;
+    // On a slot boundary, so every call in a slot continues the same purge
+    if (now > handler->retention) {
+        before = now - handler->retention;
+        normalize_epoch(handler, &before);
+    }
+
+    return tsdb_purge_before(handler, before, max_fragments, stats);
 }
 
-int tsdb_get_consolidated_tag_indexes(tsdb_handler *handler,
-                                      char **tag_names,
-                                      u_int16_t tag_names_len,
-                                      int consolidator,
-                                      u_int32_t *indexes,
-                                      u_int32_t indexes_len,
-                                      u_int32_t *count) {
-    u_int32_t i, j, max_index;
-    tsdb_tag consolidated, current;
+#define MIGRATE_BATCH_FRAGMENTS 1024
 
-    consolidated.array = NULL;
-    consolidated.array_len = 0;
-    max_index = max_tag_index(handler, indexes_len);
+int tsdb_migrate(tsdb_handler *handler, u_int32_t *migrated) {
+    compact_position pos;
+    compact_entry *entries;
+    tsdb_fragment_key key;
+    u_int32_t num_entries = 0, i;
+    int num_read, rc = 0;
 
-    *count = 0;
+    if (!handler->alive || handler->read_only) {
+        return -1;
+    }
 
-    for (i = 0; i < tag_names_len; i++) {
-        if (load_tag_array(handler, tag_names[i], &current) == 0) {
-            if (consolidated.array) {
-                for (j = 0; j < max_index; j++) {
-                    switch (consolidator) {
-                    case TSDB_AND:
-                        consolidated.array[j] &= current.array[j];
-                        break;
-                    case TSDB_OR:
-                        consolidated.array[j] |= current.array[j];
-                        break;
-                    default:
-                        consolidated.array[j] = current.array[j];
-                    }
-                }
-            } else {
-                consolidated.array = current.array;
-                consolidated.array_len = current.array_len;
+    if (handler->format == FORMAT_CURRENT) {
+        return 0;
+    }
+
+    entries = (compact_entry*)calloc(MIGRATE_BATCH_FRAGMENTS,
+                                     sizeof(compact_entry));
+    if (!entries) {
+        trace_error("Not enough memory to migrate");
+        return -2;
+    }
+
+    memset(&pos, 0, sizeof(pos));
+    fragment_key_first(FORMAT_TEXT_KEYS, &pos.key);
+
+    // A batch at a time, so the cursor isn't open while keys change
+    do {
+        if ((num_read = read_compact_entries(handler, &pos, UINT_MAX,
+                                             MIGRATE_BATCH_FRAGMENTS,
+                                             entries, &num_entries)) < 0) {
+            for (i = 0; i < num_entries; i++) {
+                free(entries[i].value);
             }
+            rc = -2;
+            break;
         }
-    }
 
-    if (consolidated.array) {
-        scan_tag_indexes(&consolidated, indexes, max_index, count);
-        free(consolidated.array);
+        for (i = 0; i < num_entries; i++) {
+            fragment_key(FORMAT_BINARY_KEYS, entries[i].epoch,
+                         entries[i].fragment, &key);
+            db_put(handler, key.data, key.len, entries[i].value,
+                   entries[i].value_len);
+            fragment_key(FORMAT_TEXT_KEYS, entries[i].epoch,
+                         entries[i].fragment, &key);
+            db_del(handler, key.data, key.len);
+            free(entries[i].value);
+        }
+
+        if (migrated) {
+            *migrated += num_entries;
+        }
+    } while (num_read == MIGRATE_BATCH_FRAGMENTS);
+
+    free(entries);
+
+    if (rc != 0) {
+        return rc;
     }
 
+    // Saved positions are text keys
+    db_del(handler, "compact", strlen("compact"));
+    db_del(handler, "purge", strlen("purge"));
+
+    handler->format = FORMAT_BINARY_KEYS;
+    db_put(handler, "format", strlen("format"),
+           &handler->format, sizeof(handler->format));
+    handler->backend->sync(handler->db);
+
+    trace_info("Migrated to format %u", handler->format);
+
     return 0;
 }
@@ -22,44 +22,159 @@
 #include <limits.h>
 #include <stdarg.h>
 #include <sys/stat.h>
-#include <db.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <errno.h>
 
 #include "tsdb_trace.h"
+#include "tsdb_backend.h"
+#include "tsdb_segment.h"
+#include "tsdb_keymap.h"
+#include "tsdb_keydict.h"
+#include "tsdb_names.h"
+#include "tsdb_generation.h"
+#include "tsdb_format.h"
+#include "tsdb_wal.h"
+#include "tsdb_pool.h"
+#include "tsdb_codec.h"
+#include "tsdb_roaring.h"
+#include "tsdb_query.h"
 #include "quicklz.h"
 
 #define CHUNK_GROWTH 10000
 #define CHUNK_LEN_PADDING 400
 #define MAX_NUM_FRAGMENTS 16384
 
+// A commit checkpoints the database when the log grows past this size
+#define WAL_CHECKPOINT_SIZE (64 * 1024 * 1024)
+
+// Key-major layout: values for SERIES_GROUP_KEYS consecutive indexes over
+// SERIES_BLOCK_SLOTS consecutive epochs are stored together.
+#define SERIES_BLOCK_SLOTS 64
+#define SERIES_GROUP_KEYS  250
+
+// Upper bound on worker threads for fragment compression
+#define MAX_NUM_THREADS 64
+
+// Tags kept decoded in memory by default
+#define TAG_CACHE_SIZE 64
+
+// Initial hash buckets of the tag cache, doubled as it grows
+#define TAG_CACHE_BUCKETS 64
+
+// New keys merged into the key dictionary at once, at least
+#define KEYDICT_MERGE_KEYS 4096
+
 typedef struct {
     u_int8_t *data;
     u_int32_t data_len;
     u_int32_t epoch;
     u_int8_t growable;
+    u_int8_t transformed;   // Some fragments are stored against another epoch
     u_int8_t fragment_changed[MAX_NUM_FRAGMENTS];
-    u_int32_t base_index;
+    u_int8_t fragment_loaded[MAX_NUM_FRAGMENTS];
+    u_int8_t fragment_depth[MAX_NUM_FRAGMENTS];
 } tsdb_chunk;
 
+typedef struct tsdb_cached_chunk {
+    tsdb_chunk chunk;
+    struct tsdb_cached_chunk *prev;
+    struct tsdb_cached_chunk *next;
+} tsdb_cached_chunk;
+
+// LRU cache of decompressed epochs. The head is the most recently used
+// chunk. A max_size of 0 disables caching.
+typedef struct {
+    tsdb_cached_chunk *head;
+    tsdb_cached_chunk *tail;
+    u_int64_t size;
+    u_int64_t max_size;
+    u_int32_t hits;
+    u_int32_t misses;
+    u_int32_t evictions;
+} tsdb_chunk_cache;
+
 typedef struct {
-    u_int32_t *array;
-    u_int32_t array_len;
+    tsdb_roaring bitmap;
 } tsdb_tag;
 
+typedef struct tsdb_cached_tag {
+    char *name;
+    u_int32_t hash;
+    tsdb_tag tag;
+    u_int8_t dirty;         // Changed since it was last written
+    struct tsdb_cached_tag *prev;
+    struct tsdb_cached_tag *next;
+    struct tsdb_cached_tag *hash_next;
+} tsdb_cached_tag;
+
+// LRU cache of decoded tags, most recently used at the head, and hashed by
+// name. Changed tags are written when they're evicted, flushed, or when
+// the database is closed; a tag that can't be written stays cached. A
+// max_count of 0 writes each change straight away.
+typedef struct {
+    tsdb_cached_tag *head;
+    tsdb_cached_tag *tail;
+    tsdb_cached_tag **buckets;
+    u_int32_t num_buckets;  // A power of 2
+    u_int32_t count;
+    u_int32_t max_count;
+    u_int32_t hits;
+    u_int32_t misses;
+    u_int32_t evictions;
+} tsdb_tag_cache;
+
+typedef struct {
+    u_int32_t epoch;
+    u_int64_t hash;
+} tsdb_fragment_hash;
+
 typedef u_int32_t tsdb_value;
 
+typedef struct {
+    u_int32_t num_fragments[SERIES_BLOCK_SLOTS];
+} tsdb_series_block;
+
 typedef struct {
     u_int8_t alive;
     u_int8_t read_only;
+    u_int8_t load_on_demand;
+    u_int8_t key_major;
+    u_int8_t keymap_loaded;
+    u_int8_t blobs_loaded;
+    u_int8_t wal_enabled;
+    u_int8_t wal_replaying;
+    u_int8_t encoding;
+    u_int8_t codec;
     u_int16_t values_per_entry;
     u_int16_t values_len;
     u_int32_t unknown_value;
     u_int32_t lowest_free_index;
     u_int32_t slot_duration;
-    qlz_state_compress state_compress;
-    qlz_state_decompress state_decompress;
+    u_int32_t format;       // FORMAT_TEXT_KEYS, FORMAT_BINARY_KEYS
+    u_int32_t retention;    // Seconds of data tsdb_purge keeps, 0 for all
+    u_int32_t purging;      // Epochs before this are being deleted
+    tsdb_codec_state codec_state;
     tsdb_chunk chunk;
-    DB *db;
+    tsdb_chunk reference;   // Last epoch written, for transformed fragments
+    tsdb_fragment_hash *written;    // Last version written of each fragment
+    tsdb_chunk_cache cache;
+    tsdb_tag_cache tag_cache;
+    tsdb_keymap keymap;     // Keys added since the dictionary was written
+    tsdb_keymap blobs;      // Keys of the stored blobs
+    tsdb_keydict keydict;
+    tsdb_names names;
+    tsdb_generation *generations;   // After the first, in epoch order
+    u_int32_t num_generations;
+    tsdb_wal wal;
+    u_int32_t num_threads;
+    tsdb_pool pool;
+    tsdb_codec_state *worker_codec;
+    char *path;
+    const tsdb_backend *backend;
+    void *db;
 } tsdb_handler;
 
 extern int  tsdb_open(char *tsdb_path, tsdb_handler *handler,
@@ -67,8 +182,28 @@ extern int  tsdb_open(char *tsdb_path, tsdb_handler *handler,
 		      u_int32_t slot_duration,
 		      u_int8_t read_only);
 
+extern int tsdb_open_backend(char *tsdb_path, tsdb_handler *handler,
+                             u_int16_t *values_per_entry,
+                             u_int32_t slot_duration,
+                             u_int8_t read_only,
+                             const tsdb_backend *backend);
+
 extern void tsdb_close(tsdb_handler *handler);
 
+extern void tsdb_set_cache_size(tsdb_handler *handler, u_int64_t max_size);
+
+extern void tsdb_set_tag_cache_size(tsdb_handler *handler,
+                                    u_int32_t max_count);
+
+extern int tsdb_set_encoding(tsdb_handler *handler, u_int8_t encoding);
+
+extern int tsdb_set_codec(tsdb_handler *handler, u_int8_t codec);
+
+extern void tsdb_set_threads(tsdb_handler *handler, u_int32_t num_threads);
+
+extern void tsdb_set_load_on_demand(tsdb_handler *handler,
+                                    u_int8_t load_on_demand);
+
 extern void normalize_epoch(tsdb_handler *handler, u_int32_t *epoch);
 
 extern int tsdb_goto_epoch(tsdb_handler *handler,
@@ -81,6 +216,12 @@ extern int tsdb_set(tsdb_handler *handler, char *key, tsdb_value *value);
 extern int tsdb_set_with_index(tsdb_handler *handler, char *key,
                                tsdb_value *value, u_int32_t *index);
 
+extern int tsdb_set_batch(tsdb_handler *handler,
+                          char **keys,
+                          tsdb_value *values,
+                          u_int32_t n,
+                          u_int32_t *indexes);
+
 extern int tsdb_get_by_key(tsdb_handler *handler,
                            char *key,
                            tsdb_value **value);
@@ -89,12 +230,106 @@ extern int tsdb_get_key_index(tsdb_handler *handler,
                               char *key,
                               u_int32_t *index);
 
+// Starts a new generation of key slots at epoch, which must be after every
+// epoch written so far. Epochs from there on only hold the keys written in
+// them, in the order they're first written, so keys that have gone idle no
+// longer take space. Key indexes don't change.
+extern int tsdb_start_generation(tsdb_handler *handler, u_int32_t epoch);
+
+// Called with each key matching a prefix, in byte order. A non-zero return
+// stops the scan.
+typedef int (*tsdb_key_handler)(const char *key, u_int32_t index,
+                                void *context);
+
+// Returns 0, the handler's non-zero return, -1 if the handler isn't alive
+// or -2.
+extern int tsdb_scan_keys(tsdb_handler *handler, const char *prefix,
+                          tsdb_key_handler callback, void *context);
+
+// Merges the keys added since the key dictionary was last written into
+// it. This happens on flush once enough keys have been added.
+extern int tsdb_merge_keys(tsdb_handler *handler);
+
 extern int tsdb_get_by_index(tsdb_handler *handler,
                              u_int32_t *index,
                              tsdb_value **value);
 
 extern void tsdb_flush(tsdb_handler *handler);
 
+extern int tsdb_enable_wal(tsdb_handler *handler);
+
+extern int tsdb_commit(tsdb_handler *handler);
+
+extern int tsdb_checkpoint(tsdb_handler *handler);
+
+extern int tsdb_transpose(tsdb_handler *handler,
+                          u_int32_t start,
+                          u_int32_t end);
+
+typedef struct {
+    u_int32_t examined;
+    u_int32_t fragments;        // Fragments stored again
+    u_int64_t bytes_before;
+    u_int64_t bytes_after;
+} tsdb_compact_stats;
+
+// Stores fragments of epochs before before with codec, looking at up to
+// max_fragments per call. Returns 1 while there are fragments left, 0
+// once they've all been seen. Progress is saved in the database.
+extern int tsdb_compact(tsdb_handler *handler,
+                        u_int8_t codec,
+                        u_int32_t before,
+                        u_int32_t max_fragments,
+                        tsdb_compact_stats *stats);
+
+extern int tsdb_set_retention(tsdb_handler *handler, u_int32_t retention);
+
+typedef struct {
+    u_int32_t examined;
+    u_int32_t fragments;        // Fragments deleted
+    u_int32_t rebased;          // Fragments stored without a reference
+    u_int32_t blobs;            // Blobs no fragment pointed to any more
+} tsdb_purge_stats;
+
+// Deletes the fragments of epochs before before, looking at up to
+// max_fragments per call. Returns 1 while there are fragments left, 0
+// once they've all been seen, after deleting the blobs that are no longer
+// used. Progress is saved in the database.
+extern int tsdb_purge_before(tsdb_handler *handler,
+                             u_int32_t before,
+                             u_int32_t max_fragments,
+                             tsdb_purge_stats *stats);
+
+// tsdb_purge_before for the slots that are entirely older than the
+// retention, if there's one
+extern int tsdb_purge(tsdb_handler *handler,
+                      u_int32_t now,
+                      u_int32_t max_fragments,
+                      tsdb_purge_stats *stats);
+
+// Stores the fragments of a FORMAT_TEXT_KEYS database under binary keys
+// and makes it FORMAT_CURRENT. Run it again if it's interrupted; until
+// it's done the database is missing fragments.
+extern int tsdb_migrate(tsdb_handler *handler, u_int32_t *migrated);
+
+extern int tsdb_get_series(tsdb_handler *handler,
+                           u_int32_t index,
+                           u_int32_t start,
+                           u_int32_t end,
+                           tsdb_value *values,
+                           u_int8_t *present,
+                           u_int32_t slots_len,
+                           u_int32_t *count);
+
+// The key for an index. key is valid until the next key is added or the
+// handler is closed.
+extern int tsdb_get_key_name(tsdb_handler *handler, u_int32_t index,
+                             const char **key);
+
+// Keys for count indexes, NULL for indexes without one
+extern int tsdb_get_key_names(tsdb_handler *handler, u_int32_t *indexes,
+                              u_int32_t count, const char **keys);
+
 extern int tsdb_tag_key(tsdb_handler *handler, char* key, char* tag_name);
 
 extern int tsdb_get_tag_indexes(tsdb_handler *handler,
@@ -113,3 +348,29 @@ extern int tsdb_get_consolidated_tag_indexes(tsdb_handler *handler,
                                              u_int32_t *indexes,
                                              u_int32_t indexes_len,
                                              u_int32_t *count);
+
+// Queries such as "(and metric=cpu (not size=small) (or dc=a dc=b))", see
+// tsdb_query.h. A compiled query can be run any number of times.
+extern int tsdb_compile_query(char *expr, tsdb_query **query);
+
+extern void tsdb_free_query(tsdb_query *query);
+
+extern int tsdb_get_query_indexes(tsdb_handler *handler,
+                                  tsdb_query *query,
+                                  u_int32_t *indexes,
+                                  u_int32_t indexes_len,
+                                  u_int32_t *count);
+
+// Called with the values of each matching index in each epoch of a scan.
+// values is only valid during the call, and the callback mustn't change
+// the database. A non-zero return stops the scan, and tsdb_scan_query
+// returns it.
+typedef int (*tsdb_scan_handler)(u_int32_t epoch, u_int32_t index,
+                                 tsdb_value *values, void *context);
+
+extern int tsdb_scan_query(tsdb_handler *handler,
+                           tsdb_query *query,
+                           u_int32_t start,
+                           u_int32_t end,
+                           tsdb_scan_handler callback,
+                           void *context);
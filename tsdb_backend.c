@@ -0,0 +1,602 @@
+/*
+ *
+ *  Copyright (C) 2011 IIT/CNR (http://www.iit.cnr.it/en)
+ *                     Luca Deri <deri@ntop.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <string.h>
+#include <db.h>
+
+#include "tsdb_backend.h"
+#include "tsdb_trace.h"
+
+//=====================================================================
+// Berkeley DB
+//=====================================================================
+
+typedef struct {
+    DBC *cursor;
+    DBT key_data;
+    DBT data;
+    void *start;
+    u_int32_t start_len;
+    u_int8_t started;
+} bdb_cursor;
+
+static int bdb_open(void **db, const char *path, u_int8_t read_only) {
+    DB *bdb;
+    int ret, mode;
+
+    if ((ret = db_create(&bdb, NULL, 0)) != 0) {
+        trace_error("Error while creating DB handler [%s]", db_strerror(ret));
+        return -1;
+    }
+
+    mode = (read_only ? 00444 : 00664 );
+
+    if ((ret = bdb->open(bdb,
+                         NULL,
+                         path,
+                         NULL,
+                         DB_BTREE,
+                         (read_only ? 0 : DB_CREATE),
+                         mode)) != 0) {
+        trace_error("Error while opening DB %s [%s][r/o=%u,mode=%o]",
+                    path, db_strerror(ret), read_only, mode);
+        bdb->close(bdb, 0);
+        return -1;
+    }
+
+    *db = bdb;
+
+    return 0;
+}
+
+static void bdb_close(void *db) {
+    DB *bdb = (DB*)db;
+    bdb->close(bdb, 0);
+}
+
+static int bdb_get(void *db, void *key, u_int32_t key_len,
+                   void **value, u_int32_t *value_len) {
+    DB *bdb = (DB*)db;
+    DBT key_data, data;
+
+    memset(&key_data, 0, sizeof(key_data));
+    memset(&data, 0, sizeof(data));
+
+    key_data.data = key;
+    key_data.size = key_len;
+
+    if (bdb->get(bdb, NULL, &key_data, &data, 0) == 0) {
+        *value = data.data, *value_len = data.size;
+        return 0;
+    } else {
+        return -1;
+    }
+}
+
+static int bdb_put(void *db, void *key, u_int32_t key_len,
+                   void *value, u_int32_t value_len) {
+    DB *bdb = (DB*)db;
+    DBT key_data, data;
+
+    memset(&key_data, 0, sizeof(key_data));
+    memset(&data, 0, sizeof(data));
+
+    key_data.data = key;
+    key_data.size = key_len;
+    data.data = value;
+    data.size = value_len;
+
+    return bdb->put(bdb, NULL, &key_data, &data, 0) == 0 ? 0 : -2;
+}
+
+static int bdb_del(void *db, void *key, u_int32_t key_len) {
+    DB *bdb = (DB*)db;
+    DBT key_data;
+    int ret;
+
+    memset(&key_data, 0, sizeof(key_data));
+
+    key_data.data = key;
+    key_data.size = key_len;
+
+    ret = bdb->del(bdb, NULL, &key_data, 0);
+
+    return ret == 0 ? 0 : (ret == DB_NOTFOUND ? -1 : -2);
+}
+
+static int bdb_cursor_open(void *db, void *start, u_int32_t start_len,
+                           void **cursor) {
+    DB *bdb = (DB*)db;
+    bdb_cursor *c;
+    int ret;
+
+    c = (bdb_cursor*)calloc(1, sizeof(bdb_cursor) + start_len);
+    if (!c) {
+        return -2;
+    }
+
+    if ((ret = bdb->cursor(bdb, NULL, &c->cursor, 0)) != 0) {
+        trace_error("Error while creating cursor [%s]", db_strerror(ret));
+        free(c);
+        return -2;
+    }
+
+    c->start = &c[1];
+    c->start_len = start_len;
+    memcpy(c->start, start, start_len);
+
+    *cursor = c;
+
+    return 0;
+}
+
+static int bdb_cursor_next(void *cursor, void **key, u_int32_t *key_len,
+                           void **value, u_int32_t *value_len) {
+    bdb_cursor *c = (bdb_cursor*)cursor;
+    int ret;
+
+    memset(&c->data, 0, sizeof(c->data));
+    if (!value) {
+        // Keys only
+        c->data.flags = DB_DBT_PARTIAL;
+    }
+
+    if (!c->started) {
+        memset(&c->key_data, 0, sizeof(c->key_data));
+        c->key_data.data = c->start;
+        c->key_data.size = c->start_len;
+        ret = c->cursor->get(c->cursor, &c->key_data, &c->data, DB_SET_RANGE);
+        c->started = 1;
+    } else {
+        ret = c->cursor->get(c->cursor, &c->key_data, &c->data, DB_NEXT);
+    }
+
+    if (ret != 0) {
+        return ret == DB_NOTFOUND ? -1 : -2;
+    }
+
+    *key = c->key_data.data;
+    *key_len = c->key_data.size;
+    if (value) {
+        *value = c->data.data;
+        *value_len = c->data.size;
+    }
+
+    return 0;
+}
+
+static int bdb_cursor_del(void *cursor) {
+    bdb_cursor *c = (bdb_cursor*)cursor;
+    return c->cursor->del(c->cursor, 0) == 0 ? 0 : -2;
+}
+
+static void bdb_cursor_close(void *cursor) {
+    bdb_cursor *c = (bdb_cursor*)cursor;
+    c->cursor->close(c->cursor);
+    free(c);
+}
+
+static int bdb_sync(void *db) {
+    DB *bdb = (DB*)db;
+    return bdb->sync(bdb, 0) == 0 ? 0 : -2;
+}
+
+static int bdb_compact(void *db) {
+    DB *bdb = (DB*)db;
+    DB_COMPACT stats;
+
+    memset(&stats, 0, sizeof(stats));
+    if (bdb->compact(bdb, NULL, NULL, NULL, &stats, DB_FREE_SPACE,
+                     NULL) != 0) {
+        return -2;
+    }
+    trace_info("Returned %u pages to the file system",
+               stats.compact_pages_truncated);
+
+    return 0;
+}
+
+const tsdb_backend tsdb_bdb_backend = {
+    "bdb",
+    1,
+    bdb_open,
+    bdb_close,
+    bdb_get,
+    bdb_put,
+    bdb_del,
+    bdb_cursor_open,
+    bdb_cursor_next,
+    bdb_cursor_del,
+    bdb_cursor_close,
+    bdb_sync,
+    bdb_compact
+};
+
+//=====================================================================
+// Memory
+//=====================================================================
+
+#define MEMORY_MIN_BUCKETS 1024
+
+typedef struct memory_entry {
+    struct memory_entry *next;
+    u_int32_t hash;
+    u_int32_t key_len;
+    u_int32_t value_len;
+    u_int8_t *value;
+    u_int8_t key[];
+} memory_entry;
+
+typedef struct {
+    memory_entry **buckets;
+    u_int32_t num_buckets;
+    u_int32_t count;
+    // Sorted view of the entries for cursors, rebuilt after keys are
+    // added or removed
+    memory_entry **sorted;
+    u_int32_t version;
+    u_int32_t sorted_version;
+} memory_db;
+
+typedef struct {
+    memory_db *db;
+    u_int32_t pos;
+    u_int32_t version;
+    u_int8_t *last_key;
+    u_int32_t last_key_len;
+    u_int8_t started;
+    u_int8_t inclusive;
+} memory_cursor;
+
+static u_int32_t memory_hash(void *key, u_int32_t key_len) {
+    u_int8_t *ptr = (u_int8_t*)key;
+    u_int32_t hash = 2166136261U, i;
+
+    for (i = 0; i < key_len; i++) {
+        hash = (hash ^ ptr[i]) * 16777619U;
+    }
+
+    return hash;
+}
+
+static int memory_cmp(void *a, u_int32_t a_len, void *b, u_int32_t b_len) {
+    int rc = memcmp(a, b, a_len < b_len ? a_len : b_len);
+
+    if (rc != 0) {
+        return rc;
+    }
+
+    return a_len < b_len ? -1 : (a_len > b_len ? 1 : 0);
+}
+
+static memory_entry **memory_find(memory_db *mdb, void *key,
+                                  u_int32_t key_len, u_int32_t hash) {
+    memory_entry **entry = &mdb->buckets[hash & (mdb->num_buckets - 1)];
+
+    while (*entry) {
+        if ((*entry)->hash == hash && (*entry)->key_len == key_len
+            && memcmp((*entry)->key, key, key_len) == 0) {
+            break;
+        }
+        entry = &(*entry)->next;
+    }
+
+    return entry;
+}
+
+static int memory_open(void **db, const char *path, u_int8_t read_only) {
+    memory_db *mdb = (memory_db*)calloc(1, sizeof(memory_db));
+
+    if (!mdb) {
+        return -1;
+    }
+
+    mdb->buckets = (memory_entry**)calloc(MEMORY_MIN_BUCKETS,
+                                          sizeof(memory_entry*));
+    if (!mdb->buckets) {
+        free(mdb);
+        return -1;
+    }
+    mdb->num_buckets = MEMORY_MIN_BUCKETS;
+    mdb->sorted_version = (u_int32_t)-1;
+
+    *db = mdb;
+
+    return 0;
+}
+
+static void memory_close(void *db) {
+    memory_db *mdb = (memory_db*)db;
+    memory_entry *entry, *next;
+    u_int32_t i;
+
+    for (i = 0; i < mdb->num_buckets; i++) {
+        for (entry = mdb->buckets[i]; entry; entry = next) {
+            next = entry->next;
+            free(entry->value);
+            free(entry);
+        }
+    }
+
+    free(mdb->buckets);
+    free(mdb->sorted);
+    free(mdb);
+}
+
+static int memory_get(void *db, void *key, u_int32_t key_len,
+                      void **value, u_int32_t *value_len) {
+    memory_db *mdb = (memory_db*)db;
+    memory_entry *entry;
+
+    entry = *memory_find(mdb, key, key_len, memory_hash(key, key_len));
+    if (!entry) {
+        return -1;
+    }
+
+    *value = entry->value;
+    *value_len = entry->value_len;
+
+    return 0;
+}
+
+static void memory_grow(memory_db *mdb) {
+    u_int32_t num_buckets = mdb->num_buckets * 2, i;
+    memory_entry **buckets, *entry, *next;
+
+    buckets = (memory_entry**)calloc(num_buckets, sizeof(memory_entry*));
+    if (!buckets) {
+        return; // Keep the longer chains
+    }
+
+    for (i = 0; i < mdb->num_buckets; i++) {
+        for (entry = mdb->buckets[i]; entry; entry = next) {
+            next = entry->next;
+            entry->next = buckets[entry->hash & (num_buckets - 1)];
+            buckets[entry->hash & (num_buckets - 1)] = entry;
+        }
+    }
+
+    free(mdb->buckets);
+    mdb->buckets = buckets;
+    mdb->num_buckets = num_buckets;
+}
+
+static int memory_put(void *db, void *key, u_int32_t key_len,
+                      void *value, u_int32_t value_len) {
+    memory_db *mdb = (memory_db*)db;
+    u_int32_t hash = memory_hash(key, key_len);
+    memory_entry **slot = memory_find(mdb, key, key_len, hash), *entry;
+    u_int8_t *copy;
+
+    copy = (u_int8_t*)malloc(value_len ? value_len : 1);
+    if (!copy) {
+        return -2;
+    }
+    memcpy(copy, value, value_len);
+
+    if ((entry = *slot)) {
+        free(entry->value);
+        entry->value = copy;
+        entry->value_len = value_len;
+        return 0;
+    }
+
+    entry = (memory_entry*)malloc(sizeof(memory_entry) + key_len);
+    if (!entry) {
+        free(copy);
+        return -2;
+    }
+    entry->next = NULL;
+    entry->hash = hash;
+    entry->key_len = key_len;
+    entry->value = copy;
+    entry->value_len = value_len;
+    memcpy(entry->key, key, key_len);
+    *slot = entry;
+
+    mdb->count++;
+    mdb->version++;
+
+    if (mdb->count > mdb->num_buckets) {
+        memory_grow(mdb);
+    }
+
+    return 0;
+}
+
+static int memory_del(void *db, void *key, u_int32_t key_len) {
+    memory_db *mdb = (memory_db*)db;
+    memory_entry **slot, *entry;
+
+    slot = memory_find(mdb, key, key_len, memory_hash(key, key_len));
+    if (!(entry = *slot)) {
+        return -1;
+    }
+
+    *slot = entry->next;
+    free(entry->value);
+    free(entry);
+
+    mdb->count--;
+    mdb->version++;
+
+    return 0;
+}
+
+static int cmp_memory_entries(const void *a, const void *b) {
+    memory_entry *x = *(memory_entry**)a, *y = *(memory_entry**)b;
+    return memory_cmp(x->key, x->key_len, y->key, y->key_len);
+}
+
+static int memory_sort(memory_db *mdb) {
+    memory_entry *entry;
+    u_int32_t i, n = 0;
+
+    if (mdb->sorted_version == mdb->version) {
+        return 0;
+    }
+
+    free(mdb->sorted);
+    mdb->sorted = (memory_entry**)malloc((mdb->count + 1)
+                                         * sizeof(memory_entry*));
+    if (!mdb->sorted) {
+        return -2;
+    }
+
+    for (i = 0; i < mdb->num_buckets; i++) {
+        for (entry = mdb->buckets[i]; entry; entry = entry->next) {
+            mdb->sorted[n++] = entry;
+        }
+    }
+    qsort(mdb->sorted, n, sizeof(memory_entry*), cmp_memory_entries);
+
+    mdb->sorted_version = mdb->version;
+
+    return 0;
+}
+
+// Position of the first entry >= key (or > key)
+static u_int32_t memory_seek(memory_db *mdb, void *key, u_int32_t key_len,
+                             u_int8_t inclusive) {
+    u_int32_t low = 0, high = mdb->count, mid;
+    int rc;
+
+    while (low < high) {
+        mid = (low + high) / 2;
+        rc = memory_cmp(mdb->sorted[mid]->key, mdb->sorted[mid]->key_len,
+                        key, key_len);
+        if (rc < 0 || (rc == 0 && !inclusive)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+static int memory_cursor_open(void *db, void *start, u_int32_t start_len,
+                              void **cursor) {
+    memory_cursor *c;
+
+    c = (memory_cursor*)calloc(1, sizeof(memory_cursor));
+    if (!c) {
+        return -2;
+    }
+    c->last_key = (u_int8_t*)malloc(start_len ? start_len : 1);
+    if (!c->last_key) {
+        free(c);
+        return -2;
+    }
+    memcpy(c->last_key, start, start_len);
+    c->last_key_len = start_len;
+    c->inclusive = 1;
+    c->db = (memory_db*)db;
+
+    *cursor = c;
+
+    return 0;
+}
+
+static int memory_cursor_next(void *cursor, void **key, u_int32_t *key_len,
+                              void **value, u_int32_t *value_len) {
+    memory_cursor *c = (memory_cursor*)cursor;
+    memory_db *mdb = c->db;
+    memory_entry *entry;
+    u_int8_t *last_key;
+
+    if (memory_sort(mdb) != 0) {
+        return -2;
+    }
+
+    if (!c->started || c->version != mdb->sorted_version) {
+        // Keys were added or removed, find our place again
+        c->pos = memory_seek(mdb, c->last_key, c->last_key_len, c->inclusive);
+        c->version = mdb->sorted_version;
+        c->started = 1;
+    } else {
+        c->pos++;
+    }
+
+    if (c->pos >= mdb->count) {
+        return -1;
+    }
+
+    entry = mdb->sorted[c->pos];
+
+    last_key = (u_int8_t*)realloc(c->last_key,
+                                  entry->key_len ? entry->key_len : 1);
+    if (!last_key) {
+        return -2;
+    }
+    memcpy(last_key, entry->key, entry->key_len);
+    c->last_key = last_key;
+    c->last_key_len = entry->key_len;
+    c->inclusive = 0;
+
+    *key = entry->key;
+    *key_len = entry->key_len;
+    if (value) {
+        *value = entry->value;
+        *value_len = entry->value_len;
+    }
+
+    return 0;
+}
+
+static int memory_cursor_del(void *cursor) {
+    memory_cursor *c = (memory_cursor*)cursor;
+
+    if (!c->started || c->inclusive) {
+        return -2;
+    }
+
+    return memory_del(c->db, c->last_key, c->last_key_len) == 0 ? 0 : -2;
+}
+
+static void memory_cursor_close(void *cursor) {
+    memory_cursor *c = (memory_cursor*)cursor;
+    free(c->last_key);
+    free(c);
+}
+
+static int memory_sync(void *db) {
+    return 0;
+}
+
+static int memory_compact(void *db) {
+    return 0;
+}
+
+const tsdb_backend tsdb_memory_backend = {
+    "memory",
+    0,
+    memory_open,
+    memory_close,
+    memory_get,
+    memory_put,
+    memory_del,
+    memory_cursor_open,
+    memory_cursor_next,
+    memory_cursor_del,
+    memory_cursor_close,
+    memory_sync,
+    memory_compact
+};
@@ -0,0 +1,57 @@
+/*
+ *
+ *  Copyright (C) 2011 IIT/CNR (http://www.iit.cnr.it/en)
+ *                     Luca Deri <deri@ntop.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+// Storage backend used by a tsdb handler.
+//
+// get returns a pointer to the stored value, which is valid until the next
+// call on the backend. All functions return 0 on success and -1 on
+// failure (get, and cursor_next at the end of the cursor) or -2 on error.
+//
+// Cursors walk keys in order, starting at the first key >= start. The value
+// pointer passed to cursor_next may be NULL if the value isn't needed.
+
+typedef struct {
+    char *name;
+    u_int8_t persistent;    // Data outlives the handler
+    int (*open)(void **db, const char *path, u_int8_t read_only);
+    void (*close)(void *db);
+    int (*get)(void *db, void *key, u_int32_t key_len,
+               void **value, u_int32_t *value_len);
+    int (*put)(void *db, void *key, u_int32_t key_len,
+               void *value, u_int32_t value_len);
+    int (*del)(void *db, void *key, u_int32_t key_len);
+    int (*cursor_open)(void *db, void *start, u_int32_t start_len,
+                       void **cursor);
+    int (*cursor_next)(void *cursor, void **key, u_int32_t *key_len,
+                       void **value, u_int32_t *value_len);
+    int (*cursor_del)(void *cursor);
+    void (*cursor_close)(void *cursor);
+    int (*sync)(void *db);
+    int (*compact)(void *db);   // Gives freed space back to the system
+} tsdb_backend;
+
+// Berkeley DB B-tree stored at path
+extern const tsdb_backend tsdb_bdb_backend;
+
+// Hash table in memory, nothing is persisted
+extern const tsdb_backend tsdb_memory_backend;
@@ -1,33 +1,195 @@
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define BITMAP_SIMD
+#endif
+
 #include "tsdb_bitmap.h"
 
 void set_bit(u_int32_t *words, int n) { 
-    words[WORD_OFFSET(n)] |= (1 << BIT_OFFSET(n));
+    words[WORD_OFFSET(n)] |= (1U << BIT_OFFSET(n));
 }
 
 void clear_bit(u_int32_t *words, int n) {
-    words[WORD_OFFSET(n)] &= ~(1 << BIT_OFFSET(n)); 
+    words[WORD_OFFSET(n)] &= ~(1U << BIT_OFFSET(n)); 
 }
 
 int get_bit(u_int32_t *words, int n) {
-    u_int32_t bit = words[WORD_OFFSET(n)] & (1 << BIT_OFFSET(n));
+    u_int32_t bit = words[WORD_OFFSET(n)] & (1U << BIT_OFFSET(n));
     return bit != 0; 
 }
 
+// Bits 64 * i to 64 * i + 63, of which only the first half may be there
+static u_int64_t load64(u_int32_t *words, u_int32_t num_words, u_int32_t i) {
+    u_int64_t lo = words[i * 2];
+    return i * 2 + 1 < num_words
+        ? lo | ((u_int64_t)words[i * 2 + 1] << 32) : lo;
+}
+
+static void store64(u_int32_t *words, u_int32_t num_words, u_int32_t i,
+                    u_int64_t x) {
+    words[i * 2] = (u_int32_t)x;
+    if (i * 2 + 1 < num_words) {
+        words[i * 2 + 1] = (u_int32_t)(x >> 32);
+    }
+}
+
+static void combine_scalar(u_int32_t *dest, u_int32_t *src, u_int32_t start,
+                           u_int32_t num_words, int op) {
+    u_int32_t i, n = (num_words + 1) / 2;
+    u_int64_t a, b;
+
+    for (i = start / 2; i < n; i++) {
+        a = load64(dest, num_words, i);
+        b = load64(src, num_words, i);
+        switch (op) {
+        case BITMAP_AND:
+            a &= b;
+            break;
+        case BITMAP_OR:
+            a |= b;
+            break;
+        case BITMAP_ANDNOT:
+            a &= ~b;
+            break;
+        }
+        store64(dest, num_words, i, a);
+    }
+}
+
+#ifdef BITMAP_SIMD
+
+// 256 bits at a time, the rest 64 at a time
+__attribute__((target("avx2")))
+static void combine_avx2(u_int32_t *dest, u_int32_t *src,
+                         u_int32_t num_words, int op) {
+    u_int32_t i = 0;
+    __m256i a, b;
+
+    switch (op) {
+    case BITMAP_AND:
+        for (; i + 8 <= num_words; i += 8) {
+            a = _mm256_loadu_si256((__m256i*)&dest[i]);
+            b = _mm256_loadu_si256((__m256i*)&src[i]);
+            _mm256_storeu_si256((__m256i*)&dest[i], _mm256_and_si256(a, b));
+        }
+        break;
+    case BITMAP_OR:
+        for (; i + 8 <= num_words; i += 8) {
+            a = _mm256_loadu_si256((__m256i*)&dest[i]);
+            b = _mm256_loadu_si256((__m256i*)&src[i]);
+            _mm256_storeu_si256((__m256i*)&dest[i], _mm256_or_si256(a, b));
+        }
+        break;
+    case BITMAP_ANDNOT:
+        for (; i + 8 <= num_words; i += 8) {
+            a = _mm256_loadu_si256((__m256i*)&dest[i]);
+            b = _mm256_loadu_si256((__m256i*)&src[i]);
+            _mm256_storeu_si256((__m256i*)&dest[i],
+                                _mm256_andnot_si256(b, a));
+        }
+        break;
+    }
+
+    combine_scalar(dest, src, i, num_words, op);
+}
+
+__attribute__((target("popcnt")))
+static u_int32_t count_popcnt(u_int32_t *words, u_int32_t num_words) {
+    u_int32_t i, n = (num_words + 1) / 2, count = 0;
+
+    for (i = 0; i < n; i++) {
+        count += __builtin_popcountll(load64(words, num_words, i));
+    }
+
+    return count;
+}
+
+#endif
+
+static u_int32_t count_scalar(u_int32_t *words, u_int32_t num_words) {
+    u_int32_t i, n = (num_words + 1) / 2, count = 0;
+
+    for (i = 0; i < n; i++) {
+        count += __builtin_popcountll(load64(words, num_words, i));
+    }
+
+    return count;
+}
+
+void bitmap_combine(u_int32_t *dest, u_int32_t *src, u_int32_t num_words,
+                    int op) {
+#ifdef BITMAP_SIMD
+    static int avx2 = -1;
+
+    if (avx2 == -1) {
+        __builtin_cpu_init();
+        avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    if (avx2) {
+        combine_avx2(dest, src, num_words, op);
+        return;
+    }
+#endif
+    combine_scalar(dest, src, 0, num_words, op);
+}
+
+u_int32_t bitmap_count(u_int32_t *words, u_int32_t num_words) {
+#ifdef BITMAP_SIMD
+    static int popcnt = -1;
+
+    if (popcnt == -1) {
+        __builtin_cpu_init();
+        popcnt = __builtin_cpu_supports("popcnt") ? 1 : 0;
+    }
+    if (popcnt) {
+        return count_popcnt(words, num_words);
+    }
+#endif
+    return count_scalar(words, num_words);
+}
+
+u_int32_t bitmap_scan(u_int32_t *words, u_int32_t max_index,
+                      u_int32_t *indexes) {
+    u_int32_t num_words = WORD_OFFSET(max_index) + 1;
+    u_int32_t i, n = (num_words + 1) / 2, count = 0, last = max_index / 64;
+    u_int64_t x;
+
+    for (i = 0; i < n; i++) {
+        if (!(x = load64(words, num_words, i))) {
+            continue;
+        }
+        if (i == last && max_index % 64 != 63) {
+            x &= (2ULL << (max_index % 64)) - 1;
+        }
+        // Clear the lowest set bit each time round
+        while (x) {
+            indexes[count++] = i * 64 + __builtin_ctzll(x);
+            x &= x - 1;
+        }
+    }
+
+    return count;
+}
+
 void scan_result(u_int32_t *result, u_int32_t max_index, 
                  void(*handler)(u_int32_t *index)) {
-    u_int32_t i, j, index;
-    u_int32_t max_word = max_index / BITS_PER_WORD;
+    u_int32_t num_words = WORD_OFFSET(max_index) + 1;
+    u_int32_t i, n = (num_words + 1) / 2, index, last = max_index / 64;
+    u_int64_t x;
 
-    for (i = 0; i <= max_word; i++) {
-        if (result[i] == 0) {
+    for (i = 0; i < n; i++) {
+        if (!(x = load64(result, num_words, i))) {
             continue;
         }
-        for (j = 0; j < BITS_PER_WORD; j++) {
-            index = i * BITS_PER_WORD + j;
-            if (index > max_index) {
-                break;
-            }
-            if (get_bit(result, index) && handler) {
+        if (i == last && max_index % 64 != 63) {
+            x &= (2ULL << (max_index % 64)) - 1;
+        }
+        while (x) {
+            index = i * 64 + __builtin_ctzll(x);
+            x &= x - 1;
+            if (handler) {
                 handler(&index);
             }
         }
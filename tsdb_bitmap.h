@@ -6,12 +6,28 @@ enum { BITS_PER_WORD = sizeof(u_int32_t) * CHAR_BIT };
 #define WORD_OFFSET(b) ((b) / BITS_PER_WORD)
 #define BIT_OFFSET(b)  ((b) % BITS_PER_WORD)
 
+// Operations for bitmap_combine, the same values as TSDB_AND and TSDB_OR
+#define BITMAP_AND    1
+#define BITMAP_OR     2
+#define BITMAP_ANDNOT 3
+
 void set_bit(u_int32_t *words, int n);
 
 void clear_bit(u_int32_t *words, int n);
 
 int get_bit(u_int32_t *words, int n);
 
+// dest = dest op src, 64 bits at a time (256 with AVX2)
+void bitmap_combine(u_int32_t *dest, u_int32_t *src, u_int32_t num_words,
+                    int op);
+
+u_int32_t bitmap_count(u_int32_t *words, u_int32_t num_words);
+
+// Stores the index of each set bit up to max_index in indexes, which must
+// have room for them all. Returns the number of indexes.
+u_int32_t bitmap_scan(u_int32_t *words, u_int32_t max_index,
+                      u_int32_t *indexes);
+
 void scan_result(u_int32_t *result,
                  u_int32_t max_index, 
                  void(*handler)(u_int32_t *index));
@@ -0,0 +1,586 @@
+/*
+ *
+ *  Copyright (C) 2011 IIT/CNR (http://www.iit.cnr.it/en)
+ *                     Luca Deri <deri@ntop.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define BITPACK_SIMD
+#endif
+
+#include "tsdb_codec.h"
+#include "quicklz.h"
+#include "quicklz3.h"
+
+#define LANES 4
+
+void fragment_write_header(tsdb_fragment_header *header, u_int8_t *dest) {
+    dest[0] = FRAGMENT_MARK;
+    dest[1] = header->transform;
+    dest[2] = header->codec;
+    dest[3] = header->depth;
+    memcpy(&dest[4], &header->ref_epoch, 4);
+    memcpy(&dest[8], &header->size, 4);
+}
+
+int fragment_read_header(u_int8_t *src, u_int32_t len,
+                         tsdb_fragment_header *header) {
+    memset(header, 0, sizeof(tsdb_fragment_header));
+
+    if (len == 0) {
+        return -1;
+    }
+
+    if (!(src[0] & FRAGMENT_MARK)) {
+        header->codec = CODEC_QLZ;
+        return 0;
+    }
+
+    if (src[0] != FRAGMENT_MARK || len < FRAGMENT_HEADER_LEN) {
+        return -1;
+    }
+
+    header->transform = src[1];
+    header->codec = src[2];
+    header->depth = src[3];
+    memcpy(&header->ref_epoch, &src[4], 4);
+    memcpy(&header->size, &src[8], 4);
+
+    if (header->transform > TRANSFORM_DELTA
+        || (!codec_find(header->codec) && header->codec != CODEC_BLOB)) {
+        return -1;
+    }
+
+    return FRAGMENT_HEADER_LEN;
+}
+
+void fragment_transform(u_int8_t transform, u_int32_t *values,
+                        u_int32_t *ref, u_int32_t num_values,
+                        u_int32_t *dest) {
+    u_int32_t i, delta;
+
+    switch (transform) {
+    case TRANSFORM_XOR:
+        for (i = 0; i < num_values; i++) {
+            dest[i] = values[i] ^ ref[i];
+        }
+        break;
+    case TRANSFORM_DELTA:
+        for (i = 0; i < num_values; i++) {
+            delta = values[i] - ref[i];
+            dest[i] = (delta << 1) ^ (u_int32_t)((int32_t)delta >> 31);
+        }
+        break;
+    default:
+        memcpy(dest, values, num_values * sizeof(u_int32_t));
+    }
+}
+
+void fragment_untransform(u_int8_t transform, u_int32_t *values,
+                          u_int32_t *ref, u_int32_t num_values) {
+    u_int32_t i, delta;
+
+    switch (transform) {
+    case TRANSFORM_XOR:
+        for (i = 0; i < num_values; i++) {
+            values[i] ^= ref[i];
+        }
+        break;
+    case TRANSFORM_DELTA:
+        for (i = 0; i < num_values; i++) {
+            delta = (values[i] >> 1) ^ (0 - (values[i] & 1));
+            values[i] = ref[i] + delta;
+        }
+        break;
+    }
+}
+
+//=====================================================================
+// Hashing
+//=====================================================================
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static u_int64_t rotl64(u_int64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static u_int64_t hash_round(u_int64_t acc, u_int64_t input) {
+    acc += input * PRIME64_2;
+    return rotl64(acc, 31) * PRIME64_1;
+}
+
+static u_int64_t hash_merge(u_int64_t acc, u_int64_t val) {
+    acc ^= hash_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+static u_int64_t read64(u_int8_t *ptr) {
+    u_int64_t x;
+    memcpy(&x, ptr, 8);
+    return x;
+}
+
+u_int64_t fragment_hash(u_int8_t *data, u_int32_t len) {
+    u_int8_t *ptr = data, *end = data + len;
+    u_int64_t v1, v2, v3, v4, h;
+    u_int32_t x;
+
+    if (len >= 32) {
+        v1 = PRIME64_1 + PRIME64_2;
+        v2 = PRIME64_2;
+        v3 = 0;
+        v4 = -PRIME64_1;
+        for (; ptr + 32 <= end; ptr += 32) {
+            v1 = hash_round(v1, read64(ptr));
+            v2 = hash_round(v2, read64(ptr + 8));
+            v3 = hash_round(v3, read64(ptr + 16));
+            v4 = hash_round(v4, read64(ptr + 24));
+        }
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = hash_merge(h, v1);
+        h = hash_merge(h, v2);
+        h = hash_merge(h, v3);
+        h = hash_merge(h, v4);
+    } else {
+        h = PRIME64_5;
+    }
+
+    h += len;
+
+    for (; ptr + 8 <= end; ptr += 8) {
+        h ^= hash_round(0, read64(ptr));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (ptr + 4 <= end) {
+        memcpy(&x, ptr, 4);
+        h ^= (u_int64_t)x * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        ptr += 4;
+    }
+    for (; ptr < end; ptr++) {
+        h ^= *ptr * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+//=====================================================================
+// Bit-packing
+//=====================================================================
+
+static u_int32_t bits_needed(u_int32_t range) {
+    return range ? 32 - __builtin_clz(range) : 0;
+}
+
+static u_int32_t block_bits(u_int32_t *values, u_int32_t n, u_int32_t *min) {
+    u_int32_t lo = values[0], hi = values[0], i;
+
+    for (i = 1; i < n; i++) {
+        if (values[i] < lo) lo = values[i];
+        if (values[i] > hi) hi = values[i];
+    }
+
+    *min = lo;
+
+    return bits_needed(hi - lo);
+}
+
+u_int32_t bitpack_bound(u_int32_t num_values) {
+    u_int32_t blocks = (num_values + BITPACK_BLOCK_VALUES - 1)
+        / BITPACK_BLOCK_VALUES;
+
+    return blocks * (BITPACK_BLOCK_HEADER + BITPACK_BLOCK_VALUES * 4);
+}
+
+u_int32_t bitpack_size(u_int32_t *values, u_int32_t num_values) {
+    u_int32_t i, n, min, size = 0;
+
+    for (i = 0; i < num_values; i += BITPACK_BLOCK_VALUES) {
+        n = num_values - i;
+        if (n > BITPACK_BLOCK_VALUES) n = BITPACK_BLOCK_VALUES;
+        size += BITPACK_BLOCK_HEADER + block_bits(&values[i], n, &min) * 16;
+    }
+
+    return size;
+}
+
+u_int32_t bitpack_encode(u_int32_t *values, u_int32_t num_values,
+                         u_int8_t *dest) {
+    u_int32_t words[BITPACK_BLOCK_VALUES];
+    u_int32_t i, j, n, v, lane, min, bits, x, offset, k, s;
+    u_int8_t *ptr = dest;
+
+    for (i = 0; i < num_values; i += BITPACK_BLOCK_VALUES) {
+        n = num_values - i;
+        if (n > BITPACK_BLOCK_VALUES) n = BITPACK_BLOCK_VALUES;
+        bits = block_bits(&values[i], n, &min);
+
+        memcpy(ptr, &min, 4);
+        ptr[4] = bits;
+        ptr += BITPACK_BLOCK_HEADER;
+
+        // Value j goes to lane j % 4 as the (j / 4)th value of the lane.
+        // Word k of a lane is stored at k * 4 + lane. A short last block
+        // is padded with min.
+        memset(words, 0, bits * 16);
+        for (j = 0; j < BITPACK_BLOCK_VALUES && bits; j++) {
+            x = (j < n ? values[i + j] : min) - min;
+            v = j / LANES, lane = j % LANES;
+            offset = v * bits, k = offset / 32, s = offset % 32;
+            words[k * LANES + lane] |= x << s;
+            if (s + bits > 32) {
+                words[(k + 1) * LANES + lane] |= x >> (32 - s);
+            }
+        }
+        memcpy(ptr, words, bits * 16);
+        ptr += bits * 16;
+    }
+
+    return ptr - dest;
+}
+
+int bitpack_check(u_int8_t *src, u_int32_t len, u_int32_t num_values) {
+    u_int32_t i, pos = 0;
+
+    for (i = 0; i < num_values; i += BITPACK_BLOCK_VALUES) {
+        if (pos + BITPACK_BLOCK_HEADER > len || src[pos + 4] > 32) {
+            return -1;
+        }
+        pos += BITPACK_BLOCK_HEADER + src[pos + 4] * 16;
+    }
+
+    return pos == len ? 0 : -1;
+}
+
+typedef void (*unpack_fn)(u_int8_t *words, u_int32_t bits, u_int32_t min,
+                          u_int32_t *dest);
+
+#ifndef BITPACK_SIMD
+
+static void unpack_block_scalar(u_int8_t *words, u_int32_t bits,
+                                u_int32_t min, u_int32_t *dest) {
+    u_int32_t mask = bits == 32 ? 0xFFFFFFFF : (1U << bits) - 1;
+    u_int32_t j, v, lane, offset, k, s, w, x;
+
+    for (j = 0; j < BITPACK_BLOCK_VALUES; j++) {
+        if (!bits) {
+            dest[j] = min;
+            continue;
+        }
+        v = j / LANES, lane = j % LANES;
+        offset = v * bits, k = offset / 32, s = offset % 32;
+        memcpy(&w, &words[(k * LANES + lane) * 4], 4);
+        x = w >> s;
+        if (s + bits > 32) {
+            memcpy(&w, &words[((k + 1) * LANES + lane) * 4], 4);
+            x |= w << (32 - s);
+        }
+        dest[j] = (x & mask) + min;
+    }
+}
+
+#else
+
+// Shifts of 32 or more give 0, so the high word can always be or'ed in;
+// it's only skipped past the last word of the block.
+static void unpack_block_sse2(u_int8_t *words, u_int32_t bits, u_int32_t min,
+                              u_int32_t *dest) {
+    __m128i *w = (__m128i*)words;
+    __m128i mask = _mm_set1_epi32(bits == 32 ? 0xFFFFFFFF : (1U << bits) - 1);
+    __m128i base = _mm_set1_epi32(min);
+    __m128i x;
+    u_int32_t v, offset, k, s;
+
+    for (v = 0; v < BITPACK_BLOCK_VALUES / LANES; v++) {
+        offset = v * bits, k = offset / 32, s = offset % 32;
+        if (bits) {
+            x = _mm_srl_epi32(_mm_loadu_si128(&w[k]), _mm_cvtsi32_si128(s));
+            if (k + 1 < bits) {
+                x = _mm_or_si128(x, _mm_sll_epi32(_mm_loadu_si128(&w[k + 1]),
+                                                  _mm_cvtsi32_si128(32 - s)));
+            }
+            x = _mm_add_epi32(_mm_and_si128(x, mask), base);
+        } else {
+            x = base;
+        }
+        _mm_storeu_si128((__m128i*)&dest[v * LANES], x);
+    }
+}
+
+// Two lane words at a time, one per 128-bit half
+__attribute__((target("avx2")))
+static void unpack_block_avx2(u_int8_t *words, u_int32_t bits, u_int32_t min,
+                              u_int32_t *dest) {
+    __m128i *w = (__m128i*)words, zero = _mm_setzero_si128();
+    __m256i mask = _mm256_set1_epi32(bits == 32 ? 0xFFFFFFFF
+                                     : (1U << bits) - 1);
+    __m256i base = _mm256_set1_epi32(min);
+    __m256i lo, hi, x;
+    u_int32_t v, k0, s0, k1, s1;
+
+    if (!bits) {
+        for (v = 0; v < BITPACK_BLOCK_VALUES; v += 8) {
+            _mm256_storeu_si256((__m256i*)&dest[v], base);
+        }
+        return;
+    }
+
+    for (v = 0; v < BITPACK_BLOCK_VALUES / LANES; v += 2) {
+        k0 = (v * bits) / 32, s0 = (v * bits) % 32;
+        k1 = ((v + 1) * bits) / 32, s1 = ((v + 1) * bits) % 32;
+
+        lo = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128(&w[k0])),
+            _mm_loadu_si128(&w[k1]), 1);
+        hi = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(k0 + 1 < bits
+                                   ? _mm_loadu_si128(&w[k0 + 1]) : zero),
+            k1 + 1 < bits ? _mm_loadu_si128(&w[k1 + 1]) : zero, 1);
+
+        x = _mm256_srlv_epi32(lo, _mm256_setr_epi32(s0, s0, s0, s0,
+                                                    s1, s1, s1, s1));
+        x = _mm256_or_si256(x, _mm256_sllv_epi32(
+                                hi, _mm256_setr_epi32(32 - s0, 32 - s0,
+                                                      32 - s0, 32 - s0,
+                                                      32 - s1, 32 - s1,
+                                                      32 - s1, 32 - s1)));
+        x = _mm256_add_epi32(_mm256_and_si256(x, mask), base);
+        _mm256_storeu_si256((__m256i*)&dest[v * LANES], x);
+    }
+}
+
+#endif
+
+// Picked once, by whichever thread decodes first
+static unpack_fn unpack;
+static pthread_once_t unpack_once = PTHREAD_ONCE_INIT;
+
+static void select_unpack(void) {
+#ifdef BITPACK_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        unpack = unpack_block_avx2;
+        return;
+    }
+    unpack = unpack_block_sse2;
+#else
+    unpack = unpack_block_scalar;
+#endif
+}
+
+void bitpack_decode(u_int8_t *src, u_int32_t num_values, u_int32_t *dest) {
+    u_int32_t last[BITPACK_BLOCK_VALUES];
+    u_int32_t i, min, bits;
+
+    pthread_once(&unpack_once, select_unpack);
+
+    for (i = 0; i < num_values; i += BITPACK_BLOCK_VALUES) {
+        memcpy(&min, src, 4);
+        bits = src[4];
+        src += BITPACK_BLOCK_HEADER;
+
+        if (num_values - i >= BITPACK_BLOCK_VALUES) {
+            unpack(src, bits, min, &dest[i]);
+        } else {
+            unpack(src, bits, min, last);
+            memcpy(&dest[i], last, (num_values - i) * sizeof(u_int32_t));
+        }
+        src += bits * 16;
+    }
+}
+
+//=====================================================================
+// Codecs
+//=====================================================================
+
+static u_int32_t no_state(u_int8_t compress) {
+    (void)compress;
+    return 0;
+}
+
+static u_int32_t raw_bound(u_int32_t size) {
+    return size;
+}
+
+static u_int32_t raw_compress(void *state, u_int8_t *src, u_int32_t size,
+                              u_int8_t *dest) {
+    (void)state;
+    memcpy(dest, src, size);
+    return size;
+}
+
+static int raw_check(u_int8_t *src, u_int32_t len, u_int32_t size) {
+    (void)src;
+    return len == size ? 0 : -1;
+}
+
+static void raw_decompress(void *state, u_int8_t *src, u_int32_t size,
+                           u_int8_t *dest) {
+    (void)state;
+    memcpy(dest, src, size);
+}
+
+// Both quicklz levels share the block format
+static u_int32_t qlz_bound(u_int32_t size) {
+    return size + 400;
+}
+
+static int qlz_check(u_int8_t *src, u_int32_t len, u_int32_t size) {
+    if (len < 9
+        || qlz_size_compressed((char*)src) != len
+        || qlz_size_decompressed((char*)src) != size) {
+        return -1;
+    }
+    return 0;
+}
+
+static u_int32_t qlz1_state(u_int8_t compress) {
+    return compress ? sizeof(qlz_state_compress)
+        : sizeof(qlz_state_decompress);
+}
+
+static u_int32_t qlz1_compress(void *state, u_int8_t *src, u_int32_t size,
+                               u_int8_t *dest) {
+    return qlz_compress(src, (char*)dest, size, (qlz_state_compress*)state);
+}
+
+static void qlz1_decompress(void *state, u_int8_t *src, u_int32_t size,
+                            u_int8_t *dest) {
+    (void)size;
+    qlz_decompress((char*)src, dest, (qlz_state_decompress*)state);
+}
+
+static u_int32_t qlz3_state(u_int8_t compress) {
+    return compress ? qlz3_state_compress_size()
+        : qlz3_state_decompress_size();
+}
+
+static u_int32_t qlz3_compress_fragment(void *state, u_int8_t *src,
+                                        u_int32_t size, u_int8_t *dest) {
+    return qlz3_compress(src, (char*)dest, size, state);
+}
+
+static void qlz3_decompress_fragment(void *state, u_int8_t *src,
+                                     u_int32_t size, u_int8_t *dest) {
+    (void)size;
+    qlz3_decompress((char*)src, dest, state);
+}
+
+static u_int32_t bitpack_bound_bytes(u_int32_t size) {
+    return bitpack_bound(size / sizeof(u_int32_t));
+}
+
+static u_int32_t bitpack_compress(void *state, u_int8_t *src, u_int32_t size,
+                                  u_int8_t *dest) {
+    (void)state;
+    return bitpack_encode((u_int32_t*)src, size / sizeof(u_int32_t), dest);
+}
+
+static int bitpack_check_bytes(u_int8_t *src, u_int32_t len, u_int32_t size) {
+    if (size % sizeof(u_int32_t) != 0) {
+        return -1;
+    }
+    return bitpack_check(src, len, size / sizeof(u_int32_t));
+}
+
+static void bitpack_decompress(void *state, u_int8_t *src, u_int32_t size,
+                               u_int8_t *dest) {
+    (void)state;
+    bitpack_decode(src, size / sizeof(u_int32_t), (u_int32_t*)dest);
+}
+
+static const tsdb_codec codecs[] = {
+    { CODEC_QLZ, "qlz", qlz1_state, qlz_bound,
+      qlz1_compress, qlz_check, qlz1_decompress },
+    { CODEC_BITPACK, "bitpack", no_state, bitpack_bound_bytes,
+      bitpack_compress, bitpack_check_bytes, bitpack_decompress },
+    { CODEC_RAW, "raw", no_state, raw_bound,
+      raw_compress, raw_check, raw_decompress },
+    { CODEC_QLZ3, "qlz3", qlz3_state, qlz_bound,
+      qlz3_compress_fragment, qlz_check, qlz3_decompress_fragment },
+};
+
+#define NUM_BUILTIN_CODECS (sizeof(codecs) / sizeof(codecs[0]))
+
+const tsdb_codec *codec_find(u_int8_t id) {
+    u_int32_t i;
+
+    for (i = 0; i < NUM_BUILTIN_CODECS; i++) {
+        if (codecs[i].id == id) {
+            return &codecs[i];
+        }
+    }
+
+    return NULL;
+}
+
+const tsdb_codec *codec_named(const char *name) {
+    u_int32_t i;
+
+    for (i = 0; i < NUM_BUILTIN_CODECS; i++) {
+        if (strcmp(codecs[i].name, name) == 0) {
+            return &codecs[i];
+        }
+    }
+
+    return NULL;
+}
+
+int codec_prepare(tsdb_codec_state *state, const tsdb_codec *codec,
+                  u_int8_t compress) {
+    void **ptr = compress ? &state->compress[codec->id]
+        : &state->decompress[codec->id];
+    u_int32_t size = codec->state_size(compress);
+
+    if (*ptr || size == 0) {
+        return 0;
+    }
+
+    if (!(*ptr = calloc(1, size))) {
+        return -2;
+    }
+
+    return 0;
+}
+
+void codec_state_free(tsdb_codec_state *state) {
+    u_int32_t i;
+
+    for (i = 0; i < NUM_CODECS; i++) {
+        free(state->compress[i]);
+        free(state->decompress[i]);
+    }
+
+    memset(state, 0, sizeof(tsdb_codec_state));
+}
@@ -0,0 +1,138 @@
+/*
+ *
+ *  Copyright (C) 2011 IIT/CNR (http://www.iit.cnr.it/en)
+ *                     Luca Deri <deri@ntop.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+// Stored fragments start with a header, except for fragments written
+// before headers were added, which are plain quicklz blocks. quicklz
+// always clears the top bit of its first byte, so FRAGMENT_MARK tells the
+// two apart.
+//
+// mark(1) transform(1) codec(1) depth(1) ref_epoch(4) size(4)
+
+#define FRAGMENT_MARK       0x80
+#define FRAGMENT_HEADER_LEN 12
+
+// Values are stored as is, or against the same fragment of the previous
+// epoch (ref_epoch)
+#define TRANSFORM_NONE  0
+#define TRANSFORM_XOR   1
+#define TRANSFORM_DELTA 2   // zig-zag encoded difference
+
+// Codecs compress a fragment's (transformed) values. The id is stored in
+// each fragment's header, so a database may mix them.
+#define CODEC_QLZ     1     // quicklz level 1
+#define CODEC_BITPACK 2
+#define CODEC_RAW     3
+#define CODEC_QLZ3    4     // quicklz level 3: slower, decompresses faster
+#define NUM_CODECS    5
+
+// Not a codec: identical fragments are stored once, in a "blob-HASH"
+// record, and the payload of each is the 8 byte hash
+#define CODEC_BLOB    5
+
+// Bit-packing: values are stored in blocks of BITPACK_BLOCK_VALUES as
+// min(4) bits(1) followed by bits * 16 bytes of (value - min), with four
+// interleaved 32-bit lanes so that blocks unpack with SIMD shifts.
+#define BITPACK_BLOCK_VALUES 128
+#define BITPACK_BLOCK_HEADER 5
+
+// Picked over the database's codec unless it's this fraction (1/n)
+// larger, as it decodes much faster
+#define BITPACK_PREFERENCE 8
+
+// Longest chain of fragments stored against a previous epoch. Decoding a
+// fragment may need every fragment in its chain.
+#define MAX_TRANSFORM_DEPTH 8
+
+typedef struct {
+    u_int8_t transform;
+    u_int8_t codec;
+    u_int8_t depth;
+    u_int32_t ref_epoch;
+    u_int32_t size;         // Decoded size
+} tsdb_fragment_header;
+
+extern void fragment_write_header(tsdb_fragment_header *header,
+                                  u_int8_t *dest);
+
+// Returns the header length, 0 for a plain quicklz block or -1 if the
+// fragment is unreadable
+extern int fragment_read_header(u_int8_t *src, u_int32_t len,
+                                tsdb_fragment_header *header);
+
+extern void fragment_transform(u_int8_t transform, u_int32_t *values,
+                               u_int32_t *ref, u_int32_t num_values,
+                               u_int32_t *dest);
+
+// Reverses fragment_transform in place
+extern void fragment_untransform(u_int8_t transform, u_int32_t *values,
+                                 u_int32_t *ref, u_int32_t num_values);
+
+// 64-bit content hash (xxHash64)
+extern u_int64_t fragment_hash(u_int8_t *data, u_int32_t len);
+
+// Largest encoded size for num_values
+extern u_int32_t bitpack_bound(u_int32_t num_values);
+
+extern u_int32_t bitpack_size(u_int32_t *values, u_int32_t num_values);
+
+extern u_int32_t bitpack_encode(u_int32_t *values, u_int32_t num_values,
+                                u_int8_t *dest);
+
+// Returns 0 if src holds exactly num_values, -1 otherwise
+extern int bitpack_check(u_int8_t *src, u_int32_t len, u_int32_t num_values);
+
+// src must have passed bitpack_check
+extern void bitpack_decode(u_int8_t *src, u_int32_t num_values,
+                           u_int32_t *dest);
+
+// Any state a codec needs is allocated per thread by codec_prepare and
+// passed to compress and decompress.
+typedef struct {
+    u_int8_t id;
+    const char *name;
+    u_int32_t (*state_size)(u_int8_t compress);
+    // Largest compressed size of size bytes
+    u_int32_t (*bound)(u_int32_t size);
+    u_int32_t (*compress)(void *state, u_int8_t *src, u_int32_t size,
+                          u_int8_t *dest);
+    // Returns 0 if src holds exactly size bytes, -1 otherwise
+    int (*check)(u_int8_t *src, u_int32_t len, u_int32_t size);
+    // src must have passed check
+    void (*decompress)(void *state, u_int8_t *src, u_int32_t size,
+                       u_int8_t *dest);
+} tsdb_codec;
+
+typedef struct {
+    void *compress[NUM_CODECS];
+    void *decompress[NUM_CODECS];
+} tsdb_codec_state;
+
+// NULL if there's no such codec
+extern const tsdb_codec *codec_find(u_int8_t id);
+extern const tsdb_codec *codec_named(const char *name);
+
+// Allocates what state needs for codec. Returns -2 if out of memory.
+extern int codec_prepare(tsdb_codec_state *state, const tsdb_codec *codec,
+                         u_int8_t compress);
+
+extern void codec_state_free(tsdb_codec_state *state);
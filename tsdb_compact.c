@@ -0,0 +1,188 @@
+#include <sys/time.h>
+
+#include "tsdb_api.h"
+
+typedef struct {
+    char *file;
+    u_int8_t codec;
+    u_int32_t age;
+    u_int32_t batch;
+    u_int32_t rate;
+    int verbose;
+} compact_args;
+
+static void help(int code) {
+    printf("tsdb-compact [-v] [-c qlz|qlz3|bitpack|raw] [-a age] "
+           "[-b batch] [-r rate] file\n");
+    exit(code);
+}
+
+static void check_strtol_error(int no_digits, long val, int err,
+                               const char *argname) {
+    if (no_digits
+        || (err == ERANGE && (val == LONG_MAX || val == LONG_MIN))
+        || (err != 0 && val == 0)
+        || val < 0) {
+        printf("tsdb-compact: invalid value for %s\n", argname);
+        exit(1);
+    }
+}
+
+static int unit_seconds_val(const char *units, const char *argname) {
+    if (*units == '\0' || strcmp(units, "s") == 0) {
+        return 1;
+    } else if (strcmp(units, "m") == 0) {
+        return 60;
+    } else if (strcmp(units, "h") == 0) {
+        return 3600;
+    } else if (strcmp(units, "d") == 0) {
+        return 86400;
+    } else {
+        printf("tsdb-compact: unknown unit for %s\n", argname);
+        exit(1);
+    }
+}
+
+static u_int32_t seconds_val(const char *str, const char *argname) {
+    char *units;
+    long numval;
+
+    errno = 0;
+    numval = strtol(str, &units, 10);
+    check_strtol_error(str == units, numval, errno, argname);
+    return numval * unit_seconds_val(units, argname);
+}
+
+static u_int32_t uint_val(const char *str, const char *argname) {
+    char *end;
+    long numval;
+
+    errno = 0;
+    numval = strtol(str, &end, 10);
+    check_strtol_error(str == end || *end != '\0', numval, errno, argname);
+    return numval;
+}
+
+static u_int8_t codec_val(const char *str) {
+    const tsdb_codec *codec = codec_named(str);
+    if (!codec) {
+        printf("tsdb-compact: invalid value for codec\n");
+        exit(1);
+    }
+    return codec->id;
+}
+
+static void process_args(int argc, char *argv[], compact_args *args) {
+    int c;
+
+    args->codec = CODEC_QLZ3;
+    args->age = 86400;
+    args->batch = 100;
+    args->rate = 0;
+    args->verbose = 0;
+
+    while ((c = getopt(argc, argv, "hvc:a:b:r:")) != -1) {
+        switch (c) {
+        case 'c':
+            args->codec = codec_val(optarg);
+            break;
+        case 'a':
+            args->age = seconds_val(optarg, "age");
+            break;
+        case 'b':
+            args->batch = uint_val(optarg, "batch");
+            break;
+        case 'r':
+            args->rate = uint_val(optarg, "rate");
+            break;
+        case 'v':
+            args->verbose = 1;
+            break;
+        case 'h':
+            help(0);
+            break;
+        default:
+            help(1);
+        }
+    }
+
+    int remaining = argc - optind;
+    if (remaining != 1 || args->batch == 0) {
+        help(1);
+    }
+    args->file = argv[optind];
+}
+
+static void check_file_exists(const char *path) {
+    if (access(path, F_OK) != 0) {
+        printf("tsdb-compact: %s doesn't exist\n", path);
+        exit(1);
+    }
+}
+
+static void init_trace(int verbose) {
+    set_trace_level(verbose ? 99 : 0);
+}
+
+static double now_seconds(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Sleeps until no more than rate fragments a second have been stored
+static void throttle(u_int32_t rate, double start, u_int32_t fragments) {
+    double wait;
+
+    if (rate == 0) {
+        return;
+    }
+    wait = start + (double)fragments / rate - now_seconds();
+    if (wait > 0) {
+        usleep(wait * 1000000);
+    }
+}
+
+static void compact_db(compact_args *args) {
+    tsdb_handler db;
+    tsdb_compact_stats stats;
+    u_int16_t unused16 = 0;
+    u_int32_t unused32 = 0;
+    u_int32_t before = time(NULL) - args->age;
+    double start = now_seconds();
+    int rc;
+
+    if (tsdb_open(args->file, &db, &unused16, unused32, 0)) {
+        printf("tsdb-compact: error opening db %s\n", args->file);
+        exit(1);
+    }
+
+    memset(&stats, 0, sizeof(stats));
+    do {
+        rc = tsdb_compact(&db, args->codec, before, args->batch, &stats);
+        throttle(args->rate, start, stats.fragments);
+    } while (rc == 1);
+
+    tsdb_close(&db);
+
+    if (rc != 0) {
+        printf("tsdb-compact: error compacting %s\n", args->file);
+        exit(1);
+    }
+
+    printf("Recompressed %u of %u fragments [%llu -> %llu bytes]\n",
+           stats.fragments, stats.examined,
+           (unsigned long long)stats.bytes_before,
+           (unsigned long long)stats.bytes_after);
+}
+
+int main(int argc, char *argv[]) {
+    compact_args args;
+
+    process_args(argc, argv, &args);
+    init_trace(args.verbose);
+    check_file_exists(args.file);
+    compact_db(&args);
+
+    return 0;
+}
@@ -4,6 +4,9 @@ typedef struct {
     char *file;
     u_int32_t slot_seconds;
     u_int16_t values_per_entry;
+    int segments;
+    u_int8_t encoding;
+    u_int8_t codec;
     int verbose;
 } create_args;
 
@@ -12,7 +15,9 @@ static void init_trace(int verbose) {
 }
 
 static void help(int code) {
-    printf("tsdb-create [-v] file slot_seconds [values_per_entry]\n");
+    printf("tsdb-create [-v] [-s] [-e none|xor|delta] "
+           "[-c qlz|qlz3|bitpack|raw]\n"
+           "            file slot_seconds [values_per_entry]\n");
     exit(code);
 }
 
@@ -34,16 +39,49 @@ static u_int32_t str_to_uint32(const char *str, const char *argname) {
     return num;
 }
 
+static u_int8_t str_to_encoding(const char *str) {
+    if (strcmp(str, "none") == 0) {
+        return TRANSFORM_NONE;
+    } else if (strcmp(str, "xor") == 0) {
+        return TRANSFORM_XOR;
+    } else if (strcmp(str, "delta") == 0) {
+        return TRANSFORM_DELTA;
+    }
+    printf("tsdb-create: invalid value for encoding\n");
+    exit(1);
+}
+
+static u_int8_t str_to_codec(const char *str) {
+    const tsdb_codec *codec = codec_named(str);
+    if (!codec) {
+        printf("tsdb-create: invalid value for codec\n");
+        exit(1);
+    }
+    return codec->id;
+}
+
 static void process_create_args(int argc, char *argv[], create_args *args) {
     int c;
 
     args->verbose = 0;
+    args->segments = 0;
+    args->encoding = TRANSFORM_NONE;
+    args->codec = CODEC_QLZ;
 
-    while ((c = getopt(argc, argv, "hv")) != -1) {
+    while ((c = getopt(argc, argv, "hse:c:v")) != -1) {
         switch (c) {
         case 'h':
             help(0);
             break;
+        case 's':
+            args->segments = 1;
+            break;
+        case 'e':
+            args->encoding = str_to_encoding(optarg);
+            break;
+        case 'c':
+            args->codec = str_to_codec(optarg);
+            break;
         case 'v':
             args->verbose = 1;
             break;
@@ -82,14 +120,25 @@ static void validate_values_per_entry(u_int16_t values_per_entry) {
 
 static void create_db(char *file,
                       u_int32_t slot_seconds,
-                      u_int16_t values_per_entry) {
+                      u_int16_t values_per_entry,
+                      int segments,
+                      u_int8_t encoding,
+                      u_int8_t codec) {
     tsdb_handler handler;
     int rc;
-    rc = tsdb_open(file, &handler, &values_per_entry, slot_seconds, 0);
+    rc = tsdb_open_backend(file, &handler, &values_per_entry, slot_seconds, 0,
+                           segments ? &tsdb_segment_backend
+                                    : &tsdb_bdb_backend);
     if (rc) {
         printf("tsdb-create: error creating database\n");
         exit(1);
     }
+    if (encoding != TRANSFORM_NONE) {
+        tsdb_set_encoding(&handler, encoding);
+    }
+    if (codec != CODEC_QLZ) {
+        tsdb_set_codec(&handler, codec);
+    }
     tsdb_close(&handler);
 }
 
@@ -102,7 +151,8 @@ int main(int argc, char *argv[]) {
     check_file_exists(args.file);
     validate_slot_seconds(args.slot_seconds);
     validate_values_per_entry(args.values_per_entry);
-    create_db(args.file, args.slot_seconds, args.values_per_entry);
+    create_db(args.file, args.slot_seconds, args.values_per_entry,
+              args.segments, args.encoding, args.codec);
 
     return 0;
 }
@@ -0,0 +1,101 @@
+/*
+ *
+ *  Copyright (C) 2011 IIT/CNR (http://www.iit.cnr.it/en)
+ *                     Luca Deri <deri@ntop.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "tsdb_format.h"
+
+static void put_u32_be(u_int8_t *buf, u_int32_t value) {
+    buf[0] = value >> 24;
+    buf[1] = value >> 16;
+    buf[2] = value >> 8;
+    buf[3] = value;
+}
+
+static u_int32_t get_u32_be(const u_int8_t *buf) {
+    return ((u_int32_t)buf[0] << 24) | ((u_int32_t)buf[1] << 16)
+        | ((u_int32_t)buf[2] << 8) | buf[3];
+}
+
+void fragment_key(u_int32_t format, u_int32_t epoch, u_int32_t fragment,
+                  tsdb_fragment_key *key) {
+    if (format == FORMAT_TEXT_KEYS) {
+        key->len = snprintf((char*)key->data, sizeof(key->data), "%u-%u",
+                            epoch, fragment);
+        return;
+    }
+
+    key->data[0] = FRAGMENT_KEY_TYPE;
+    put_u32_be(&key->data[1], epoch);
+    put_u32_be(&key->data[5], fragment);
+    key->len = 9;
+}
+
+void fragment_key_epoch(u_int32_t format, u_int32_t epoch,
+                        tsdb_fragment_key *key) {
+    if (format == FORMAT_TEXT_KEYS) {
+        key->len = snprintf((char*)key->data, sizeof(key->data), "%u-",
+                            epoch);
+        return;
+    }
+
+    key->data[0] = FRAGMENT_KEY_TYPE;
+    put_u32_be(&key->data[1], epoch);
+    key->len = 5;
+}
+
+void fragment_key_first(u_int32_t format, tsdb_fragment_key *key) {
+    key->data[0] = format == FORMAT_TEXT_KEYS ? '0' : FRAGMENT_KEY_TYPE;
+    key->len = 1;
+}
+
+int fragment_key_in_range(u_int32_t format, void *key, u_int32_t key_len) {
+    u_int8_t c = key_len ? *(u_int8_t*)key : 0;
+
+    if (format == FORMAT_TEXT_KEYS) {
+        // Digits sort before every other text key
+        return c >= '0' && c <= '9';
+    }
+
+    return c == FRAGMENT_KEY_TYPE;
+}
+
+int fragment_key_parse(u_int32_t format, void *key, u_int32_t key_len,
+                       u_int32_t *epoch, u_int32_t *fragment) {
+    char str[FRAGMENT_KEY_MAX];
+
+    if (format == FORMAT_TEXT_KEYS) {
+        if (key_len == 0 || key_len >= sizeof(str)) {
+            return -1;
+        }
+        memcpy(str, key, key_len);
+        str[key_len] = '\0';
+        return sscanf(str, "%u-%u", epoch, fragment) == 2 ? 0 : -1;
+    }
+
+    if (key_len != 9 || *(u_int8_t*)key != FRAGMENT_KEY_TYPE) {
+        return -1;
+    }
+    *epoch = get_u32_be((u_int8_t*)key + 1);
+    *fragment = get_u32_be((u_int8_t*)key + 5);
+
+    return 0;
+}
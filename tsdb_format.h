@@ -0,0 +1,63 @@
+/*
+ *
+ *  Copyright (C) 2011 IIT/CNR (http://www.iit.cnr.it/en)
+ *                     Luca Deri <deri@ntop.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+// On-disk format of a database, stored in the "format" record. Databases
+// without one are FORMAT_TEXT_KEYS.
+//
+// FORMAT_TEXT_KEYS stores fragments as "EPOCH-FRAGMENT" records, which
+// sort as strings: "1000-10" comes before "1000-2", and epochs of
+// different lengths are mixed together.
+//
+// FORMAT_BINARY_KEYS stores them under FRAGMENT_KEY_TYPE followed by the
+// big-endian epoch and fragment, so they sort by epoch then fragment with
+// the default byte order. The type byte sorts before any text key.
+
+#define FORMAT_TEXT_KEYS   1
+#define FORMAT_BINARY_KEYS 2
+#define FORMAT_CURRENT     FORMAT_BINARY_KEYS
+
+#define FRAGMENT_KEY_TYPE 0x01
+#define FRAGMENT_KEY_MAX  24
+
+typedef struct {
+    u_int8_t data[FRAGMENT_KEY_MAX];
+    u_int32_t len;
+} tsdb_fragment_key;
+
+void fragment_key(u_int32_t format, u_int32_t epoch, u_int32_t fragment,
+                  tsdb_fragment_key *key);
+
+// The first key of the epoch's fragments
+void fragment_key_epoch(u_int32_t format, u_int32_t epoch,
+                        tsdb_fragment_key *key);
+
+// The first key of any fragment
+void fragment_key_first(u_int32_t format, tsdb_fragment_key *key);
+
+// Whether a key sorts with the fragment keys. Keys after the last one
+// don't.
+int fragment_key_in_range(u_int32_t format, void *key, u_int32_t key_len);
+
+// Returns -1 if key isn't a fragment key
+int fragment_key_parse(u_int32_t format, void *key, u_int32_t key_len,
+                       u_int32_t *epoch, u_int32_t *fragment);
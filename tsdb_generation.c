@@ -0,0 +1,113 @@
+/*
+ *
+ *  Copyright (C) 2011 IIT/CNR (http://www.iit.cnr.it/en)
+ *                     Luca Deri <deri@ntop.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <string.h>
+
+#include "tsdb_generation.h"
+
+#define GENERATION_MIN_SIZE 1024
+
+static u_int32_t hash_index(u_int32_t index) {
+    // Fibonacci hashing
+    return index * 2654435761U;
+}
+
+int generation_get(tsdb_generation *gen, u_int32_t index, u_int32_t *slot) {
+    u_int32_t pos;
+
+    if (gen->table_size == 0) {
+        return -1;
+    }
+
+    pos = hash_index(index) & (gen->table_size - 1);
+    while (gen->table[pos]) {
+        if (gen->indexes[gen->table[pos] - 1] == index) {
+            *slot = gen->table[pos] - 1;
+            return 0;
+        }
+        pos = (pos + 1) & (gen->table_size - 1);
+    }
+
+    return -1;
+}
+
+static void insert_slot(u_int32_t *table, u_int32_t size, u_int32_t index,
+                        u_int32_t slot) {
+    u_int32_t pos = hash_index(index) & (size - 1);
+
+    while (table[pos]) {
+        pos = (pos + 1) & (size - 1);
+    }
+    table[pos] = slot + 1;
+}
+
+static int grow_table(tsdb_generation *gen) {
+    u_int32_t new_size = gen->table_size ? gen->table_size * 2
+                                         : GENERATION_MIN_SIZE;
+    u_int32_t *table, slot;
+
+    if (!(table = calloc(new_size, sizeof(u_int32_t)))) {
+        return -1;
+    }
+    for (slot = 0; slot < gen->num_slots; slot++) {
+        insert_slot(table, new_size, gen->indexes[slot], slot);
+    }
+
+    free(gen->table);
+    gen->table = table;
+    gen->table_size = new_size;
+
+    return 0;
+}
+
+int generation_add(tsdb_generation *gen, u_int32_t index, u_int32_t *slot) {
+    if (gen->num_slots == gen->indexes_size) {
+        u_int32_t new_size = gen->indexes_size ? gen->indexes_size * 2
+                                               : GENERATION_MIN_SIZE;
+        u_int32_t *indexes = realloc(gen->indexes,
+                                     new_size * sizeof(u_int32_t));
+        if (!indexes) {
+            return -1;
+        }
+        gen->indexes = indexes;
+        gen->indexes_size = new_size;
+    }
+
+    // Keep the load factor under 1/2
+    if ((gen->num_slots + 1) * 2 > gen->table_size && grow_table(gen) != 0) {
+        return -1;
+    }
+
+    *slot = gen->num_slots++;
+    gen->indexes[*slot] = index;
+    insert_slot(gen->table, gen->table_size, index, *slot);
+
+    return 0;
+}
+
+void generation_free(tsdb_generation *gen) {
+    free(gen->indexes);
+    free(gen->table);
+    gen->indexes = NULL;
+    gen->indexes_size = 0;
+    gen->table = NULL;
+    gen->table_size = 0;
+    gen->loaded = 0;
+}
@@ -0,0 +1,50 @@
+/*
+ *
+ *  Copyright (C) 2011 IIT/CNR (http://www.iit.cnr.it/en)
+ *                     Luca Deri <deri@ntop.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+// A generation is a range of epochs with its own key slots: the position
+// of each key's values in the epochs' chunks. Slots are assigned in the
+// order keys are first written in the generation, so its epochs are only
+// as wide as the keys in use, however many came before.
+//
+// Slots are stored as "gen-GENERATION-BLOCK" records of up to
+// GENERATION_BLOCK_SLOTS key indexes, in slot order.
+
+#define GENERATION_BLOCK_SLOTS 1024
+
+typedef struct {
+    u_int32_t start;            // First epoch
+    u_int32_t num_slots;
+    u_int32_t num_written;      // Slots stored in the database
+    u_int8_t loaded;
+    u_int32_t *indexes;         // slot -> index
+    u_int32_t indexes_size;
+    u_int32_t *table;           // index -> slot + 1, 0 for an empty entry
+    u_int32_t table_size;
+} tsdb_generation;
+
+int generation_get(tsdb_generation *gen, u_int32_t index, u_int32_t *slot);
+
+// Assigns the next slot to index
+int generation_add(tsdb_generation *gen, u_int32_t index, u_int32_t *slot);
+
+void generation_free(tsdb_generation *gen);
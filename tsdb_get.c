@@ -136,18 +136,6 @@ static void open_db(char *file, tsdb_handler *db) {
     }
 }
 
-static int goto_epoch(tsdb_handler *db, u_int32_t epoch) {
-    if (tsdb_goto_epoch(db, epoch, 1, 0)) {
-        return 0;
-    } else {
-        return 1;
-    }
-}
-
-static int get_vals(tsdb_handler *db, char *key, tsdb_value **vals) {
-    return tsdb_get_by_key(db, key, vals);
-}
-
 static void print_missing(u_int32_t epoch, int value_count) {
     int i;
     printf("%u", epoch);
@@ -166,40 +154,53 @@ static void print_vals(u_int32_t epoch, int count, tsdb_value *vals) {
     printf("\n");
 }
 
-static void print_key_vals(tsdb_handler *db, char *key, u_int32_t epoch) {
-    tsdb_value *vals;
-    if (get_vals(db, key, &vals) >= 0) {
-        print_vals(epoch, db->values_per_entry, vals);
-    } else {
-        print_missing(epoch, db->values_per_entry);
-    }
-}
-
-static void print_epoch_vals(tsdb_handler *db, u_int32_t epoch, char *key) {
-    if (goto_epoch(db, epoch)) {
-        print_key_vals(db, key, epoch);
-    } else {
-        print_missing(epoch, db->values_per_entry);
-    }
-}
-
 static void print_tsdb_values(char *file, char *key, u_int32_t start,
                               u_int32_t end, u_int16_t interval) {
     tsdb_handler db;
-    u_int32_t cur_epoch = start;
+    u_int32_t cur_epoch = start, index, slots = 0, count = 0, slot;
+    tsdb_value *vals = NULL;
+    u_int8_t *present = NULL;
 
     open_db(file, &db);
+    tsdb_set_load_on_demand(&db, 1);
 
     normalize_epoch(&db, &cur_epoch);
     normalize_epoch(&db, &end);
     if (interval <= 0) {
         interval = db.slot_duration;
     }
+    start = cur_epoch;
+
+    // Read the whole series in one go, then print the requested slots
+    if (end >= start && tsdb_get_key_index(&db, key, &index) == 0) {
+        slots = (end - start) / db.slot_duration + 1;
+        vals = calloc(slots, db.values_len);
+        present = calloc(slots, sizeof(u_int8_t));
+        if (!vals || !present) {
+            printf("tsdb-get: out of memory\n");
+            exit(1);
+        }
+        if (tsdb_get_series(&db, index, start, end, vals, present,
+                            slots, &count)) {
+            printf("tsdb-get: error reading values\n");
+            exit(1);
+        }
+    }
 
     while (cur_epoch <= end) {
-        print_epoch_vals(&db, cur_epoch, key);
+        slot = (cur_epoch - start) / db.slot_duration;
+        if (slot < count && present[slot]) {
+            print_vals(cur_epoch, db.values_per_entry,
+                       &vals[slot * db.values_per_entry]);
+        } else {
+            print_missing(cur_epoch, db.values_per_entry);
+        }
         cur_epoch += interval;
     }
+
+    free(vals);
+    free(present);
+    tsdb_close(&db);
 }
 
 int main(int argc, char *argv[]) {
@@ -61,6 +61,9 @@ static void print_db_info(char *file) {
     printf("          Size: %zd\n", info.st_size);
     printf("Vals Per Entry: %u\n", db.values_per_entry);
     printf("  Slot Seconds: %u\n", db.slot_duration);;
+    printf("         Codec: %s\n", codec_find(db.codec)->name);
+    printf("     Retention: %u\n", db.retention);
+    printf("        Format: %u\n", db.format);
     tsdb_close(&db);
 }
 
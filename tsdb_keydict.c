@@ -0,0 +1,494 @@
+/*
+ *
+ *  Copyright (C) 2011 IIT/CNR (http://www.iit.cnr.it/en)
+ *                     Luca Deri <deri@ntop.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tsdb_keydict.h"
+#include "tsdb_trace.h"
+
+typedef struct {
+    const u_int8_t *ptr;
+    const u_int8_t *end;
+    u_int32_t block;
+    u_int32_t pos;          // Entries read from the block
+    char *key;
+    u_int32_t key_len;
+    u_int32_t key_size;
+    u_int32_t index;
+} keydict_cursor;
+
+typedef struct {
+    FILE *file;
+    u_int64_t offset;
+    u_int64_t *blocks;
+    u_int32_t num_blocks;
+    u_int32_t blocks_size;
+    char *prev;
+    u_int32_t prev_len;
+    u_int32_t prev_size;
+    u_int32_t count;
+} keydict_writer;
+
+static int read_varint(const u_int8_t **ptr, const u_int8_t *end,
+                       u_int32_t *value) {
+    u_int32_t shift = 0;
+
+    *value = 0;
+    while (*ptr < end && shift < 35) {
+        u_int8_t byte = *(*ptr)++;
+        *value |= (u_int32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+        shift += 7;
+    }
+
+    return -1;
+}
+
+static const u_int8_t *block_start(const tsdb_keydict *dict, u_int32_t block) {
+    u_int64_t offset;
+
+    memcpy(&offset, &dict->map[dict->blocks_offset + block * 8], 8);
+
+    return &dict->map[offset];
+}
+
+static const u_int8_t *block_end(const tsdb_keydict *dict, u_int32_t block) {
+    if (block + 1 < dict->num_blocks) {
+        return block_start(dict, block + 1);
+    }
+    return &dict->map[dict->blocks_offset];
+}
+
+static u_int32_t block_count(const tsdb_keydict *dict, u_int32_t block) {
+    if (block + 1 < dict->num_blocks) {
+        return KEYDICT_BLOCK_KEYS;
+    }
+    return dict->count - block * KEYDICT_BLOCK_KEYS;
+}
+
+int keydict_compare(const char *a, u_int32_t a_len,
+                    const char *b, u_int32_t b_len) {
+    int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+
+    if (cmp != 0) {
+        return cmp;
+    }
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+int keydict_open(tsdb_keydict *dict, const char *path) {
+    struct stat st;
+    u_int32_t magic, version;
+    u_int64_t offset;
+    u_int32_t i;
+    int fd;
+
+    memset(dict, 0, sizeof(tsdb_keydict));
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size < KEYDICT_HEADER_LEN) {
+        close(fd);
+        trace_error("Key dictionary %s is truncated", path);
+        return -1;
+    }
+
+    dict->map = (u_int8_t*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+                                fd, 0);
+    close(fd);
+    if (dict->map == MAP_FAILED) {
+        dict->map = NULL;
+        trace_error("Unable to map key dictionary %s", path);
+        return -1;
+    }
+    dict->map_len = st.st_size;
+
+    memcpy(&magic, &dict->map[0], 4);
+    memcpy(&version, &dict->map[4], 4);
+    memcpy(&dict->count, &dict->map[8], 4);
+    memcpy(&dict->num_blocks, &dict->map[12], 4);
+    memcpy(&dict->blocks_offset, &dict->map[16], 8);
+
+    if (magic != KEYDICT_MAGIC || version != KEYDICT_VERSION
+        || dict->num_blocks != (dict->count + KEYDICT_BLOCK_KEYS - 1)
+                                / KEYDICT_BLOCK_KEYS
+        || dict->blocks_offset < KEYDICT_HEADER_LEN
+        || dict->blocks_offset + (u_int64_t)dict->num_blocks * 8
+           != dict->map_len) {
+        trace_error("Key dictionary %s is corrupt", path);
+        keydict_close(dict);
+        return -1;
+    }
+
+    // Blocks must be in order for block_end
+    for (i = 0; i < dict->num_blocks; i++) {
+        memcpy(&offset, &dict->map[dict->blocks_offset + i * 8], 8);
+        if (offset < KEYDICT_HEADER_LEN || offset > dict->blocks_offset
+            || (i > 0 && block_start(dict, i - 1) > &dict->map[offset])) {
+            trace_error("Key dictionary %s is corrupt", path);
+            keydict_close(dict);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void keydict_close(tsdb_keydict *dict) {
+    if (dict->map) {
+        munmap(dict->map, dict->map_len);
+    }
+    free(dict->key_buf);
+    memset(dict, 0, sizeof(tsdb_keydict));
+}
+
+static void cursor_seek(const tsdb_keydict *dict, keydict_cursor *c,
+                        u_int32_t block) {
+    c->ptr = block_start(dict, block);
+    c->end = block_end(dict, block);
+    c->block = block;
+    c->pos = 0;
+    c->key_len = 0;
+}
+
+// Decodes the next key, moving on to the next block as need be. Returns -1
+// at the end of the dictionary.
+static int cursor_next(const tsdb_keydict *dict, keydict_cursor *c) {
+    u_int32_t shared, suffix_len;
+
+    if (c->pos == block_count(dict, c->block)) {
+        if (c->block + 1 >= dict->num_blocks) {
+            return -1;
+        }
+        cursor_seek(dict, c, c->block + 1);
+    }
+
+    if (read_varint(&c->ptr, c->end, &shared) != 0
+        || read_varint(&c->ptr, c->end, &suffix_len) != 0
+        || shared > c->key_len
+        || suffix_len > (u_int32_t)(c->end - c->ptr)) {
+        trace_error("Key dictionary block %u is corrupt", c->block);
+        return -2;
+    }
+
+    if (shared + suffix_len + 1 > c->key_size) {
+        u_int32_t new_size = c->key_size ? c->key_size : 64;
+        char *key;
+
+        while (shared + suffix_len + 1 > new_size) {
+            new_size *= 2;
+        }
+        if (!(key = realloc(c->key, new_size))) {
+            return -2;
+        }
+        c->key = key;
+        c->key_size = new_size;
+    }
+
+    memcpy(&c->key[shared], c->ptr, suffix_len);
+    c->ptr += suffix_len;
+    c->key_len = shared + suffix_len;
+    c->key[c->key_len] = '\0';
+
+    if (read_varint(&c->ptr, c->end, &c->index) != 0) {
+        trace_error("Key dictionary block %u is corrupt", c->block);
+        return -2;
+    }
+    c->pos++;
+
+    return 0;
+}
+
+// The last block with a first key <= key, or 0
+static u_int32_t find_block(const tsdb_keydict *dict, const char *key,
+                            u_int32_t key_len) {
+    u_int32_t low = 0, high = dict->num_blocks, mid, shared, len;
+    const u_int8_t *ptr, *end;
+
+    while (high - low > 1) {
+        mid = low + (high - low) / 2;
+        ptr = block_start(dict, mid);
+        end = block_end(dict, mid);
+        if (read_varint(&ptr, end, &shared) != 0
+            || read_varint(&ptr, end, &len) != 0
+            || len > (u_int32_t)(end - ptr)) {
+            // Corrupt, left for the cursor to report
+            high = mid;
+            continue;
+        }
+        if (keydict_compare((const char*)ptr, len, key, key_len) <= 0) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+// Seeks to the block that would hold key, borrowing the key buffer
+static void start_cursor(tsdb_keydict *dict, keydict_cursor *c,
+                         const char *key, u_int32_t key_len) {
+    memset(c, 0, sizeof(keydict_cursor));
+    c->key = dict->key_buf;
+    c->key_size = dict->key_buf_size;
+    cursor_seek(dict, c, find_block(dict, key, key_len));
+}
+
+static void end_cursor(tsdb_keydict *dict, keydict_cursor *c) {
+    dict->key_buf = c->key;
+    dict->key_buf_size = c->key_size;
+}
+
+int keydict_get(tsdb_keydict *dict, const char *key, u_int32_t key_len,
+                u_int32_t *index) {
+    keydict_cursor c;
+    int cmp, rc = -1;
+
+    if (dict->count == 0) {
+        return -1;
+    }
+
+    start_cursor(dict, &c, key, key_len);
+
+    while (c.pos < block_count(dict, c.block)) {
+        if ((rc = cursor_next(dict, &c)) != 0) {
+            break;
+        }
+        cmp = keydict_compare(c.key, c.key_len, key, key_len);
+        if (cmp == 0) {
+            *index = c.index;
+            break;
+        }
+        rc = -1;
+        if (cmp > 0) {
+            break;
+        }
+    }
+
+    end_cursor(dict, &c);
+
+    return rc;
+}
+
+int keydict_scan(tsdb_keydict *dict, const char *prefix, u_int32_t prefix_len,
+                 keydict_handler handler, void *context) {
+    keydict_cursor c;
+    int rc;
+
+    if (dict->count == 0) {
+        return 0;
+    }
+
+    start_cursor(dict, &c, prefix, prefix_len);
+
+    while ((rc = cursor_next(dict, &c)) == 0) {
+        if (c.key_len >= prefix_len
+            && memcmp(c.key, prefix, prefix_len) == 0) {
+            if ((rc = handler(c.key, c.key_len, c.index, context)) != 0) {
+                break;
+            }
+        } else if (keydict_compare(c.key, c.key_len,
+                                   prefix, prefix_len) > 0) {
+            break;
+        }
+    }
+
+    end_cursor(dict, &c);
+
+    return rc == -1 ? 0 : rc;
+}
+
+static void put_varint(keydict_writer *w, u_int32_t value) {
+    u_int8_t buf[5];
+    u_int32_t len = 0;
+
+    while (value >= 0x80) {
+        buf[len++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    buf[len++] = value;
+
+    fwrite(buf, len, 1, w->file);
+    w->offset += len;
+}
+
+static int write_entry(keydict_writer *w, const char *key, u_int32_t key_len,
+                       u_int32_t index) {
+    u_int32_t shared = 0;
+
+    if (w->count % KEYDICT_BLOCK_KEYS == 0) {
+        if (w->num_blocks == w->blocks_size) {
+            u_int32_t new_size = w->blocks_size ? w->blocks_size * 2 : 1024;
+            u_int64_t *blocks = realloc(w->blocks, new_size * 8);
+            if (!blocks) {
+                return -2;
+            }
+            w->blocks = blocks;
+            w->blocks_size = new_size;
+        }
+        w->blocks[w->num_blocks++] = w->offset;
+    } else {
+        while (shared < key_len && shared < w->prev_len
+               && key[shared] == w->prev[shared]) {
+            shared++;
+        }
+    }
+
+    put_varint(w, shared);
+    put_varint(w, key_len - shared);
+    fwrite(&key[shared], key_len - shared, 1, w->file);
+    w->offset += key_len - shared;
+    put_varint(w, index);
+
+    if (key_len > w->prev_size) {
+        char *prev = realloc(w->prev, key_len);
+        if (!prev) {
+            return -2;
+        }
+        w->prev = prev;
+        w->prev_size = key_len;
+    }
+    if (key_len > 0) {
+        memcpy(w->prev, key, key_len);
+    }
+    w->prev_len = key_len;
+    w->count++;
+
+    return 0;
+}
+
+static int write_entries(keydict_writer *w, tsdb_keydict *dict,
+                         const keydict_entry *added, u_int32_t num_added) {
+    keydict_cursor c;
+    u_int32_t i = 0;
+    int cmp, rc = 0, more;
+
+    memset(&c, 0, sizeof(c));
+    more = dict->count > 0;
+    if (more) {
+        cursor_seek(dict, &c, 0);
+        more = (rc = cursor_next(dict, &c)) == 0;
+    }
+
+    while (rc == 0 && (more || i < num_added)) {
+        if (!more) {
+            cmp = 1;
+        } else if (i == num_added) {
+            cmp = -1;
+        } else {
+            cmp = keydict_compare(c.key, c.key_len,
+                                  added[i].key, added[i].key_len);
+        }
+
+        if (cmp < 0) {
+            rc = write_entry(w, c.key, c.key_len, c.index);
+        } else {
+            rc = write_entry(w, added[i].key, added[i].key_len,
+                             added[i].index);
+            i++;
+        }
+        if (rc == 0 && cmp <= 0) {
+            rc = cursor_next(dict, &c);
+            more = rc == 0;
+            if (rc == -1) {
+                rc = 0;
+            }
+        }
+    }
+
+    free(c.key);
+
+    return rc;
+}
+
+int keydict_write(tsdb_keydict *dict, const keydict_entry *added,
+                  u_int32_t num_added, const char *path) {
+    char tmp[PATH_MAX];
+    u_int8_t header[KEYDICT_HEADER_LEN];
+    u_int32_t magic = KEYDICT_MAGIC, version = KEYDICT_VERSION;
+    keydict_writer w;
+    int rc;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    memset(&w, 0, sizeof(w));
+    if (!(w.file = fopen(tmp, "w"))) {
+        trace_error("Unable to write key dictionary %s [%s]", tmp,
+                    strerror(errno));
+        return -2;
+    }
+
+    memset(header, 0, sizeof(header));
+    fwrite(header, sizeof(header), 1, w.file);
+    w.offset = sizeof(header);
+
+    rc = write_entries(&w, dict, added, num_added);
+
+    if (rc == 0) {
+        fwrite(w.blocks, 8, w.num_blocks, w.file);
+
+        memcpy(&header[0], &magic, 4);
+        memcpy(&header[4], &version, 4);
+        memcpy(&header[8], &w.count, 4);
+        memcpy(&header[12], &w.num_blocks, 4);
+        memcpy(&header[16], &w.offset, 8);
+
+        if (ferror(w.file)
+            || fseek(w.file, 0, SEEK_SET) != 0
+            || fwrite(header, sizeof(header), 1, w.file) != 1
+            || fflush(w.file) != 0
+            || fsync(fileno(w.file)) != 0) {
+            rc = -2;
+        }
+    }
+    if (fclose(w.file) != 0) {
+        rc = -2;
+    }
+    free(w.blocks);
+    free(w.prev);
+
+    if (rc != 0 || rename(tmp, path) != 0) {
+        trace_error("Unable to write key dictionary %s [%s]", path,
+                    strerror(errno));
+        unlink(tmp);
+        return -2;
+    }
+
+    keydict_close(dict);
+    if (keydict_open(dict, path) != 0) {
+        return -2;
+    }
+
+    trace_info("Wrote %u keys to %s", dict->count, path);
+
+    return 0;
+}
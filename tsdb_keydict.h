@@ -0,0 +1,88 @@
+/*
+ *
+ *  Copyright (C) 2011 IIT/CNR (http://www.iit.cnr.it/en)
+ *                     Luca Deri <deri@ntop.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+// Immutable, sorted key -> index dictionary, memory mapped from a file.
+//
+// Keys are front coded in blocks of KEYDICT_BLOCK_KEYS. Each entry is
+//
+//   varint shared (prefix length in common with the previous key, 0 for
+//                  the first key of a block)
+//   varint suffix length
+//   suffix
+//   varint index
+//
+// followed, after the last block, by a u_int64_t data offset per block.
+// Lookups binary search the first keys of the blocks and decode a single
+// block.
+//
+// The dictionary is rebuilt by merging it with a sorted batch of new keys
+// into a new file, which replaces the old one.
+
+#define KEYDICT_MAGIC 0x4b444331
+#define KEYDICT_VERSION 1
+#define KEYDICT_HEADER_LEN 24
+#define KEYDICT_BLOCK_KEYS 16
+
+typedef struct {
+    u_int8_t *map;          // NULL for an empty dictionary
+    u_int64_t map_len;
+    u_int32_t count;
+    u_int32_t num_blocks;
+    u_int64_t blocks_offset;
+    char *key_buf;          // Scratch for decoded keys
+    u_int32_t key_buf_size;
+} tsdb_keydict;
+
+typedef struct {
+    const char *key;
+    u_int32_t key_len;
+    u_int32_t index;
+} keydict_entry;
+
+// Called with each key, NUL terminated, in order. A non-zero return stops
+// the scan.
+typedef int (*keydict_handler)(const char *key, u_int32_t key_len,
+                               u_int32_t index, void *context);
+
+// A missing file opens as an empty dictionary. Returns -1 if the file is
+// corrupt.
+int keydict_open(tsdb_keydict *dict, const char *path);
+
+void keydict_close(tsdb_keydict *dict);
+
+int keydict_get(tsdb_keydict *dict, const char *key, u_int32_t key_len,
+                u_int32_t *index);
+
+// Visits the keys starting with prefix. Returns 0, the handler's non-zero
+// return or -2.
+int keydict_scan(tsdb_keydict *dict, const char *prefix, u_int32_t prefix_len,
+                 keydict_handler handler, void *context);
+
+// Byte order, shorter keys first
+int keydict_compare(const char *a, u_int32_t a_len,
+                    const char *b, u_int32_t b_len);
+
+// Writes dict merged with added (sorted with keydict_compare, unique) to
+// path and reopens dict from it. Added entries replace equal keys.
+int keydict_write(tsdb_keydict *dict, const keydict_entry *added,
+                  u_int32_t num_added, const char *path);
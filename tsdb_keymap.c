@@ -0,0 +1,190 @@
+/*
+ *
+ *  Copyright (C) 2011 IIT/CNR (http://www.iit.cnr.it/en)
+ *                     Luca Deri <deri@ntop.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <string.h>
+
+#include "tsdb_keymap.h"
+
+#define KEYMAP_MIN_SIZE 1024
+#define KEYMAP_ARENA_MIN_SIZE 65536
+
+static u_int32_t hash_key(const char *key, u_int32_t key_len) {
+    u_int32_t hash = 2166136261U, i;
+
+    // FNV-1a
+    for (i = 0; i < key_len; i++) {
+        hash ^= (u_int8_t)key[i];
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+static int entry_matches(tsdb_keymap *map, tsdb_keymap_entry *entry,
+                         const char *key, u_int32_t key_len,
+                         u_int32_t hash) {
+    char *entry_key = &map->arena[entry->key_offset];
+
+    return entry->hash == hash
+        && memcmp(entry_key, key, key_len) == 0
+        && entry_key[key_len] == '\0';
+}
+
+int keymap_init(tsdb_keymap *map, u_int32_t size) {
+    u_int32_t actual_size = KEYMAP_MIN_SIZE;
+
+    while (actual_size < size) {
+        actual_size *= 2;
+    }
+
+    memset(map, 0, sizeof(tsdb_keymap));
+
+    map->entries = calloc(actual_size, sizeof(tsdb_keymap_entry));
+    if (!map->entries) {
+        return -1;
+    }
+    map->size = actual_size;
+
+    map->arena = malloc(KEYMAP_ARENA_MIN_SIZE);
+    if (!map->arena) {
+        free(map->entries);
+        map->entries = NULL;
+        return -1;
+    }
+    map->arena_size = KEYMAP_ARENA_MIN_SIZE;
+
+    // Offset 0 marks an empty slot
+    map->arena[0] = '\0';
+    map->arena_len = 1;
+
+    return 0;
+}
+
+void keymap_free(tsdb_keymap *map) {
+    free(map->entries);
+    free(map->arena);
+    memset(map, 0, sizeof(tsdb_keymap));
+}
+
+int keymap_get(tsdb_keymap *map, const char *key, u_int32_t key_len,
+               u_int32_t *index) {
+    u_int32_t hash = hash_key(key, key_len);
+    u_int32_t slot = hash & (map->size - 1);
+    tsdb_keymap_entry *entry;
+
+    while (1) {
+        entry = &map->entries[slot];
+        if (entry->key_offset == 0) {
+            return -1;
+        }
+        if (entry_matches(map, entry, key, key_len, hash)) {
+            *index = entry->index;
+            return 0;
+        }
+        slot = (slot + 1) & (map->size - 1);
+    }
+}
+
+static int grow_entries(tsdb_keymap *map) {
+    u_int32_t new_size = map->size * 2, i, slot;
+    tsdb_keymap_entry *entries;
+
+    entries = calloc(new_size, sizeof(tsdb_keymap_entry));
+    if (!entries) {
+        return -1;
+    }
+
+    for (i = 0; i < map->size; i++) {
+        if (map->entries[i].key_offset == 0) {
+            continue;
+        }
+        slot = map->entries[i].hash & (new_size - 1);
+        while (entries[slot].key_offset != 0) {
+            slot = (slot + 1) & (new_size - 1);
+        }
+        entries[slot] = map->entries[i];
+    }
+
+    free(map->entries);
+    map->entries = entries;
+    map->size = new_size;
+
+    return 0;
+}
+
+static int append_key(tsdb_keymap *map, const char *key, u_int32_t key_len,
+                      u_int64_t *offset) {
+    if (map->arena_len + key_len + 1 > map->arena_size) {
+        u_int64_t new_size = map->arena_size * 2;
+        char *arena;
+
+        while (map->arena_len + key_len + 1 > new_size) {
+            new_size *= 2;
+        }
+        arena = realloc(map->arena, new_size);
+        if (!arena) {
+            return -1;
+        }
+        map->arena = arena;
+        map->arena_size = new_size;
+    }
+
+    *offset = map->arena_len;
+    memcpy(&map->arena[map->arena_len], key, key_len);
+    map->arena[map->arena_len + key_len] = '\0';
+    map->arena_len += key_len + 1;
+
+    return 0;
+}
+
+int keymap_put(tsdb_keymap *map, const char *key, u_int32_t key_len,
+               u_int32_t index) {
+    u_int32_t hash = hash_key(key, key_len), slot;
+    tsdb_keymap_entry *entry;
+
+    // Keep the load factor under 1/2
+    if ((map->count + 1) * 2 > map->size) {
+        if (grow_entries(map) != 0) {
+            return -1;
+        }
+    }
+
+    slot = hash & (map->size - 1);
+    while (1) {
+        entry = &map->entries[slot];
+        if (entry->key_offset == 0) {
+            break;
+        }
+        if (entry_matches(map, entry, key, key_len, hash)) {
+            entry->index = index;
+            return 0;
+        }
+        slot = (slot + 1) & (map->size - 1);
+    }
+
+    if (append_key(map, key, key_len, &entry->key_offset) != 0) {
+        return -1;
+    }
+    entry->hash = hash;
+    entry->index = index;
+    map->count++;
+
+    return 0;
+}
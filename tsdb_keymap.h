@@ -0,0 +1,50 @@
+/*
+ *
+ *  Copyright (C) 2011 IIT/CNR (http://www.iit.cnr.it/en)
+ *                     Luca Deri <deri@ntop.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+// Open addressing (linear probing) hash table of key -> index. Key strings
+// are copied into a single arena and referenced by offset.
+
+typedef struct {
+    u_int64_t key_offset;   // 0 for an empty slot
+    u_int32_t hash;
+    u_int32_t index;
+} tsdb_keymap_entry;
+
+typedef struct {
+    tsdb_keymap_entry *entries;
+    u_int32_t size;
+    u_int32_t count;
+    char *arena;
+    u_int64_t arena_len;
+    u_int64_t arena_size;
+} tsdb_keymap;
+
+int keymap_init(tsdb_keymap *map, u_int32_t size);
+
+void keymap_free(tsdb_keymap *map);
+
+int keymap_get(tsdb_keymap *map, const char *key, u_int32_t key_len,
+               u_int32_t *index);
+
+int keymap_put(tsdb_keymap *map, const char *key, u_int32_t key_len,
+               u_int32_t index);
@@ -0,0 +1,88 @@
+#include "tsdb_api.h"
+
+typedef struct {
+    char *file;
+    int verbose;
+} migrate_args;
+
+static void help(int code) {
+    printf("tsdb-migrate [-v] file\n");
+    exit(code);
+}
+
+static void process_args(int argc, char *argv[], migrate_args *args) {
+    int c;
+
+    args->verbose = 0;
+
+    while ((c = getopt(argc, argv, "hv")) != -1) {
+        switch (c) {
+        case 'v':
+            args->verbose = 1;
+            break;
+        case 'h':
+            help(0);
+            break;
+        default:
+            help(1);
+        }
+    }
+
+    int remaining = argc - optind;
+    if (remaining != 1) {
+        help(1);
+    }
+    args->file = argv[optind];
+}
+
+static void check_file_exists(const char *path) {
+    if (access(path, F_OK) != 0) {
+        printf("tsdb-migrate: %s doesn't exist\n", path);
+        exit(1);
+    }
+}
+
+static void init_trace(int verbose) {
+    set_trace_level(verbose ? 99 : 0);
+}
+
+static void migrate_db(migrate_args *args) {
+    tsdb_handler db;
+    u_int16_t unused16 = 0;
+    u_int32_t unused32 = 0, format, migrated = 0;
+
+    if (tsdb_open(args->file, &db, &unused16, unused32, 0)) {
+        printf("tsdb-migrate: error opening db %s\n", args->file);
+        exit(1);
+    }
+
+    format = db.format;
+    if (format == FORMAT_CURRENT) {
+        tsdb_close(&db);
+        printf("%s is already format %u\n", args->file, format);
+        return;
+    }
+
+    if (tsdb_migrate(&db, &migrated) != 0) {
+        tsdb_close(&db);
+        printf("tsdb-migrate: error migrating %s, run again to finish\n",
+               args->file);
+        exit(1);
+    }
+
+    tsdb_close(&db);
+
+    printf("Migrated %u fragments [format %u -> %u]\n", migrated, format,
+           FORMAT_CURRENT);
+}
+
+int main(int argc, char *argv[]) {
+    migrate_args args;
+
+    process_args(argc, argv, &args);
+    init_trace(args.verbose);
+    check_file_exists(args.file);
+    migrate_db(&args);
+
+    return 0;
+}
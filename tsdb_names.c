@@ -0,0 +1,156 @@
+/*
+ *
+ *  Copyright (C) 2011 IIT/CNR (http://www.iit.cnr.it/en)
+ *                     Luca Deri <deri@ntop.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <string.h>
+
+#include "tsdb_names.h"
+
+#define OFFSETS_LEN ((NAME_BLOCK_KEYS + 1) * sizeof(u_int32_t))
+
+tsdb_name_block *name_block_new(void) {
+    return calloc(1, sizeof(tsdb_name_block));
+}
+
+void name_block_free(tsdb_name_block *block) {
+    if (block) {
+        free(block->strings);
+        free(block);
+    }
+}
+
+int name_block_set(tsdb_name_block *block, u_int32_t slot,
+                   const char *key, u_int32_t key_len) {
+    u_int32_t start = block->offsets[slot];
+    u_int32_t old_len = block->offsets[slot + 1] - start;
+    u_int32_t new_len = key_len + 1;
+    u_int32_t total = block->offsets[NAME_BLOCK_KEYS] - old_len + new_len;
+    u_int32_t size, i;
+    char *strings;
+
+    if (total > block->size) {
+        size = block->size ? block->size * 2 : 1024;
+        while (size < total) {
+            size *= 2;
+        }
+        if (!(strings = realloc(block->strings, size))) {
+            return -2;
+        }
+        block->strings = strings;
+        block->size = size;
+    }
+
+    // Keys are usually added in index order, so there's rarely a tail
+    memmove(&block->strings[start + new_len], &block->strings[start + old_len],
+            block->offsets[NAME_BLOCK_KEYS] - start - old_len);
+    memcpy(&block->strings[start], key, key_len);
+    block->strings[start + key_len] = '\0';
+
+    for (i = slot + 1; i <= NAME_BLOCK_KEYS; i++) {
+        block->offsets[i] = block->offsets[i] - old_len + new_len;
+    }
+    block->dirty = 1;
+
+    return 0;
+}
+
+const char *name_block_get(tsdb_name_block *block, u_int32_t slot) {
+    if (block->offsets[slot + 1] == block->offsets[slot]) {
+        return NULL;
+    }
+    return &block->strings[block->offsets[slot]];
+}
+
+u_int32_t name_block_serialized_size(tsdb_name_block *block) {
+    return OFFSETS_LEN + block->offsets[NAME_BLOCK_KEYS];
+}
+
+void name_block_serialize(tsdb_name_block *block, u_int8_t *buf) {
+    memcpy(buf, block->offsets, OFFSETS_LEN);
+    memcpy(buf + OFFSETS_LEN, block->strings, block->offsets[NAME_BLOCK_KEYS]);
+}
+
+int name_block_deserialize(tsdb_name_block *block, u_int8_t *buf,
+                           u_int32_t len) {
+    u_int32_t offsets[NAME_BLOCK_KEYS + 1], i;
+    char *strings;
+
+    if (len < OFFSETS_LEN) {
+        return -1;
+    }
+    memcpy(offsets, buf, OFFSETS_LEN);
+
+    if (offsets[0] != 0 || len - OFFSETS_LEN != offsets[NAME_BLOCK_KEYS]) {
+        return -1;
+    }
+    for (i = 0; i < NAME_BLOCK_KEYS; i++) {
+        if (offsets[i + 1] < offsets[i]
+            || (offsets[i + 1] > offsets[i]
+                && buf[OFFSETS_LEN + offsets[i + 1] - 1] != '\0')) {
+            return -1;
+        }
+    }
+
+    if (!(strings = malloc(offsets[NAME_BLOCK_KEYS] + 1))) {
+        return -2;
+    }
+    memcpy(strings, buf + OFFSETS_LEN, offsets[NAME_BLOCK_KEYS]);
+
+    free(block->strings);
+    memcpy(block->offsets, offsets, OFFSETS_LEN);
+    block->strings = strings;
+    block->size = offsets[NAME_BLOCK_KEYS] + 1;
+    block->dirty = 0;
+
+    return 0;
+}
+
+int names_reserve(tsdb_names *names, u_int32_t block) {
+    tsdb_name_block **blocks;
+    u_int32_t num_blocks = names->num_blocks ? names->num_blocks : 16;
+
+    if (block < names->num_blocks) {
+        return 0;
+    }
+    while (num_blocks <= block) {
+        num_blocks *= 2;
+    }
+
+    blocks = realloc(names->blocks, num_blocks * sizeof(tsdb_name_block*));
+    if (!blocks) {
+        return -2;
+    }
+    memset(&blocks[names->num_blocks], 0,
+           (num_blocks - names->num_blocks) * sizeof(tsdb_name_block*));
+    names->blocks = blocks;
+    names->num_blocks = num_blocks;
+
+    return 0;
+}
+
+void names_free(tsdb_names *names) {
+    u_int32_t i;
+
+    for (i = 0; i < names->num_blocks; i++) {
+        name_block_free(names->blocks[i]);
+    }
+    free(names->blocks);
+    names->blocks = NULL;
+    names->num_blocks = 0;
+}
@@ -0,0 +1,65 @@
+/*
+ *
+ *  Copyright (C) 2011 IIT/CNR (http://www.iit.cnr.it/en)
+ *                     Luca Deri <deri@ntop.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+// Index -> key dictionary. Keys are packed into blocks of NAME_BLOCK_KEYS
+// consecutive indexes, stored as "name-BLOCK" records. Each block is an
+// offset per index followed by the keys, NUL terminated, in index order.
+// An index without a key takes no space.
+
+#define NAME_BLOCK_KEYS 1024
+
+typedef struct {
+    u_int32_t offsets[NAME_BLOCK_KEYS + 1];
+    char *strings;
+    u_int32_t size;
+    u_int8_t dirty;         // Changed since it was last written
+} tsdb_name_block;
+
+typedef struct {
+    tsdb_name_block **blocks;       // NULL until loaded
+    u_int32_t num_blocks;
+    u_int32_t complete;     // Stored blocks have every index below this
+    u_int8_t backfill;      // Some keys are only in "key-" records
+} tsdb_names;
+
+tsdb_name_block *name_block_new(void);
+
+void name_block_free(tsdb_name_block *block);
+
+int name_block_set(tsdb_name_block *block, u_int32_t slot,
+                   const char *key, u_int32_t key_len);
+
+// The key at slot, or NULL
+const char *name_block_get(tsdb_name_block *block, u_int32_t slot);
+
+u_int32_t name_block_serialized_size(tsdb_name_block *block);
+
+void name_block_serialize(tsdb_name_block *block, u_int8_t *buf);
+
+int name_block_deserialize(tsdb_name_block *block, u_int8_t *buf,
+                           u_int32_t len);
+
+// Makes room for block in names->blocks
+int names_reserve(tsdb_names *names, u_int32_t block);
+
+void names_free(tsdb_names *names);
@@ -0,0 +1,156 @@
+/*
+ *
+ *  Copyright (C) 2011 IIT/CNR (http://www.iit.cnr.it/en)
+ *                     Luca Deri <deri@ntop.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tsdb_pool.h"
+
+typedef struct {
+    tsdb_pool *pool;
+    u_int32_t worker;
+} pool_worker;
+
+// Runs tasks until there are none left. Called with the lock held.
+static void run_tasks(tsdb_pool *pool, u_int32_t worker) {
+    u_int32_t task;
+
+    while (pool->next_task < pool->num_tasks) {
+        task = pool->next_task++;
+        pthread_mutex_unlock(&pool->lock);
+        pool->fn(pool->context, task, worker);
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->finished_tasks == pool->num_tasks) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+}
+
+static void *worker_main(void *arg) {
+    pool_worker *w = (pool_worker*)arg;
+    tsdb_pool *pool = w->pool;
+    u_int32_t worker = w->worker, generation = 0;
+
+    free(w);
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->shutdown && pool->generation == generation) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->shutdown) {
+            break;
+        }
+        generation = pool->generation;
+        run_tasks(pool, worker);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+int pool_init(tsdb_pool *pool, u_int32_t num_workers) {
+    pool_worker *w;
+    u_int32_t i;
+
+    memset(pool, 0, sizeof(tsdb_pool));
+
+    if (num_workers == 0) {
+        num_workers = 1;
+    }
+
+    pool->threads = (pthread_t*)calloc(num_workers, sizeof(pthread_t));
+    if (!pool->threads) {
+        return -2;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    // Worker 0 is the caller
+    pool->num_workers = 1;
+
+    for (i = 1; i < num_workers; i++) {
+        if (!(w = (pool_worker*)malloc(sizeof(pool_worker)))) {
+            break;
+        }
+        w->pool = pool;
+        w->worker = i;
+        if (pthread_create(&pool->threads[i], NULL, worker_main, w) != 0) {
+            free(w);
+            break;
+        }
+        pool->num_workers++;
+    }
+
+    return 0;
+}
+
+void pool_run(tsdb_pool *pool, tsdb_pool_fn fn, void *context,
+              u_int32_t num_tasks) {
+    u_int32_t i;
+
+    if (pool->num_workers < 2 || num_tasks < 2) {
+        for (i = 0; i < num_tasks; i++) {
+            fn(context, i, 0);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->context = context;
+    pool->num_tasks = num_tasks;
+    pool->next_task = 0;
+    pool->finished_tasks = 0;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work);
+
+    run_tasks(pool, 0);
+    while (pool->finished_tasks < pool->num_tasks) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_free(tsdb_pool *pool) {
+    u_int32_t i;
+
+    if (!pool->threads) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 1; i < pool->num_workers; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    free(pool->threads);
+
+    memset(pool, 0, sizeof(tsdb_pool));
+}
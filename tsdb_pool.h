@@ -0,0 +1,50 @@
+/*
+ *
+ *  Copyright (C) 2011 IIT/CNR (http://www.iit.cnr.it/en)
+ *                     Luca Deri <deri@ntop.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <pthread.h>
+#include <sys/types.h>
+
+// Fixed set of worker threads that run a function over a range of tasks.
+// The calling thread works too, as worker 0, so a pool with one thread
+// runs everything inline.
+
+typedef void (*tsdb_pool_fn)(void *context, u_int32_t task, u_int32_t worker);
+
+typedef struct {
+    pthread_t *threads;
+    u_int32_t num_workers;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    tsdb_pool_fn fn;
+    void *context;
+    u_int32_t num_tasks;
+    u_int32_t next_task;
+    u_int32_t finished_tasks;
+    u_int32_t generation;
+    u_int8_t shutdown;
+} tsdb_pool;
+
+extern int pool_init(tsdb_pool *pool, u_int32_t num_workers);
+
+extern void pool_run(tsdb_pool *pool, tsdb_pool_fn fn, void *context,
+                     u_int32_t num_tasks);
+
+extern void pool_free(tsdb_pool *pool);
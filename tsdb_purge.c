@@ -0,0 +1,182 @@
+#include <sys/time.h>
+
+#include "tsdb_api.h"
+
+typedef struct {
+    char *file;
+    u_int32_t keep;
+    u_int32_t batch;
+    u_int32_t rate;
+    int verbose;
+} purge_args;
+
+static void help(int code) {
+    printf("tsdb-purge [-v] [-k keep] [-b batch] [-r rate] file\n");
+    exit(code);
+}
+
+static void check_strtol_error(int no_digits, long val, int err,
+                               const char *argname) {
+    if (no_digits
+        || (err == ERANGE && (val == LONG_MAX || val == LONG_MIN))
+        || (err != 0 && val == 0)
+        || val < 0) {
+        printf("tsdb-purge: invalid value for %s\n", argname);
+        exit(1);
+    }
+}
+
+static int unit_seconds_val(const char *units, const char *argname) {
+    if (*units == '\0' || strcmp(units, "s") == 0) {
+        return 1;
+    } else if (strcmp(units, "m") == 0) {
+        return 60;
+    } else if (strcmp(units, "h") == 0) {
+        return 3600;
+    } else if (strcmp(units, "d") == 0) {
+        return 86400;
+    } else {
+        printf("tsdb-purge: unknown unit for %s\n", argname);
+        exit(1);
+    }
+}
+
+static u_int32_t seconds_val(const char *str, const char *argname) {
+    char *units;
+    long numval;
+
+    errno = 0;
+    numval = strtol(str, &units, 10);
+    check_strtol_error(str == units, numval, errno, argname);
+    return numval * unit_seconds_val(units, argname);
+}
+
+static u_int32_t uint_val(const char *str, const char *argname) {
+    char *end;
+    long numval;
+
+    errno = 0;
+    numval = strtol(str, &end, 10);
+    check_strtol_error(str == end || *end != '\0', numval, errno, argname);
+    return numval;
+}
+
+static void process_args(int argc, char *argv[], purge_args *args) {
+    int c;
+
+    args->keep = 0;
+    args->batch = 100;
+    args->rate = 0;
+    args->verbose = 0;
+
+    while ((c = getopt(argc, argv, "hvk:b:r:")) != -1) {
+        switch (c) {
+        case 'k':
+            args->keep = seconds_val(optarg, "keep");
+            break;
+        case 'b':
+            args->batch = uint_val(optarg, "batch");
+            break;
+        case 'r':
+            args->rate = uint_val(optarg, "rate");
+            break;
+        case 'v':
+            args->verbose = 1;
+            break;
+        case 'h':
+            help(0);
+            break;
+        default:
+            help(1);
+        }
+    }
+
+    int remaining = argc - optind;
+    if (remaining != 1 || args->batch == 0) {
+        help(1);
+    }
+    args->file = argv[optind];
+}
+
+static void check_file_exists(const char *path) {
+    if (access(path, F_OK) != 0) {
+        printf("tsdb-purge: %s doesn't exist\n", path);
+        exit(1);
+    }
+}
+
+static void init_trace(int verbose) {
+    set_trace_level(verbose ? 99 : 0);
+}
+
+static double now_seconds(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Sleeps until no more than rate fragments a second have been looked at
+static void throttle(u_int32_t rate, double start, u_int32_t fragments) {
+    double wait;
+
+    if (rate == 0) {
+        return;
+    }
+    wait = start + (double)fragments / rate - now_seconds();
+    if (wait > 0) {
+        usleep(wait * 1000000);
+    }
+}
+
+static void purge_db(purge_args *args) {
+    tsdb_handler db;
+    tsdb_purge_stats stats;
+    u_int16_t unused16 = 0;
+    u_int32_t unused32 = 0;
+    double start = now_seconds();
+    int rc;
+
+    if (tsdb_open(args->file, &db, &unused16, unused32, 0)) {
+        printf("tsdb-purge: error opening db %s\n", args->file);
+        exit(1);
+    }
+
+    if (args->keep && tsdb_set_retention(&db, args->keep) != 0) {
+        printf("tsdb-purge: error setting retention for %s\n", args->file);
+        tsdb_close(&db);
+        exit(1);
+    }
+
+    if (!db.retention) {
+        printf("tsdb-purge: %s has no retention, use -k\n", args->file);
+        tsdb_close(&db);
+        exit(1);
+    }
+
+    memset(&stats, 0, sizeof(stats));
+    do {
+        rc = tsdb_purge(&db, time(NULL), args->batch, &stats);
+        throttle(args->rate, start, stats.examined);
+    } while (rc == 1);
+
+    tsdb_close(&db);
+
+    if (rc != 0) {
+        printf("tsdb-purge: error purging %s\n", args->file);
+        exit(1);
+    }
+
+    printf("Deleted %u of %u fragments and %u blobs [%u rebased]\n",
+           stats.fragments, stats.examined, stats.blobs, stats.rebased);
+}
+
+int main(int argc, char *argv[]) {
+    purge_args args;
+
+    process_args(argc, argv, &args);
+    init_trace(args.verbose);
+    check_file_exists(args.file);
+    purge_db(&args);
+
+    return 0;
+}
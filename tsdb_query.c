@@ -0,0 +1,284 @@
+/*
+ *
+ *  Copyright (C) 2011 IIT/CNR (http://www.iit.cnr.it/en)
+ *                     Luca Deri <deri@ntop.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <ctype.h>
+#include <string.h>
+
+#include "tsdb_roaring.h"
+#include "tsdb_query.h"
+
+static tsdb_query *new_node(u_int8_t type) {
+    tsdb_query *node = calloc(1, sizeof(tsdb_query));
+
+    if (node) {
+        node->type = type;
+    }
+
+    return node;
+}
+
+void query_free(tsdb_query *query) {
+    u_int32_t i;
+
+    if (!query) {
+        return;
+    }
+    for (i = 0; i < query->num_children; i++) {
+        query_free(query->children[i]);
+    }
+    free(query->children);
+    free(query->tag);
+    free(query);
+}
+
+static int add_child(tsdb_query *node, tsdb_query *child) {
+    tsdb_query **children;
+
+    children = realloc(node->children,
+                       (node->num_children + 1) * sizeof(tsdb_query*));
+    if (!children) {
+        return -2;
+    }
+    node->children = children;
+    node->children[node->num_children++] = child;
+
+    return 0;
+}
+
+static void skip_space(const char **pos) {
+    while (isspace((unsigned char)**pos)) {
+        (*pos)++;
+    }
+}
+
+static int parse_token(const char **pos, char **token) {
+    const char *start = *pos;
+    u_int32_t len;
+
+    if (**pos == '"') {
+        start = ++(*pos);
+        while (**pos && **pos != '"') {
+            (*pos)++;
+        }
+        if (**pos != '"') {
+            return -1;
+        }
+        len = *pos - start;
+        (*pos)++;
+    } else {
+        while (**pos && !isspace((unsigned char)**pos)
+               && **pos != '(' && **pos != ')' && **pos != '"') {
+            (*pos)++;
+        }
+        len = *pos - start;
+    }
+
+    if (len == 0) {
+        return -1;
+    }
+    if (!(*token = strndup(start, len))) {
+        return -2;
+    }
+
+    return 0;
+}
+
+static int group_type(const char *name) {
+    if (strcmp(name, "and") == 0 || strcmp(name, "i") == 0) {
+        return QUERY_AND;
+    } else if (strcmp(name, "or") == 0 || strcmp(name, "u") == 0) {
+        return QUERY_OR;
+    } else if (strcmp(name, "not") == 0 || strcmp(name, "n") == 0) {
+        return QUERY_NOT;
+    }
+    return -1;
+}
+
+static int parse_expr(const char **pos, tsdb_query **query);
+
+static int parse_group(const char **pos, tsdb_query **query) {
+    tsdb_query *node, *child;
+    char *name;
+    int rc, type;
+
+    skip_space(pos);
+    if ((rc = parse_token(pos, &name)) != 0) {
+        return rc;
+    }
+    type = group_type(name);
+    free(name);
+    if (type == -1) {
+        return -1;
+    }
+    if (!(node = new_node(type))) {
+        return -2;
+    }
+
+    for (;;) {
+        skip_space(pos);
+        if (**pos == ')') {
+            (*pos)++;
+            break;
+        }
+        if ((rc = parse_expr(pos, &child)) != 0) {
+            query_free(node);
+            return rc;
+        }
+        if (add_child(node, child) != 0) {
+            query_free(child);
+            query_free(node);
+            return -2;
+        }
+    }
+
+    if (node->num_children == 0
+        || (type == QUERY_NOT && node->num_children != 1)) {
+        query_free(node);
+        return -1;
+    }
+    *query = node;
+
+    return 0;
+}
+
+static int parse_expr(const char **pos, tsdb_query **query) {
+    tsdb_query *node;
+    char *tag;
+    int rc;
+
+    skip_space(pos);
+
+    if (**pos == '(') {
+        (*pos)++;
+        return parse_group(pos, query);
+    }
+    if (**pos == ')' || **pos == '\0') {
+        return -1;
+    }
+
+    if ((rc = parse_token(pos, &tag)) != 0) {
+        return rc;
+    }
+    if (!(node = new_node(QUERY_TAG))) {
+        free(tag);
+        return -2;
+    }
+    node->tag = tag;
+    *query = node;
+
+    return 0;
+}
+
+// Folds groups into a parent of the same kind, groups of one into their
+// operand, and double negatives away
+static int simplify(tsdb_query **query) {
+    tsdb_query *node = *query, *child, *folded;
+    u_int32_t i, j;
+    int rc;
+
+    for (i = 0; i < node->num_children; i++) {
+        if ((rc = simplify(&node->children[i])) != 0) {
+            return rc;
+        }
+    }
+
+    if (node->type == QUERY_NOT) {
+        child = node->children[0];
+        if (child->type == QUERY_NOT) {
+            *query = child->children[0];
+            child->num_children = 0;
+            node->num_children = 0;
+            query_free(child);
+            query_free(node);
+        }
+        return 0;
+    }
+
+    if (node->type == QUERY_AND || node->type == QUERY_OR) {
+        if (!(folded = new_node(node->type))) {
+            return -2;
+        }
+        for (i = 0; i < node->num_children; i++) {
+            child = node->children[i];
+            if (child->type != node->type) {
+                if (add_child(folded, child) != 0) {
+                    break;
+                }
+                continue;
+            }
+            for (j = 0; j < child->num_children; j++) {
+                if (add_child(folded, child->children[j]) != 0) {
+                    break;
+                }
+            }
+            if (j < child->num_children) {
+                break;
+            }
+        }
+        if (i < node->num_children) {
+            // The children still belong to node
+            folded->num_children = 0;
+            query_free(folded);
+            return -2;
+        }
+        for (i = 0; i < node->num_children; i++) {
+            child = node->children[i];
+            if (child->type == node->type) {
+                child->num_children = 0;
+                query_free(child);
+            }
+        }
+        node->num_children = 0;
+        query_free(node);
+
+        if (folded->num_children == 1) {
+            *query = folded->children[0];
+            folded->num_children = 0;
+            query_free(folded);
+        } else {
+            *query = folded;
+        }
+    }
+
+    return 0;
+}
+
+int query_parse(const char *expr, tsdb_query **query) {
+    tsdb_query *node;
+    int rc;
+
+    if ((rc = parse_expr(&expr, &node)) != 0) {
+        return rc;
+    }
+
+    skip_space(&expr);
+    if (*expr != '\0') {
+        query_free(node);
+        return -1;
+    }
+
+    if ((rc = simplify(&node)) != 0) {
+        query_free(node);
+        return rc;
+    }
+    *query = node;
+
+    return 0;
+}
@@ -0,0 +1,49 @@
+/*
+ *
+ *  Copyright (C) 2011 IIT/CNR (http://www.iit.cnr.it/en)
+ *                     Luca Deri <deri@ntop.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+// Tag query expressions in prefix form, e.g.
+//
+//   (and metric=cpu (not size=small) (or dc=a dc=b))
+//
+// Groups are "and", "or" and "not" ("i", "u" and "n" for short). Tags are
+// bare words, or double quoted when they contain spaces or parentheses.
+
+#define QUERY_TAG 1
+#define QUERY_AND 2
+#define QUERY_OR  3
+#define QUERY_NOT 4
+
+typedef struct tsdb_query {
+    u_int8_t type;
+    char *tag;
+    struct tsdb_query **children;
+    u_int32_t num_children;
+    // Filled in when a query is planned
+    u_int32_t estimate;
+    tsdb_roaring *bitmap;
+} tsdb_query;
+
+// Returns -1 for a syntax error and -2 when out of memory
+int query_parse(const char *expr, tsdb_query **query);
+
+void query_free(tsdb_query *query);
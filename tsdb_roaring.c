@@ -0,0 +1,905 @@
+/*
+ *
+ *  Copyright (C) 2011 IIT/CNR (http://www.iit.cnr.it/en)
+ *                     Luca Deri <deri@ntop.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <string.h>
+
+#include "tsdb_roaring.h"
+#include "tsdb_bitmap.h"
+
+#define ARRAY_MAX 4096          // larger arrays are stored as bitmaps
+#define BITMAP_WORDS (65536 / BITS_PER_WORD)
+#define BITMAP_BYTES (BITMAP_WORDS * sizeof(u_int32_t))
+
+#define ROARING_COOKIE 0x52424d31
+#define ROARING_HEADER_LEN 8
+#define CONTAINER_HEADER_LEN 12
+
+void roaring_init(tsdb_roaring *r) {
+    memset(r, 0, sizeof(tsdb_roaring));
+}
+
+static void free_container(tsdb_container *c) {
+    free(c->values);
+    free(c->words);
+    c->values = NULL;
+    c->words = NULL;
+    c->len = 0;
+    c->size = 0;
+}
+
+void roaring_free(tsdb_roaring *r) {
+    u_int32_t i;
+
+    for (i = 0; i < r->count; i++) {
+        free_container(&r->containers[i]);
+    }
+    free(r->containers);
+    roaring_init(r);
+}
+
+static int find_container(tsdb_roaring *r, u_int16_t key, u_int32_t *pos) {
+    u_int32_t lo = 0, hi = r->count, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (r->containers[mid].key < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *pos = lo;
+
+    return lo < r->count && r->containers[lo].key == key;
+}
+
+static tsdb_container *insert_container(tsdb_roaring *r, u_int32_t pos,
+                                        u_int16_t key) {
+    tsdb_container *containers, *c;
+    u_int32_t size;
+
+    if (r->count == r->size) {
+        size = r->size ? r->size * 2 : 4;
+        containers = realloc(r->containers, size * sizeof(tsdb_container));
+        if (!containers) {
+            return NULL;
+        }
+        r->containers = containers;
+        r->size = size;
+    }
+
+    memmove(&r->containers[pos + 1], &r->containers[pos],
+            (r->count - pos) * sizeof(tsdb_container));
+    r->count++;
+
+    c = &r->containers[pos];
+    memset(c, 0, sizeof(tsdb_container));
+    c->key = key;
+    c->type = ROARING_ARRAY;
+
+    return c;
+}
+
+static void remove_container(tsdb_roaring *r, u_int32_t pos) {
+    free_container(&r->containers[pos]);
+    r->count--;
+    memmove(&r->containers[pos], &r->containers[pos + 1],
+            (r->count - pos) * sizeof(tsdb_container));
+}
+
+static int grow_values(tsdb_container *c, u_int32_t size) {
+    u_int16_t *values;
+
+    if (size <= c->size) {
+        return 0;
+    }
+    if (size < c->size * 2) {
+        size = c->size * 2;
+    }
+    if (size < 4) {
+        size = 4;
+    }
+
+    values = realloc(c->values, size * sizeof(u_int16_t));
+    if (!values) {
+        return -2;
+    }
+    c->values = values;
+    c->size = size;
+
+    return 0;
+}
+
+// Position of value in a sorted array, or where it would go
+static u_int32_t search_values(u_int16_t *values, u_int32_t len,
+                               u_int16_t value) {
+    u_int32_t lo = 0, hi = len, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (values[mid] < value) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static int run_contains(tsdb_container *c, u_int16_t value) {
+    u_int32_t lo = 0, hi = c->len, mid;
+
+    // The last run starting at or before value
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (c->values[mid * 2] <= value) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo > 0
+        && value - c->values[(lo - 1) * 2] <= c->values[(lo - 1) * 2 + 1];
+}
+
+static void set_range(u_int32_t *words, u_int32_t start, u_int32_t end) {
+    while (start <= end) {
+        if (BIT_OFFSET(start) == 0 && start + BITS_PER_WORD - 1 <= end) {
+            words[WORD_OFFSET(start)] = ~0U;
+            start += BITS_PER_WORD;
+        } else {
+            set_bit(words, start);
+            start++;
+        }
+    }
+}
+
+static int to_bitmap(tsdb_container *c) {
+    u_int32_t *words, i;
+
+    if (c->type == ROARING_BITMAP) {
+        return 0;
+    }
+
+    words = calloc(BITMAP_WORDS, sizeof(u_int32_t));
+    if (!words) {
+        return -2;
+    }
+
+    if (c->type == ROARING_ARRAY) {
+        for (i = 0; i < c->len; i++) {
+            set_bit(words, c->values[i]);
+        }
+    } else {
+        for (i = 0; i < c->len; i++) {
+            set_range(words, c->values[i * 2],
+                      c->values[i * 2] + c->values[i * 2 + 1]);
+        }
+    }
+
+    free_container(c);
+    c->words = words;
+    c->type = ROARING_BITMAP;
+
+    return 0;
+}
+
+static int to_array(tsdb_container *c) {
+    u_int16_t *values;
+    u_int32_t i, j, x, n = 0;
+    u_int32_t size = c->cardinality ? c->cardinality : 1;
+
+    if (c->type == ROARING_ARRAY) {
+        return 0;
+    }
+
+    values = malloc(size * sizeof(u_int16_t));
+    if (!values) {
+        return -2;
+    }
+
+    if (c->type == ROARING_BITMAP) {
+        for (i = 0; i < BITMAP_WORDS; i++) {
+            for (x = c->words[i]; x; x &= x - 1) {
+                values[n++] = i * BITS_PER_WORD + __builtin_ctz(x);
+            }
+        }
+    } else {
+        for (i = 0; i < c->len; i++) {
+            for (j = 0; j <= c->values[i * 2 + 1]; j++) {
+                values[n++] = c->values[i * 2] + j;
+            }
+        }
+    }
+
+    free_container(c);
+    c->values = values;
+    c->len = n;
+    c->size = size;
+    c->type = ROARING_ARRAY;
+
+    return 0;
+}
+
+static u_int32_t count_runs(tsdb_container *c) {
+    u_int32_t i, w, prev, runs = 0;
+
+    switch (c->type) {
+    case ROARING_ARRAY:
+        for (i = 0; i < c->len; i++) {
+            if (i == 0 || c->values[i] != c->values[i - 1] + 1) {
+                runs++;
+            }
+        }
+        break;
+    case ROARING_BITMAP:
+        // A run starts at each set bit whose lower neighbour is clear
+        for (i = 0; i < BITMAP_WORDS; i++) {
+            w = c->words[i];
+            prev = i ? c->words[i - 1] >> 31 : 0;
+            runs += __builtin_popcount(w & ~((w << 1) | prev));
+        }
+        break;
+    default:
+        runs = c->len;
+    }
+
+    return runs;
+}
+
+static int to_runs(tsdb_container *c) {
+    u_int16_t *values;
+    u_int32_t i, w, prev, next, starts, ends, end, n = 0, e = 0;
+    u_int32_t runs = count_runs(c);
+
+    if (c->type == ROARING_RUN) {
+        return 0;
+    }
+
+    values = malloc((runs ? runs : 1) * 2 * sizeof(u_int16_t));
+    if (!values) {
+        return -2;
+    }
+
+    if (c->type == ROARING_ARRAY) {
+        for (i = 0; i < c->len; i++) {
+            if (n && (u_int32_t)values[(n - 1) * 2]
+                + values[(n - 1) * 2 + 1] + 1 == c->values[i]) {
+                values[(n - 1) * 2 + 1]++;
+            } else {
+                values[n * 2] = c->values[i];
+                values[n * 2 + 1] = 0;
+                n++;
+            }
+        }
+    } else {
+        // The nth end bit closes the nth run, so starts and ends can be
+        // collected separately
+        for (i = 0; i < BITMAP_WORDS; i++) {
+            w = c->words[i];
+            prev = i ? c->words[i - 1] >> 31 : 0;
+            next = i + 1 < BITMAP_WORDS ? c->words[i + 1] & 1 : 0;
+            starts = w & ~((w << 1) | prev);
+            ends = w & ~((w >> 1) | (next << 31));
+            for (; starts; starts &= starts - 1) {
+                values[n++ * 2] = i * BITS_PER_WORD + __builtin_ctz(starts);
+            }
+            for (; ends; ends &= ends - 1) {
+                end = i * BITS_PER_WORD + __builtin_ctz(ends);
+                values[e * 2 + 1] = end - values[e * 2];
+                e++;
+            }
+        }
+    }
+
+    free_container(c);
+    c->values = values;
+    c->len = n;
+    c->size = (runs ? runs : 1) * 2;
+    c->type = ROARING_RUN;
+
+    return 0;
+}
+
+static int expand_runs(tsdb_container *c) {
+    if (c->cardinality > ARRAY_MAX) {
+        return to_bitmap(c);
+    }
+    return to_array(c);
+}
+
+static int optimize_container(tsdb_container *c) {
+    u_int32_t run_bytes = count_runs(c) * 2 * sizeof(u_int16_t);
+    u_int32_t array_bytes = c->cardinality * sizeof(u_int16_t);
+
+    if (run_bytes < array_bytes && run_bytes < BITMAP_BYTES) {
+        return to_runs(c);
+    }
+    if (c->cardinality <= ARRAY_MAX) {
+        return to_array(c);
+    }
+    return to_bitmap(c);
+}
+
+int roaring_optimize(tsdb_roaring *r) {
+    u_int32_t i;
+
+    for (i = 0; i < r->count; i++) {
+        if (optimize_container(&r->containers[i])) {
+            return -2;
+        }
+    }
+
+    return 0;
+}
+
+static int container_add(tsdb_container *c, u_int16_t value) {
+    u_int32_t i;
+
+    if (c->type == ROARING_RUN) {
+        if (run_contains(c, value)) {
+            return 0;
+        }
+        if (expand_runs(c)) {
+            return -2;
+        }
+    }
+
+    if (c->type == ROARING_BITMAP) {
+        if (!get_bit(c->words, value)) {
+            set_bit(c->words, value);
+            c->cardinality++;
+        }
+        return 0;
+    }
+
+    i = search_values(c->values, c->len, value);
+    if (i < c->len && c->values[i] == value) {
+        return 0;
+    }
+
+    if (c->len == ARRAY_MAX) {
+        if (to_bitmap(c)) {
+            return -2;
+        }
+        set_bit(c->words, value);
+        c->cardinality++;
+        return 0;
+    }
+
+    if (grow_values(c, c->len + 1)) {
+        return -2;
+    }
+    memmove(&c->values[i + 1], &c->values[i],
+            (c->len - i) * sizeof(u_int16_t));
+    c->values[i] = value;
+    c->len++;
+    c->cardinality++;
+
+    return 0;
+}
+
+int roaring_add(tsdb_roaring *r, u_int32_t index) {
+    tsdb_container *c;
+    u_int32_t pos;
+
+    if (find_container(r, index >> 16, &pos)) {
+        c = &r->containers[pos];
+    } else if (!(c = insert_container(r, pos, index >> 16))) {
+        return -2;
+    }
+
+    if (container_add(c, index & 0xffff)) {
+        if (c->cardinality == 0) {
+            remove_container(r, pos);
+        }
+        return -2;
+    }
+
+    return 0;
+}
+
+int roaring_fill(tsdb_roaring *r, u_int32_t count) {
+    tsdb_container *c;
+    u_int64_t key, first;
+
+    roaring_init(r);
+
+    // One run per container
+    for (key = 0; (first = key << 16) < count; key++) {
+        if (!(c = insert_container(r, r->count, key))
+            || !(c->values = malloc(2 * sizeof(u_int16_t)))) {
+            roaring_free(r);
+            return -2;
+        }
+        c->type = ROARING_RUN;
+        c->cardinality = count - first > 65536 ? 65536 : count - first;
+        c->values[0] = 0;
+        c->values[1] = c->cardinality - 1;
+        c->len = 1;
+        c->size = 2;
+    }
+
+    return 0;
+}
+
+int roaring_contains(tsdb_roaring *r, u_int32_t index) {
+    tsdb_container *c;
+    u_int16_t value = index & 0xffff;
+    u_int32_t pos, i;
+
+    if (!find_container(r, index >> 16, &pos)) {
+        return 0;
+    }
+    c = &r->containers[pos];
+
+    switch (c->type) {
+    case ROARING_BITMAP:
+        return get_bit(c->words, value);
+    case ROARING_RUN:
+        return run_contains(c, value);
+    default:
+        i = search_values(c->values, c->len, value);
+        return i < c->len && c->values[i] == value;
+    }
+}
+
+u_int32_t roaring_cardinality(tsdb_roaring *r) {
+    u_int32_t i, cardinality = 0;
+
+    for (i = 0; i < r->count; i++) {
+        cardinality += r->containers[i].cardinality;
+    }
+
+    return cardinality;
+}
+
+static int copy_container(tsdb_container *dest, tsdb_container *src) {
+    u_int32_t n = src->type == ROARING_RUN ? src->len * 2 : src->len;
+
+    *dest = *src;
+    dest->values = NULL;
+    dest->words = NULL;
+    dest->size = 0;
+
+    if (src->type == ROARING_BITMAP) {
+        if (!(dest->words = malloc(BITMAP_BYTES))) {
+            return -2;
+        }
+        memcpy(dest->words, src->words, BITMAP_BYTES);
+    } else {
+        if (!(dest->values = malloc((n ? n : 1) * sizeof(u_int16_t)))) {
+            return -2;
+        }
+        memcpy(dest->values, src->values, n * sizeof(u_int16_t));
+        dest->size = n ? n : 1;
+    }
+
+    return 0;
+}
+
+static int merge_arrays(tsdb_container *dest, tsdb_container *a,
+                        tsdb_container *b, int op) {
+    u_int32_t i = 0, j = 0, n = 0;
+    u_int32_t size = op == BITMAP_OR ? a->len + b->len : a->len;
+    u_int16_t *values;
+
+    if (!(values = malloc((size ? size : 1) * sizeof(u_int16_t)))) {
+        return -2;
+    }
+
+    while (i < a->len && j < b->len) {
+        if (a->values[i] < b->values[j]) {
+            if (op != BITMAP_AND) {
+                values[n++] = a->values[i];
+            }
+            i++;
+        } else if (a->values[i] > b->values[j]) {
+            if (op == BITMAP_OR) {
+                values[n++] = b->values[j];
+            }
+            j++;
+        } else {
+            if (op != BITMAP_ANDNOT) {
+                values[n++] = a->values[i];
+            }
+            i++;
+            j++;
+        }
+    }
+    if (op != BITMAP_AND) {
+        while (i < a->len) {
+            values[n++] = a->values[i++];
+        }
+    }
+    if (op == BITMAP_OR) {
+        while (j < b->len) {
+            values[n++] = b->values[j++];
+        }
+    }
+
+    dest->type = ROARING_ARRAY;
+    dest->values = values;
+    dest->len = n;
+    dest->size = size ? size : 1;
+    dest->cardinality = n;
+
+    return n > ARRAY_MAX ? to_bitmap(dest) : 0;
+}
+
+// Keeps the values of an array whose bit in words is keep
+static int filter_array(tsdb_container *dest, tsdb_container *array,
+                        u_int32_t *words, int keep) {
+    u_int32_t i, n = 0;
+    u_int16_t *values;
+
+    if (!(values = malloc((array->len ? array->len : 1)
+                          * sizeof(u_int16_t)))) {
+        return -2;
+    }
+
+    for (i = 0; i < array->len; i++) {
+        if (get_bit(words, array->values[i]) == keep) {
+            values[n++] = array->values[i];
+        }
+    }
+
+    dest->type = ROARING_ARRAY;
+    dest->values = values;
+    dest->len = n;
+    dest->size = array->len ? array->len : 1;
+    dest->cardinality = n;
+
+    return 0;
+}
+
+static int combine_bitmaps(tsdb_container *dest, tsdb_container *a,
+                           tsdb_container *b, int op) {
+    u_int32_t i;
+
+    if (copy_container(dest, a) || to_bitmap(dest)) {
+        return -2;
+    }
+
+    if (b->type == ROARING_BITMAP) {
+        bitmap_combine(dest->words, b->words, BITMAP_WORDS, op);
+    } else {
+        // Only OR and AND NOT get here with an array on the right
+        for (i = 0; i < b->len; i++) {
+            if (op == BITMAP_OR) {
+                set_bit(dest->words, b->values[i]);
+            } else {
+                clear_bit(dest->words, b->values[i]);
+            }
+        }
+    }
+
+    dest->cardinality = bitmap_count(dest->words, BITMAP_WORDS);
+
+    return dest->cardinality <= ARRAY_MAX ? to_array(dest) : 0;
+}
+
+static int combine_containers(tsdb_container *dest, tsdb_container *a,
+                              tsdb_container *b, int op) {
+    tsdb_container ta, tb;
+    int rc;
+
+    memset(&ta, 0, sizeof(ta));
+    memset(&tb, 0, sizeof(tb));
+
+    // Runs are expanded into temporary copies first
+    if (a->type == ROARING_RUN) {
+        if (copy_container(&ta, a) || expand_runs(&ta)) {
+            free_container(&ta);
+            return -2;
+        }
+        a = &ta;
+    }
+    if (b->type == ROARING_RUN) {
+        if (copy_container(&tb, b) || expand_runs(&tb)) {
+            free_container(&ta);
+            free_container(&tb);
+            return -2;
+        }
+        b = &tb;
+    }
+
+    if (a->type == ROARING_ARRAY && b->type == ROARING_ARRAY) {
+        rc = merge_arrays(dest, a, b, op);
+    } else if (a->type == ROARING_ARRAY && op != BITMAP_OR) {
+        rc = filter_array(dest, a, b->words, op == BITMAP_AND);
+    } else if (b->type == ROARING_ARRAY && op == BITMAP_AND) {
+        rc = filter_array(dest, b, a->words, 1);
+    } else {
+        rc = combine_bitmaps(dest, a, b, op);
+    }
+
+    free_container(&ta);
+    free_container(&tb);
+
+    return rc;
+}
+
+// Takes ownership of c, which is dropped if empty
+static int append_container(tsdb_roaring *r, tsdb_container *c) {
+    tsdb_container *dest;
+
+    if (c->cardinality == 0) {
+        free_container(c);
+        return 0;
+    }
+    if (!(dest = insert_container(r, r->count, c->key))) {
+        free_container(c);
+        return -2;
+    }
+    *dest = *c;
+
+    return 0;
+}
+
+int roaring_combine(tsdb_roaring *result, tsdb_roaring *a, tsdb_roaring *b,
+                    int op) {
+    tsdb_container *ca, *cb, c;
+    u_int32_t i = 0, j = 0;
+    int rc = 0;
+
+    roaring_init(result);
+
+    while (rc == 0 && (i < a->count || j < b->count)) {
+        ca = i < a->count ? &a->containers[i] : NULL;
+        cb = j < b->count ? &b->containers[j] : NULL;
+        if (op == BITMAP_AND && (!ca || !cb)) {
+            break;
+        }
+
+        memset(&c, 0, sizeof(c));
+        if (ca && cb && ca->key == cb->key) {
+            c.key = ca->key;
+            rc = combine_containers(&c, ca, cb, op);
+            i++;
+            j++;
+        } else if (ca && (!cb || ca->key < cb->key)) {
+            i++;
+            if (op == BITMAP_AND) {
+                continue;
+            }
+            rc = copy_container(&c, ca);
+        } else {
+            j++;
+            if (op != BITMAP_OR) {
+                continue;
+            }
+            rc = copy_container(&c, cb);
+        }
+
+        if (rc == 0) {
+            rc = append_container(result, &c);
+        } else {
+            free_container(&c);
+        }
+    }
+
+    if (rc) {
+        roaring_free(result);
+    }
+
+    return rc;
+}
+
+u_int32_t roaring_scan(tsdb_roaring *r, u_int32_t max_index,
+                       u_int32_t *indexes) {
+    tsdb_container *c;
+    u_int32_t i, j, k, base, limit, start, end, count = 0, n;
+
+    for (i = 0; i < r->count; i++) {
+        c = &r->containers[i];
+        base = (u_int32_t)c->key << 16;
+        if (base > max_index) {
+            break;
+        }
+        limit = max_index - base > 0xffff ? 0xffff : max_index - base;
+
+        switch (c->type) {
+        case ROARING_ARRAY:
+            for (j = 0; j < c->len && c->values[j] <= limit; j++) {
+                indexes[count++] = base + c->values[j];
+            }
+            break;
+        case ROARING_BITMAP:
+            n = bitmap_scan(c->words, limit, &indexes[count]);
+            for (j = 0; j < n; j++) {
+                indexes[count++] += base;
+            }
+            break;
+        case ROARING_RUN:
+            for (j = 0; j < c->len && c->values[j * 2] <= limit; j++) {
+                start = c->values[j * 2];
+                end = start + c->values[j * 2 + 1];
+                if (end > limit) {
+                    end = limit;
+                }
+                for (k = start; k <= end; k++) {
+                    indexes[count++] = base + k;
+                }
+            }
+            break;
+        }
+    }
+
+    return count;
+}
+
+static u_int32_t container_data_len(tsdb_container *c) {
+    switch (c->type) {
+    case ROARING_BITMAP:
+        return BITMAP_BYTES;
+    case ROARING_RUN:
+        return c->len * 2 * sizeof(u_int16_t);
+    default:
+        return c->len * sizeof(u_int16_t);
+    }
+}
+
+u_int32_t roaring_serialized_size(tsdb_roaring *r) {
+    u_int32_t i, size = ROARING_HEADER_LEN;
+
+    for (i = 0; i < r->count; i++) {
+        size += CONTAINER_HEADER_LEN + container_data_len(&r->containers[i]);
+    }
+
+    return size;
+}
+
+// Cookie and container count, then for each container its key, type,
+// cardinality and length followed by its values or words
+void roaring_serialize(tsdb_roaring *r, u_int8_t *buf) {
+    tsdb_container *c;
+    u_int32_t i, cookie = ROARING_COOKIE;
+
+    memcpy(buf, &cookie, 4);
+    memcpy(buf + 4, &r->count, 4);
+    buf += ROARING_HEADER_LEN;
+
+    for (i = 0; i < r->count; i++) {
+        c = &r->containers[i];
+        memcpy(buf, &c->key, 2);
+        buf[2] = c->type;
+        buf[3] = 0;
+        memcpy(buf + 4, &c->cardinality, 4);
+        memcpy(buf + 8, &c->len, 4);
+        buf += CONTAINER_HEADER_LEN;
+        memcpy(buf, c->type == ROARING_BITMAP
+               ? (void*)c->words : (void*)c->values, container_data_len(c));
+        buf += container_data_len(c);
+    }
+}
+
+static int check_container(tsdb_container *c) {
+    u_int32_t i, cardinality = 0;
+
+    switch (c->type) {
+    case ROARING_ARRAY:
+        if (c->len == 0 || c->len > ARRAY_MAX) {
+            return -1;
+        }
+        for (i = 1; i < c->len; i++) {
+            if (c->values[i] <= c->values[i - 1]) {
+                return -1;
+            }
+        }
+        cardinality = c->len;
+        break;
+    case ROARING_RUN:
+        for (i = 0; i < c->len; i++) {
+            if ((u_int32_t)c->values[i * 2] + c->values[i * 2 + 1] > 0xffff
+                || (i > 0 && c->values[i * 2] <= c->values[i * 2 - 2]
+                    + c->values[i * 2 - 1])) {
+                return -1;
+            }
+            cardinality += c->values[i * 2 + 1] + 1;
+        }
+        break;
+    case ROARING_BITMAP:
+        cardinality = bitmap_count(c->words, BITMAP_WORDS);
+        break;
+    default:
+        return -1;
+    }
+
+    return cardinality == c->cardinality && cardinality ? 0 : -1;
+}
+
+int roaring_deserialize(tsdb_roaring *r, u_int8_t *buf, u_int32_t len) {
+    tsdb_container c, *dest;
+    u_int32_t i, cookie, count, data_len, pos = ROARING_HEADER_LEN;
+
+    roaring_init(r);
+
+    if (len < ROARING_HEADER_LEN) {
+        return -1;
+    }
+    memcpy(&cookie, buf, 4);
+    memcpy(&count, buf + 4, 4);
+    if (cookie != ROARING_COOKIE || count > 65536) {
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (len - pos < CONTAINER_HEADER_LEN) {
+            roaring_free(r);
+            return -1;
+        }
+        memset(&c, 0, sizeof(c));
+        memcpy(&c.key, buf + pos, 2);
+        c.type = buf[pos + 2];
+        memcpy(&c.cardinality, buf + pos + 4, 4);
+        memcpy(&c.len, buf + pos + 8, 4);
+        pos += CONTAINER_HEADER_LEN;
+
+        if ((i > 0 && c.key <= r->containers[r->count - 1].key)
+            || c.len > 65536) {
+            roaring_free(r);
+            return -1;
+        }
+        if (c.type == ROARING_BITMAP) {
+            c.len = 0;
+        }
+        data_len = container_data_len(&c);
+        if (len - pos < data_len) {
+            roaring_free(r);
+            return -1;
+        }
+
+        if (c.type == ROARING_BITMAP) {
+            c.words = malloc(BITMAP_BYTES);
+        } else {
+            c.size = data_len / sizeof(u_int16_t);
+            c.values = malloc(data_len ? data_len : 1);
+        }
+        if (!c.words && !c.values) {
+            roaring_free(r);
+            return -2;
+        }
+        memcpy(c.type == ROARING_BITMAP ? (void*)c.words : (void*)c.values,
+               buf + pos, data_len);
+        pos += data_len;
+
+        if (check_container(&c)) {
+            free_container(&c);
+            roaring_free(r);
+            return -1;
+        }
+        if (!(dest = insert_container(r, r->count, c.key))) {
+            free_container(&c);
+            roaring_free(r);
+            return -2;
+        }
+        *dest = c;
+    }
+
+    if (pos != len) {
+        roaring_free(r);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,77 @@
+/*
+ *
+ *  Copyright (C) 2011 IIT/CNR (http://www.iit.cnr.it/en)
+ *                     Luca Deri <deri@ntop.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <sys/types.h>
+
+// Compressed bitmap of 32-bit indexes in the style of Roaring. Indexes are
+// split on their high 16 bits into containers. Each container holds the low
+// 16 bits as a sorted array, a 65536 bit bitmap or a list of runs.
+
+#define ROARING_ARRAY  1
+#define ROARING_BITMAP 2
+#define ROARING_RUN    3
+
+typedef struct {
+    u_int16_t key;          // high 16 bits of the indexes
+    u_int8_t type;
+    u_int32_t cardinality;
+    u_int32_t len;          // values in an array, runs in a run container
+    u_int32_t size;         // room in values before it must grow
+    u_int16_t *values;      // sorted values, or run start and length - 1
+    u_int32_t *words;       // bitmap
+} tsdb_container;
+
+typedef struct {
+    tsdb_container *containers;     // ordered by key
+    u_int32_t count;
+    u_int32_t size;
+} tsdb_roaring;
+
+void roaring_init(tsdb_roaring *r);
+
+void roaring_free(tsdb_roaring *r);
+
+int roaring_add(tsdb_roaring *r, u_int32_t index);
+
+// Initializes r with the indexes 0 to count - 1
+int roaring_fill(tsdb_roaring *r, u_int32_t count);
+
+int roaring_contains(tsdb_roaring *r, u_int32_t index);
+
+u_int32_t roaring_cardinality(tsdb_roaring *r);
+
+// result = a op b, where op is BITMAP_AND, BITMAP_OR or BITMAP_ANDNOT.
+// result is initialized here and must be freed by the caller.
+int roaring_combine(tsdb_roaring *result, tsdb_roaring *a, tsdb_roaring *b,
+                    int op);
+
+// Stores each index up to max_index in indexes, which must have room for
+// them all. Returns the number of indexes.
+u_int32_t roaring_scan(tsdb_roaring *r, u_int32_t max_index,
+                       u_int32_t *indexes);
+
+// Converts each container to whichever of the three types is smallest
+int roaring_optimize(tsdb_roaring *r);
+
+u_int32_t roaring_serialized_size(tsdb_roaring *r);
+
+void roaring_serialize(tsdb_roaring *r, u_int8_t *buf);
+
+int roaring_deserialize(tsdb_roaring *r, u_int8_t *buf, u_int32_t len);
@@ -0,0 +1,1363 @@
+/*
+ *
+ *  Copyright (C) 2011 IIT/CNR (http://www.iit.cnr.it/en)
+ *                     Luca Deri <deri@ntop.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tsdb_backend.h"
+#include "tsdb_segment.h"
+#include "tsdb_trace.h"
+
+// Record: key_len(4) value_len(4) checksum(4) key value
+#define SEGMENT_HEADER_LEN 12
+
+// Index: magic(4) version(4) count(4) segment(4) segment_len(8), then
+// per key, in key order: key_len(4) segment(4) offset(8) value_len(4)
+// first(4) key. Tombstones are entries too. The entries are followed by
+// an offset(8) per entry and the live bytes(8) of segments 0 to segment.
+// Version 1 entries have no first, and versions 1 and 2 have no tables.
+#define INDEX_HEADER_LEN 24
+#define INDEX_ENTRY_LEN 24
+#define INDEX_V1_ENTRY_LEN 20
+
+// A key whose tombstone was dropped from the index
+#define LOCATION_REMOVED 0xFFFFFFFF
+
+#define SEGMENT_BUFFER_SIZE (1024 * 1024)
+
+// The index is written on sync once this many bytes were appended since
+// it was last written (or when segments are compacted); until then, the
+// records after it are replayed at open
+#define INDEX_LAG_BYTES (16 * 1024 * 1024)
+
+u_int64_t tsdb_segment_size = 64 * 1024 * 1024;
+
+typedef struct {
+    u_int32_t segment;
+    u_int32_t value_len;
+    u_int64_t offset;       // Start of the record
+    u_int32_t first;        // Oldest segment that may hold a record of the key
+} segment_location;
+
+typedef struct {
+    int fd;                 // -1 until first used
+    u_int8_t present;
+    u_int8_t compacting;
+    u_int64_t size;         // Including any buffered bytes
+    u_int64_t live;         // Bytes of records referenced by the index
+} segment_file;
+
+// The index file, mapped. Lookups binary search it in place.
+typedef struct {
+    u_int8_t *map;          // NULL without an index
+    u_int64_t map_len;
+    u_int32_t version;
+    u_int32_t count;
+    u_int32_t segment;      // Covered up to segment_len of this segment
+    u_int64_t segment_len;
+    u_int8_t *offsets;      // Of each entry
+    u_int8_t *live;         // Of each segment covered
+} segment_index;
+
+typedef struct {
+    char *path;
+    u_int8_t read_only;
+    u_int8_t dirty;
+    segment_index index;
+    u_int32_t remaps;       // Times the index was written and mapped again
+    void *changes;          // Memory backend of key -> segment_location,
+                            // for the keys changed since the index
+    u_int64_t unindexed;    // Bytes appended since the index was written
+    segment_file *segments;
+    u_int32_t num_segments; // The last one is appended to
+    u_int8_t *buf;          // Appends not yet written to the last segment
+    u_int32_t buf_len;
+    u_int8_t *read_buf;
+    u_int32_t read_buf_size;
+} segment_db;
+
+// Walks the index merged with the changes, in key order. Changes may be
+// made between steps.
+typedef struct {
+    segment_db *db;
+    u_int8_t *key;          // The last key returned, or the start
+    u_int32_t key_len;
+    u_int8_t started;
+    u_int32_t pos;          // Next entry of the index
+    u_int32_t remaps;       // When pos was found
+} index_walk;
+
+typedef struct {
+    index_walk walk;
+    u_int8_t has_key;
+} segment_cursor;
+
+static u_int32_t checksum(void *key, u_int32_t key_len,
+                          void *value, u_int32_t value_len) {
+    u_int8_t *ptr = (u_int8_t*)key;
+    u_int32_t hash = 2166136261U, i;
+
+    for (i = 0; i < key_len; i++) {
+        hash = (hash ^ ptr[i]) * 16777619U;
+    }
+    ptr = (u_int8_t*)value;
+    for (i = 0; i < value_len; i++) {
+        hash = (hash ^ ptr[i]) * 16777619U;
+    }
+
+    return hash;
+}
+
+static u_int64_t record_len(u_int32_t key_len, u_int32_t value_len) {
+    return SEGMENT_HEADER_LEN + key_len
+        + (value_len == SEGMENT_TOMBSTONE ? 0 : value_len);
+}
+
+static int write_all(int fd, void *data, u_int64_t len) {
+    u_int8_t *ptr = (u_int8_t*)data;
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, ptr, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        ptr += n, len -= n;
+    }
+
+    return 0;
+}
+
+static int read_all(int fd, void *data, u_int64_t len, u_int64_t offset) {
+    u_int8_t *ptr = (u_int8_t*)data;
+    ssize_t n;
+
+    while (len > 0) {
+        n = pread(fd, ptr, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        ptr += n, len -= n, offset += n;
+    }
+
+    return 0;
+}
+
+static u_int32_t active_segment(segment_db *db) {
+    return db->num_segments - 1;
+}
+
+static void segment_path(segment_db *db, u_int32_t id, char *str,
+                         u_int32_t str_len) {
+    snprintf(str, str_len, "%s/%08u.seg", db->path, id);
+}
+
+static int ensure_segments(segment_db *db, u_int32_t num_segments) {
+    segment_file *segments;
+    u_int32_t i;
+
+    if (num_segments <= db->num_segments) {
+        return 0;
+    }
+
+    segments = (segment_file*)realloc(db->segments,
+                                      num_segments * sizeof(segment_file));
+    if (!segments) {
+        return -2;
+    }
+
+    for (i = db->num_segments; i < num_segments; i++) {
+        memset(&segments[i], 0, sizeof(segment_file));
+        segments[i].fd = -1;
+    }
+
+    db->segments = segments;
+    db->num_segments = num_segments;
+
+    return 0;
+}
+
+static int segment_fd(segment_db *db, u_int32_t id) {
+    segment_file *segment = &db->segments[id];
+    char str[PATH_MAX];
+
+    if (segment->fd < 0) {
+        segment_path(db, id, str, sizeof(str));
+        segment->fd = open(str, db->read_only ? O_RDONLY : O_RDWR | O_CREAT,
+                           00664);
+        if (segment->fd < 0) {
+            trace_error("Unable to open segment %s [%s]", str,
+                        strerror(errno));
+        }
+    }
+
+    return segment->fd;
+}
+
+static int flush_buffer(segment_db *db) {
+    int fd;
+
+    if (db->buf_len == 0) {
+        return 0;
+    }
+
+    if ((fd = segment_fd(db, active_segment(db))) < 0
+        || lseek(fd, 0, SEEK_END) < 0
+        || write_all(fd, db->buf, db->buf_len) != 0) {
+        trace_error("Unable to write segment [%s]", strerror(errno));
+        return -2;
+    }
+
+    db->buf_len = 0;
+
+    return 0;
+}
+
+static int add_segment(segment_db *db) {
+    u_int32_t id = db->num_segments;
+
+    if (ensure_segments(db, id + 1) != 0) {
+        return -2;
+    }
+    db->segments[id].present = 1;
+
+    return segment_fd(db, id) < 0 ? -2 : 0;
+}
+
+static int append_record(segment_db *db, void *key, u_int32_t key_len,
+                         void *value, u_int32_t value_len,
+                         segment_location *loc) {
+    u_int8_t header[SEGMENT_HEADER_LEN];
+    u_int32_t sum, data_len;
+    u_int64_t len = record_len(key_len, value_len);
+    segment_file *segment = &db->segments[active_segment(db)];
+
+    data_len = (value_len == SEGMENT_TOMBSTONE ? 0 : value_len);
+
+    if (segment->size > 0 && segment->size + len > tsdb_segment_size) {
+        if (flush_buffer(db) != 0
+            || fsync(segment_fd(db, active_segment(db))) != 0
+            || add_segment(db) != 0) {
+            return -2;
+        }
+        segment = &db->segments[active_segment(db)];
+    }
+
+    sum = checksum(key, key_len, value, data_len);
+    memcpy(&header[0], &key_len, 4);
+    memcpy(&header[4], &value_len, 4);
+    memcpy(&header[8], &sum, 4);
+
+    if (db->buf_len + len > SEGMENT_BUFFER_SIZE && flush_buffer(db) != 0) {
+        return -2;
+    }
+
+    if (len > SEGMENT_BUFFER_SIZE) {
+        int fd = segment_fd(db, active_segment(db));
+
+        if (fd < 0
+            || lseek(fd, 0, SEEK_END) < 0
+            || write_all(fd, header, SEGMENT_HEADER_LEN) != 0
+            || write_all(fd, key, key_len) != 0
+            || write_all(fd, value, data_len) != 0) {
+            trace_error("Unable to write segment [%s]", strerror(errno));
+            return -2;
+        }
+    } else {
+        memcpy(&db->buf[db->buf_len], header, SEGMENT_HEADER_LEN);
+        memcpy(&db->buf[db->buf_len + SEGMENT_HEADER_LEN], key, key_len);
+        if (data_len > 0) {
+            // Tombstones have no value
+            memcpy(&db->buf[db->buf_len + SEGMENT_HEADER_LEN + key_len],
+                   value, data_len);
+        }
+        db->buf_len += len;
+    }
+
+    if (loc) {
+        loc->segment = active_segment(db);
+        loc->value_len = value_len;
+        loc->offset = segment->size;
+        loc->first = loc->segment;
+    }
+
+    segment->size += len;
+    db->unindexed += len;
+    db->dirty = 1;
+
+    return 0;
+}
+
+// Same order as the memory backend's cursors
+static int compare_keys(void *a, u_int32_t a_len, void *b, u_int32_t b_len) {
+    int rc = memcmp(a, b, a_len < b_len ? a_len : b_len);
+
+    if (rc != 0) {
+        return rc;
+    }
+
+    return a_len < b_len ? -1 : (a_len > b_len ? 1 : 0);
+}
+
+static int index_entry(segment_index *index, u_int32_t pos, u_int8_t **key,
+                       u_int32_t *key_len, segment_location *loc) {
+    u_int64_t offset;
+    u_int8_t *ptr;
+
+    memcpy(&offset, &index->offsets[(u_int64_t)pos * 8], 8);
+    if (offset < INDEX_HEADER_LEN
+        || offset + INDEX_ENTRY_LEN > index->map_len) {
+        trace_error("Corrupt segment index entry %u", pos);
+        return -2;
+    }
+
+    ptr = &index->map[offset];
+    memcpy(key_len, &ptr[0], 4);
+    memcpy(&loc->segment, &ptr[4], 4);
+    memcpy(&loc->offset, &ptr[8], 8);
+    memcpy(&loc->value_len, &ptr[16], 4);
+    memcpy(&loc->first, &ptr[20], 4);
+
+    if (offset + INDEX_ENTRY_LEN + *key_len > index->map_len) {
+        trace_error("Corrupt segment index entry %u", pos);
+        return -2;
+    }
+    *key = &ptr[INDEX_ENTRY_LEN];
+
+    return 0;
+}
+
+// Position of the first entry >= key (or > key)
+static int index_seek(segment_index *index, void *key, u_int32_t key_len,
+                      u_int8_t inclusive, u_int32_t *pos) {
+    u_int32_t low = 0, high = index->count, mid, mid_len;
+    segment_location loc;
+    u_int8_t *mid_key;
+    int rc;
+
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (index_entry(index, mid, &mid_key, &mid_len, &loc) != 0) {
+            return -2;
+        }
+        rc = compare_keys(mid_key, mid_len, key, key_len);
+        if (rc < 0 || (rc == 0 && !inclusive)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *pos = low;
+
+    return 0;
+}
+
+// The latest record of a key, a value or a tombstone
+static int location_get(segment_db *db, void *key, u_int32_t key_len,
+                        segment_location *loc) {
+    u_int32_t pos, found_len;
+    u_int8_t *found;
+    void *value;
+    u_int32_t value_len;
+
+    if (tsdb_memory_backend.get(db->changes, key, key_len,
+                                &value, &value_len) == 0) {
+        memcpy(loc, value, sizeof(segment_location));
+        return loc->segment == LOCATION_REMOVED ? -1 : 0;
+    }
+
+    if (index_seek(&db->index, key, key_len, 1, &pos) != 0) {
+        return -2;
+    }
+    if (pos >= db->index.count) {
+        return -1;
+    }
+    if (index_entry(&db->index, pos, &found, &found_len, loc) != 0) {
+        return -2;
+    }
+
+    return compare_keys(found, found_len, key, key_len) == 0 ? 0 : -1;
+}
+
+static int index_get(segment_db *db, void *key, u_int32_t key_len,
+                     segment_location *loc) {
+    int rc = location_get(db, key, key_len, loc);
+
+    if (rc == 0 && loc->value_len == SEGMENT_TOMBSTONE) {
+        return -1;
+    }
+
+    return rc;
+}
+
+// Points the key at its latest record, a value or a tombstone, or drops
+// it from the index (LOCATION_REMOVED). The oldest segment that may hold
+// a record of the key is carried over.
+static int index_put(segment_db *db, void *key, u_int32_t key_len,
+                     segment_location *loc) {
+    u_int8_t removed = loc->segment == LOCATION_REMOVED;
+    segment_location old;
+    int rc;
+
+    if ((rc = location_get(db, key, key_len, &old)) == -2) {
+        return -2;
+    }
+    if (rc == 0) {
+        db->segments[old.segment].live -= record_len(key_len, old.value_len);
+        if (old.first < loc->first) {
+            loc->first = old.first;
+        }
+    }
+
+    if ((!removed && ensure_segments(db, loc->segment + 1) != 0)
+        || tsdb_memory_backend.put(db->changes, key, key_len,
+                                   loc, sizeof(segment_location)) != 0) {
+        return -2;
+    }
+    if (!removed) {
+        db->segments[loc->segment].live += record_len(key_len,
+                                                      loc->value_len);
+    }
+
+    return 0;
+}
+
+static int walk_open(index_walk *walk, segment_db *db, void *start,
+                     u_int32_t start_len) {
+    memset(walk, 0, sizeof(index_walk));
+    if (!(walk->key = (u_int8_t*)malloc(start_len ? start_len : 1))) {
+        return -2;
+    }
+    memcpy(walk->key, start, start_len);
+    walk->key_len = start_len;
+    walk->db = db;
+
+    return 0;
+}
+
+static void walk_close(index_walk *walk) {
+    free(walk->key);
+    walk->key = NULL;
+}
+
+// The first change after the walk's key (or at it, before the first step)
+static int next_change(index_walk *walk, void **key, u_int32_t *key_len,
+                       segment_location *loc) {
+    void *cursor, *value;
+    u_int32_t value_len;
+    int rc;
+
+    if (tsdb_memory_backend.cursor_open(walk->db->changes, walk->key,
+                                        walk->key_len, &cursor) != 0) {
+        return -2;
+    }
+    rc = tsdb_memory_backend.cursor_next(cursor, key, key_len,
+                                         &value, &value_len);
+    if (rc == 0 && walk->started
+        && compare_keys(*key, *key_len, walk->key, walk->key_len) == 0) {
+        rc = tsdb_memory_backend.cursor_next(cursor, key, key_len,
+                                             &value, &value_len);
+    }
+    if (rc == 0) {
+        memcpy(loc, value, sizeof(segment_location));
+    }
+    tsdb_memory_backend.cursor_close(cursor);
+
+    return rc;
+}
+
+// Moves to the next key with a value or a tombstone. The key is left in
+// walk->key.
+static int walk_next(index_walk *walk, segment_location *loc) {
+    segment_db *db = walk->db;
+    segment_location index_loc, change_loc;
+    u_int8_t *index_key = NULL, *key;
+    void *change_key = NULL;
+    u_int32_t index_key_len = 0, change_key_len = 0, key_len;
+    int rc, cmp;
+
+    do {
+        if (!walk->started || walk->remaps != db->remaps) {
+            if (index_seek(&db->index, walk->key, walk->key_len,
+                           !walk->started, &walk->pos) != 0) {
+                return -2;
+            }
+            walk->remaps = db->remaps;
+        }
+
+        if (walk->pos < db->index.count) {
+            if (index_entry(&db->index, walk->pos, &index_key,
+                            &index_key_len, &index_loc) != 0) {
+                return -2;
+            }
+        } else {
+            index_key = NULL;
+        }
+
+        if ((rc = next_change(walk, &change_key, &change_key_len,
+                              &change_loc)) == -2) {
+            return -2;
+        }
+        if (rc == -1) {
+            change_key = NULL;
+        }
+
+        if (!index_key && !change_key) {
+            return -1;
+        }
+
+        // Changes replace the index entry of the same key
+        cmp = !change_key ? -1 : (!index_key ? 1
+              : compare_keys(index_key, index_key_len,
+                             change_key, change_key_len));
+        if (cmp < 0) {
+            key = index_key, key_len = index_key_len;
+            memcpy(loc, &index_loc, sizeof(segment_location));
+            walk->pos++;
+        } else {
+            key = (u_int8_t*)change_key, key_len = change_key_len;
+            memcpy(loc, &change_loc, sizeof(segment_location));
+            if (cmp == 0) {
+                walk->pos++;
+            }
+        }
+
+        if (key_len > walk->key_len) {
+            u_int8_t *grown = (u_int8_t*)realloc(walk->key, key_len);
+
+            if (!grown) {
+                return -2;
+            }
+            walk->key = grown;
+        }
+        memcpy(walk->key, key, key_len);
+        walk->key_len = key_len;
+        walk->started = 1;
+    } while (loc->segment == LOCATION_REMOVED);
+
+    return 0;
+}
+
+// Calls visit with every key, in no particular order: the changes first,
+// then the rest of the index. visit may change the key's location.
+typedef int (*index_visitor)(segment_db *db, void *key, u_int32_t key_len,
+                             segment_location *loc);
+
+static int visit_index(segment_db *db, index_visitor visit) {
+    void *cursor, *key, *value;
+    u_int32_t key_len, value_len, pos;
+    segment_location loc;
+    u_int8_t *index_key;
+    int ret = 0;
+
+    // Putting a key that's already changed doesn't move the cursor
+    if (tsdb_memory_backend.cursor_open(db->changes, "", 0, &cursor) != 0) {
+        return -2;
+    }
+    while (ret == 0
+           && tsdb_memory_backend.cursor_next(cursor, &key, &key_len,
+                                              &value, &value_len) == 0) {
+        memcpy(&loc, value, sizeof(loc));
+        if (loc.segment != LOCATION_REMOVED) {
+            ret = visit(db, key, key_len, &loc);
+        }
+    }
+    tsdb_memory_backend.cursor_close(cursor);
+
+    for (pos = 0; ret == 0 && pos < db->index.count; pos++) {
+        if (index_entry(&db->index, pos, &index_key, &key_len, &loc) != 0) {
+            return -2;
+        }
+        if (tsdb_memory_backend.get(db->changes, index_key, key_len,
+                                    &value, &value_len) != 0) {
+            ret = visit(db, index_key, key_len, &loc);
+        }
+    }
+
+    return ret;
+}
+
+static int read_value(segment_db *db, segment_location *loc,
+                      u_int32_t key_len, void **value) {
+    u_int64_t offset = loc->offset + SEGMENT_HEADER_LEN + key_len;
+    u_int64_t flushed;
+    int fd;
+
+    if (loc->segment == active_segment(db)) {
+        flushed = db->segments[loc->segment].size - db->buf_len;
+        if (loc->offset >= flushed) {
+            *value = &db->buf[offset - flushed];
+            return 0;
+        }
+    }
+
+    if (loc->value_len > db->read_buf_size) {
+        u_int8_t *read_buf = (u_int8_t*)realloc(db->read_buf, loc->value_len);
+
+        if (!read_buf) {
+            return -2;
+        }
+        db->read_buf = read_buf;
+        db->read_buf_size = loc->value_len;
+    }
+
+    if ((fd = segment_fd(db, loc->segment)) < 0
+        || read_all(fd, db->read_buf, loc->value_len, offset) != 0) {
+        trace_error("Unable to read segment %u at %llu", loc->segment,
+                    (unsigned long long)offset);
+        return -2;
+    }
+
+    *value = db->read_buf;
+
+    return 0;
+}
+
+static void unmap_index(segment_index *index) {
+    if (index->map) {
+        munmap(index->map, index->map_len);
+    }
+    memset(index, 0, sizeof(segment_index));
+}
+
+// Returns -1 if there's no usable index at path
+static int map_index(const char *path, segment_index *index) {
+    u_int8_t *map;
+    u_int32_t magic;
+    u_int64_t tables_len;
+    struct stat st;
+    int fd;
+
+    memset(index, 0, sizeof(segment_index));
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size < INDEX_HEADER_LEN) {
+        close(fd);
+        return -1;
+    }
+
+    map = (u_int8_t*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        trace_error("Unable to map segment index %s", path);
+        return -1;
+    }
+    index->map = map;
+    index->map_len = st.st_size;
+
+    memcpy(&magic, &map[0], 4);
+    memcpy(&index->version, &map[4], 4);
+    memcpy(&index->count, &map[8], 4);
+    memcpy(&index->segment, &map[12], 4);
+    memcpy(&index->segment_len, &map[16], 8);
+
+    if (magic != SEGMENT_INDEX_MAGIC
+        || index->version < 1 || index->version > SEGMENT_INDEX_VERSION) {
+        trace_warning("Ignoring segment index %s (bad header)", path);
+        unmap_index(index);
+        return -1;
+    }
+
+    if (index->version == SEGMENT_INDEX_VERSION) {
+        tables_len = ((u_int64_t)index->count + index->segment + 1) * 8;
+        if (index->segment == LOCATION_REMOVED
+            || tables_len > index->map_len - INDEX_HEADER_LEN) {
+            trace_warning("Ignoring segment index %s (truncated)", path);
+            unmap_index(index);
+            return -1;
+        }
+        index->live = &map[index->map_len - (u_int64_t)(index->segment + 1) * 8];
+        index->offsets = index->live - (u_int64_t)index->count * 8;
+    }
+
+    return 0;
+}
+
+// Loads an index written before it was sorted into the changes, to be
+// written in the current format at the next sync
+static int load_old_index(segment_db *db, segment_index *index) {
+    u_int8_t *ptr = &index->map[INDEX_HEADER_LEN];
+    u_int8_t *end = &index->map[index->map_len];
+    u_int32_t i, key_len, entry_len;
+    segment_location loc;
+
+    entry_len = index->version == 1 ? INDEX_V1_ENTRY_LEN : INDEX_ENTRY_LEN;
+
+    for (i = 0; i < index->count; i++) {
+        if (ptr + entry_len > end) {
+            return -1;
+        }
+        memcpy(&key_len, &ptr[0], 4);
+        memcpy(&loc.segment, &ptr[4], 4);
+        memcpy(&loc.offset, &ptr[8], 8);
+        memcpy(&loc.value_len, &ptr[16], 4);
+        // Without it, any segment may hold older records
+        loc.first = 0;
+        if (index->version != 1) {
+            memcpy(&loc.first, &ptr[20], 4);
+        }
+        ptr += entry_len;
+
+        if (ptr + key_len > end) {
+            return -1;
+        }
+        if (index_put(db, ptr, key_len, &loc) != 0) {
+            return -2;
+        }
+        ptr += key_len;
+    }
+
+    db->dirty = 1;
+    db->unindexed = INDEX_LAG_BYTES;
+
+    return 0;
+}
+
+// Returns the segment and length covered by the index, or -1 if there's
+// no usable index. The index stays mapped.
+static int load_index(segment_db *db, u_int32_t *segment,
+                      u_int64_t *segment_len) {
+    char str[PATH_MAX];
+    segment_index index;
+    u_int32_t id;
+    int ret;
+
+    snprintf(str, sizeof(str), "%s/index", db->path);
+
+    if (map_index(str, &index) != 0) {
+        return -1;
+    }
+    *segment = index.segment;
+    *segment_len = index.segment_len;
+
+    if (index.version != SEGMENT_INDEX_VERSION) {
+        ret = load_old_index(db, &index);
+        unmap_index(&index);
+        if (ret == -1) {
+            trace_warning("Ignoring segment index %s (truncated)", str);
+        }
+        return ret;
+    }
+
+    if (ensure_segments(db, index.segment + 1) != 0) {
+        unmap_index(&index);
+        return -2;
+    }
+    for (id = 0; id <= index.segment; id++) {
+        memcpy(&db->segments[id].live, &index.live[(u_int64_t)id * 8], 8);
+    }
+    db->index = index;
+
+    return 0;
+}
+
+static int write_index(segment_db *db) {
+    char str[PATH_MAX], tmp[PATH_MAX];
+    u_int8_t header[INDEX_HEADER_LEN], entry[INDEX_ENTRY_LEN];
+    u_int32_t magic = SEGMENT_INDEX_MAGIC, version = SEGMENT_INDEX_VERSION;
+    u_int32_t count = 0, offsets_size = 0, segment = active_segment(db), id;
+    u_int64_t segment_len = db->segments[segment].size;
+    u_int64_t offset = INDEX_HEADER_LEN, *offsets = NULL, *grown;
+    segment_index index;
+    segment_location loc;
+    index_walk walk;
+    void *changes;
+    FILE *file;
+    int ret = 0, rc;
+
+    snprintf(str, sizeof(str), "%s/index", db->path);
+    snprintf(tmp, sizeof(tmp), "%s/index.tmp", db->path);
+
+    if (walk_open(&walk, db, "", 0) != 0) {
+        return -2;
+    }
+    if (!(file = fopen(tmp, "w"))) {
+        trace_error("Unable to write segment index %s [%s]", tmp,
+                    strerror(errno));
+        walk_close(&walk);
+        return -2;
+    }
+
+    memset(header, 0, sizeof(header));
+    fwrite(header, sizeof(header), 1, file);
+
+    // The index merged with the changes, in key order
+    while ((rc = walk_next(&walk, &loc)) == 0) {
+        if (count == offsets_size) {
+            offsets_size = offsets_size ? offsets_size * 2 : 1024;
+            grown = (u_int64_t*)realloc(offsets,
+                                        offsets_size * sizeof(u_int64_t));
+            if (!grown) {
+                rc = -2;
+                break;
+            }
+            offsets = grown;
+        }
+        offsets[count++] = offset;
+
+        memcpy(&entry[0], &walk.key_len, 4);
+        memcpy(&entry[4], &loc.segment, 4);
+        memcpy(&entry[8], &loc.offset, 8);
+        memcpy(&entry[16], &loc.value_len, 4);
+        memcpy(&entry[20], &loc.first, 4);
+        fwrite(entry, sizeof(entry), 1, file);
+        fwrite(walk.key, walk.key_len, 1, file);
+        offset += INDEX_ENTRY_LEN + walk.key_len;
+    }
+    walk_close(&walk);
+
+    if (rc == -2) {
+        free(offsets);
+        fclose(file);
+        return -2;
+    }
+
+    fwrite(offsets, sizeof(u_int64_t), count, file);
+    free(offsets);
+    for (id = 0; id <= segment; id++) {
+        fwrite(&db->segments[id].live, sizeof(u_int64_t), 1, file);
+    }
+
+    memcpy(&header[0], &magic, 4);
+    memcpy(&header[4], &version, 4);
+    memcpy(&header[8], &count, 4);
+    memcpy(&header[12], &segment, 4);
+    memcpy(&header[16], &segment_len, 8);
+
+    if (ferror(file)
+        || fseek(file, 0, SEEK_SET) != 0
+        || fwrite(header, sizeof(header), 1, file) != 1
+        || fflush(file) != 0
+        || fsync(fileno(file)) != 0) {
+        ret = -2;
+    }
+    if (fclose(file) != 0) {
+        ret = -2;
+    }
+
+    // The new index holds all of the changes, which start over
+    if (ret != 0
+        || tsdb_memory_backend.open(&changes, db->path, db->read_only) != 0) {
+        trace_error("Unable to write segment index %s [%s]", str,
+                    strerror(errno));
+        return -2;
+    }
+    if (map_index(tmp, &index) != 0 || rename(tmp, str) != 0) {
+        trace_error("Unable to write segment index %s [%s]", str,
+                    strerror(errno));
+        unmap_index(&index);
+        tsdb_memory_backend.close(changes);
+        return -2;
+    }
+
+    unmap_index(&db->index);
+    db->index = index;
+    db->remaps++;
+    tsdb_memory_backend.close(db->changes);
+    db->changes = changes;
+    db->unindexed = 0;
+
+    return 0;
+}
+
+// Applies the records in a segment from start, truncating it at the first
+// bad or partial record
+static int replay_segment(segment_db *db, u_int32_t id, u_int64_t start) {
+    segment_file *segment = &db->segments[id];
+    u_int8_t header[SEGMENT_HEADER_LEN], *data = NULL, *grown;
+    u_int32_t key_len, value_len, sum, data_size = 0, data_len;
+    u_int64_t pos = start;
+    segment_location loc;
+    int fd, ret = 0;
+
+    if ((fd = segment_fd(db, id)) < 0) {
+        return -2;
+    }
+
+    while (pos < segment->size) {
+        if (pos + SEGMENT_HEADER_LEN > segment->size
+            || read_all(fd, header, SEGMENT_HEADER_LEN, pos) != 0) {
+            break;
+        }
+        memcpy(&key_len, &header[0], 4);
+        memcpy(&value_len, &header[4], 4);
+        memcpy(&sum, &header[8], 4);
+
+        if (pos + record_len(key_len, value_len) > segment->size) {
+            break;
+        }
+
+        data_len = record_len(key_len, value_len) - SEGMENT_HEADER_LEN;
+        if (data_len > data_size) {
+            if (!(grown = (u_int8_t*)realloc(data, data_len))) {
+                ret = -2;
+                break;
+            }
+            data = grown, data_size = data_len;
+        }
+
+        if (read_all(fd, data, data_len, pos + SEGMENT_HEADER_LEN) != 0
+            || checksum(data, key_len, &data[key_len],
+                        data_len - key_len) != sum) {
+            break;
+        }
+
+        loc.segment = loc.first = id;
+        loc.value_len = value_len;
+        loc.offset = pos;
+        if (index_put(db, data, key_len, &loc) != 0) {
+            ret = -2;
+            break;
+        }
+
+        pos += record_len(key_len, value_len);
+        db->unindexed += record_len(key_len, value_len);
+    }
+
+    free(data);
+
+    if (ret == 0 && pos < segment->size) {
+        trace_warning("Dropping %llu bytes at the end of segment %u",
+                      (unsigned long long)(segment->size - pos), id);
+        if (!db->read_only && ftruncate(fd, pos) != 0) {
+            trace_error("Unable to truncate segment %u", id);
+            return -2;
+        }
+        segment->size = pos;
+    }
+
+    return ret;
+}
+
+static int scan_segments(segment_db *db) {
+    char str[PATH_MAX];
+    struct dirent *entry;
+    struct stat st;
+    u_int32_t id;
+    char extra;
+    DIR *dir;
+
+    if (!(dir = opendir(db->path))) {
+        trace_error("Unable to open segment directory %s [%s]", db->path,
+                    strerror(errno));
+        return -1;
+    }
+
+    while ((entry = readdir(dir))) {
+        if (sscanf(entry->d_name, "%8u.se%c", &id, &extra) != 2
+            || extra != 'g' || strlen(entry->d_name) != 12) {
+            continue;
+        }
+        if (ensure_segments(db, id + 1) != 0) {
+            closedir(dir);
+            return -2;
+        }
+        segment_path(db, id, str, sizeof(str));
+        if (stat(str, &st) == 0) {
+            db->segments[id].present = 1;
+            db->segments[id].size = st.st_size;
+        }
+    }
+
+    closedir(dir);
+
+    return 0;
+}
+
+static void free_segment_db(segment_db *db) {
+    u_int32_t i;
+
+    for (i = 0; i < db->num_segments; i++) {
+        if (db->segments[i].fd >= 0) {
+            close(db->segments[i].fd);
+        }
+    }
+
+    unmap_index(&db->index);
+    if (db->changes) {
+        tsdb_memory_backend.close(db->changes);
+    }
+    free(db->segments);
+    free(db->buf);
+    free(db->read_buf);
+    free(db->path);
+    free(db);
+}
+
+static int segment_open(void **handle, const char *path, u_int8_t read_only) {
+    segment_db *db;
+    u_int32_t indexed_segment = 0, id;
+    u_int64_t indexed_len = 0;
+    int ret;
+
+    if (!read_only && mkdir(path, 00775) != 0 && errno != EEXIST) {
+        trace_error("Unable to create segment directory %s [%s]", path,
+                    strerror(errno));
+        return -1;
+    }
+
+    if (!(db = (segment_db*)calloc(1, sizeof(segment_db)))) {
+        return -1;
+    }
+    db->read_only = read_only;
+
+    if (!(db->path = strdup(path))
+        || !(db->buf = (u_int8_t*)malloc(SEGMENT_BUFFER_SIZE))
+        || tsdb_memory_backend.open(&db->changes, path, read_only) != 0
+        || scan_segments(db) != 0) {
+        free_segment_db(db);
+        return -1;
+    }
+
+    ret = load_index(db, &indexed_segment, &indexed_len);
+    if (ret == -2) {
+        free_segment_db(db);
+        return -1;
+    } else if (ret == -1) {
+        // Rebuild the index from every segment
+        tsdb_memory_backend.close(db->changes);
+        db->changes = NULL;
+        if (tsdb_memory_backend.open(&db->changes, path, read_only) != 0) {
+            free_segment_db(db);
+            return -1;
+        }
+        for (id = 0; id < db->num_segments; id++) {
+            db->segments[id].live = 0;
+        }
+        indexed_segment = 0, indexed_len = 0;
+    }
+
+    // Anything written after the index was saved
+    for (id = indexed_segment; id < db->num_segments; id++) {
+        if (db->segments[id].present
+            && replay_segment(db, id,
+                              id == indexed_segment ? indexed_len : 0) != 0) {
+            free_segment_db(db);
+            return -1;
+        }
+    }
+
+    if (db->num_segments == 0 || !db->segments[active_segment(db)].present) {
+        if (read_only) {
+            // Nothing to read, but keep an empty segment to append to
+            ensure_segments(db, db->num_segments + 1);
+        } else if (add_segment(db) != 0) {
+            free_segment_db(db);
+            return -1;
+        }
+    }
+
+    *handle = db;
+
+    return 0;
+}
+
+static int segment_get(void *handle, void *key, u_int32_t key_len,
+                       void **value, u_int32_t *value_len) {
+    segment_db *db = (segment_db*)handle;
+    segment_location loc;
+    int rc;
+
+    if ((rc = index_get(db, key, key_len, &loc)) != 0) {
+        return rc;
+    }
+
+    if (read_value(db, &loc, key_len, value) != 0) {
+        return -2;
+    }
+    *value_len = loc.value_len;
+
+    return 0;
+}
+
+static int segment_put(void *handle, void *key, u_int32_t key_len,
+                       void *value, u_int32_t value_len) {
+    segment_db *db = (segment_db*)handle;
+    segment_location loc;
+
+    if (db->read_only || value_len == SEGMENT_TOMBSTONE
+        || append_record(db, key, key_len, value, value_len, &loc) != 0) {
+        return -2;
+    }
+
+    return index_put(db, key, key_len, &loc);
+}
+
+static int segment_del(void *handle, void *key, u_int32_t key_len) {
+    segment_db *db = (segment_db*)handle;
+    segment_location loc;
+    int rc;
+
+    if (db->read_only) {
+        return -2;
+    }
+
+    if ((rc = index_get(db, key, key_len, &loc)) != 0) {
+        return rc;
+    }
+
+    if (append_record(db, key, key_len, NULL, SEGMENT_TOMBSTONE,
+                      &loc) != 0) {
+        return -2;
+    }
+
+    return index_put(db, key, key_len, &loc);
+}
+
+// Whether a segment older than a tombstone's, and not about to be removed,
+// may hold a record of the deleted key. Rebuilding the index from the
+// segments would bring the key back without the tombstone.
+static int tombstone_needed(segment_db *db, segment_location *loc) {
+    u_int32_t id;
+
+    for (id = loc->first; id < loc->segment; id++) {
+        if (db->segments[id].present && !db->segments[id].compacting) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Copies a tombstone that's still needed out of a compacted segment, and
+// forgets it otherwise
+static int compact_tombstone(segment_db *db, void *key, u_int32_t key_len,
+                             segment_location *loc) {
+    if (loc->value_len != SEGMENT_TOMBSTONE
+        || !db->segments[loc->segment].compacting) {
+        return 0;
+    }
+    if (!tombstone_needed(db, loc)) {
+        loc->segment = LOCATION_REMOVED;
+        return index_put(db, key, key_len, loc);
+    }
+    if (append_record(db, key, key_len, NULL, SEGMENT_TOMBSTONE, loc) != 0) {
+        return -2;
+    }
+    return index_put(db, key, key_len, loc);
+}
+
+// Copies a live record out of a compacted segment
+static int compact_record(segment_db *db, void *key, u_int32_t key_len,
+                          segment_location *loc) {
+    void *data;
+
+    if (loc->value_len == SEGMENT_TOMBSTONE
+        || !db->segments[loc->segment].compacting) {
+        return 0;
+    }
+    if (read_value(db, loc, key_len, &data) != 0
+        || append_record(db, key, key_len, data, loc->value_len, loc) != 0) {
+        return -2;
+    }
+    return index_put(db, key, key_len, loc);
+}
+
+// Copies the live records out of segments that are mostly garbage.
+// Returns the number of segments to remove once the index is written.
+static int compact_segments(segment_db *db) {
+    u_int32_t id, num_compacting = 0;
+    int ret;
+
+    for (id = 0; id < active_segment(db); id++) {
+        segment_file *segment = &db->segments[id];
+
+        if (segment->present && segment->live * 2 < segment->size) {
+            segment->compacting = 1;
+            num_compacting++;
+        }
+    }
+
+    if (num_compacting == 0) {
+        return 0;
+    }
+
+    ret = visit_index(db, compact_record);
+    if (ret == 0) {
+        ret = visit_index(db, compact_tombstone);
+    }
+
+    if (ret != 0) {
+        for (id = 0; id < db->num_segments; id++) {
+            db->segments[id].compacting = 0;
+        }
+        return ret;
+    }
+
+    return num_compacting;
+}
+
+static void remove_compacted_segments(segment_db *db) {
+    char str[PATH_MAX];
+    u_int32_t id;
+
+    for (id = 0; id < db->num_segments; id++) {
+        segment_file *segment = &db->segments[id];
+
+        if (!segment->compacting) {
+            continue;
+        }
+        if (segment->fd >= 0) {
+            close(segment->fd);
+        }
+        segment_path(db, id, str, sizeof(str));
+        unlink(str);
+        trace_info("Removed compacted segment %s", str);
+        memset(segment, 0, sizeof(segment_file));
+        segment->fd = -1;
+    }
+}
+
+// Makes the appended records durable. The index is only written when
+// it's fallen far behind, when segments were compacted, or on close.
+static int sync_segments(segment_db *db, u_int8_t write_all_index) {
+    int num_compacted;
+
+    if (db->read_only
+        || (!db->dirty && !(write_all_index && db->unindexed > 0))) {
+        return 0;
+    }
+
+    if ((num_compacted = compact_segments(db)) < 0) {
+        trace_error("Unable to compact segments");
+        num_compacted = 0;
+    }
+
+    // Old segments may only go once the index no longer points at them
+    if (flush_buffer(db) != 0
+        || fsync(segment_fd(db, active_segment(db))) != 0
+        || ((write_all_index || num_compacted > 0
+             || db->unindexed >= INDEX_LAG_BYTES)
+            && write_index(db) != 0)) {
+        return -2;
+    }
+
+    remove_compacted_segments(db);
+    db->dirty = 0;
+
+    return 0;
+}
+
+static int segment_sync(void *handle) {
+    return sync_segments((segment_db*)handle, 0);
+}
+
+static void segment_close(void *handle) {
+    segment_db *db = (segment_db*)handle;
+
+    sync_segments(db, 1);
+    free_segment_db(db);
+}
+
+static int segment_cursor_open(void *handle, void *start, u_int32_t start_len,
+                               void **cursor) {
+    segment_cursor *c;
+
+    if (!(c = (segment_cursor*)calloc(1, sizeof(segment_cursor)))) {
+        return -2;
+    }
+
+    if (walk_open(&c->walk, (segment_db*)handle, start, start_len) != 0) {
+        free(c);
+        return -2;
+    }
+
+    *cursor = c;
+
+    return 0;
+}
+
+static int segment_cursor_next(void *cursor, void **key, u_int32_t *key_len,
+                               void **value, u_int32_t *value_len) {
+    segment_cursor *c = (segment_cursor*)cursor;
+    segment_location loc;
+    int ret;
+
+    // Deleted keys are skipped
+    do {
+        ret = walk_next(&c->walk, &loc);
+    } while (ret == 0 && loc.value_len == SEGMENT_TOMBSTONE);
+
+    c->has_key = ret == 0;
+    if (ret != 0) {
+        return ret;
+    }
+    *key = c->walk.key, *key_len = c->walk.key_len;
+
+    if (value) {
+        if (read_value(c->walk.db, &loc, *key_len, value) != 0) {
+            return -2;
+        }
+        *value_len = loc.value_len;
+    }
+
+    return 0;
+}
+
+static int segment_cursor_del(void *cursor) {
+    segment_cursor *c = (segment_cursor*)cursor;
+    int ret;
+
+    if (!c->has_key) {
+        return -2;
+    }
+
+    ret = segment_del(c->walk.db, c->walk.key, c->walk.key_len);
+    c->has_key = 0;
+
+    return ret == 0 ? 0 : -2;
+}
+
+static void segment_cursor_close(void *cursor) {
+    segment_cursor *c = (segment_cursor*)cursor;
+    walk_close(&c->walk);
+    free(c);
+}
+
+const tsdb_backend tsdb_segment_backend = {
+    "segment",
+    1,
+    segment_open,
+    segment_close,
+    segment_get,
+    segment_put,
+    segment_del,
+    segment_cursor_open,
+    segment_cursor_next,
+    segment_cursor_del,
+    segment_cursor_close,
+    segment_sync,
+    segment_sync    // Syncing rewrites segments with too much garbage
+};
@@ -0,0 +1,37 @@
+/*
+ *
+ *  Copyright (C) 2011 IIT/CNR (http://www.iit.cnr.it/en)
+ *                     Luca Deri <deri@ntop.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// Append-only segment store. The database is a directory of numbered
+// segment files holding key/value records, plus a sorted index file of
+// key -> (segment, offset, length) that is mapped at open and searched in
+// place. Keys changed since the index was written are kept in memory.
+// Records after the point covered by the index are replayed from the
+// segments, so a torn tail is dropped rather than corrupting the store.
+// Tombstones are kept in the index until no older segment may hold the
+// deleted key.
+
+#define SEGMENT_INDEX_MAGIC   0x58495354  // "TSIX"
+#define SEGMENT_INDEX_VERSION 3
+#define SEGMENT_TOMBSTONE     0xFFFFFFFF
+
+// Segments are rolled when they would grow past this size (bytes)
+extern u_int64_t tsdb_segment_size;
+
+extern const tsdb_backend tsdb_segment_backend;
@@ -0,0 +1,132 @@
+#include "tsdb_api.h"
+
+typedef struct {
+    char *file;
+    u_int32_t start;
+    u_int32_t end;
+    int verbose;
+} transpose_args;
+
+static void help(int code) {
+    printf("tsdb-transpose [-v] file [-s start] [-e end]\n");
+    exit(code);
+}
+
+static void check_strtol_error(int no_digits, long val, int err,
+                               const char *argname) {
+    if (no_digits
+        || (err == ERANGE && (val == LONG_MAX || val == LONG_MIN))
+        || (err != 0 && val == 0)) {
+        printf("tsdb-transpose: invalid value for %s\n", argname);
+        exit(1);
+    }
+}
+
+static int unit_seconds_val(const char *units, const char *argname) {
+    if (*units == '\0') {
+        return 0;
+    } else if (strcmp(units, "s") == 0) {
+        return 1;
+    } else if (strcmp(units, "m") == 0) {
+        return 60;
+    } else if (strcmp(units, "h") == 0) {
+        return 3600;
+    } else if (strcmp(units, "d") == 0) {
+        return 86400;
+    } else {
+        printf("tsdb-transpose: unknown unit for %s\n", argname);
+        exit(1);
+    }
+}
+
+static u_int32_t epoch_val(const char *str, u_int32_t now,
+                           const char *argname) {
+    char *units;
+    long numval;
+    int unit_seconds;
+
+    errno = 0;
+    numval = strtol(str, &units, 10);
+    check_strtol_error(str == units, numval, errno, argname);
+    unit_seconds = unit_seconds_val(units, argname);
+    if (unit_seconds == 0) {
+        return numval;
+    } else {
+        return now + numval * unit_seconds;
+    }
+}
+
+static void process_args(int argc, char *argv[], transpose_args *args) {
+    int c;
+    u_int32_t now = time(NULL);
+
+    args->start = now - 86400;
+    args->end = now;
+    args->verbose = 0;
+
+    while ((c = getopt(argc, argv, "hvs:e:")) != -1) {
+        switch (c) {
+        case 's':
+            args->start = epoch_val(optarg, now, "start");
+            break;
+        case 'e':
+            args->end = epoch_val(optarg, now, "end");
+            break;
+        case 'v':
+            args->verbose = 1;
+            break;
+        case 'h':
+            help(0);
+            break;
+        default:
+            help(1);
+        }
+    }
+
+    int remaining = argc - optind;
+    if (remaining != 1) {
+        help(1);
+    }
+    args->file = argv[optind];
+}
+
+static void check_file_exists(const char *path) {
+    FILE *file;
+    if ((file = fopen(path, "r"))) {
+        fclose(file);
+    } else {
+        printf("tsdb-transpose: %s doesn't exist\n", path);
+        exit(1);
+    }
+}
+
+static void init_trace(int verbose) {
+    set_trace_level(verbose ? 99 : 0);
+}
+
+static void transpose_db(char *file, u_int32_t start, u_int32_t end) {
+    tsdb_handler db;
+    u_int16_t unused16 = 0;
+    u_int32_t unused32 = 0;
+
+    if (tsdb_open(file, &db, &unused16, unused32, 0)) {
+        printf("tsdb-transpose: error opening db %s\n", file);
+        exit(1);
+    }
+    if (tsdb_transpose(&db, start, end)) {
+        printf("tsdb-transpose: error transposing epochs\n");
+        exit(1);
+    }
+    tsdb_close(&db);
+}
+
+int main(int argc, char *argv[]) {
+    transpose_args args;
+
+    process_args(argc, argv, &args);
+    init_trace(args.verbose);
+    check_file_exists(args.file);
+    transpose_db(args.file, args.start, args.end);
+
+    return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ *
+ *  Copyright (C) 2011 IIT/CNR (http://www.iit.cnr.it/en)
+ *                     Luca Deri <deri@ntop.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "tsdb_wal.h"
+
+#define WAL_HEADER_LEN 9
+
+static u_int32_t checksum(u_int8_t type, u_int8_t *data, u_int32_t len) {
+    u_int32_t hash = 2166136261U, i;
+
+    hash = (hash ^ type) * 16777619U;
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ data[i]) * 16777619U;
+    }
+
+    return hash;
+}
+
+static int write_all(int fd, u_int8_t *data, u_int32_t len) {
+    ssize_t written;
+
+    while (len > 0) {
+        written = write(fd, data, len);
+        if (written < 0) {
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+
+    return 0;
+}
+
+// Writes buffered records without syncing them
+static int wal_write(tsdb_wal *wal) {
+    if (wal->buf_len == 0) {
+        return 0;
+    }
+    if (write_all(wal->fd, wal->buf, wal->buf_len) != 0) {
+        return -1;
+    }
+    wal->file_len += wal->buf_len;
+    wal->buf_len = 0;
+
+    return 0;
+}
+
+int wal_open(tsdb_wal *wal, const char *path) {
+    struct stat info;
+
+    memset(wal, 0, sizeof(tsdb_wal));
+
+    wal->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 00664);
+    if (wal->fd < 0) {
+        return -1;
+    }
+
+    if (fstat(wal->fd, &info) == 0) {
+        wal->file_len = info.st_size;
+    }
+
+    wal->buf = malloc(WAL_BUFFER_SIZE);
+    if (!wal->buf) {
+        close(wal->fd);
+        return -1;
+    }
+    wal->buf_size = WAL_BUFFER_SIZE;
+
+    return 0;
+}
+
+void wal_close(tsdb_wal *wal) {
+    if (wal->buf) {
+        close(wal->fd);
+        free(wal->buf);
+    }
+    memset(wal, 0, sizeof(tsdb_wal));
+}
+
+int wal_append(tsdb_wal *wal, u_int8_t type,
+               void *data1, u_int32_t len1,
+               void *data2, u_int32_t len2) {
+    u_int32_t len = len1 + len2, record_len = WAL_HEADER_LEN + len, sum;
+    u_int8_t *ptr;
+
+    if (wal->buf_len + record_len > wal->buf_size) {
+        if (wal_write(wal) != 0) {
+            return -1;
+        }
+        if (record_len > wal->buf_size) {
+            u_int8_t *buf = realloc(wal->buf, record_len);
+            if (!buf) {
+                return -1;
+            }
+            wal->buf = buf;
+            wal->buf_size = record_len;
+        }
+    }
+
+    ptr = &wal->buf[wal->buf_len];
+    memcpy(&ptr[WAL_HEADER_LEN], data1, len1);
+    memcpy(&ptr[WAL_HEADER_LEN + len1], data2, len2);
+    sum = checksum(type, &ptr[WAL_HEADER_LEN], len);
+    memcpy(ptr, &len, sizeof(len));
+    memcpy(&ptr[4], &sum, sizeof(sum));
+    ptr[8] = type;
+
+    wal->buf_len += record_len;
+
+    return 0;
+}
+
+int wal_commit(tsdb_wal *wal) {
+    if (wal_write(wal) != 0) {
+        return -1;
+    }
+    if (fsync(wal->fd) != 0) {
+        return -1;
+    }
+    wal->commits++;
+
+    return 0;
+}
+
+int wal_reset(tsdb_wal *wal) {
+    wal->buf_len = 0;
+    if (ftruncate(wal->fd, 0) != 0 || fsync(wal->fd) != 0) {
+        return -1;
+    }
+    wal->file_len = 0;
+
+    return 0;
+}
+
+int wal_replay(tsdb_wal *wal, wal_record_handler handler, void *context) {
+    u_int8_t *data, *ptr, *end;
+    u_int32_t len, sum, count = 0;
+    ssize_t read_len;
+    int rc;
+
+    if (wal->file_len == 0) {
+        return 0;
+    }
+
+    data = malloc(wal->file_len);
+    if (!data) {
+        return -1;
+    }
+
+    read_len = pread(wal->fd, data, wal->file_len, 0);
+    if (read_len < 0) {
+        free(data);
+        return -1;
+    }
+
+    ptr = data;
+    end = data + read_len;
+
+    // A short or corrupt record marks the end of the log (a torn write)
+    while (ptr + WAL_HEADER_LEN <= end) {
+        memcpy(&len, ptr, sizeof(len));
+        memcpy(&sum, &ptr[4], sizeof(sum));
+        if (len > (u_int64_t)(end - ptr) - WAL_HEADER_LEN
+            || checksum(ptr[8], &ptr[WAL_HEADER_LEN], len) != sum) {
+            break;
+        }
+        if ((rc = handler(ptr[8], &ptr[WAL_HEADER_LEN], len, context)) != 0) {
+            free(data);
+            return rc;
+        }
+        ptr += WAL_HEADER_LEN + len;
+        count++;
+    }
+
+    wal->replayed_len = ptr - data;
+    free(data);
+
+    return count;
+}
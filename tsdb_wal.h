@@ -0,0 +1,66 @@
+/*
+ *
+ *  Copyright (C) 2011 IIT/CNR (http://www.iit.cnr.it/en)
+ *                     Luca Deri <deri@ntop.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+// Append-only write-ahead log. Records are buffered in memory and written
+// to the log file together on commit, followed by a single fsync.
+//
+// Each record is laid out as:
+//
+//   u_int32_t len (of the payload)
+//   u_int32_t checksum (of the type and payload)
+//   u_int8_t  type
+//   payload
+
+#define WAL_KEY   1
+#define WAL_VALUE 2
+#define WAL_TAG   3
+#define WAL_SLOT  4
+
+#define WAL_BUFFER_SIZE (1024 * 1024)
+
+typedef struct {
+    int fd;
+    u_int8_t *buf;
+    u_int32_t buf_len;
+    u_int32_t buf_size;
+    u_int64_t file_len;
+    u_int64_t replayed_len;     // Up to the first torn or corrupt record
+    u_int32_t commits;
+} tsdb_wal;
+
+typedef int (*wal_record_handler)(u_int8_t type, u_int8_t *data,
+                                  u_int32_t len, void *context);
+
+int wal_open(tsdb_wal *wal, const char *path);
+
+void wal_close(tsdb_wal *wal);
+
+int wal_append(tsdb_wal *wal, u_int8_t type,
+               void *data1, u_int32_t len1,
+               void *data2, u_int32_t len2);
+
+int wal_commit(tsdb_wal *wal);
+
+int wal_reset(tsdb_wal *wal);
+
+int wal_replay(tsdb_wal *wal, wal_record_handler handler, void *context);